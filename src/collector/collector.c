@@ -33,6 +33,7 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
@@ -93,6 +94,15 @@ static void reset_collector_stats(collector_global_t *glob) {
     glob->stats.voipsessions_added_diff = 0;
     glob->stats.ipsessions_ended_diff = 0;
     glob->stats.voipsessions_ended_diff = 0;
+
+    glob->stats.compress_bytes_in = 0;
+    glob->stats.compress_bytes_out = 0;
+    glob->stats.compress_cpu_usec = 0;
+
+    glob->stats.cc_queue_peak = 0;
+    glob->stats.iri_queue_peak = 0;
+    glob->stats.cc_wait_peak_ms = 0;
+    glob->stats.iri_wait_peak_ms = 0;
 }
 
 static void log_collector_stats(collector_global_t *glob) {
@@ -145,6 +155,23 @@ static void log_collector_stats(collector_global_t *glob) {
             glob->stats.voipsessions_ended_diff,
             glob->stats.voipsessions_ended_total);
 
+    if (glob->stats.compress_bytes_in > 0) {
+        logger(LOG_INFO, "OpenLI: Export compression... bytes in: %lu  bytes out: %lu  ratio: %.2f  CPU time: %.3f sec",
+                glob->stats.compress_bytes_in,
+                glob->stats.compress_bytes_out,
+                glob->stats.compress_bytes_out == 0 ? 0.0 :
+                ((double)glob->stats.compress_bytes_in) /
+                        glob->stats.compress_bytes_out,
+                glob->stats.compress_cpu_usec / 1000000.0);
+    }
+
+    logger(LOG_INFO, "OpenLI: Largest export backlog... CCs: %lu bytes  IRIs: %lu bytes",
+            glob->stats.cc_queue_peak, glob->stats.iri_queue_peak);
+    logger(LOG_INFO, "OpenLI: Longest export queue wait... CCs: %lu ms  IRIs: %lu ms",
+            glob->stats.cc_wait_peak_ms, glob->stats.iri_wait_peak_ms);
+    logger(LOG_INFO, "OpenLI: Net buffer memory... current: %lu KB  peak: %lu KB",
+            get_net_buffer_committed() / 1024, get_net_buffer_peak() / 1024);
+
     logger(LOG_INFO, "OpenLI: === statistics complete ===");
 }
 
@@ -1162,6 +1189,19 @@ static void clear_global_config(collector_global_t *glob) {
         free(glob->RMQ_conf.hostname);
     }
 
+    if (glob->spoolconf.directory) {
+        free(glob->spoolconf.directory);
+    }
+
+    if (glob->snapshotdir) {
+        free(glob->snapshotdir);
+    }
+
+    if (glob->mediator_compression) {
+        Word_t bytes;
+        JLFA(bytes, glob->mediator_compression);
+    }
+
     free_ssl_config(&(glob->sslconf));
 
     if (glob->alumirrors) {
@@ -1301,6 +1341,17 @@ static void init_collector_global(collector_global_t *glob) {
     glob->RMQ_conf.heartbeatFreq = 0;
     glob->RMQ_conf.enabled = 0;
 
+    glob->spoolconf.directory = NULL;
+    glob->spoolconf.threshold = DEFAULT_SPOOL_THRESHOLD;
+    glob->spoolconf.maxsize = 0;
+    glob->use_iouring = 0;
+    glob->export_latency = DEFAULT_EXPORT_LATENCY;
+    glob->export_compression = OPENLI_COMPRESS_NONE;
+    glob->mediator_compression = NULL;
+    glob->iri_weight = DEFAULT_IRI_WEIGHT;
+    glob->netbufferlimit = NETBUF_DEFAULT_LIMIT;
+    glob->snapshotdir = NULL;
+
     glob->etsitls = 1;
     glob->ignore_sdpo_matches = 0;
     glob->encoding_method = OPENLI_ENCODING_DER;
@@ -1330,6 +1381,7 @@ static collector_global_t *parse_global_config(char *configfile) {
         clear_global_config(glob);
         return NULL;
     }
+    set_net_buffer_limit(glob->netbufferlimit);
 
     logger(LOG_DEBUG, "OpenLI: Encoding Method: %s",
         glob->encoding_method == OPENLI_ENCODING_BER ? "BER" : "DER");
@@ -1433,6 +1485,7 @@ static int reload_collector_config(collector_global_t *glob,
     pthread_rwlock_wrlock(&(glob->config_mutex));
 
     glob->stat_frequency = newstate.stat_frequency;
+    set_net_buffer_limit(newstate.netbufferlimit);
     reload_inputs(glob, &newstate);
 
     /* Just update these, regardless of whether they've changed. It's more
@@ -1511,6 +1564,8 @@ static void *start_ip_sync_thread(void *params) {
     int ret;
     collector_sync_t *sync = init_sync_data(glob);
     sync_sendq_t *sq;
+    struct timeval tv;
+    uint64_t now, nextconnect = 0;
 
     /* XXX For early development work, we will read intercept instructions
      * from a config file. Eventually this should be replaced with
@@ -1528,7 +1583,10 @@ static void *start_ip_sync_thread(void *params) {
             sync_thread_publish_reload(sync);
             reload_config = 0;
         }
-        if (sync->instruct_fd == -1) {
+        gettimeofday(&tv, NULL);
+        now = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+
+        if (sync->instruct_fd == -1 && now >= nextconnect) {
             ret = sync_connect_provisioner(sync, glob->sslconf.ctx);
             if (ret < 0) {
                 /* Fatal error */
@@ -1538,9 +1596,12 @@ static void *start_ip_sync_thread(void *params) {
             }
 
             if (ret == 0) {
-                /* Connection failed, but we should retry */
-                usleep(500000);
-                continue;
+                /* Connection failed, but we should retry. Keep talking
+                 * to our processing threads in the meantime, so that we
+                 * can resume interception from our config snapshot while
+                 * the provisioner is unreachable.
+                 */
+                nextconnect = now + 500;
             }
         }
 
@@ -1697,6 +1758,14 @@ int main(int argc, char *argv[]) {
                 (glob->sslconf.ctx && glob->etsitls) ? glob->sslconf.ctx : NULL;
         //forwarder only needs CTX if ctx exists and is enabled 
         glob->forwarders[i].RMQ_conf = glob->RMQ_conf;
+        glob->forwarders[i].spoolconf = glob->spoolconf;
+        glob->forwarders[i].use_iouring = glob->use_iouring;
+        glob->forwarders[i].latencybudget = glob->export_latency;
+        glob->forwarders[i].compressmethod = glob->export_compression;
+        glob->forwarders[i].compress_by_mediator = glob->mediator_compression;
+        glob->forwarders[i].stats = &(glob->stats);
+        glob->forwarders[i].stats_mutex = &(glob->stats_mutex);
+        glob->forwarders[i].iriweight = glob->iri_weight;
 
         pthread_create(&(glob->forwarders[i].threadid), NULL,
                 start_forwarding_thread, (void *)&(glob->forwarders[i]));
@@ -295,6 +295,17 @@ typedef struct collector_global {
     uint8_t encoding_method;
     openli_ssl_config_t sslconf;
     openli_RMQ_config_t RMQ_conf; 
+    openli_spool_config_t spoolconf;
+    uint8_t use_iouring;
+    uint32_t export_latency;
+    uint8_t export_compression;
+    Pvoid_t mediator_compression;
+    uint32_t iri_weight;
+    /* Largest size (in bytes) that any one net buffer may grow to */
+    uint64_t netbufferlimit;
+    /* Directory to save snapshots of the provisioner's configuration in,
+     * so that we can resume intercepting straight away after a restart */
+    char *snapshotdir;
 
 } collector_global_t;
 
@@ -40,9 +40,25 @@
 #include "collector_publish.h"
 #include "export_buffer.h"
 #include "openli_tls.h"
+#include "openli_uring.h"
+#include "openli_compress.h"
 
 #define MAX_ENCODED_RESULT_BATCH 50
 
+/* Records for an LIID that a mediator has asked us to hold back, e.g.
+ * because the agency that they are for is not keeping up */
+typedef struct held_liid {
+    char *liid;
+    /* Set while the mediator wants us to hold on to these records */
+    uint8_t paused;
+    /* How long the mediator asked us to hold on for (in ms) */
+    uint32_t leasems;
+    /* Time (in ms, monotonic) when the hold runs out and we should send
+     * a few records to see if the mediator is ready for them */
+    uint64_t holduntil;
+    export_buffer_t buffer;
+} held_liid_t;
+
 typedef struct export_dest {
     int failmsg;
     int fd;
@@ -55,11 +71,65 @@ typedef struct export_dest {
     export_buffer_t buffer;
     uint8_t logallowed;
 
+    /* IRIs are queued separately so that they don't have to wait behind
+     * a backlog of CCs (only used if the IRI lane is enabled) */
+    export_buffer_t iribuffer;
+    /* Set to 1 if this destination uses the IRI lane */
+    uint8_t irilane;
+    /* The queue that the current send (or compressed chunk) came from */
+    export_buffer_t *txbuffer;
+    /* Number of IRI sends since we last sent from the CC queue */
+    uint32_t iriturns;
+    /* Time (in ms, monotonic) since when the data at the front of each
+     * queue has been waiting to be sent, or zero if the queue is empty */
+    uint64_t ccwaitsince;
+    uint64_t iriwaitsince;
+
+    openli_encoded_result_t *directq;
+    uint32_t directcount;
+    uint32_t directsent;
+    uint64_t directbytes;
+    struct iovec *directiov;
+    struct msghdr directmh;
+
+    /* Time (in ms, monotonic) by which buffered records must be sent,
+     * or zero if nothing is waiting */
+    uint64_t flushdeadline;
+
     SSL *ssl;
     int waitingforhandshake;
     int ssllasterror;
+    uint8_t ktls_send;
+
+    /* Set if the mediator has told us that it accepts record batches */
+    uint8_t batchframing;
+    /* Partially received control messages from the mediator */
+    uint8_t ctrlbuf[256];
+    uint32_t ctrllen;
+
+    /* Stream compression configured for this mediator */
+    uint8_t compressmethod;
+    /* Set once the mediator has agreed to our compression method, until
+     * we have told it that the compressed stream is starting */
+    uint8_t startcompress;
+    openli_compressor_t *compressor;
+    /* Compressed output that has not yet been sent in full */
+    uint8_t *zbuf;
+    uint64_t zalloc;
+    uint64_t zlen;
+    uint64_t zsent;
+    /* Amount of the export buffer that is covered by zbuf */
+    uint64_t zchunk;
+
+    /* LIIDs that the mediator has asked us to hold back, keyed by LIID */
+    Pvoid_t heldliids;
+    uint32_t heldcount;
 
     amqp_bytes_t rmq_queueid;
+    /* Heartbeat that is being sent to the mediator while exporting via
+     * RabbitMQ, and how much of it has been sent so far */
+    ii_header_t hbeat;
+    uint32_t hbsent;
 
     UT_hash_handle hh_fd;
     UT_hash_handle hh_medid;
@@ -97,6 +167,15 @@ typedef struct collector_stats {
     uint64_t voipsessions_ended_diff;
     uint64_t voipsessions_ended_total;
 
+    uint64_t compress_bytes_in;
+    uint64_t compress_bytes_out;
+    uint64_t compress_cpu_usec;
+
+    uint64_t cc_queue_peak;
+    uint64_t iri_queue_peak;
+    uint64_t cc_wait_peak_ms;
+    uint64_t iri_wait_peak_ms;
+
 } collector_stats_t;
 
 typedef struct sync_thread_global {
@@ -181,6 +260,27 @@ typedef struct intercept_reorderer {
 
 } int_reorderer_t;
 
+/* Default maximum time (in ms) that a forwarder will hold on to records
+ * before sending them to a mediator */
+#define DEFAULT_EXPORT_LATENCY (1000)
+
+/* Default number of IRI sends that a forwarder will make for each CC send
+ * when both have records waiting */
+#define DEFAULT_IRI_WEIGHT (4)
+
+/* Maximum number of RabbitMQ publishes that a forwarder will have waiting
+ * on a confirm from the broker at any one time */
+#define RMQ_CONFIRM_WINDOW (32)
+
+/* A batch of records that has been published to RabbitMQ, but has not yet
+ * been confirmed by the broker */
+typedef struct rmq_unconfirmed {
+    uint64_t deliverytag;
+    export_dest_t *dest;
+    uint64_t len;
+    uint8_t acked;
+} rmq_unconfirmed_t;
+
 typedef struct forwarding_thread_data {
     void *zmq_ctxt;
     pthread_t threadid;
@@ -213,6 +313,39 @@ typedef struct forwarding_thread_data {
     amqp_connection_state_t ampq_conn;
     amqp_socket_t *ampq_sock;
     openli_RMQ_config_t RMQ_conf;
+    /* Set once we have logged in to the broker and enabled confirms */
+    uint8_t rmq_connected;
+    /* Time (in ms) at which we should next try to reconnect to the broker */
+    uint64_t rmq_retryat;
+    /* Delivery tag that the broker will give our next publish */
+    uint64_t rmq_nexttag;
+    /* Publishes awaiting confirmation, oldest first (circular) */
+    rmq_unconfirmed_t rmq_window[RMQ_CONFIRM_WINDOW];
+    uint32_t rmq_winstart;
+    uint32_t rmq_wincount;
+    openli_spool_config_t spoolconf;
+    uint8_t use_iouring;
+    openli_uring_t uring;
+
+    /* Maximum time (in ms) that a record may be held back in the hope of
+     * sending it as part of a larger batch */
+    uint32_t latencybudget;
+
+    /* Default compression method for mediator connections, and any
+     * per-mediator overrides (indexed by mediator ID) */
+    uint8_t compressmethod;
+    Pvoid_t compress_by_mediator;
+
+    collector_stats_t *stats;
+    pthread_mutex_t *stats_mutex;
+
+    /* Number of IRI sends allowed for each CC send when both queues have
+     * records waiting -- zero puts all records in a single queue */
+    uint32_t iriweight;
+
+    /* Longest queue waits seen since we last updated the global stats */
+    uint64_t ccwaitpeak;
+    uint64_t iriwaitpeak;
 
 } forwarding_thread_data_t;
 
@@ -33,6 +33,9 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <amqp_tcp_socket.h>
 
 #include "util.h"
@@ -42,8 +45,33 @@
 
 #define BUF_BATCH_SIZE (100 * 1024 * 1024)
 #define MIN_SEND_AMOUNT (1 * 1024 * 1024)
+/* Smaller sends are used when IRIs have their own queue, so that an IRI
+ * never has to wait for too much CC data to be sent ahead of it */
+#define LANE_BATCH_SIZE (4 * 1024 * 1024)
+/* Maximum amount of buffered records to compress in one go, so that the
+ * compressed output (and the time spent compressing) stays bounded */
+#define COMPRESS_BATCH_SIZE (4 * 1024 * 1024)
+/* Each queued result needs up to three iovecs, so keep this well under
+ * IOV_MAX. */
+#define DIRECT_QUEUE_SIZE (256)
 #define AMPQ_BYTES_FROM(x) (amqp_bytes_t){.len=sizeof(x),.bytes=&x}
 #define AMQP_FRAME_MAX 131072
+/* Maximum size of a single RMQ publish -- smaller messages let several
+ * publishes be in flight at once, rather than one huge message */
+#define RMQ_BATCH_SIZE (4 * 1024 * 1024)
+/* How often to check for publish confirms from the broker (in ms) while
+ * any publishes are waiting on one */
+#define RMQ_CONFIRM_POLL_MS (10)
+/* How long to wait before trying to reconnect to the broker (in ms) */
+#define RMQ_RECONNECT_DELAY (1000)
+/* How much of an LIID's held records to send when a hold runs out without
+ * the mediator renewing it, to find out if the mediator is ready for more.
+ * Must be larger than the gap between the export buffer's record offsets,
+ * otherwise the whole buffer would be released at once. */
+#define HELD_PROBE_AMOUNT (1 * 1024 * 1024)
+/* Held records are only moved into a mediator's export buffer while it has
+ * less than this much waiting to be sent */
+#define HELD_RELEASE_AMOUNT (4 * 1024 * 1024)
 
 static inline void free_encoded_result(openli_encoded_result_t *res) {
     if (res->liid) {
@@ -68,6 +96,246 @@ static inline void free_encoded_result(openli_encoded_result_t *res) {
 
 }
 
+static inline uint64_t get_monotonic_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* Starts the clock on the latency budget for a destination, if there
+ * were no records already waiting to be sent to it.
+ */
+static inline void arm_flush_deadline(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    if (dest->flushdeadline == 0) {
+        dest->flushdeadline = get_monotonic_ms() + fwd->latencybudget;
+    }
+}
+
+static inline uint8_t flush_is_due(export_dest_t *dest, uint64_t now) {
+    return (dest->flushdeadline != 0 && dest->flushdeadline <= now);
+}
+
+static inline uint8_t use_iri_lane(export_dest_t *dest) {
+    return dest->irilane;
+}
+
+static inline uint64_t transmit_limit(export_dest_t *dest) {
+    return use_iri_lane(dest) ? LANE_BATCH_SIZE : BUF_BATCH_SIZE;
+}
+
+static inline uint64_t get_dest_buffered_amount(export_dest_t *dest) {
+    return get_buffered_amount(&(dest->buffer)) +
+            get_buffered_amount(&(dest->iribuffer));
+}
+
+/* Works out which queue a record for a destination belongs in, and starts
+ * the wait timer for that queue if it was empty.
+ */
+static export_buffer_t *select_record_buffer(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, openli_encoded_result_t *res) {
+
+    export_buffer_t *buf = &(dest->buffer);
+    uint64_t *since = &(dest->ccwaitsince);
+
+    if (use_iri_lane(dest) &&
+            ntohs(res->header.intercepttype) == OPENLI_PROTO_ETSI_IRI) {
+        buf = &(dest->iribuffer);
+        since = &(dest->iriwaitsince);
+    }
+
+    if (*since == 0) {
+        *since = get_monotonic_ms();
+    }
+    return buf;
+}
+
+/* Chooses the queue to send from next. A frame that has been partly
+ * written to the socket must be finished before anything else can be
+ * sent, otherwise IRIs are preferred over CCs according to the
+ * configured weight.
+ */
+static export_buffer_t *select_transmit_buffer(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    export_buffer_t *cc = &(dest->buffer);
+    export_buffer_t *iri = &(dest->iribuffer);
+
+    if (!use_iri_lane(dest) || cc->partialfront > 0) {
+        dest->txbuffer = cc;
+    } else if (iri->partialfront > 0) {
+        dest->txbuffer = iri;
+    } else if (get_buffered_amount(iri) == 0) {
+        dest->txbuffer = cc;
+    } else if (get_buffered_amount(cc) == 0) {
+        dest->txbuffer = iri;
+    } else if (dest->iriturns < fwd->iriweight) {
+        dest->iriturns ++;
+        dest->txbuffer = iri;
+    } else {
+        dest->iriturns = 0;
+        dest->txbuffer = cc;
+    }
+    return dest->txbuffer;
+}
+
+/* Updates the wait time for a queue after a send. The wait only ends once
+ * the whole chunk that was being sent has made it out.
+ */
+static void note_transmit_progress(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, export_buffer_t *buf, uint64_t now) {
+
+    uint64_t *since, *peak;
+
+    if (buf == &(dest->iribuffer)) {
+        since = &(dest->iriwaitsince);
+        peak = &(fwd->iriwaitpeak);
+    } else {
+        since = &(dest->ccwaitsince);
+        peak = &(fwd->ccwaitpeak);
+    }
+
+    if (*since == 0 || buf->partialrem > 0) {
+        return;
+    }
+
+    if (now > *since && now - *since > *peak) {
+        *peak = now - *since;
+    }
+
+    if (get_buffered_amount(buf) > 0) {
+        *since = now;
+    } else {
+        *since = 0;
+    }
+}
+
+/* Adds the current queue depths and waits for this thread's mediators to
+ * the collector statistics.
+ */
+static void update_queue_stats(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *dest;
+    PWord_t jval;
+    Word_t index = 0;
+    uint64_t ccdepth = 0, iridepth = 0, amt;
+
+    if (fwd->stats == NULL) {
+        return;
+    }
+
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval) {
+        dest = (export_dest_t *)(*jval);
+        JLN(jval, fwd->destinations_by_id, index);
+
+        amt = get_buffered_amount(&(dest->buffer));
+        if (amt > ccdepth) {
+            ccdepth = amt;
+        }
+        amt = get_buffered_amount(&(dest->iribuffer));
+        if (amt > iridepth) {
+            iridepth = amt;
+        }
+    }
+
+    pthread_mutex_lock(fwd->stats_mutex);
+    if (ccdepth > fwd->stats->cc_queue_peak) {
+        fwd->stats->cc_queue_peak = ccdepth;
+    }
+    if (iridepth > fwd->stats->iri_queue_peak) {
+        fwd->stats->iri_queue_peak = iridepth;
+    }
+    if (fwd->ccwaitpeak > fwd->stats->cc_wait_peak_ms) {
+        fwd->stats->cc_wait_peak_ms = fwd->ccwaitpeak;
+    }
+    if (fwd->iriwaitpeak > fwd->stats->iri_wait_peak_ms) {
+        fwd->stats->iri_wait_peak_ms = fwd->iriwaitpeak;
+    }
+    pthread_mutex_unlock(fwd->stats_mutex);
+
+    fwd->ccwaitpeak = 0;
+    fwd->iriwaitpeak = 0;
+}
+
+static uint8_t lookup_compression_method(forwarding_thread_data_t *fwd,
+        uint32_t mediatorid) {
+
+    PWord_t jval;
+
+    JLG(jval, fwd->compress_by_mediator, mediatorid);
+    if (jval == NULL) {
+        return fwd->compressmethod;
+    }
+    return (uint8_t)(*jval);
+}
+
+static inline uint32_t compression_capability(uint8_t method) {
+    switch(method) {
+        case OPENLI_COMPRESS_LZ4:
+            return OPENLI_CAP_COMPRESS_LZ4;
+        case OPENLI_COMPRESS_ZSTD:
+            return OPENLI_CAP_COMPRESS_ZSTD;
+    }
+    return 0;
+}
+
+static void reset_compression(export_dest_t *dest) {
+    destroy_compressor(dest->compressor);
+    dest->compressor = NULL;
+    dest->startcompress = 0;
+    dest->zlen = 0;
+    dest->zsent = 0;
+    dest->zchunk = 0;
+}
+
+static void init_destination_buffer(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    char spoolname[64];
+
+    init_export_buffer(&(dest->buffer));
+    init_export_buffer(&(dest->iribuffer));
+    dest->txbuffer = &(dest->buffer);
+    dest->iriturns = 0;
+
+    /* RMQ publishes only ever come from the main queue, as they are
+     * released in order as the broker confirms them. Check the config
+     * rather than the RMQ connection, so that the decision does not
+     * depend on whether we have connected to the broker yet. */
+    dest->irilane = (fwd->iriweight > 0 && !fwd->RMQ_conf.enabled);
+    dest->ccwaitsince = 0;
+    dest->iriwaitsince = 0;
+    dest->directq = NULL;
+    dest->directiov = NULL;
+    dest->directcount = 0;
+    dest->directsent = 0;
+    dest->directbytes = 0;
+    dest->flushdeadline = 0;
+
+    snprintf(spoolname, 64, "mediator-%u-fwd%d", dest->mediatorid,
+            fwd->forwardid);
+    if (enable_export_buffer_spool(&(dest->buffer), &(fwd->spoolconf),
+                spoolname) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: records for mediator %u will only be buffered in memory",
+                dest->mediatorid);
+    }
+
+    if (use_iri_lane(dest)) {
+        snprintf(spoolname, 64, "mediator-%u-fwd%d-iri", dest->mediatorid,
+                fwd->forwardid);
+        if (enable_export_buffer_spool(&(dest->iribuffer),
+                    &(fwd->spoolconf), spoolname) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: IRIs for mediator %u will only be buffered in memory",
+                    dest->mediatorid);
+        }
+    }
+}
+
 static int add_new_destination(forwarding_thread_data_t *fwd,
         openli_export_recv_t *msg) {
 
@@ -92,6 +360,19 @@ static int add_new_destination(forwarding_thread_data_t *fwd,
         newdest->ipstr = msg->data.med.ipstr;
         newdest->portstr = msg->data.med.portstr;
         newdest->ssl = NULL;
+        newdest->ktls_send = 0;
+        newdest->batchframing = 0;
+        newdest->ctrllen = 0;
+        newdest->compressmethod = lookup_compression_method(fwd,
+                newdest->mediatorid);
+        newdest->startcompress = 0;
+        newdest->compressor = NULL;
+        newdest->zbuf = NULL;
+        newdest->zalloc = 0;
+        newdest->zlen = 0;
+        newdest->zsent = 0;
+        newdest->zchunk = 0;
+        newdest->hbsent = 0;
         newdest->ssllasterror = 0;
         newdest->waitingforhandshake = 0;
 
@@ -102,7 +383,7 @@ static int add_new_destination(forwarding_thread_data_t *fwd,
             newdest->rmq_queueid.bytes = (void *)(strdup(stringspace));
         }
 
-        init_export_buffer(&(newdest->buffer));
+        init_destination_buffer(fwd, newdest);
 
         JLI(jval, fwd->destinations_by_id, newdest->mediatorid);
         *jval = (Word_t)newdest;
@@ -167,150 +448,591 @@ static int add_new_destination(forwarding_thread_data_t *fwd,
     return 1;
 }
 
-static inline void disconnect_mediator(forwarding_thread_data_t *fwd,
-        export_dest_t *med) {
+static inline void add_direct_iovec(struct iovec *iov, int *iovcnt,
+        void *base, uint32_t len, uint32_t *skip) {
 
-    if (med->fd != -1) {
-        close(med->fd);
+    if (*skip >= len) {
+        *skip -= len;
+        return;
     }
-    med->fd = -1;
 
-    if (med->logallowed) {
-        logger(LOG_INFO, "OpenLI: disconnecting mediator %s:%s",
-                med->ipstr, med->portstr);
-    }
+    iov[*iovcnt].iov_base = ((uint8_t *)base) + *skip;
+    iov[*iovcnt].iov_len = len - *skip;
+    *skip = 0;
+    (*iovcnt) ++;
+}
 
-    med->logallowed = 0;
-    if (med->pollindex >= 0 && fwd->topoll) {
-        fwd->topoll[med->pollindex].fd = 0;
-        fwd->topoll[med->pollindex].events = 0;
-    }
-    if (med->ssl){
-        SSL_free(med->ssl);
-        med->ssl = NULL;
+/* Builds the message header needed to send queued encoded results
+ * straight from the encoder's memory, without copying them into the export
+ * buffer first. Returns the number of iovecs in the message.
+ */
+static int prepare_direct_results(export_dest_t *med) {
+
+    openli_encoded_result_t *res;
+    uint32_t i, skip = med->directsent;
+    int iovcnt = 0;
+
+    for (i = 0; i < med->directcount; i++) {
+        res = &(med->directq[i]);
+        add_direct_iovec(med->directiov, &iovcnt, &(res->header),
+                sizeof(res->header), &skip);
+        add_direct_iovec(med->directiov, &iovcnt, res->msgbody->encoded,
+                res->msgbody->len - res->ipclen, &skip);
+        add_direct_iovec(med->directiov, &iovcnt, res->ipcontents,
+                res->ipclen, &skip);
     }
+
+    memset(&(med->directmh), 0, sizeof(med->directmh));
+    med->directmh.msg_iov = med->directiov;
+    med->directmh.msg_iovlen = iovcnt;
+    return iovcnt;
 }
 
-static void remove_destination(forwarding_thread_data_t *fwd,
-        export_dest_t *med) {
+/* Releases any queued results that have been completely sent, given
+ * the outcome of sending the message built by prepare_direct_results().
+ * Results are only released once all of their bytes have been accepted
+ * by the socket.
+ */
+static int finish_direct_results(export_dest_t *med, ssize_t ret) {
 
-    int err;
+    openli_encoded_result_t *res;
+    uint32_t i;
+    uint64_t remaining, reclen;
 
-    JLD(err, fwd->destinations_by_id, med->mediatorid);
-    if (med->fd != -1) {
-        JLD(err, fwd->destinations_by_fd, med->fd);
-        disconnect_mediator(fwd, med);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
     }
 
-    release_export_buffer(&(med->buffer));
-    if (med->ipstr) {
-        free(med->ipstr);
+    remaining = (uint64_t)ret;
+    for (i = 0; i < med->directcount; i++) {
+        res = &(med->directq[i]);
+        reclen = sizeof(res->header) + res->msgbody->len;
+
+        if (remaining < reclen - med->directsent) {
+            med->directsent += remaining;
+            break;
+        }
+        remaining -= (reclen - med->directsent);
+        med->directsent = 0;
+        med->directbytes -= reclen;
+        free_encoded_result(res);
     }
-    if (med->portstr) {
-        free(med->portstr);
+
+    if (i > 0) {
+        memmove(med->directq, med->directq + i,
+                (med->directcount - i) * sizeof(openli_encoded_result_t));
+        med->directcount -= i;
     }
-    if (med->rmq_queueid.bytes) {
-        free(med->rmq_queueid.bytes);
+    return (int)ret;
+}
+
+/* Sends queued encoded results straight from the encoder's memory */
+static int transmit_direct_results(export_dest_t *med) {
+
+    if (prepare_direct_results(med) == 0) {
+        return 0;
     }
 
-    free(med);
+    return finish_direct_results(med,
+            sendmsg(med->fd, &(med->directmh), MSG_DONTWAIT));
 }
 
-static void remove_all_destinations(forwarding_thread_data_t *fwd) {
-    export_dest_t *med;
-    PWord_t *jval;
-    Word_t index;
+/* Moves any results that are still waiting to be sent directly into the
+ * export buffer, e.g. because the mediator is no longer keeping up or
+ * the connection has gone away.
+ */
+static int spill_direct_results(forwarding_thread_data_t *fwd,
+        export_dest_t *med) {
 
-    index = 0;
-    JLF(jval, fwd->destinations_by_id, index);
-    while (jval != NULL) {
-        med = (export_dest_t *)(*jval);
-        remove_destination(fwd, med);
-        JLN(jval, fwd->destinations_by_id, index);
+    uint32_t i;
+    int ret = 0;
+    export_buffer_t *buf;
+
+    for (i = 0; i < med->directcount; i++) {
+        buf = select_record_buffer(fwd, med, &(med->directq[i]));
+        if (ret == 0 && append_message_to_buffer(buf,
+                    &(med->directq[i]), i == 0 ? med->directsent : 0) == 0) {
+            logger(LOG_INFO,
+                    "OpenLI: unable to buffer pending records for mediator %u -- records have been lost!",
+                    med->mediatorid);
+            ret = -1;
+        }
+        free_encoded_result(&(med->directq[i]));
     }
+
+    med->directcount = 0;
+    med->directsent = 0;
+    med->directbytes = 0;
+    return ret;
 }
 
-static void disconnect_all_destinations(forwarding_thread_data_t *fwd) {
+/* Finds the held records for an LIID, if the mediator has asked us to
+ * hold that LIID back at some point.
+ */
+static inline held_liid_t *lookup_held_liid(export_dest_t *dest,
+        char *liid) {
 
-    export_dest_t *med;
-    PWord_t *jval;
-    Word_t index;
+    PWord_t jval;
 
-    index = 0;
-    JLF(jval, fwd->destinations_by_id, index);
+    if (dest->heldcount == 0 || liid == NULL) {
+        return NULL;
+    }
+
+    JSLG(jval, dest->heldliids, (unsigned char *)liid);
+    if (jval == NULL) {
+        return NULL;
+    }
+    return (held_liid_t *)(*jval);
+}
+
+static void free_held_liid(export_dest_t *dest, held_liid_t *held) {
+
+    int err;
+
+    JSLD(err, dest->heldliids, (unsigned char *)held->liid);
+    dest->heldcount --;
+
+    release_export_buffer(&(held->buffer));
+    free(held->liid);
+    free(held);
+}
+
+static void remove_held_liids(export_dest_t *dest) {
+
+    PWord_t jval;
+    uint8_t index[256];
+    held_liid_t *held;
+
+    index[0] = '\0';
+    JSLF(jval, dest->heldliids, index);
     while (jval != NULL) {
-        med = (export_dest_t *)(*jval);
-        JLN(jval, fwd->destinations_by_id, index);
-        disconnect_mediator(fwd, med);
-        med->ssllasterror = 0;
+        held = (held_liid_t *)(*jval);
+        free_held_liid(dest, held);
+        JSLN(jval, dest->heldliids, index);
     }
 }
 
-static void remove_reorderers(forwarding_thread_data_t *fwd, char *liid,
-        Pvoid_t *reorderer_array) {
+/* Ends any holds that a mediator has asked for, so that the held records
+ * will be released.
+ */
+static void end_all_holds(export_dest_t *dest) {
 
     PWord_t jval;
-    PWord_t pval;
     uint8_t index[256];
-    int_reorderer_t *reord;
-    int err;
-    Word_t seqindex;
 
     index[0] = '\0';
-    JSLF(jval, *reorderer_array, index);
+    JSLF(jval, dest->heldliids, index);
     while (jval != NULL) {
-        reord = (int_reorderer_t *)(*jval);
+        ((held_liid_t *)(*jval))->paused = 0;
+        JSLN(jval, dest->heldliids, index);
+    }
+}
 
-        if (liid != NULL && strcmp(reord->liid, liid) != 0) {
-            JSLN(jval, *reorderer_array, index);
-            continue;
-        }
-        JSLD(err, *reorderer_array, index);
+/* Starts, renews or ends a hold on the records for an LIID, as requested
+ * by the mediator.
+ */
+static void update_held_liid(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, char *liid, uint32_t leasems) {
 
-        seqindex = 0;
-        JLF(pval, reord->pending, seqindex);
-        while (pval) {
-            openli_encoded_result_t *res;
+    held_liid_t *held;
+    PWord_t jval;
+    char spoolname[128];
 
-            res = (openli_encoded_result_t *)(*pval);
-            free_encoded_result(res);
-            free(res);
-            JLN(pval, reord->pending, seqindex);
-        }
-        JLFA(err, reord->pending);
+    held = lookup_held_liid(dest, liid);
 
-        free(reord->liid);
-        free(reord->key);
-        free(reord);
-        JSLN(jval, *reorderer_array, index);
+    if (leasems == 0) {
+        if (held && held->paused) {
+            held->paused = 0;
+            logger(LOG_INFO,
+                    "OpenLI: mediator %s:%s is ready for records for LIID %s again",
+                    dest->ipstr, dest->portstr, liid);
+        }
+        return;
     }
-}
 
-static void flag_all_destinations(forwarding_thread_data_t *fwd) {
-    export_dest_t *med;
-    PWord_t *jval;
-    Word_t index;
+    if (held == NULL) {
+        JSLI(jval, dest->heldliids, (unsigned char *)liid);
+        if (jval == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI: unable to hold back records for LIID %s due to lack of memory",
+                    liid);
+            return;
+        }
 
-    index = 0;
-    JLF(jval, fwd->destinations_by_id, index);
-    while (jval != NULL) {
-        med = (export_dest_t *)(*jval);
-        JLN(jval, fwd->destinations_by_id, index);
+        held = (held_liid_t *)calloc(1, sizeof(held_liid_t));
+        held->liid = strdup(liid);
+        init_export_buffer(&(held->buffer));
 
-        med->awaitingconfirm = 1;
+        snprintf(spoolname, 128, "mediator-%u-fwd%d-held-%s",
+                dest->mediatorid, fwd->forwardid, liid);
+        if (enable_export_buffer_spool(&(held->buffer), &(fwd->spoolconf),
+                    spoolname) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: held records for LIID %s will only be buffered in memory",
+                    liid);
+        }
+
+        *jval = (Word_t)held;
+        dest->heldcount ++;
     }
-    fwd->awaitingconfirm = 1;
 
-    if (fwd->flagtimerfd != -1) {
-        close(fwd->flagtimerfd);
-        fwd->flagtimerfd = -1;
+    if (!held->paused) {
+        logger(LOG_INFO,
+                "OpenLI: mediator %s:%s has asked us to hold back records for LIID %s",
+                dest->ipstr, dest->portstr, liid);
     }
+
+    held->paused = 1;
+    held->leasems = leasems;
+    held->holduntil = get_monotonic_ms() + leasems;
 }
 
-static int handle_ctrl_message(forwarding_thread_data_t *fwd,
-        openli_export_recv_t *msg) {
+/* Moves some of the records that we have been holding for an LIID into
+ * the export buffer for the mediator, so that they can be sent. Held
+ * records are always moved into the main queue, even if they are IRIs.
+ *
+ * Returns the number of bytes that were moved.
+ */
+static uint64_t move_held_records(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, held_liid_t *held, uint64_t limit) {
 
-    if (msg->type == OPENLI_EXPORT_HALT) {
+    uint64_t moved = 0, avail;
+    uint8_t *start = NULL;
+
+    if (get_buffered_amount(&(held->buffer)) == 0) {
+        return 0;
+    }
+
+    /* Anything queued for a direct send is older than the held records */
+    spill_direct_results(fwd, dest);
+
+    while (moved < limit) {
+        avail = prepare_buffered_transmit(&(held->buffer), limit - moved,
+                &start);
+        if (avail == 0) {
+            break;
+        }
+
+        if (append_etsipdu_to_buffer(&(dest->buffer), start,
+                    (uint32_t)avail, 0) == 0) {
+            /* Leave them where they are and try again later */
+            logger(LOG_INFO,
+                    "OpenLI: unable to release held records for LIID %s to mediator %u",
+                    held->liid, dest->mediatorid);
+            break;
+        }
+        finish_buffered_transmit(&(held->buffer), avail, (int)avail);
+        moved += avail;
+    }
+
+    if (moved > 0) {
+        if (dest->ccwaitsince == 0) {
+            dest->ccwaitsince = get_monotonic_ms();
+        }
+        arm_flush_deadline(fwd, dest);
+    }
+    return moved;
+}
+
+/* Releases the records that we have been holding for a mediator, at a
+ * rate that depends on whether the mediator still wants us to hold them.
+ *
+ * Returns the number of milliseconds until the held records next need
+ * attention, or -1 if there is no need to wake up for them.
+ */
+static int release_held_records(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, uint64_t now) {
+
+    PWord_t jval;
+    uint8_t index[256];
+    held_liid_t *held;
+    int wait = -1;
+
+    index[0] = '\0';
+    JSLF(jval, dest->heldliids, index);
+    while (jval != NULL) {
+        held = (held_liid_t *)(*jval);
+
+        if (held->paused) {
+            if (now >= held->holduntil) {
+                /* The mediator hasn't renewed the hold, so send a few
+                 * records -- it will either tell us to resume or ask us
+                 * to keep holding */
+                move_held_records(fwd, dest, held, HELD_PROBE_AMOUNT);
+                held->holduntil = now + held->leasems;
+            }
+            if (wait < 0 || held->holduntil - now < (uint64_t)wait) {
+                wait = (int)(held->holduntil - now);
+            }
+            JSLN(jval, dest->heldliids, index);
+            continue;
+        }
+
+        if (get_dest_buffered_amount(dest) < HELD_RELEASE_AMOUNT) {
+            move_held_records(fwd, dest, held, HELD_RELEASE_AMOUNT);
+        }
+
+        if (get_buffered_amount(&(held->buffer)) == 0) {
+            free_held_liid(dest, held);
+        } else if (get_dest_buffered_amount(dest) < HELD_RELEASE_AMOUNT) {
+            /* Otherwise we'll be woken when the mediator is writable */
+            wait = 0;
+        }
+        JSLN(jval, dest->heldliids, index);
+    }
+    return wait;
+}
+
+static int release_all_held_records(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *dest;
+    PWord_t jval;
+    Word_t index = 0;
+    uint64_t now = 0;
+    int wait = -1, destwait;
+
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval) {
+        dest = (export_dest_t *)(*jval);
+        JLN(jval, fwd->destinations_by_id, index);
+
+        if (dest->heldcount == 0) {
+            continue;
+        }
+        if (now == 0) {
+            now = get_monotonic_ms();
+        }
+
+        destwait = release_held_records(fwd, dest, now);
+        if (destwait >= 0 && (wait < 0 || destwait < wait)) {
+            wait = destwait;
+        }
+    }
+    return wait;
+}
+
+static inline void disconnect_mediator(forwarding_thread_data_t *fwd,
+        export_dest_t *med) {
+
+    spill_direct_results(fwd, med);
+
+    if (med->fd != -1) {
+        close(med->fd);
+    }
+    med->fd = -1;
+    /* Any partially sent heartbeat went with the old connection */
+    med->hbsent = 0;
+
+    if (med->logallowed) {
+        logger(LOG_INFO, "OpenLI: disconnecting mediator %s:%s",
+                med->ipstr, med->portstr);
+    }
+
+    med->logallowed = 0;
+    if (med->pollindex >= 0 && fwd->topoll) {
+        fwd->topoll[med->pollindex].fd = 0;
+        fwd->topoll[med->pollindex].events = 0;
+    }
+    if (med->ssl){
+        SSL_free(med->ssl);
+        med->ssl = NULL;
+    }
+    med->ktls_send = 0;
+
+    /* We'll find out whether the mediator supports batching again when
+     * we reconnect */
+    med->batchframing = 0;
+    med->ctrllen = 0;
+
+    /* The mediator will ask again after we reconnect if it still needs
+     * us to hold anything back */
+    end_all_holds(med);
+
+    /* Any partially sent compressed data is lost, but the records that
+     * it covered are still in the export buffer */
+    reset_compression(med);
+}
+
+/* Makes sure that a destination which is being removed is not touched by
+ * any confirms that arrive for its publishes later on.
+ */
+static void forget_rmq_confirms(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    uint32_t i;
+    rmq_unconfirmed_t *pend;
+
+    for (i = 0; i < fwd->rmq_wincount; i++) {
+        pend = &(fwd->rmq_window[(fwd->rmq_winstart + i) %
+                RMQ_CONFIRM_WINDOW]);
+        if (pend->dest == dest) {
+            pend->dest = NULL;
+        }
+    }
+}
+
+static void remove_destination(forwarding_thread_data_t *fwd,
+        export_dest_t *med) {
+
+    int err;
+
+    JLD(err, fwd->destinations_by_id, med->mediatorid);
+    if (med->fd != -1) {
+        JLD(err, fwd->destinations_by_fd, med->fd);
+        disconnect_mediator(fwd, med);
+    }
+
+    forget_rmq_confirms(fwd, med);
+
+    spill_direct_results(fwd, med);
+    remove_held_liids(med);
+    if (med->directq) {
+        free(med->directq);
+    }
+    if (med->directiov) {
+        free(med->directiov);
+    }
+    reset_compression(med);
+    if (med->zbuf) {
+        free(med->zbuf);
+    }
+    release_export_buffer(&(med->buffer));
+    release_export_buffer(&(med->iribuffer));
+    if (med->ipstr) {
+        free(med->ipstr);
+    }
+    if (med->portstr) {
+        free(med->portstr);
+    }
+    if (med->rmq_queueid.bytes) {
+        free(med->rmq_queueid.bytes);
+    }
+
+    free(med);
+}
+
+static void remove_all_destinations(forwarding_thread_data_t *fwd) {
+    export_dest_t *med;
+    PWord_t *jval;
+    Word_t index;
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval != NULL) {
+        med = (export_dest_t *)(*jval);
+        remove_destination(fwd, med);
+        JLN(jval, fwd->destinations_by_id, index);
+    }
+}
+
+static void disconnect_all_destinations(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *med;
+    PWord_t *jval;
+    Word_t index;
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval != NULL) {
+        med = (export_dest_t *)(*jval);
+        JLN(jval, fwd->destinations_by_id, index);
+        disconnect_mediator(fwd, med);
+        med->ssllasterror = 0;
+    }
+}
+
+static void remove_reorderers(forwarding_thread_data_t *fwd, char *liid,
+        Pvoid_t *reorderer_array) {
+
+    PWord_t jval;
+    PWord_t pval;
+    uint8_t index[256];
+    int_reorderer_t *reord;
+    int err;
+    Word_t seqindex;
+
+    index[0] = '\0';
+    JSLF(jval, *reorderer_array, index);
+    while (jval != NULL) {
+        reord = (int_reorderer_t *)(*jval);
+
+        if (liid != NULL && strcmp(reord->liid, liid) != 0) {
+            JSLN(jval, *reorderer_array, index);
+            continue;
+        }
+        JSLD(err, *reorderer_array, index);
+
+        seqindex = 0;
+        JLF(pval, reord->pending, seqindex);
+        while (pval) {
+            openli_encoded_result_t *res;
+
+            res = (openli_encoded_result_t *)(*pval);
+            free_encoded_result(res);
+            free(res);
+            JLN(pval, reord->pending, seqindex);
+        }
+        JLFA(err, reord->pending);
+
+        free(reord->liid);
+        free(reord->key);
+        free(reord);
+        JSLN(jval, *reorderer_array, index);
+    }
+}
+
+static void flag_all_destinations(forwarding_thread_data_t *fwd) {
+    export_dest_t *med;
+    PWord_t *jval;
+    Word_t index;
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval != NULL) {
+        med = (export_dest_t *)(*jval);
+        JLN(jval, fwd->destinations_by_id, index);
+
+        med->awaitingconfirm = 1;
+    }
+    fwd->awaitingconfirm = 1;
+
+    if (fwd->flagtimerfd != -1) {
+        close(fwd->flagtimerfd);
+        fwd->flagtimerfd = -1;
+    }
+}
+
+/* The provisioner has told us that the mediators we already had are still
+ * valid, so none of them should be purged when the flag timer expires.
+ */
+static void confirm_all_destinations(forwarding_thread_data_t *fwd) {
+    export_dest_t *med;
+    PWord_t *jval;
+    Word_t index;
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval != NULL) {
+        med = (export_dest_t *)(*jval);
+        JLN(jval, fwd->destinations_by_id, index);
+
+        med->awaitingconfirm = 0;
+    }
+    fwd->awaitingconfirm = 0;
+
+    if (fwd->flagtimerfd != -1) {
+        close(fwd->flagtimerfd);
+        fwd->flagtimerfd = -1;
+    }
+}
+
+static int handle_ctrl_message(forwarding_thread_data_t *fwd,
+        openli_export_recv_t *msg) {
+
+    if (msg->type == OPENLI_EXPORT_HALT) {
         free(msg);
         return 0;
     }
@@ -343,6 +1065,8 @@ static int handle_ctrl_message(forwarding_thread_data_t *fwd,
         remove_all_destinations(fwd);
     } else if (msg->type == OPENLI_EXPORT_FLAG_MEDIATORS) {
         flag_all_destinations(fwd);
+    } else if (msg->type == OPENLI_EXPORT_CONFIRM_MEDIATORS) {
+        confirm_all_destinations(fwd);
     } else if (msg->type == OPENLI_EXPORT_RECONNECT_ALL_MEDIATORS) {
         logger(LOG_DEBUG, "causing all mediators to reconnect");
         disconnect_all_destinations(fwd);
@@ -351,23 +1075,133 @@ static int handle_ctrl_message(forwarding_thread_data_t *fwd,
     return 1;
 }
 
-static inline int enqueue_result(forwarding_thread_data_t *fwd,
-        export_dest_t *med, openli_encoded_result_t *res) {
-
-    PWord_t jval;
-    PWord_t pval;
-    int_reorderer_t *reord;
-    Pvoid_t *reorderer;
-    openli_encoded_result_t *stored;
-    int rcint;
+static inline int can_send_directly(forwarding_thread_data_t *fwd,
+        export_dest_t *med) {
 
-    if (res->origreq->type == OPENLI_EXPORT_IPCC ||
-            res->origreq->type == OPENLI_EXPORT_IPMMCC ||
-            res->origreq->type == OPENLI_EXPORT_UMTSCC) {
+    /* With kTLS the kernel encrypts whatever we write to the socket, so
+     * we can still bypass OpenSSL in that case */
+    if (fwd->ampq_conn || med->fd == -1 || med->waitingforhandshake ||
+            (med->ssl != NULL && !med->ktls_send)) {
+        return 0;
+    }
 
-        reorderer = &(fwd->intreorderer_cc);
-    } else {
-        reorderer = &(fwd->intreorderer_iri);
+    /* Direct sends use the per-record framing, so only use them if the
+     * mediator can't accept batches */
+    if (med->batchframing) {
+        return 0;
+    }
+
+    /* Compressed streams have to go through the export buffer */
+    if (med->compressor || med->startcompress) {
+        return 0;
+    }
+
+    /* Only bypass the export buffers if they are empty, otherwise we would
+     * be sending records out of order */
+    if (med->directcount > 0) {
+        return 1;
+    }
+    return (get_dest_buffered_amount(med) == 0);
+}
+
+/* Either queues a result for direct transmission or copies it into the
+ * export buffer. If the result is queued, the queue takes ownership of
+ * any memory that it refers to and the caller's copy is cleared so that
+ * freeing it becomes a no-op.
+ *
+ * Returns 0 if the result was queued, 1 if it was copied into the export
+ * buffer and -1 if it could not be buffered at all.
+ */
+static int export_encoded_result(forwarding_thread_data_t *fwd,
+        export_dest_t *med, openli_encoded_result_t *res) {
+
+    export_buffer_t *buf;
+    held_liid_t *held;
+
+    /* Records for an LIID that the mediator has asked us to hold back
+     * have to queue behind any that we are already holding */
+    if ((held = lookup_held_liid(med, res->liid)) != NULL) {
+        if (append_message_to_buffer(&(held->buffer), res, 0) == 0) {
+            return -1;
+        }
+        return 1;
+    }
+
+    arm_flush_deadline(fwd, med);
+
+    if (can_send_directly(fwd, med)) {
+        if (med->directq == NULL) {
+            med->directq = calloc(DIRECT_QUEUE_SIZE,
+                    sizeof(openli_encoded_result_t));
+            med->directiov = calloc(DIRECT_QUEUE_SIZE * 3,
+                    sizeof(struct iovec));
+        }
+    }
+
+    if (med->directq && med->directiov && can_send_directly(fwd, med)) {
+        memcpy(&(med->directq[med->directcount]), res,
+                sizeof(openli_encoded_result_t));
+        med->directcount ++;
+        med->directbytes += (sizeof(res->header) + res->msgbody->len);
+
+        res->liid = NULL;
+        res->cinstr = NULL;
+        res->msgbody = NULL;
+        res->origreq = NULL;
+
+        if (med->directcount < DIRECT_QUEUE_SIZE &&
+                med->directbytes < MIN_SEND_AMOUNT) {
+            return 0;
+        }
+
+        if (transmit_direct_results(med) < 0) {
+            if (med->logallowed) {
+                logger(LOG_INFO,
+                    "OpenLI: error transmitting records to mediator %s:%s: %s",
+                    med->ipstr, med->portstr, strerror(errno));
+            }
+            disconnect_mediator(fwd, med);
+            return 0;
+        }
+
+        if (med->directcount == DIRECT_QUEUE_SIZE) {
+            /* Mediator is not keeping up, so start buffering instead */
+            spill_direct_results(fwd, med);
+        }
+        return 0;
+    }
+
+    buf = select_record_buffer(fwd, med, res);
+    if (med->batchframing) {
+        if (append_batched_message_to_buffer(buf, res) == 0) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (append_message_to_buffer(buf, res, 0) == 0) {
+        return -1;
+    }
+    return 1;
+}
+
+static inline int enqueue_result(forwarding_thread_data_t *fwd,
+        export_dest_t *med, openli_encoded_result_t *res) {
+
+    PWord_t jval;
+    PWord_t pval;
+    int_reorderer_t *reord;
+    Pvoid_t *reorderer;
+    openli_encoded_result_t *stored;
+    int rcint;
+
+    if (res->origreq->type == OPENLI_EXPORT_IPCC ||
+            res->origreq->type == OPENLI_EXPORT_IPMMCC ||
+            res->origreq->type == OPENLI_EXPORT_UMTSCC) {
+
+        reorderer = &(fwd->intreorderer_cc);
+    } else {
+        reorderer = &(fwd->intreorderer_iri);
     }
 
 
@@ -389,452 +1223,1150 @@ static inline int enqueue_result(forwarding_thread_data_t *fwd,
         reord->pending = NULL;
         reord->expectedseqno = 0;
 
-        *jval = (Word_t)reord;
-    } else {
-        reord = (int_reorderer_t *)(*jval);
-    }
+        *jval = (Word_t)reord;
+    } else {
+        reord = (int_reorderer_t *)(*jval);
+    }
+
+    if (res->seqno != reord->expectedseqno) {
+        openli_encoded_result_t *tosave = calloc(1,
+                sizeof(openli_encoded_result_t));
+        memcpy(tosave, res, sizeof(openli_encoded_result_t));
+
+        JLI(pval, reord->pending, res->seqno);
+        if (pval == NULL) {
+            logger(LOG_INFO, "OpenLI: unable to create stored intercept record due to lack of memory");
+            exit(-3);
+        }
+
+        *pval = (Word_t)tosave;
+        return 0;
+    }
+
+    if (export_encoded_result(fwd, med, res) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate now!",
+                med->mediatorid);
+        remove_destination(fwd, med);
+        return 1;
+    }
+
+    reord->expectedseqno = res->seqno + 1;
+
+    JLG(pval, reord->pending, reord->expectedseqno);
+    while (pval != NULL) {
+        stored = (openli_encoded_result_t *)(*pval);
+
+        JLD(rcint, reord->pending, reord->expectedseqno);
+
+        if (export_encoded_result(fwd, med, stored) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate asap!",
+                    med->mediatorid);
+            remove_destination(fwd, med);
+            return -1;
+        }
+        reord->expectedseqno = stored->seqno + 1;
+
+        free_encoded_result(stored);
+        free(stored);
+        JLG(pval, reord->pending, reord->expectedseqno);
+    }
+
+    return 1;
+}
+
+static int handle_encoded_result(forwarding_thread_data_t *fwd,
+        openli_encoded_result_t *res) {
+
+    int ret = 0;
+    export_dest_t *med;
+    PWord_t jval;
+
+    /* Check if this result is for a mediator we know about. If not,
+     * create a destination for that mediator and buffer results until
+     * we get a corresponding announcement. */
+
+
+    JLG(jval, fwd->destinations_by_id, res->destid);
+    if (jval == NULL) {
+        char stringspace[32];
+        JLI(jval, fwd->destinations_by_id, res->destid);
+
+        if (jval == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI: unable to allocate memory for unknown mediator %u",
+                    res->destid);
+            exit(-2);
+        }
+
+        med = (export_dest_t *)calloc(1, sizeof(export_dest_t));
+        med->failmsg = 0;
+        med->pollindex = -1;
+        med->fd = -1;
+        med->logallowed = 1;
+        med->ipstr = NULL;
+        med->portstr = NULL;
+        med->awaitingconfirm = 0;
+        med->halted = 0;
+        med->mediatorid = res->destid;
+        init_destination_buffer(fwd, med);
+
+        if (fwd->ampq_conn) {
+            snprintf(stringspace, 32, "ID%d", med->mediatorid);
+
+            med->rmq_queueid.len = strlen(stringspace);
+            med->rmq_queueid.bytes = (void *)(strdup(stringspace));
+        }
+        *jval = (Word_t) med;
+    } else {
+        med = (export_dest_t *)(*jval);
+    }
+
+    ret = enqueue_result(fwd, med, res);
+
+    if (ret != 0) {
+        free_encoded_result(res);
+    }
+
+    return ret;
+}
+
+static void purge_unconfirmed_mediators(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *med;
+    PWord_t *jval;
+    Word_t index;
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval != NULL) {
+        med = (export_dest_t *)(*jval);
+
+        if (med->awaitingconfirm) {
+            remove_destination(fwd, med);
+        }
+        JLN(jval, fwd->destinations_by_id, index);
+    }
+
+}
+
+static int connect_single_target(export_dest_t *dest, SSL_CTX *ctx) {
+
+    int sockfd;
+
+    if (dest->ipstr == NULL) {
+        /* This is an unannounced mediator */
+        return -1;
+    }
+
+    sockfd = connect_socket(dest->ipstr, dest->portstr, dest->failmsg, 0);
+    fd_set_nonblock(sockfd);
+
+    if (sockfd == -1) {
+        /* TODO should probably bail completely on this dest if this
+         * happens. */
+        return -1;
+    }
+
+    if (sockfd == 0) {
+        dest->failmsg = 1;
+        return -1;
+    }
+
+    if (ctx != NULL){
+        int errr;
+        dest->ssl = SSL_new(ctx);
+        SSL_set_fd(dest->ssl, sockfd);
+        errr = SSL_connect(dest->ssl);
+
+        if(errr <= 0){
+            errr = SSL_get_error(dest->ssl, errr);
+            if (errr != SSL_ERROR_WANT_WRITE && errr != SSL_ERROR_WANT_READ){ //handshake failed badly
+                close(sockfd);
+                SSL_free(dest->ssl);
+                dest->ssl = NULL;
+                logger(LOG_INFO, "OpenLI: SSL Handshake with mediator failed");
+                return -1;
+            }
+        }
+        if (dest->ssllasterror == 0) {
+            logger(LOG_DEBUG, "OpenLI: SSL Handshake with mediator started");
+        }
+    }
+    else {
+        logger(LOG_INFO, "OpenLI: collector has connected to mediator %s:%s using a non-TLS connection", dest->ipstr, dest->portstr);
+        dest->ssl = NULL;
+    }
+
+    dest->failmsg = 0;
+    /* If we disconnected after a partial send, make sure we re-send the
+     * whole record and trust that downstream will figure out how to deal
+     * with any duplication.
+     */
+    dest->buffer.partialfront = 0;
+    dest->iribuffer.partialfront = 0;
+    return sockfd;
+}
+
+
+static void declare_rmq_queue(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    amqp_queue_declare(
+            fwd->ampq_conn,
+            1,
+            dest->rmq_queueid,
+            0,
+            1,
+            0,
+            0,
+            amqp_empty_table);
+
+    if (amqp_get_rpc_reply(fwd->ampq_conn).reply_type != AMQP_RESPONSE_NORMAL ) {
+        logger(LOG_INFO, "OpenLI: Failed to declare queue");
+    }
+}
+
+static void connect_export_targets(forwarding_thread_data_t *fwd) {
+
+    export_dest_t *dest;
+    int ind;
+    PWord_t jval, jval2;
+    Word_t index;
+
+    index = 0;
+    JLF(jval, fwd->destinations_by_id, index);
+
+    while (jval != NULL) {
+        dest = (export_dest_t *)(*jval);
+
+        JLN(jval, fwd->destinations_by_id, index);
+
+        if (dest->fd != -1) {
+            continue;
+        }
+
+        if (dest->halted) {
+            continue;
+        }
+
+        pthread_mutex_lock(&(fwd->sslmutex));
+        dest->fd = connect_single_target(dest, fwd->ctx);
+        pthread_mutex_unlock(&(fwd->sslmutex));
+        if (dest->fd == -1) {
+            continue;
+        }
+
+        if (fwd->ampq_conn && fwd->rmq_connected) {
+            declare_rmq_queue(fwd, dest);
+        }
+
+        JLI(jval2, fwd->destinations_by_fd, dest->fd);
+        if (jval2 == NULL) {
+            logger(LOG_INFO, "memory issue while connecting to export target");
+            close(dest->fd);
+            dest->fd = -1;
+            exit(-2);
+        }
+
+        *jval2 = (Word_t)dest;
+
+        if (dest->pollindex == -1) {
+            if (fwd->nextpoll == fwd->pollsize - 1) {
+                fwd->topoll = realloc(fwd->topoll, (fwd->pollsize + 10) *
+                        sizeof(zmq_pollitem_t));
+                fwd->forcesend = realloc(fwd->forcesend,
+                        (fwd->pollsize + 10) * sizeof(uint8_t));
+
+                fwd->pollsize += 10;
+            }
+            ind = fwd->nextpoll;
+            fwd->nextpoll ++;
+            dest->pollindex = ind;
+        } else {
+            ind = dest->pollindex;
+        }
+
+        dest->waitingforhandshake = (dest->ssl != NULL); //needs to await for handshake if SSL is enabled 
+
+        fwd->forcesend[ind] = 0;
+        fwd->topoll[ind].socket = NULL;
+        fwd->topoll[ind].fd = dest->fd;
+        fwd->topoll[ind].events = ZMQ_POLLOUT;
+        fwd->topoll[ind].revents = 0;
+    }
+
+}
+
+static int drain_incoming_etsi(forwarding_thread_data_t *fwd) {
+
+    int x, encoders_over = 0, i, msgcnt;
+    openli_encoded_result_t res[MAX_ENCODED_RESULT_BATCH];
+
+    do {
+        x = zmq_recv(fwd->zmq_pullressock, res, sizeof(res),
+                ZMQ_DONTWAIT);
+        if (x < 0 && errno != EAGAIN) {
+            return -1;
+        }
+
+        if (x < 0) {
+            continue;
+        }
+
+        if (x % sizeof(openli_encoded_result_t) != 0) {
+            logger(LOG_INFO, "forwarder received odd sized message (%d bytes)?",
+                    x);
+            return -1;
+        }
+        msgcnt = x / sizeof(openli_encoded_result_t);
+
+        for (i = 0; i < msgcnt; i++) {
+
+            if (res[i].liid == NULL && res[i].destid == 0) {
+                logger(LOG_INFO, "encoder %d has ceased encoding", encoders_over);
+                encoders_over ++;
+            }
+
+            free_encoded_result(&(res[i]));
+        }
+    } while (encoders_over < fwd->encoders);
+
+    return 1;
+}
+
+static int receive_incoming_etsi(forwarding_thread_data_t *fwd) {
+    int x, processed, i, msgcnt;
+    openli_encoded_result_t res[MAX_ENCODED_RESULT_BATCH];
+
+    processed = 0;
+    do {
+        x = zmq_recv(fwd->zmq_pullressock, &res, sizeof(res),
+                ZMQ_DONTWAIT);
+        if (x < 0 && errno != EAGAIN) {
+            logger(LOG_INFO,
+                    "OpenLI: error while receiving result in forwarder %d: %s",
+                    fwd->forwardid, strerror(errno));
+            return -1;
+        }
+
+        if (x <= 0) {
+            break;
+        }
+
+        if (x % sizeof(openli_encoded_result_t) != 0) {
+            logger(LOG_INFO, "forwarder received odd sized message (%d bytes)?",
+                    x);
+            return -1;
+        }
+        msgcnt = x / sizeof(openli_encoded_result_t);
+
+        for (i = 0; i < msgcnt; i++) {
+            if (handle_encoded_result(fwd, &(res[i])) < 0) {
+                return -1;
+            }
+            processed ++;
+        }
+    } while (x > 0 && processed < 100000);
+    return 1;
+}
+
+static int process_control_message(forwarding_thread_data_t *fwd) {
+    openli_export_recv_t *msg;
+    int x;
+
+    do {
+        /* Got something on the control socket */
+        x = zmq_recv(fwd->zmq_ctrlsock, &msg, sizeof(msg),
+                ZMQ_DONTWAIT);
+        if (x < 0 && errno != EAGAIN) {
+            logger(LOG_INFO,
+                    "OpenLI: error while receiving command in forwarder %d: %s",
+                    fwd->forwardid, strerror(errno));
+            return -1;
+        }
+
+        if (x <= 0) {
+            break;
+        }
+
+        if (handle_ctrl_message(fwd,msg)  <= 0) {
+            return -1;
+        }
+
+    } while (x > 0);
 
-    if (res->seqno != reord->expectedseqno) {
-        openli_encoded_result_t *tosave = calloc(1,
-                sizeof(openli_encoded_result_t));
-        memcpy(tosave, res, sizeof(openli_encoded_result_t));
+    return 1;
+}
 
-        JLI(pval, reord->pending, res->seqno);
-        if (pval == NULL) {
-            logger(LOG_INFO, "OpenLI: unable to create stored intercept record due to lack of memory");
-            exit(-3);
-        }
+/* Publishes the next batch of records for a destination to its RMQ
+ * queue, if there is enough waiting to be worth sending.
+ *
+ * Returns -1 if the publish failed, 0 if nothing was published and 1 if a
+ * batch was published.
+ */
+static int rmq_publish_dest(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, uint64_t now) {
+
+    uint64_t availsend;
+    rmq_unconfirmed_t *pend;
+    int ret;
+
+    availsend = get_unpublished_amount_RMQ(&(dest->buffer));
+    if (availsend == 0) {
+        /* Anything still buffered has been published and is just waiting
+         * to be confirmed, so there is nothing to flush */
+        dest->flushdeadline = 0;
+        return 0;
+    }
 
-        *pval = (Word_t)tosave;
+    if (availsend < MIN_SEND_AMOUNT && fwd->forcesend_rmq == 0 &&
+            !flush_is_due(dest, now)) {
         return 0;
     }
 
-    if (append_message_to_buffer(&(med->buffer), res, 0) == 0) {
-        logger(LOG_INFO,
-                "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate now!",
-                med->mediatorid);
-        remove_destination(fwd, med);
-        return 1;
+    ret = transmit_buffered_records_RMQ(&(dest->buffer),
+            fwd->ampq_conn,
+            1,
+            amqp_cstring_bytes(""),
+            dest->rmq_queueid,
+            RMQ_BATCH_SIZE);
+    if (ret < 0) {
+        logger(LOG_INFO, "OpenLI: Error Publishing to RMQ");
+        return -1;
+    }
+    if (ret == 0) {
+        return 0;
     }
 
-    reord->expectedseqno = res->seqno + 1;
+    pend = &(fwd->rmq_window[(fwd->rmq_winstart + fwd->rmq_wincount) %
+            RMQ_CONFIRM_WINDOW]);
+    pend->deliverytag = fwd->rmq_nexttag;
+    pend->dest = dest;
+    pend->len = ret;
+    pend->acked = 0;
+    fwd->rmq_nexttag ++;
+    fwd->rmq_wincount ++;
+
+    /* Give whatever is left a fresh deadline */
+    dest->flushdeadline = 0;
+    if (get_unpublished_amount_RMQ(&(dest->buffer)) > 0) {
+        arm_flush_deadline(fwd, dest);
+    }
+    return 1;
+}
 
-    JLG(pval, reord->pending, reord->expectedseqno);
-    while (pval != NULL) {
-        stored = (openli_encoded_result_t *)(*pval);
+/* Releases the records for any publishes at the front of the confirm
+ * window that the broker has now confirmed. Publishes are released in
+ * order, so that each export buffer is only ever trimmed from the front.
+ */
+static void release_rmq_confirms(forwarding_thread_data_t *fwd) {
 
-        JLD(rcint, reord->pending, reord->expectedseqno);
+    rmq_unconfirmed_t *pend;
 
-        if (append_message_to_buffer(&(med->buffer), stored, 0) == 0) {
-            logger(LOG_INFO,
-                    "OpenLI: forced to drop mediator %u because we cannot buffer any more records for it -- please investigate asap!",
-                    med->mediatorid);
-            remove_destination(fwd, med);
-            return -1;
+    while (fwd->rmq_wincount > 0) {
+        pend = &(fwd->rmq_window[fwd->rmq_winstart]);
+        if (!pend->acked) {
+            break;
         }
-        reord->expectedseqno = stored->seqno + 1;
-
-        free_encoded_result(stored);
-        free(stored);
-        JLG(pval, reord->pending, reord->expectedseqno);
+        if (pend->dest) {
+            confirm_buffered_records_RMQ(&(pend->dest->buffer), pend->len);
+        }
+        fwd->rmq_winstart = (fwd->rmq_winstart + 1) % RMQ_CONFIRM_WINDOW;
+        fwd->rmq_wincount --;
     }
-
-    return 1;
 }
 
-static int handle_encoded_result(forwarding_thread_data_t *fwd,
-        openli_encoded_result_t *res) {
-
-    int ret = 0;
-    export_dest_t *med;
-    PWord_t jval;
+/* Reads any publish confirms that the broker has sent us, without
+ * blocking.
+ *
+ * Returns -1 if the broker has rejected a publish or the connection has
+ * failed, 0 otherwise.
+ */
+static int process_rmq_confirms(forwarding_thread_data_t *fwd) {
 
-    /* Check if this result is for a mediator we know about. If not,
-     * create a destination for that mediator and buffer results until
-     * we get a corresponding announcement. */
+    amqp_frame_t frame;
+    struct timeval tv;
+    uint64_t tag;
+    uint8_t multiple;
+    uint32_t i;
+    rmq_unconfirmed_t *pend;
+    int ret;
 
+    while (fwd->rmq_wincount > 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
 
-    JLG(jval, fwd->destinations_by_id, res->destid);
-    if (jval == NULL) {
-        char stringspace[32];
-        JLI(jval, fwd->destinations_by_id, res->destid);
+        amqp_maybe_release_buffers(fwd->ampq_conn);
 
-        if (jval == NULL) {
+        ret = amqp_simple_wait_frame_noblock(fwd->ampq_conn, &frame, &tv);
+        if (ret == AMQP_STATUS_TIMEOUT) {
+            break;
+        }
+        if (ret != AMQP_STATUS_OK) {
             logger(LOG_INFO,
-                    "OpenLI: unable to allocate memory for unknown mediator %u",
-                    res->destid);
-            exit(-2);
+                    "OpenLI: forwarding thread %d lost its RMQ connection: %s",
+                    fwd->forwardid, amqp_error_string2(ret));
+            return -1;
         }
 
-        med = (export_dest_t *)calloc(1, sizeof(export_dest_t));
-        med->failmsg = 0;
-        med->pollindex = -1;
-        med->fd = -1;
-        med->logallowed = 1;
-        med->ipstr = NULL;
-        med->portstr = NULL;
-        med->awaitingconfirm = 0;
-        med->halted = 0;
-        med->mediatorid = res->destid;
-        init_export_buffer(&(med->buffer));
-
-        if (fwd->ampq_conn) {
-            snprintf(stringspace, 32, "ID%d", med->mediatorid);
-
-            med->rmq_queueid.len = strlen(stringspace);
-            med->rmq_queueid.bytes = (void *)(strdup(stringspace));
+        if (frame.frame_type != AMQP_FRAME_METHOD) {
+            continue;
         }
-        *jval = (Word_t) med;
-    } else {
-        med = (export_dest_t *)(*jval);
-    }
 
-    ret = enqueue_result(fwd, med, res);
+        switch(frame.payload.method.id) {
+            case AMQP_BASIC_ACK_METHOD:
+                tag = ((amqp_basic_ack_t *)
+                        frame.payload.method.decoded)->delivery_tag;
+                multiple = ((amqp_basic_ack_t *)
+                        frame.payload.method.decoded)->multiple;
+                break;
+            case AMQP_BASIC_NACK_METHOD:
+                /* The broker has lost our records, so we'll have to
+                 * publish everything that is unconfirmed again */
+                logger(LOG_INFO,
+                        "OpenLI: RMQ broker rejected a publish from forwarding thread %d",
+                        fwd->forwardid);
+                return -1;
+            case AMQP_CHANNEL_CLOSE_METHOD:
+            case AMQP_CONNECTION_CLOSE_METHOD:
+                logger(LOG_INFO,
+                        "OpenLI: RMQ broker closed the channel for forwarding thread %d",
+                        fwd->forwardid);
+                return -1;
+            default:
+                continue;
+        }
 
-    if (ret != 0) {
-        free_encoded_result(res);
+        for (i = 0; i < fwd->rmq_wincount; i++) {
+            pend = &(fwd->rmq_window[(fwd->rmq_winstart + i) %
+                    RMQ_CONFIRM_WINDOW]);
+            if (pend->deliverytag == tag ||
+                    (multiple && pend->deliverytag < tag)) {
+                pend->acked = 1;
+            }
+        }
+        release_rmq_confirms(fwd);
     }
-
-    return ret;
+    return 0;
 }
 
-static void purge_unconfirmed_mediators(forwarding_thread_data_t *fwd) {
+/* Drops the connection to the RMQ broker. Anything that the broker had
+ * not yet confirmed will be published again once we have reconnected.
+ */
+static void reset_rmq_connection(forwarding_thread_data_t *fwd) {
 
-    export_dest_t *med;
-    PWord_t *jval;
-    Word_t index;
+    export_dest_t *dest;
+    PWord_t jval;
+    Word_t index = 0;
 
-    index = 0;
     JLF(jval, fwd->destinations_by_id, index);
-    while (jval != NULL) {
-        med = (export_dest_t *)(*jval);
-
-        if (med->awaitingconfirm) {
-            remove_destination(fwd, med);
-        }
+    while (jval) {
+        dest = (export_dest_t *)(*jval);
         JLN(jval, fwd->destinations_by_id, index);
+        rewind_buffered_records_RMQ(&(dest->buffer));
     }
-
+    fwd->rmq_winstart = 0;
+    fwd->rmq_wincount = 0;
+
+    /* Keep a connection object around, as other code relies on it to know
+     * that we are exporting via RMQ */
+    amqp_destroy_connection(fwd->ampq_conn);
+    fwd->ampq_conn = amqp_new_connection();
+    fwd->ampq_sock = amqp_tcp_socket_new(fwd->ampq_conn);
+    fwd->rmq_connected = 0;
+    fwd->rmq_retryat = get_monotonic_ms() + RMQ_RECONNECT_DELAY;
 }
 
-static int connect_single_target(export_dest_t *dest, SSL_CTX *ctx) {
+/* Connects to the RMQ broker and puts our channel into confirm mode.
+ *
+ * Returns -1 if the connection attempt failed, 0 otherwise.
+ */
+static int connect_rmq_broker(forwarding_thread_data_t *fwd) {
 
-    int sockfd;
+    export_dest_t *dest;
+    PWord_t jval;
+    Word_t index = 0;
 
-    if (dest->ipstr == NULL) {
-        /* This is an unannounced mediator */
-        return -1;
+    if (fwd->ampq_conn == NULL) {
+        fwd->ampq_conn = amqp_new_connection();
+        fwd->ampq_sock = amqp_tcp_socket_new(fwd->ampq_conn);
     }
 
-    sockfd = connect_socket(dest->ipstr, dest->portstr, dest->failmsg, 0);
-    fd_set_nonblock(sockfd);
+    //TODO RMQ instance will always be on localhost? (for collector)
+    if (amqp_socket_open(fwd->ampq_sock, "localhost", 5672 )){
+        logger(LOG_INFO,
+                "OpenLI: RMQ forwarding thread %d failed to open amqp socket",
+                fwd->forwardid);
+        goto rmqfail;
+    }
 
-    if (sockfd == -1) {
-        /* TODO should probably bail completely on this dest if this
-         * happens. */
-        return -1;
+    /* login using PLAIN, must specify username and password */
+    if ( (amqp_login(fwd->ampq_conn, "OpenLI", 0, AMQP_FRAME_MAX,0,
+                    AMQP_SASL_METHOD_PLAIN, fwd->RMQ_conf.name,
+                    fwd->RMQ_conf.pass)
+            ).reply_type != AMQP_RESPONSE_NORMAL ) {
+        logger(LOG_ERR, "OpenLI: RMQ Failed to login to broker using PLAIN auth");
+        goto rmqfail;
     }
 
-    if (sockfd == 0) {
-        dest->failmsg = 1;
-        return -1;
+    amqp_channel_open(fwd->ampq_conn, 1);
+
+    if ( (amqp_get_rpc_reply(fwd->ampq_conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+        logger(LOG_ERR, "OpenLI: Failed to open channel");
+        goto rmqfail;
     }
 
-    if (ctx != NULL){
-        int errr;
-        dest->ssl = SSL_new(ctx);
-        SSL_set_fd(dest->ssl, sockfd);
-        errr = SSL_connect(dest->ssl);
+    /* Have the broker confirm each publish once it has taken
+     * responsibility for it */
+    amqp_confirm_select(fwd->ampq_conn, 1);
 
-        if(errr <= 0){
-            errr = SSL_get_error(dest->ssl, errr);
-            if (errr != SSL_ERROR_WANT_WRITE && errr != SSL_ERROR_WANT_READ){ //handshake failed badly
-                close(sockfd);
-                SSL_free(dest->ssl);
-                dest->ssl = NULL;
-                logger(LOG_INFO, "OpenLI: SSL Handshake with mediator failed");
-                return -1;
-            }
-        }
-        if (dest->ssllasterror == 0) {
-            logger(LOG_DEBUG, "OpenLI: SSL Handshake with mediator started");
-        }
+    if ( (amqp_get_rpc_reply(fwd->ampq_conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+        logger(LOG_ERR, "OpenLI: Failed to enable RMQ publisher confirms");
+        goto rmqfail;
     }
-    else {
-        logger(LOG_INFO, "OpenLI: collector has connected to mediator %s:%s using a non-TLS connection", dest->ipstr, dest->portstr);
-        dest->ssl = NULL;
+
+    JLF(jval, fwd->destinations_by_id, index);
+    while (jval) {
+        dest = (export_dest_t *)(*jval);
+        JLN(jval, fwd->destinations_by_id, index);
+        if (dest->rmq_queueid.bytes) {
+            declare_rmq_queue(fwd, dest);
+        }
     }
 
-    dest->failmsg = 0;
-    /* If we disconnected after a partial send, make sure we re-send the
-     * whole record and trust that downstream will figure out how to deal
-     * with any duplication.
-     */
-    dest->buffer.partialfront = 0;
-    return sockfd;
-}
+    fwd->rmq_connected = 1;
+    fwd->rmq_nexttag = 1;
+    logger(LOG_INFO, "OpenLI: Connected to RMQ instance");
+    return 0;
 
+rmqfail:
+    reset_rmq_connection(fwd);
+    return -1;
+}
 
-static void connect_export_targets(forwarding_thread_data_t *fwd) {
+static void rmq_write_buffered(forwarding_thread_data_t *fwd) {
 
     export_dest_t *dest;
-    int ind;
-    PWord_t jval, jval2;
-    Word_t index;
+    PWord_t jval;
+    uint64_t now = get_monotonic_ms();
+    Word_t index = 0;
+    int ret, published;
 
-    index = 0;
     JLF(jval, fwd->destinations_by_id, index);
-
-    while (jval != NULL) {
+    while (jval) {
         dest = (export_dest_t *)(*jval);
-
         JLN(jval, fwd->destinations_by_id, index);
 
-        if (dest->fd != -1) {
+        if (dest->fd == -1 || dest->waitingforhandshake) {
             continue;
         }
 
-        if (dest->halted) {
-            continue;
+        /* Finish off any heartbeat that couldn't be sent in full last
+         * time, even if another isn't due yet */
+        if (fwd->forcesend_rmq || dest->hbsent > 0) {
+            if (transmit_heartbeat_nonblocking(dest->fd, dest->ssl,
+                        &(dest->hbeat), &(dest->hbsent)) < 0) {
+                logger(LOG_INFO,
+                        "OpenLI: failed to send heartbeat to mediator %s:%s",
+                        dest->ipstr, dest->portstr);
+                disconnect_mediator(fwd, dest);
+            }
         }
+    }
 
-        pthread_mutex_lock(&(fwd->sslmutex));
-        dest->fd = connect_single_target(dest, fwd->ctx);
-        pthread_mutex_unlock(&(fwd->sslmutex));
-        if (dest->fd == -1) {
-            continue;
+    if (!fwd->rmq_connected) {
+        if (now < fwd->rmq_retryat || connect_rmq_broker(fwd) < 0) {
+            return;
         }
+    }
 
-        if (fwd->ampq_conn) {
-            amqp_queue_declare(
-                    fwd->ampq_conn,
-                    1,
-                    dest->rmq_queueid,
-                    0,
-                    1,
-                    0,
-                    0,
-                    amqp_empty_table);
-
-            if (amqp_get_rpc_reply(fwd->ampq_conn).reply_type != AMQP_RESPONSE_NORMAL ) {
-                logger(LOG_INFO, "OpenLI: Failed to declare queue");
-            }
-        }
+    if (process_rmq_confirms(fwd) < 0) {
+        reset_rmq_connection(fwd);
+        return;
+    }
 
-        JLI(jval2, fwd->destinations_by_fd, dest->fd);
-        if (jval2 == NULL) {
-            logger(LOG_INFO, "memory issue while connecting to export target");
-            close(dest->fd);
-            dest->fd = -1;
-            exit(-2);
+    /* Take turns publishing a batch for each destination, until either
+     * there is nothing more worth sending or the confirm window is full */
+    do {
+        published = 0;
+        index = 0;
+        JLF(jval, fwd->destinations_by_id, index);
+        while (jval && fwd->rmq_wincount < RMQ_CONFIRM_WINDOW) {
+            dest = (export_dest_t *)(*jval);
+            JLN(jval, fwd->destinations_by_id, index);
+
+            ret = rmq_publish_dest(fwd, dest, now);
+            if (ret < 0) {
+                reset_rmq_connection(fwd);
+                return;
+            }
+            published += ret;
         }
+    } while (published > 0 && fwd->rmq_wincount < RMQ_CONFIRM_WINDOW);
+}
 
-        *jval2 = (Word_t)dest;
+static void complete_ssl_handshake(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
 
-        if (dest->pollindex == -1) {
-            if (fwd->nextpoll == fwd->pollsize - 1) {
-                fwd->topoll = realloc(fwd->topoll, (fwd->pollsize + 10) *
-                        sizeof(zmq_pollitem_t));
-                fwd->forcesend = realloc(fwd->forcesend,
-                        (fwd->pollsize + 10) * sizeof(uint8_t));
+    //either keep running handshake or fail when error
+    int ret = SSL_connect(dest->ssl);
 
-                fwd->pollsize += 10;
-            }
-            ind = fwd->nextpoll;
-            fwd->nextpoll ++;
-            dest->pollindex = ind;
-        } else {
-            ind = dest->pollindex;
+    if (ret <= 0) {
+        ret = SSL_get_error(dest->ssl, ret);
+        if(ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE){
+            //keep trying
+            return;
+        }
+        else {
+            //fail out
+            if (dest->ssllasterror == 0) {
+                logger(LOG_INFO,
+                        "OpenLI: error in continuing SSL handshake with mediator: %s:%s",
+                        dest->ipstr, dest->portstr);
+            }
+            dest->waitingforhandshake = 0;
+            dest->ssllasterror = 1;
+            disconnect_mediator(fwd, dest);
         }
+    } else {
+        char desc[256];
 
-        dest->waitingforhandshake = (dest->ssl != NULL); //needs to await for handshake if SSL is enabled 
+        logger(LOG_DEBUG, "OpenLI: SSL Handshake from mediator accepted");
+        dest->waitingforhandshake = 0;
+        dest->ssllasterror = 0;
 
-        fwd->forcesend[ind] = 0;
-        fwd->topoll[ind].socket = NULL;
-        fwd->topoll[ind].fd = dest->fd;
-        fwd->topoll[ind].events = ZMQ_POLLOUT;
-        fwd->topoll[ind].revents = 0;
+        dest->ktls_send = ssl_has_ktls_send(dest->ssl);
+        snprintf(desc, 256, "mediator %s:%s", dest->ipstr, dest->portstr);
+        log_ssl_offload_mode(dest->ssl, desc);
     }
-
 }
 
-static int drain_incoming_etsi(forwarding_thread_data_t *fwd) {
-
-    int x, encoders_over = 0, i, msgcnt;
-    openli_encoded_result_t res[MAX_ENCODED_RESULT_BATCH];
+/* Reads any messages that the mediator has sent us. Currently, the only
+ * message that a mediator will send is a list of the protocol features
+ * that it supports.
+ *
+ * Returns -1 if the connection to the mediator has failed, 0 otherwise.
+ */
+static int receive_mediator_message(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
 
-    do {
-        x = zmq_recv(fwd->zmq_pullressock, res, sizeof(res),
-                ZMQ_DONTWAIT);
-        if (x < 0 && errno != EAGAIN) {
+    ii_header_t hdr;
+    uint32_t msglen, caps, leasems;
+    char liid[256];
+    int ret;
+
+    if (dest->ssl != NULL) {
+        ret = SSL_read(dest->ssl, dest->ctrlbuf + dest->ctrllen,
+                sizeof(dest->ctrlbuf) - dest->ctrllen);
+        if (ret <= 0) {
+            ret = SSL_get_error(dest->ssl, ret);
+            if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE) {
+                return 0;
+            }
             return -1;
         }
-
-        if (x < 0) {
-            continue;
+    } else {
+        ret = recv(dest->fd, dest->ctrlbuf + dest->ctrllen,
+                sizeof(dest->ctrlbuf) - dest->ctrllen, MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (ret <= 0) {
+            return -1;
         }
+    }
+    dest->ctrllen += ret;
 
-        if (x % sizeof(openli_encoded_result_t) != 0) {
-            logger(LOG_INFO, "forwarder received odd sized message (%d bytes)?",
-                    x);
+    while (dest->ctrllen >= sizeof(ii_header_t)) {
+        memcpy(&hdr, dest->ctrlbuf, sizeof(ii_header_t));
+        msglen = sizeof(ii_header_t) + ntohs(hdr.bodylen);
+
+        if (ntohl(hdr.magic) != OPENLI_PROTO_MAGIC ||
+                msglen > sizeof(dest->ctrlbuf)) {
+            logger(LOG_INFO,
+                    "OpenLI: received invalid message from mediator %s:%s",
+                    dest->ipstr, dest->portstr);
             return -1;
         }
-        msgcnt = x / sizeof(openli_encoded_result_t);
 
-        for (i = 0; i < msgcnt; i++) {
+        if (dest->ctrllen < msglen) {
+            break;
+        }
 
-            if (res[i].liid == NULL && res[i].destid == 0) {
-                logger(LOG_INFO, "encoder %d has ceased encoding", encoders_over);
-                encoders_over ++;
+        /* Ignore any other message types, in case a newer mediator sends
+         * us something that we don't know about */
+        if (ntohs(hdr.intercepttype) == OPENLI_PROTO_CAPABILITIES &&
+                decode_capabilities(dest->ctrlbuf + sizeof(ii_header_t),
+                    ntohs(hdr.bodylen), &caps) == 0 && !fwd->ampq_conn) {
+
+            if ((caps & OPENLI_CAP_BATCHED_RECORDS) && !dest->batchframing) {
+                /* Anything queued for a direct send must go into the
+                 * buffer first, so that records remain in order */
+                spill_direct_results(fwd, dest);
+                dest->batchframing = 1;
+                logger(LOG_INFO,
+                        "OpenLI: mediator %s:%s accepts batched records, enabling batched framing",
+                        dest->ipstr, dest->portstr);
             }
 
-            free_encoded_result(&(res[i]));
+            if (dest->compressmethod != OPENLI_COMPRESS_NONE &&
+                    dest->compressor == NULL && !dest->startcompress) {
+                if (caps & compression_capability(dest->compressmethod)) {
+                    spill_direct_results(fwd, dest);
+                    dest->startcompress = 1;
+                    logger(LOG_INFO,
+                            "OpenLI: mediator %s:%s accepts %s compression, compressing exported records",
+                            dest->ipstr, dest->portstr,
+                            compression_method_string(dest->compressmethod));
+                } else {
+                    logger(LOG_INFO,
+                            "OpenLI: mediator %s:%s does not support %s compression, records will be sent uncompressed",
+                            dest->ipstr, dest->portstr,
+                            compression_method_string(dest->compressmethod));
+                }
+            }
         }
-    } while (encoders_over < fwd->encoders);
 
-    return 1;
+        if (ntohs(hdr.intercepttype) == OPENLI_PROTO_FLOW_CONTROL &&
+                decode_flow_control(dest->ctrlbuf + sizeof(ii_header_t),
+                    ntohs(hdr.bodylen), liid, sizeof(liid),
+                    &leasems) == 0 && !fwd->ampq_conn) {
+            update_held_liid(fwd, dest, liid, leasems);
+        }
+
+        memmove(dest->ctrlbuf, dest->ctrlbuf + msglen,
+                dest->ctrllen - msglen);
+        dest->ctrllen -= msglen;
+    }
+    return 0;
 }
 
-static int receive_incoming_etsi(forwarding_thread_data_t *fwd) {
-    int x, processed, i, msgcnt;
-    openli_encoded_result_t res[MAX_ENCODED_RESULT_BATCH];
+static void check_transmit_result(forwarding_thread_data_t *fwd,
+        export_dest_t *dest, int ret) {
 
-    processed = 0;
-    do {
-        x = zmq_recv(fwd->zmq_pullressock, &res, sizeof(res),
-                ZMQ_DONTWAIT);
-        if (x < 0 && errno != EAGAIN) {
+    if (ret < 0) {
+        if (dest->logallowed) {
             logger(LOG_INFO,
-                    "OpenLI: error while receiving result in forwarder %d: %s",
-                    fwd->forwardid, strerror(errno));
-            return -1;
+                "OpenLI: error transmitting records to mediator %s:%s: %s",
+                dest->ipstr, dest->portstr, strerror(errno));
         }
+        disconnect_mediator(fwd, dest);
+    } else if (dest->logallowed == 0) {
+        logger(LOG_INFO,
+                "OpenLI: successfully started transmitting records to mediator %s:%s", dest->ipstr, dest->portstr);
+        dest->logallowed = 1;
+    }
+}
 
-        if (x <= 0) {
-            break;
+static inline uint64_t elapsed_usec(struct timespec *start,
+        struct timespec *end) {
+    return ((end->tv_sec - start->tv_sec) * 1000000) +
+            ((end->tv_nsec - start->tv_nsec) / 1000);
+}
+
+/* Compresses the next chunk of the export buffer (if we're not still
+ * sending the previous one) and writes as much of the compressed data to
+ * the mediator as we can. The records in a chunk are only removed from the
+ * export buffer once all of the compressed data for that chunk has been
+ * sent, so nothing is lost if we get disconnected part way through.
+ *
+ * Returns -1 if an error occurs, otherwise the number of bytes sent.
+ */
+static int transmit_compressed_records(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    uint8_t *start = NULL;
+    uint64_t len, before;
+    struct timespec cpustart, cpuend;
+    SSL *ssl = dest->ktls_send ? NULL : dest->ssl;
+    export_buffer_t *buf;
+    int ret;
+
+    if (dest->zlen == 0 && dest->compressor == NULL) {
+        /* A record that was only partly sent before the mediator agreed
+         * to compression has to be finished off uncompressed */
+        if (dest->buffer.partialfront == 0 &&
+                dest->iribuffer.partialfront == 0) {
+            dest->compressor = create_compressor(dest->compressmethod);
+            dest->startcompress = 0;
+            if (dest->compressor == NULL) {
+                dest->compressmethod = OPENLI_COMPRESS_NONE;
+            }
         }
 
-        if (x % sizeof(openli_encoded_result_t) != 0) {
-            logger(LOG_INFO, "forwarder received odd sized message (%d bytes)?",
-                    x);
+        if (dest->compressor == NULL) {
+            buf = select_transmit_buffer(fwd, dest);
+            ret = transmit_buffered_records(buf, dest->fd,
+                    transmit_limit(dest), ssl);
+            note_transmit_progress(fwd, dest, buf, get_monotonic_ms());
+            return ret;
+        }
+
+        if (dest->zbuf == NULL) {
+            dest->zalloc = MIN_SEND_AMOUNT;
+            dest->zbuf = malloc(dest->zalloc);
+        }
+
+        /* The message that announces compression is itself uncompressed */
+        ret = construct_start_compression_message(dest->zbuf, dest->zalloc,
+                dest->compressmethod);
+        if (ret < 0) {
             return -1;
         }
-        msgcnt = x / sizeof(openli_encoded_result_t);
+        dest->zlen = ret;
+    }
 
-        for (i = 0; i < msgcnt; i++) {
-            if (handle_encoded_result(fwd, &(res[i])) < 0) {
+    if (dest->zchunk == 0) {
+        buf = select_transmit_buffer(fwd, dest);
+        len = prepare_buffered_transmit(buf, COMPRESS_BATCH_SIZE, &start);
+        if (start != NULL && len == 0) {
+            finish_buffered_transmit(buf, 0, 0);
+        } else if (start != NULL) {
+            before = dest->zlen;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpustart);
+            if (compress_and_flush(dest->compressor, start, len,
+                        &(dest->zbuf), &(dest->zlen), &(dest->zalloc)) < 0) {
                 return -1;
             }
-            processed ++;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuend);
+            dest->zchunk = len;
+
+            if (fwd->stats) {
+                pthread_mutex_lock(fwd->stats_mutex);
+                fwd->stats->compress_bytes_in += len;
+                fwd->stats->compress_bytes_out += (dest->zlen - before);
+                fwd->stats->compress_cpu_usec += elapsed_usec(&cpustart,
+                        &cpuend);
+                pthread_mutex_unlock(fwd->stats_mutex);
+            }
         }
-    } while (x > 0 && processed < 100000);
-    return 1;
-}
+    }
 
-static int process_control_message(forwarding_thread_data_t *fwd) {
-    openli_export_recv_t *msg;
-    int x;
+    if (dest->zlen == dest->zsent) {
+        return 0;
+    }
 
-    do {
-        /* Got something on the control socket */
-        x = zmq_recv(fwd->zmq_ctrlsock, &msg, sizeof(msg),
-                ZMQ_DONTWAIT);
-        if (x < 0 && errno != EAGAIN) {
-            logger(LOG_INFO,
-                    "OpenLI: error while receiving command in forwarder %d: %s",
-                    fwd->forwardid, strerror(errno));
+    if (ssl != NULL) {
+        while (1) {
+            ret = SSL_write(ssl, dest->zbuf + dest->zsent,
+                    (int)(dest->zlen - dest->zsent));
+            if (ret <= 0) {
+                char errstring[128];
+                int errr = SSL_get_error(ssl, ret);
+                if (errr == SSL_ERROR_WANT_WRITE) {
+                    continue;
+                }
+                logger(LOG_INFO,
+                        "OpenLI: ssl_write error (%d) while sending compressed records: %s",
+                        errr, ERR_error_string(ERR_get_error(), errstring));
+                return -1;
+            }
+            break;
+        }
+    } else {
+        ret = send(dest->fd, dest->zbuf + dest->zsent,
+                dest->zlen - dest->zsent, MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
             return -1;
         }
+    }
 
-        if (x <= 0) {
-            break;
-        }
+    dest->zsent += ret;
+    if (dest->zsent < dest->zlen) {
+        return ret;
+    }
 
-        if (handle_ctrl_message(fwd,msg)  <= 0) {
+    if (dest->zchunk > 0) {
+        finish_buffered_transmit(dest->txbuffer, dest->zchunk,
+                (int)dest->zchunk);
+        note_transmit_progress(fwd, dest, dest->txbuffer,
+                get_monotonic_ms());
+    }
+    dest->zlen = 0;
+    dest->zsent = 0;
+    dest->zchunk = 0;
+    return ret;
+}
+
+/* Adds a send for this destination to the current io_uring batch.
+ *
+ * Returns 0 if the destination has been dealt with, or -1 if the records
+ * must be sent using the regular path instead (e.g. because OpenSSL
+ * needs to encrypt them).
+ */
+static int queue_uring_transmit(forwarding_thread_data_t *fwd,
+        export_dest_t *dest) {
+
+    uint8_t *start = NULL;
+    uint64_t len;
+    export_buffer_t *buf;
+
+    if (dest->ssl != NULL && !dest->ktls_send) {
+        return -1;
+    }
+
+    if (dest->directcount > 0) {
+        if (prepare_direct_results(dest) == 0) {
             return -1;
         }
+        return queue_uring_sendmsg(&(fwd->uring), dest->fd,
+                &(dest->directmh), dest);
+    }
 
-    } while (x > 0);
+    buf = select_transmit_buffer(fwd, dest);
+    len = prepare_buffered_transmit(buf, transmit_limit(dest), &start);
+    if (start == NULL) {
+        return 0;
+    }
+    if (len == 0) {
+        finish_buffered_transmit(buf, 0, 0);
+        return 0;
+    }
+    return queue_uring_send(&(fwd->uring), dest->fd, start, len, dest);
+}
 
-    return 1;
+/* Submits all of the sends that were batched up by queue_uring_transmit()
+ * and applies the results to each destination.
+ */
+static void flush_uring_transmits(forwarding_thread_data_t *fwd) {
+
+    openli_uring_send_t *s;
+    export_dest_t *dest;
+    uint32_t i;
+    uint64_t now;
+    int ret;
+
+    /* If the ring fails, any unsent entries are reported as EAGAIN and
+     * will be retried via the regular path on the next iteration */
+    submit_uring_batch(&(fwd->uring));
+    now = get_monotonic_ms();
+
+    for (i = 0; i < fwd->uring.batchcount; i++) {
+        s = &(fwd->uring.batch[i]);
+        dest = (export_dest_t *)(s->owner);
+
+        if (s->result < 0) {
+            errno = -(s->result);
+            ret = -1;
+        } else {
+            ret = s->result;
+        }
+
+        if (s->msg) {
+            ret = finish_direct_results(dest, ret);
+        } else {
+            ret = finish_buffered_transmit(dest->txbuffer, s->len, ret);
+            note_transmit_progress(fwd, dest, dest->txbuffer, now);
+        }
+        check_transmit_result(fwd, dest, ret);
+    }
+
+    clear_uring_batch(&(fwd->uring));
 }
 
-static void rmq_write_buffered(forwarding_thread_data_t *fwd) {
+/* Decides which destinations we need to wait on for writability, based
+ * on whether they have enough records to be worth sending or have run out
+ * of latency budget.
+ *
+ * Returns the number of milliseconds until the next flush deadline
+ * expires, or -1 if there are no deadlines pending.
+ */
+static int update_destination_polling(forwarding_thread_data_t *fwd,
+        uint64_t now) {
 
     export_dest_t *dest;
     PWord_t jval;
-    uint64_t availsend = 0;
     Word_t index = 0;
+    uint64_t availsend, nextdeadline = 0;
+    zmq_pollitem_t *item;
+    short readev;
+    uint8_t rmqwaiting = 0;
 
     JLF(jval, fwd->destinations_by_id, index);
     while (jval) {
         dest = (export_dest_t *)(*jval);
         JLN(jval, fwd->destinations_by_id, index);
 
-        if (dest->fd != -1 && fwd->forcesend_rmq &&
-                !dest->waitingforhandshake) {
-            /* XXX Warning: will block */
-            if (transmit_heartbeat(dest->fd, dest->ssl) < 0) {
-                logger(LOG_INFO,
-                        "OpenLI: failed to send heartbeat to mediator %s:%s",
-                        dest->ipstr, dest->portstr);
-                disconnect_mediator(fwd, dest);
-            }
+        if (dest->fd == -1 || dest->pollindex < 0) {
+            continue;
+        }
+        item = &(fwd->topoll[dest->pollindex]);
+
+        if (dest->waitingforhandshake) {
+            item->events = ZMQ_POLLOUT;
+            continue;
+        }
+
+        /* Always listen for messages from the mediator, e.g. capability
+         * announcements */
+        readev = fwd->ampq_conn ? 0 : ZMQ_POLLIN;
+
+        if (dest->directcount > 0) {
+            availsend = dest->directbytes;
+        } else {
+            availsend = get_dest_buffered_amount(dest);
         }
 
-        availsend = get_buffered_amount(&(dest->buffer));
         if (availsend == 0) {
+            dest->flushdeadline = 0;
+            item->events = readev;
             continue;
         }
 
-        if (availsend < MIN_SEND_AMOUNT && fwd->forcesend_rmq == 0) {
+        /* RMQ destinations are written by rmq_write_buffered() instead */
+        if (fwd->ampq_conn) {
+            item->events = 0;
+
+            /* If we can't publish right now, a flush deadline that has
+             * passed would just keep waking us up for nothing -- instead,
+             * wait until we can reconnect or a confirm has arrived */
+            if (!fwd->rmq_connected ||
+                    fwd->rmq_wincount >= RMQ_CONFIRM_WINDOW) {
+                rmqwaiting = 1;
+                continue;
+            }
+            if (get_unpublished_amount_RMQ(&(dest->buffer)) == 0) {
+                continue;
+            }
+        } else if (availsend >= MIN_SEND_AMOUNT ||
+                fwd->forcesend[dest->pollindex] ||
+                flush_is_due(dest, now)) {
+            item->events = ZMQ_POLLOUT | readev;
             continue;
+        } else {
+            item->events = readev;
         }
 
-        if (transmit_buffered_records_RMQ(&(dest->buffer), 
-                fwd->ampq_conn,
-                1,
-                amqp_cstring_bytes(""),
-                dest->rmq_queueid,
-                BUF_BATCH_SIZE) < 0 ) {
-            logger(LOG_INFO, "OpenLI: Error Publishing to RMQ");
+        if (dest->flushdeadline != 0 && (nextdeadline == 0 ||
+                    dest->flushdeadline < nextdeadline)) {
+            nextdeadline = dest->flushdeadline;
         }
     }
-}
-
-static void complete_ssl_handshake(forwarding_thread_data_t *fwd,
-        export_dest_t *dest) {
 
-    //either keep running handshake or fail when error
-    int ret = SSL_connect(dest->ssl);
+    if (rmqwaiting && !fwd->rmq_connected && (nextdeadline == 0 ||
+                fwd->rmq_retryat < nextdeadline)) {
+        nextdeadline = fwd->rmq_retryat;
+    }
+    /* If the confirm window is full, forwarder_main_loop() will poll for
+     * confirms every RMQ_CONFIRM_POLL_MS */
 
-    if (ret <= 0) {
-        ret = SSL_get_error(dest->ssl, ret);
-        if(ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE){
-            //keep trying
-            return;
-        }
-        else {
-            //fail out
-            if (dest->ssllasterror == 0) {
-                logger(LOG_INFO,
-                        "OpenLI: error in continuing SSL handshake with mediator: %s:%s",
-                        dest->ipstr, dest->portstr);
-            }
-            dest->waitingforhandshake = 0;
-            dest->ssllasterror = 1;
-            disconnect_mediator(fwd, dest);
-        }
-    } else {
-        logger(LOG_DEBUG, "OpenLI: SSL Handshake from mediator accepted");
-        dest->waitingforhandshake = 0;
-        dest->ssllasterror = 0;
+    if (nextdeadline == 0) {
+        return -1;
+    }
+    if (nextdeadline <= now) {
+        return 0;
     }
+    return (int)(nextdeadline - now);
 }
 
 static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
-    int topollc, x, i;
-    int towait = 10000;
+    int topollc, x, i, ret, timeout, heldwait;
+    uint64_t now;
 
     /* Add the mediator confirmation timer to our poll item list, if
      * required.
@@ -849,8 +2381,25 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
         topollc = fwd->nextpoll;
     }
 
+    /* Block until we get new results, a control message, a timer fires,
+     * a destination with records ready becomes writable, the latency
+     * budget for a destination runs out or some held records need to be
+     * released.
+     */
+    heldwait = release_all_held_records(fwd);
+    timeout = update_destination_polling(fwd, get_monotonic_ms());
+    if (heldwait >= 0 && (timeout < 0 || heldwait < timeout)) {
+        timeout = heldwait;
+    }
+
+    /* Publish confirms arrive on the RMQ socket, which we don't poll on */
+    if (fwd->rmq_wincount > 0 &&
+            (timeout < 0 || timeout > RMQ_CONFIRM_POLL_MS)) {
+        timeout = RMQ_CONFIRM_POLL_MS;
+    }
+
     while (1) {
-        if ((x = zmq_poll(fwd->topoll, topollc, 10)) < 0) {
+        if ((x = zmq_poll(fwd->topoll, topollc, timeout)) < 0) {
             if (errno == EINTR) {
                 continue;
             }
@@ -859,10 +2408,6 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
                     fwd->forwardid, strerror(errno));
             return -1;
         }
-        if (x == 0) {
-            usleep(towait);
-            continue;
-        }
         break;
     }
 
@@ -872,13 +2417,13 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
             return 0;
         }
         fwd->topoll[0].revents = 0;
-        towait = 0;
     }
 
     if (fwd->topoll[2].revents & ZMQ_POLLIN) {
         struct itimerspec its;
 
         connect_export_targets(fwd);
+        update_queue_stats(fwd);
 
         for (i = 3; i < fwd->nextpoll; i++) {
             fwd->forcesend[i] = 1;
@@ -891,7 +2436,6 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
         its.it_value.tv_nsec = 0;
 
         timerfd_settime(fwd->conntimerfd, 0, &its, NULL);
-        towait = 0;
     }
 
     if (fwd->topoll[1].revents & ZMQ_POLLIN) {
@@ -900,7 +2444,6 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
             return 0;
         }
         fwd->topoll[1].revents = 0;
-        towait = 0;
     }
 
     if (fwd->awaitingconfirm && fwd->flagtimerfd != -1) {
@@ -909,7 +2452,6 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
             fwd->awaitingconfirm = 0;
             close(fwd->flagtimerfd);
             fwd->flagtimerfd = -1;
-            towait = 0;
         }
     }
 
@@ -922,12 +2464,14 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
     }
 
 
+    now = get_monotonic_ms();
     for (i = 3; i < fwd->nextpoll; i++) {
         export_dest_t *dest;
         PWord_t jval;
         uint64_t availsend = 0;
+        short revents = fwd->topoll[i].revents;
         /* check if any destinations can received any buffered data */
-        if (!(fwd->topoll[i].revents & ZMQ_POLLOUT)) {
+        if (!(revents & (ZMQ_POLLOUT | ZMQ_POLLIN))) {
             continue;
         }
         fwd->topoll[i].revents = 0;
@@ -946,9 +2490,23 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
 
         dest = (export_dest_t *)(*jval);
 
+        if (revents & ZMQ_POLLIN) {
+            if (receive_mediator_message(fwd, dest) < 0) {
+                if (dest->logallowed) {
+                    logger(LOG_INFO,
+                            "OpenLI: lost connection to mediator %s:%s",
+                            dest->ipstr, dest->portstr);
+                }
+                disconnect_mediator(fwd, dest);
+                continue;
+            }
+            if (!(revents & ZMQ_POLLOUT)) {
+                continue;
+            }
+        }
+
         if (dest->waitingforhandshake){
             complete_ssl_handshake(fwd, dest);
-            towait = 0;
             continue;
         }
 
@@ -956,36 +2514,57 @@ static inline int forwarder_main_loop(forwarding_thread_data_t *fwd) {
             continue;
         }
 
-        if ((availsend = get_buffered_amount(&(dest->buffer))) == 0) {
+        if (dest->directcount > 0) {
+            availsend = dest->directbytes;
+        } else {
+            availsend = get_dest_buffered_amount(dest);
+        }
+
+        if (availsend == 0 && dest->zlen == 0) {
             /* Nothing available to send */
             continue;
         }
 
-        if (fwd->forcesend[i] == 0 && availsend < MIN_SEND_AMOUNT) {
+        if (fwd->forcesend[i] == 0 && availsend < MIN_SEND_AMOUNT &&
+                dest->zlen == 0 && !flush_is_due(dest, now)) {
             /* Not enough data to warrant a send right now */
             continue;
         }
 
-        if (transmit_buffered_records(&(dest->buffer), dest->fd,
-                BUF_BATCH_SIZE, dest->ssl) < 0) {
-            if (dest->logallowed) {
-                logger(LOG_INFO,
-                    "OpenLI: error transmitting records to mediator %s:%s: %s",
-                    dest->ipstr, dest->portstr, strerror(errno));
-            }
-            disconnect_mediator(fwd, dest);
-        } else if (dest->logallowed == 0) {
-            logger(LOG_INFO,
-                    "OpenLI: successfully started transmitting records to mediator %s:%s", dest->ipstr, dest->portstr);
-            dest->logallowed = 1;
-        }
-        towait = 0;
         fwd->forcesend[i] = 0;
+
+        /* Compression happens in this thread, so compressed streams are
+         * always written using the regular path */
+        if (dest->compressor || dest->startcompress) {
+            ret = transmit_compressed_records(fwd, dest);
+            check_transmit_result(fwd, dest, ret);
+            continue;
+        }
+
+        /* Sends are collected and submitted together once we've
+         * looked at every destination */
+        if (fwd->uring.active && queue_uring_transmit(fwd, dest) == 0) {
+            continue;
+        }
+
+        if (dest->directcount > 0) {
+            ret = transmit_direct_results(dest);
+        } else {
+            export_buffer_t *buf = select_transmit_buffer(fwd, dest);
+
+            /* Records can be written straight to the socket if the
+             * kernel is doing the TLS encryption for us */
+            ret = transmit_buffered_records(buf, dest->fd,
+                    transmit_limit(dest), dest->ktls_send ? NULL : dest->ssl);
+            note_transmit_progress(fwd, dest, buf, now);
+        }
+        check_transmit_result(fwd, dest, ret);
     }
 
-    if (towait != 0) {
-        usleep(towait);
+    if (fwd->uring.batchcount > 0) {
+        flush_uring_transmits(fwd);
     }
+
     return 1;
 }
 
@@ -1032,6 +2611,15 @@ static void forwarder_main(forwarding_thread_data_t *fwd) {
     fwd->topoll[2].fd = fwd->conntimerfd;
     fwd->topoll[2].events = ZMQ_POLLIN;
 
+    if (fwd->use_iouring) {
+        char ringname[64];
+
+        snprintf(ringname, 64, "forwarding thread %d", fwd->forwardid);
+        init_openli_uring(&(fwd->uring), DEFAULT_URING_DEPTH, ringname);
+    } else {
+        memset(&(fwd->uring), 0, sizeof(fwd->uring));
+    }
+
     do {
         x = forwarder_main_loop(fwd);
     } while (x == 1);
@@ -1047,6 +2635,7 @@ static void forwarder_main(forwarding_thread_data_t *fwd) {
     fwd->topoll = NULL;
     free(fwd->forcesend);
     fwd->forcesend = NULL;
+    destroy_openli_uring(&(fwd->uring));
     close(fwd->conntimerfd);
     if (fwd->flagtimerfd != -1) {
         close(fwd->flagtimerfd);
@@ -1098,33 +2687,9 @@ void *start_forwarding_thread(void *data) {
 
     if (fwd->RMQ_conf.enabled) {
         if ( fwd->RMQ_conf.name && fwd->RMQ_conf.pass ) {
-            fwd->ampq_conn = amqp_new_connection();
-            fwd->ampq_sock = amqp_tcp_socket_new(fwd->ampq_conn);
-
-            //TODO RMQ instance will always be on localhost? (for collector)
-            if (amqp_socket_open(fwd->ampq_sock, "localhost", 5672 )){
-                logger(LOG_INFO, 
-                        "OpenLI: RMQ forwarding thread %d failed to open amqp socket",
-                        fwd->forwardid);
-                goto haltforwarder;
-            }
-
-            /* login using PLAIN, must specify username and password */
-            if ( (amqp_login(fwd->ampq_conn, "OpenLI", 0, AMQP_FRAME_MAX,0,
-                            AMQP_SASL_METHOD_PLAIN, fwd->RMQ_conf.name,
-                            fwd->RMQ_conf.pass)
-                    ).reply_type != AMQP_RESPONSE_NORMAL ) {
-                logger(LOG_ERR, "OpenLI: RMQ Failed to login to broker using PLAIN auth");
-                goto haltforwarder;
-            }
-
-            amqp_channel_open(fwd->ampq_conn, 1);
-
-            if ( (amqp_get_rpc_reply(fwd->ampq_conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
-                logger(LOG_ERR, "OpenLI: Failed to open channel");
-                goto haltforwarder;
-            }
-            logger(LOG_INFO, "OpenLI: Connected to RMQ instance");
+            /* If the broker isn't up yet, we'll keep trying to connect
+             * and buffer our records in the meantime */
+            connect_rmq_broker(fwd);
         } else {
             logger(LOG_INFO, "OpenLI: Incomplete RMQ login information supplied");
             goto haltforwarder;
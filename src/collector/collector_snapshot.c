@@ -0,0 +1,152 @@
+/*
+ *
+ * Copyright (c) 2018-2021 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "logger.h"
+#include "collector_snapshot.h"
+
+/* The sync threads save the configuration that they have been given by the
+ * provisioner as a sequence of the same messages that the provisioner
+ * would send to announce it. This means that a snapshot can be replayed
+ * using the regular message handling code when the collector starts.
+ */
+
+char *create_config_snapshot_path(const char *dir, const char *name) {
+
+    char *path;
+    size_t len = strlen(dir) + strlen(name) + 2;
+
+    path = (char *)malloc(len);
+    if (path == NULL) {
+        return NULL;
+    }
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+/* Replaces the snapshot at the given path with the contents of a send
+ * buffer. The new snapshot is written to a temporary file which is then
+ * renamed over the old one, so a crash while writing will never leave us
+ * with an incomplete snapshot.
+ *
+ * Returns -1 if an error occurs, 0 otherwise.
+ */
+int write_config_snapshot(const char *path, net_buffer_t *nb) {
+
+    char *tmppath;
+    size_t len = strlen(path) + 5;
+    int fd;
+
+    tmppath = (char *)malloc(len);
+    if (tmppath == NULL) {
+        return -1;
+    }
+    snprintf(tmppath, len, "%s.tmp", path);
+
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        logger(LOG_INFO,
+                "OpenLI: unable to open configuration snapshot %s: %s",
+                tmppath, strerror(errno));
+        free(tmppath);
+        return -1;
+    }
+
+    if (write_net_buffer_to_fd(nb, fd) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to write configuration snapshot %s: %s",
+                tmppath, strerror(errno));
+        goto writefail;
+    }
+
+    if (fsync(fd) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to sync configuration snapshot %s: %s",
+                tmppath, strerror(errno));
+        goto writefail;
+    }
+    close(fd);
+    fd = -1;
+
+    if (rename(tmppath, path) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to replace configuration snapshot %s: %s",
+                path, strerror(errno));
+        goto writefail;
+    }
+
+    free(tmppath);
+    return 0;
+
+writefail:
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(tmppath);
+    free(tmppath);
+    return -1;
+}
+
+/* Loads a snapshot into a new receive buffer, so that the messages within
+ * it can be read using receive_net_buffer().
+ *
+ * Returns NULL if there is no snapshot at the given path or the snapshot
+ * cannot be read.
+ */
+net_buffer_t *read_config_snapshot(const char *path) {
+
+    net_buffer_t *nb;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            logger(LOG_INFO,
+                    "OpenLI: unable to open configuration snapshot %s: %s",
+                    path, strerror(errno));
+        }
+        return NULL;
+    }
+
+    nb = create_net_buffer(NETBUF_RECV, -1, NULL);
+    if (read_net_buffer_from_fd(nb, fd) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to read configuration snapshot %s: %s",
+                path, strerror(errno));
+        destroy_net_buffer(nb);
+        nb = NULL;
+    }
+    close(fd);
+    return nb;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
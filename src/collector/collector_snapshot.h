@@ -0,0 +1,43 @@
+/*
+ *
+ * Copyright (c) 2018-2021 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_COLLECTOR_SNAPSHOT_H_
+#define OPENLI_COLLECTOR_SNAPSHOT_H_
+
+#include "netcomms.h"
+
+/* Names of the snapshot files written by each sync thread, within the
+ * configured snapshot directory */
+#define IPSYNC_SNAPSHOT_NAME "openli-collector-ipsync.snapshot"
+#define VOIPSYNC_SNAPSHOT_NAME "openli-collector-voipsync.snapshot"
+
+char *create_config_snapshot_path(const char *dir, const char *name);
+int write_config_snapshot(const char *path, net_buffer_t *nb);
+net_buffer_t *read_config_snapshot(const char *path);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
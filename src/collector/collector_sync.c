@@ -26,6 +26,7 @@
 
 
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -41,6 +42,7 @@
 #include "collector_sync.h"
 #include "collector_sync_voip.h"
 #include "collector_publish.h"
+#include "collector_snapshot.h"
 #include "configparser.h"
 #include "logger.h"
 #include "intercept.h"
@@ -68,12 +70,28 @@ collector_sync_t *init_sync_data(collector_global_t *glob) {
     sync->knownvoips = NULL;
     sync->userintercepts = NULL;
     sync->coreservers = NULL;
+    sync->mediators = NULL;
     sync->defaultradiususers = NULL;
     sync->instruct_fd = -1;
     sync->instruct_fail = 0;
     sync->instruct_log = 1;
     sync->instruct_events = ZMQ_POLLIN | ZMQ_POLLOUT;
     sync->hellosreceived = 0;
+    sync->confepoch = 0;
+    sync->confversion = 0;
+    sync->snapshotready = 0;
+    sync->snapshotdirty = 0;
+    sync->snapshotloaded = 0;
+
+    if (glob->snapshotdir) {
+        sync->snapshotfile = create_config_snapshot_path(glob->snapshotdir,
+                IPSYNC_SNAPSHOT_NAME);
+        sync->voipsnapshotfile = create_config_snapshot_path(
+                glob->snapshotdir, VOIPSYNC_SNAPSHOT_NAME);
+    } else {
+        sync->snapshotfile = NULL;
+        sync->voipsnapshotfile = NULL;
+    }
 
     sync->outgoing = NULL;
     sync->incoming = NULL;
@@ -140,6 +158,7 @@ void clean_sync_data(collector_sync_t *sync) {
     ip_to_session_t *iter, *tmp;
     openli_export_recv_t *haltmsg;
     default_radius_user_t *raditer, *radtmp;
+    sync_mediator_t *med, *medtmp;
 
 	if (sync->instruct_fd != -1) {
 		close(sync->instruct_fd);
@@ -161,6 +180,20 @@ void clean_sync_data(collector_sync_t *sync) {
         free(raditer);
     }
 
+    HASH_ITER(hh, sync->mediators, med, medtmp) {
+        HASH_DELETE(hh, sync->mediators, med);
+        free(med->med.ipstr);
+        free(med->med.portstr);
+        free(med);
+    }
+
+    if (sync->snapshotfile) {
+        free(sync->snapshotfile);
+    }
+    if (sync->voipsnapshotfile) {
+        free(sync->voipsnapshotfile);
+    }
+
     clear_intercept_time_events(&(sync->upcoming_intercept_events));
     if (sync->upcomingtimerfd != -1) {
         close(sync->upcomingtimerfd);
@@ -196,6 +229,9 @@ void clean_sync_data(collector_sync_t *sync) {
     sync->ipintercepts = NULL;
     sync->knownvoips = NULL;
     sync->defaultradiususers = NULL;
+    sync->mediators = NULL;
+    sync->snapshotfile = NULL;
+    sync->voipsnapshotfile = NULL;
     sync->userintercepts = NULL;
     sync->outgoing = NULL;
     sync->incoming = NULL;
@@ -938,6 +974,45 @@ static void push_ipintercept_update_to_threads(collector_sync_t *sync,
 
 }
 
+/* Remembers a mediator announced by the provisioner, so that it can be
+ * included in our configuration snapshot. The forwarding threads keep
+ * their own copy of the mediator details.
+ */
+static void record_sync_mediator(collector_sync_t *sync,
+        openli_mediator_t *med) {
+
+    sync_mediator_t *found;
+
+    HASH_FIND(hh, sync->mediators, &(med->mediatorid), sizeof(uint32_t),
+            found);
+    if (found == NULL) {
+        found = (sync_mediator_t *)calloc(1, sizeof(sync_mediator_t));
+        found->med.mediatorid = med->mediatorid;
+        HASH_ADD(hh, sync->mediators, med.mediatorid, sizeof(uint32_t),
+                found);
+    } else {
+        free(found->med.ipstr);
+        free(found->med.portstr);
+    }
+
+    found->med.ipstr = strdup(med->ipstr);
+    found->med.portstr = strdup(med->portstr);
+    found->awaitingconfirm = 0;
+}
+
+static void forget_sync_mediator(collector_sync_t *sync, uint32_t mediatorid) {
+
+    sync_mediator_t *found;
+
+    HASH_FIND(hh, sync->mediators, &mediatorid, sizeof(uint32_t), found);
+    if (found) {
+        HASH_DELETE(hh, sync->mediators, found);
+        free(found->med.ipstr);
+        free(found->med.portstr);
+        free(found);
+    }
+}
+
 static int new_mediator(collector_sync_t *sync, uint8_t *provmsg,
         uint16_t msglen) {
 
@@ -952,6 +1027,8 @@ static int new_mediator(collector_sync_t *sync, uint8_t *provmsg,
         return -1;
     }
 
+    record_sync_mediator(sync, &med);
+
     for (i = 0; i < sync->forwardcount; i++) {
         expmsg = (openli_export_recv_t *)calloc(1,
                 sizeof(openli_export_recv_t));
@@ -982,6 +1059,8 @@ static int remove_mediator(collector_sync_t *sync, uint8_t *provmsg,
         return -1;
     }
 
+    forget_sync_mediator(sync, med.mediatorid);
+
     for (i = 0; i < sync->forwardcount; i++) {
         expmsg = (openli_export_recv_t *)calloc(1,
                 sizeof(openli_export_recv_t));
@@ -1339,8 +1418,13 @@ static int halt_ipintercept(collector_sync_t *sync, uint8_t *intmsg,
 
 void sync_drop_all_mediators(collector_sync_t *sync) {
     openli_export_recv_t *expmsg;
+    sync_mediator_t *med, *tmp;
     int i;
 
+    HASH_ITER(hh, sync->mediators, med, tmp) {
+        forget_sync_mediator(sync, med->med.mediatorid);
+    }
+
     for (i = 0; i < sync->forwardcount; i++) {
         expmsg = (openli_export_recv_t *)calloc(1,
                 sizeof(openli_export_recv_t));
@@ -1552,6 +1636,7 @@ static void disable_unconfirmed_intercepts(collector_sync_t *sync) {
     ipintercept_t *ipint, *tmp;
     static_ipranges_t *ipr, *tmpr;
     default_radius_user_t *defrad, *tmprad;
+    sync_mediator_t *med, *tmpmed;
 
     HASH_ITER(hh_liid, sync->ipintercepts, ipint, tmp) {
 
@@ -1587,6 +1672,290 @@ static void disable_unconfirmed_intercepts(collector_sync_t *sync) {
             remove_default_radius(sync, defrad);
         }
     }
+
+    /* The forwarding threads will purge their own unconfirmed mediators,
+     * we just need to make sure they don't end up in our snapshot */
+    HASH_ITER(hh, sync->mediators, med, tmpmed) {
+        if (med->awaitingconfirm) {
+            forget_sync_mediator(sync, med->med.mediatorid);
+        }
+    }
+}
+
+/* Called when the provisioner is only going to send us the changes that
+ * we missed while we were disconnected, rather than re-announcing
+ * everything -- anything we flagged when we disconnected is still valid.
+ */
+static void confirm_existing_config(collector_sync_t *sync) {
+    coreserver_t *cs, *tmp3;
+    ipintercept_t *ipint, *tmp;
+    static_ipranges_t *ipr, *tmpr;
+    default_radius_user_t *defrad, *tmprad;
+    sync_mediator_t *med, *tmpmed;
+    openli_export_recv_t *expmsg;
+    int i;
+
+    HASH_ITER(hh_liid, sync->ipintercepts, ipint, tmp) {
+        ipint->awaitingconfirm = 0;
+        HASH_ITER(hh, ipint->statics, ipr, tmpr) {
+            ipr->awaitingconfirm = 0;
+        }
+    }
+
+    HASH_ITER(hh, sync->coreservers, cs, tmp3) {
+        cs->awaitingconfirm = 0;
+    }
+
+    HASH_ITER(hh, sync->defaultradiususers, defrad, tmprad) {
+        defrad->awaitingconfirm = 0;
+    }
+
+    HASH_ITER(hh, sync->mediators, med, tmpmed) {
+        med->awaitingconfirm = 0;
+    }
+
+    for (i = 0; i < sync->forwardcount; i++) {
+        expmsg = (openli_export_recv_t *)calloc(1,
+                sizeof(openli_export_recv_t));
+        expmsg->type = OPENLI_EXPORT_CONFIRM_MEDIATORS;
+        expmsg->data.packet = NULL;
+
+        publish_openli_msg(sync->zmq_fwdctrlsocks[i], expmsg);
+    }
+
+    logger(LOG_INFO,
+            "OpenLI: provisioner is sending only the configuration changes since version %" PRIu64,
+            sync->confversion);
+}
+
+/* Saves the configuration that we have been given by the provisioner,
+ * apart from the VOIP intercepts (which are saved by the VOIP sync thread).
+ *
+ * Note that this re-encodes and fsyncs the entire configuration every time
+ * a batch of messages from the provisioner changes it, so the cost grows
+ * with the number of intercepts rather than the size of the change. This is
+ * fine for the rate at which intercepts are normally added or removed, but
+ * an incremental format would be needed if that ever becomes a problem.
+ */
+static void write_sync_snapshot(collector_sync_t *sync) {
+    net_buffer_t *nb;
+    sync_mediator_t *med, *tmpmed;
+    coreserver_t *cs, *tmpcs;
+    default_radius_user_t *defrad, *tmprad;
+    ipintercept_t *ipint, *tmp;
+
+    sync->snapshotdirty = 0;
+    if (sync->snapshotfile == NULL) {
+        return;
+    }
+
+    nb = create_net_buffer(NETBUF_SEND, -1, NULL);
+
+    HASH_ITER(hh, sync->mediators, med, tmpmed) {
+        if (push_mediator_onto_net_buffer(nb, &(med->med)) < 0) {
+            goto snapfail;
+        }
+    }
+
+    HASH_ITER(hh, sync->coreservers, cs, tmpcs) {
+        if (push_coreserver_onto_net_buffer(nb, cs, cs->servertype) < 0) {
+            goto snapfail;
+        }
+    }
+
+    HASH_ITER(hh, sync->defaultradiususers, defrad, tmprad) {
+        if (push_default_radius_onto_net_buffer(nb, defrad) < 0) {
+            goto snapfail;
+        }
+    }
+
+    /* Static IP ranges are included with each intercept */
+    HASH_ITER(hh_liid, sync->ipintercepts, ipint, tmp) {
+        if (push_ipintercept_onto_net_buffer(nb, ipint) < 0) {
+            goto snapfail;
+        }
+    }
+
+    write_config_snapshot(sync->snapshotfile, nb);
+    destroy_net_buffer(nb);
+    return;
+
+snapfail:
+    logger(LOG_INFO,
+            "OpenLI: unable to encode configuration snapshot for %s",
+            sync->snapshotfile);
+    destroy_net_buffer(nb);
+}
+
+/* Applies a single message from the provisioner (or from one of our
+ * configuration snapshots) to our state.
+ *
+ * Returns -2 if the provisioner wants us to reconnect using SSL, -1 if
+ * the message is invalid or we must disconnect, 0 or 1 otherwise.
+ */
+static int handle_provisioner_message(collector_sync_t *sync,
+        openli_proto_msgtype_t msgtype, uint8_t *provmsg, uint16_t msglen) {
+
+    int ret = 0;
+    static_ipranges_t *ipr;
+
+    switch(msgtype) {
+        case OPENLI_PROTO_DISCONNECT:
+            return -1;
+        case OPENLI_PROTO_SSL_REQUIRED:
+            logger(LOG_INFO, "OpenLI collector: provisioner requested that we connect using SSL. Disconnecting.");
+            return -2;
+        case OPENLI_PROTO_DISCONNECT_MEDIATORS:
+            sync_drop_all_mediators(sync);
+            ret = 1;
+            break;
+        case OPENLI_PROTO_ANNOUNCE_MEDIATOR:
+            ret = new_mediator(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_WITHDRAW_MEDIATOR:
+            ret = remove_mediator(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_START_IPINTERCEPT:
+            ret = new_ipintercept(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_ADD_STATICIPS:
+            ret = new_staticiprange(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_MODIFY_STATICIPS:
+            ipr = (static_ipranges_t *)malloc(sizeof(static_ipranges_t));
+
+            if (decode_staticip_modify(provmsg, msglen, ipr) == -1) {
+                if (sync->instruct_log) {
+                    logger(LOG_INFO,
+                        "OpenLI: received invalid static IP range from provisioner for removal.");
+                }
+                free(ipr);
+                return -1;
+            }
+            ret = modify_staticiprange(sync, ipr);
+            if (ret == -1) {
+                return -1;
+            }
+            free_single_staticiprange(ipr);
+            break;
+        case OPENLI_PROTO_REMOVE_STATICIPS:
+            ipr = (static_ipranges_t *)malloc(sizeof(static_ipranges_t));
+
+            if (decode_staticip_removal(provmsg, msglen, ipr) == -1) {
+                if (sync->instruct_log) {
+                    logger(LOG_INFO,
+                        "OpenLI: received invalid static IP range from provisioner for removal.");
+                }
+                free(ipr);
+                return -1;
+            }
+            ret = remove_staticiprange(sync, ipr);
+            if (ret == -1) {
+                return -1;
+            }
+            free_single_staticiprange(ipr);
+            break;
+        case OPENLI_PROTO_HALT_IPINTERCEPT:
+            ret = halt_ipintercept(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_ANNOUNCE_DEFAULT_RADIUS:
+            ret = new_default_radius(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_WITHDRAW_DEFAULT_RADIUS:
+            ret = withdraw_default_radius(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_ANNOUNCE_CORESERVER:
+            ret = forward_new_coreserver(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_WITHDRAW_CORESERVER:
+            ret = forward_remove_coreserver(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_START_VOIPINTERCEPT:
+            ret = new_voipintercept(sync, provmsg, msglen);
+            if (ret == -1) {
+                return -1;
+            }
+            ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
+                    msgtype);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+
+        case OPENLI_PROTO_MODIFY_IPINTERCEPT:
+            ret = modify_ipintercept(sync, provmsg, msglen);
+            if (ret < 0) {
+                return -1;
+            }
+            break;
+
+        case OPENLI_PROTO_HALT_VOIPINTERCEPT:
+        case OPENLI_PROTO_MODIFY_VOIPINTERCEPT:
+        case OPENLI_PROTO_ANNOUNCE_SIP_TARGET:
+        case OPENLI_PROTO_WITHDRAW_SIP_TARGET:
+            ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
+                    msgtype);
+            if (ret == -1) {
+                return -1;
+            }
+            break;
+        case OPENLI_PROTO_NOMORE_INTERCEPTS:
+            disable_unconfirmed_intercepts(sync);
+            sync->snapshotready = 1;
+            ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
+                    msgtype);
+            break;
+        case OPENLI_PROTO_CONFIG_DELTA:
+            confirm_existing_config(sync);
+            sync->snapshotready = 1;
+            ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
+                    msgtype);
+            break;
+        case OPENLI_PROTO_CONFIG_VERSION:
+            if (decode_config_version(provmsg, msglen, &(sync->confepoch),
+                        &(sync->confversion)) <= 0) {
+                if (sync->instruct_log) {
+                    logger(LOG_INFO,
+                            "OpenLI: received invalid configuration version from provisioner.");
+                }
+                return -1;
+            }
+            ret = 1;
+            break;
+        default:
+            if (sync->instruct_log) {
+                logger(LOG_INFO, "Received unexpected message of type %d from provisioner.", msgtype);
+                return -1;
+            }
+    }
+    return ret;
 }
 
 static int recv_from_provisioner(collector_sync_t *sync) {
@@ -1594,7 +1963,6 @@ static int recv_from_provisioner(collector_sync_t *sync) {
     uint8_t *provmsg;
     uint16_t msglen = 0;
     uint64_t intid = 0;
-    static_ipranges_t *ipr;
     openli_proto_msgtype_t msgtype;
 
     do {
@@ -1607,149 +1975,26 @@ static int recv_from_provisioner(collector_sync_t *sync) {
             return -1;
         }
 
-        switch(msgtype) {
-            case OPENLI_PROTO_DISCONNECT:
-                return -1;
-            case OPENLI_PROTO_NO_MESSAGE:
-                break;
-            case OPENLI_PROTO_SSL_REQUIRED:
-                logger(LOG_INFO, "OpenLI collector: provisioner requested that we connect using SSL. Disconnecting.");
-                return -2;
-            case OPENLI_PROTO_DISCONNECT_MEDIATORS:
-                sync_drop_all_mediators(sync);
-                ret = 1;
-                break;
-            case OPENLI_PROTO_ANNOUNCE_MEDIATOR:
-                ret = new_mediator(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_WITHDRAW_MEDIATOR:
-                ret = remove_mediator(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_START_IPINTERCEPT:
-                ret = new_ipintercept(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_ADD_STATICIPS:
-                ret = new_staticiprange(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_MODIFY_STATICIPS:
-                ipr = (static_ipranges_t *)malloc(sizeof(static_ipranges_t));
-
-                if (decode_staticip_modify(provmsg, msglen, ipr) == -1) {
-                    if (sync->instruct_log) {
-                        logger(LOG_INFO,
-                            "OpenLI: received invalid static IP range from provisioner for removal.");
-                    }
-                    free(ipr);
-                    return -1;
-                }
-                ret = modify_staticiprange(sync, ipr);
-                if (ret == -1) {
-                    return -1;
-                }
-                free_single_staticiprange(ipr);
-                break;
-            case OPENLI_PROTO_REMOVE_STATICIPS:
-                ipr = (static_ipranges_t *)malloc(sizeof(static_ipranges_t));
-
-                if (decode_staticip_removal(provmsg, msglen, ipr) == -1) {
-                    if (sync->instruct_log) {
-                        logger(LOG_INFO,
-                            "OpenLI: received invalid static IP range from provisioner for removal.");
-                    }
-                    free(ipr);
-                    return -1;
-                }
-                ret = remove_staticiprange(sync, ipr);
-                if (ret == -1) {
-                    return -1;
-                }
-                free_single_staticiprange(ipr);
-                break;
-            case OPENLI_PROTO_HALT_IPINTERCEPT:
-                ret = halt_ipintercept(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_ANNOUNCE_DEFAULT_RADIUS:
-                ret = new_default_radius(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_WITHDRAW_DEFAULT_RADIUS:
-                ret = withdraw_default_radius(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_ANNOUNCE_CORESERVER:
-                ret = forward_new_coreserver(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_WITHDRAW_CORESERVER:
-                ret = forward_remove_coreserver(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_START_VOIPINTERCEPT:
-                ret = new_voipintercept(sync, provmsg, msglen);
-                if (ret == -1) {
-                    return -1;
-                }
-                ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
-                        msgtype);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-
-            case OPENLI_PROTO_MODIFY_IPINTERCEPT:
-                ret = modify_ipintercept(sync, provmsg, msglen);
-                if (ret < 0) {
-                    return -1;
-                }
-                break;
+        if (msgtype == OPENLI_PROTO_NO_MESSAGE) {
+            break;
+        }
 
-            case OPENLI_PROTO_HALT_VOIPINTERCEPT:
-            case OPENLI_PROTO_MODIFY_VOIPINTERCEPT:
-            case OPENLI_PROTO_ANNOUNCE_SIP_TARGET:
-            case OPENLI_PROTO_WITHDRAW_SIP_TARGET:
-                ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
-                        msgtype);
-                if (ret == -1) {
-                    return -1;
-                }
-                break;
-            case OPENLI_PROTO_NOMORE_INTERCEPTS:
-                disable_unconfirmed_intercepts(sync);
-                ret = forward_provmsg_to_voipsync(sync, provmsg, msglen,
-                        msgtype);
-                break;
-            default:
-                if (sync->instruct_log) {
-                    logger(LOG_INFO, "Received unexpected message of type %d from provisioner.", msgtype);
-                    return -1;
-                }
+        ret = handle_provisioner_message(sync, msgtype, provmsg, msglen);
+        if (ret < 0) {
+            return ret;
+        }
+        if (msgtype != OPENLI_PROTO_CONFIG_VERSION) {
+            sync->snapshotdirty = 1;
         }
 
     } while (msgtype != OPENLI_PROTO_NO_MESSAGE);
 
+    /* Only save the configuration once we've processed everything that
+     * the provisioner has sent us so far */
+    if (sync->snapshotready && sync->snapshotdirty) {
+        write_sync_snapshot(sync);
+    }
+
     if (ret == 1 && sync->instruct_log == 0) {
         logger(LOG_INFO, "Successfully connected to a legit OpenLI provisioner");
         sync->instruct_log = 1;
@@ -1818,8 +2063,8 @@ int sync_connect_provisioner(collector_sync_t *sync, SSL_CTX *ctx) {
     sync->incoming = create_net_buffer(NETBUF_RECV, sync->instruct_fd, sync->ssl);
 
     /* Put our auth message onto the outgoing buffer */
-    if (push_auth_onto_net_buffer(sync->outgoing, OPENLI_PROTO_COLLECTOR_AUTH)
-            < 0) {
+    if (push_auth_onto_net_buffer(sync->outgoing, OPENLI_PROTO_COLLECTOR_AUTH,
+                sync->confepoch, sync->confversion) < 0) {
         if (sync->instruct_fail == 0) {
             logger(LOG_INFO,"OpenLI: collector is unable to queue auth message.");
         }
@@ -1863,6 +2108,14 @@ static inline void touch_all_intercepts(ipintercept_t *intlist) {
     }
 }
 
+static inline void touch_all_mediators(sync_mediator_t *meds) {
+    sync_mediator_t *med, *tmp;
+
+    HASH_ITER(hh, meds, med, tmp) {
+        med->awaitingconfirm = 1;
+    }
+}
+
 void sync_disconnect_provisioner(collector_sync_t *sync, uint8_t dropmeds) {
 
     openli_export_recv_t *expmsg;
@@ -1889,6 +2142,10 @@ void sync_disconnect_provisioner(collector_sync_t *sync, uint8_t dropmeds) {
     touch_all_intercepts(sync->ipintercepts);
     touch_all_coreservers(sync->coreservers);
     touch_all_defaultradius(sync->defaultradiususers);
+    touch_all_mediators(sync->mediators);
+
+    /* Don't save anything until the provisioner has confirmed it */
+    sync->snapshotready = 0;
 
     /* Tell other sync thread to flag its intercepts too */
     forward_provmsg_to_voipsync(sync, NULL, 0, OPENLI_PROTO_DISCONNECT);
@@ -1910,6 +2167,105 @@ void sync_disconnect_provisioner(collector_sync_t *sync, uint8_t dropmeds) {
 
 }
 
+/* Replays the messages in one of our configuration snapshots, as though
+ * they had been sent by the provisioner.
+ *
+ * Returns the number of messages that were replayed.
+ */
+static int replay_sync_snapshot(collector_sync_t *sync, char *path) {
+    net_buffer_t *nb;
+    uint8_t *msgbody;
+    uint16_t msglen = 0;
+    uint64_t intid = 0;
+    openli_proto_msgtype_t msgtype;
+    int count = 0;
+
+    nb = read_config_snapshot(path);
+    if (nb == NULL) {
+        return 0;
+    }
+
+    while (net_buffer_message_ready(nb)) {
+        msgtype = receive_net_buffer(nb, &msgbody, &msglen, &intid);
+
+        /* A snapshot should only ever announce things */
+        switch(msgtype) {
+            case OPENLI_PROTO_ANNOUNCE_MEDIATOR:
+            case OPENLI_PROTO_ANNOUNCE_CORESERVER:
+            case OPENLI_PROTO_ANNOUNCE_DEFAULT_RADIUS:
+            case OPENLI_PROTO_START_IPINTERCEPT:
+            case OPENLI_PROTO_ADD_STATICIPS:
+            case OPENLI_PROTO_START_VOIPINTERCEPT:
+            case OPENLI_PROTO_ANNOUNCE_SIP_TARGET:
+                break;
+            default:
+                logger(LOG_INFO,
+                        "OpenLI: unexpected message type %d in configuration snapshot %s",
+                        msgtype, path);
+                goto replaydone;
+        }
+
+        if (handle_provisioner_message(sync, msgtype, msgbody, msglen) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: invalid message in configuration snapshot %s",
+                    path);
+            goto replaydone;
+        }
+        count ++;
+    }
+
+    if (NETBUF_CONTENT_SIZE(nb) > 0) {
+        logger(LOG_INFO, "OpenLI: configuration snapshot %s is truncated",
+                path);
+    }
+
+replaydone:
+    destroy_net_buffer(nb);
+    return count;
+}
+
+/* Loads the configuration that we saved before we were restarted, so that
+ * we can start intercepting without waiting to hear from the provisioner.
+ *
+ * Everything that we load is treated as though we had just lost our
+ * connection to the provisioner, i.e. it will be removed if the
+ * provisioner does not confirm it once we are connected.
+ */
+static void load_sync_snapshot(collector_sync_t *sync) {
+    openli_export_recv_t *expmsg;
+    int i, count = 0;
+
+    sync->snapshotloaded = 1;
+    if (sync->snapshotfile == NULL) {
+        return;
+    }
+
+    count += replay_sync_snapshot(sync, sync->snapshotfile);
+    count += replay_sync_snapshot(sync, sync->voipsnapshotfile);
+    if (count == 0) {
+        return;
+    }
+
+    touch_all_intercepts(sync->ipintercepts);
+    touch_all_coreservers(sync->coreservers);
+    touch_all_defaultradius(sync->defaultradiususers);
+    touch_all_mediators(sync->mediators);
+    forward_provmsg_to_voipsync(sync, NULL, 0, OPENLI_PROTO_DISCONNECT);
+
+    for (i = 0; i < sync->forwardcount; i++) {
+        expmsg = (openli_export_recv_t *)calloc(1,
+                sizeof(openli_export_recv_t));
+        expmsg->type = OPENLI_EXPORT_FLAG_MEDIATORS;
+        expmsg->data.packet = NULL;
+
+        publish_openli_msg(sync->zmq_fwdctrlsocks[i], expmsg);
+    }
+
+    logger(LOG_INFO,
+            "OpenLI: loaded %d configuration items from the snapshot in %s -- these will be removed if they are not confirmed by the provisioner.",
+            count, sync->snapshotfile);
+}
+
 static void push_all_active_intercepts(collector_sync_t *sync,
         internet_user_t *allusers,
         ipintercept_t *intlist, libtrace_message_queue_t *q) {
@@ -2371,7 +2727,12 @@ int sync_thread_main(collector_sync_t *sync) {
 
     items[1].socket = NULL;
     items[1].fd = sync->instruct_fd;
-    items[1].events = sync->instruct_events;
+    if (sync->instruct_fd == -1) {
+        /* Not connected to the provisioner */
+        items[1].events = 0;
+    } else {
+        items[1].events = sync->instruct_events;
+    }
 
     if (sync->upcomingtimerfd == -1) {
         set_upcoming_timer(sync);
@@ -2458,6 +2819,9 @@ int sync_thread_main(collector_sync_t *sync) {
 
                 if (sync->hellosreceived == sync->glob->total_col_threads) {
                     logger(LOG_INFO, "openli-collector: all processing threads have reported for duty");
+                    if (!sync->snapshotloaded) {
+                        load_sync_snapshot(sync);
+                    }
                 }
             }
 
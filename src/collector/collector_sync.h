@@ -41,6 +41,13 @@
 #include "sipparsing.h"
 #include "timed_intercept.h"
 
+/* A mediator that has been announced by the provisioner */
+typedef struct sync_mediator {
+    openli_mediator_t med;
+    uint8_t awaitingconfirm;
+    UT_hash_handle hh;
+} sync_mediator_t;
+
 typedef struct colsync_data {
 
     sync_thread_global_t *glob;
@@ -62,6 +69,7 @@ typedef struct colsync_data {
     int upcomingtimerfd;
 
     coreserver_t *coreservers;
+    sync_mediator_t *mediators;
 
     int instruct_fd;
     uint8_t instruct_fail;
@@ -85,6 +93,28 @@ typedef struct colsync_data {
     uint8_t provconnfailed;
     uint8_t hellosreceived;
 
+    /* The version of the provisioner's configuration that we have, which
+     * lets the provisioner send only the changes we have missed if we
+     * have to reconnect to it */
+    uint64_t confepoch;
+    uint64_t confversion;
+
+    /* Where to save our snapshot of the provisioner's configuration (and
+     * where the VOIP sync thread saves its own snapshot), if anywhere */
+    char *snapshotfile;
+    char *voipsnapshotfile;
+
+    /* Set to 1 once the provisioner has finished sending its
+     * configuration, i.e. our snapshot will not include anything that
+     * the provisioner is yet to confirm */
+    uint8_t snapshotready;
+
+    /* Set to 1 if the configuration has changed since we last saved it */
+    uint8_t snapshotdirty;
+
+    /* Set to 1 once we have tried to load our snapshots */
+    uint8_t snapshotloaded;
+
 } collector_sync_t;
 
 collector_sync_t *init_sync_data(collector_global_t *glob);
@@ -39,6 +39,7 @@
 #include "collector.h"
 #include "collector_sync_voip.h"
 #include "collector_publish.h"
+#include "collector_snapshot.h"
 #include "configparser.h"
 #include "logger.h"
 #include "intercept.h"
@@ -116,6 +117,15 @@ collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob) {
         sync->sipdebugfile = NULL;
     }
 
+    if (glob->snapshotdir) {
+        sync->snapshotfile = create_config_snapshot_path(glob->snapshotdir,
+                VOIPSYNC_SNAPSHOT_NAME);
+    } else {
+        sync->snapshotfile = NULL;
+    }
+    sync->snapshotready = 0;
+    sync->snapshotdirty = 0;
+
     return sync;
 }
 
@@ -159,6 +169,10 @@ void clean_sync_voip_data(collector_sync_voip_t *sync) {
         free(sync->sipdebugfile);
     }
 
+    if (sync->snapshotfile) {
+        free(sync->snapshotfile);
+    }
+
     for (i = 0; i < sync->pubsockcount; i++) {
         if (sync->zmq_pubsocks[i] == NULL) {
             continue;
@@ -2021,6 +2035,26 @@ static void touch_all_voipintercepts(voipintercept_t *vints) {
     }
 }
 
+/* The provisioner is only sending us the changes that we missed while
+ * we were disconnected, so everything we already had is still valid.
+ */
+static void untouch_all_voipintercepts(voipintercept_t *vints) {
+    voipintercept_t *v;
+    libtrace_list_node_t *n;
+    openli_sip_identity_t *sipid;
+
+    for (v = vints; v != NULL; v = v->hh_liid.next) {
+        v->awaitingconfirm = 0;
+
+        n = v->targets->head;
+        while (n) {
+            sipid = *((openli_sip_identity_t **)(n->data));
+            sipid->awaitingconfirm = 0;
+            n = n->next;
+        }
+    }
+}
+
 static libtrace_out_t *open_debug_output(char *basename, char *ext) {
 
     libtrace_out_t *out = NULL;
@@ -2293,6 +2327,53 @@ static void disable_unconfirmed_voip_intercepts(collector_sync_voip_t *sync) {
 
 }
 
+/* Saves all of our active VOIP intercepts and SIP targets, using the
+ * same messages that the provisioner uses to announce them.
+ */
+static void write_voip_sync_snapshot(collector_sync_voip_t *sync) {
+
+    net_buffer_t *nb;
+    voipintercept_t *v;
+    libtrace_list_node_t *n;
+    openli_sip_identity_t *sipid;
+
+    sync->snapshotdirty = 0;
+    if (sync->snapshotfile == NULL) {
+        return;
+    }
+
+    nb = create_net_buffer(NETBUF_SEND, -1, NULL);
+    for (v = sync->voipintercepts; v != NULL; v = v->hh_liid.next) {
+        if (v->active == 0) {
+            continue;
+        }
+        if (push_voipintercept_onto_net_buffer(nb, v) < 0) {
+            goto snapfail;
+        }
+
+        n = v->targets->head;
+        while (n) {
+            sipid = *((openli_sip_identity_t **)(n->data));
+            n = n->next;
+
+            if (sipid->active &&
+                    push_sip_target_onto_net_buffer(nb, sipid, v) < 0) {
+                goto snapfail;
+            }
+        }
+    }
+
+    write_config_snapshot(sync->snapshotfile, nb);
+    destroy_net_buffer(nb);
+    return;
+
+snapfail:
+    logger(LOG_INFO,
+            "OpenLI: unable to encode VOIP configuration snapshot for %s",
+            sync->snapshotfile);
+    destroy_net_buffer(nb);
+}
+
 static inline int process_intersync_msg(collector_sync_voip_t *sync) {
 
     openli_intersync_msg_t syncmsg;
@@ -2335,15 +2416,32 @@ static inline int process_intersync_msg(collector_sync_voip_t *sync) {
             break;
         case OPENLI_PROTO_NOMORE_INTERCEPTS:
             disable_unconfirmed_voip_intercepts(sync);
+            sync->snapshotready = 1;
             break;
         case OPENLI_PROTO_DISCONNECT:
             touch_all_voipintercepts(sync->voipintercepts);
+            sync->snapshotready = 0;
+            break;
+        case OPENLI_PROTO_CONFIG_DELTA:
+            untouch_all_voipintercepts(sync->voipintercepts);
+            sync->snapshotready = 1;
             break;
         case OPENLI_PROTO_CONFIG_RELOADED:
             sync->log_bad_sip = 1;
             break;
     }
 
+    if (syncmsg.msgtype != OPENLI_PROTO_CONFIG_RELOADED &&
+            syncmsg.msgtype != OPENLI_PROTO_DISCONNECT) {
+        sync->snapshotdirty = 1;
+    }
+
+    /* Wait until we've caught up with the IP sync thread before saving */
+    if (sync->snapshotready && sync->snapshotdirty &&
+            libtrace_message_queue_count(sync->intersyncq) == 0) {
+        write_voip_sync_snapshot(sync);
+    }
+
     if (syncmsg.msgbody) {
         free(syncmsg.msgbody);
     }
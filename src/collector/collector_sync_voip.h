@@ -67,6 +67,16 @@ typedef struct collector_sync_voip_data {
     struct rtpstreaminf **expiring_streams;
     int topoll_size;
 
+    /* Where to save our snapshot of the VOIP intercepts, if anywhere --
+     * the IP sync thread loads it when the collector starts */
+    char *snapshotfile;
+
+    /* Set to 1 once the provisioner has finished sending its intercepts */
+    uint8_t snapshotready;
+
+    /* Set to 1 if our intercepts have changed since we last saved them */
+    uint8_t snapshotdirty;
+
 } collector_sync_voip_t;
 
 collector_sync_voip_t *init_voip_sync_data(collector_global_t *glob);
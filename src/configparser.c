@@ -175,6 +175,95 @@ static int parse_input_config(collector_global_t *glob, yaml_document_t *doc,
     return 0;
 }
 
+static int parse_export_compression(char *methodstr) {
+
+    int method = parse_compression_method(methodstr);
+
+    if (method < 0) {
+        logger(LOG_INFO, "OpenLI: unknown compression method '%s' in config.",
+                methodstr);
+        return -1;
+    }
+
+    if (!compression_method_available(method)) {
+        logger(LOG_INFO, "OpenLI: %s compression is not supported by this build of OpenLI, exports will not be compressed.",
+                methodstr);
+        return OPENLI_COMPRESS_NONE;
+    }
+    return method;
+}
+
+/* Parses the 'netbuffermax' option, which is given in megabytes.
+ *
+ * Returns the limit in bytes, or 0 if the value is invalid.
+ */
+static uint64_t parse_netbuffer_limit(char *valstr) {
+
+    uint64_t limit = strtoull(valstr, NULL, 10) * 1024 * 1024;
+
+    if (limit < NETBUF_MIN_LIMIT) {
+        logger(LOG_INFO, "OpenLI: 'netbuffermax' must be at least %llu (MB).",
+                NETBUF_MIN_LIMIT / (1024 * 1024));
+        return 0;
+    }
+    return limit;
+}
+
+static int parse_mediator_compression(collector_global_t *glob,
+        yaml_document_t *doc, yaml_node_t *medconf) {
+
+    yaml_node_item_t *item;
+
+    for (item = medconf->data.sequence.items.start;
+            item != medconf->data.sequence.items.top; item ++) {
+        yaml_node_t *node = yaml_document_get_node(doc, *item);
+        yaml_node_pair_t *pair;
+        int64_t mediatorid = -1;
+        int method = -1;
+        PWord_t jval;
+
+        if (node->type != YAML_MAPPING_NODE) {
+            continue;
+        }
+
+        for (pair = node->data.mapping.pairs.start;
+                pair < node->data.mapping.pairs.top; pair ++) {
+            yaml_node_t *key, *value;
+
+            key = yaml_document_get_node(doc, pair->key);
+            value = yaml_document_get_node(doc, pair->value);
+
+            if (key->type == YAML_SCALAR_NODE &&
+                    value->type == YAML_SCALAR_NODE &&
+                    strcmp((char *)key->data.scalar.value,
+                        "mediatorid") == 0) {
+                mediatorid = strtoll((char *)value->data.scalar.value,
+                        NULL, 10);
+            }
+
+            if (key->type == YAML_SCALAR_NODE &&
+                    value->type == YAML_SCALAR_NODE &&
+                    strcmp((char *)key->data.scalar.value,
+                        "compression") == 0) {
+                method = parse_export_compression(
+                        (char *)value->data.scalar.value);
+                if (method < 0) {
+                    return -1;
+                }
+            }
+        }
+
+        if (mediatorid < 0 || method < 0) {
+            logger(LOG_INFO, "OpenLI: 'mediatorcompression' entries must have both a mediatorid and a compression method.");
+            return -1;
+        }
+
+        JLI(jval, glob->mediator_compression, (Word_t)mediatorid);
+        *jval = (Word_t)method;
+    }
+    return 0;
+}
+
 static void parse_sip_targets(libtrace_list_t *targets, yaml_document_t *doc,
         yaml_node_t *tgtconf) {
 
@@ -539,6 +628,7 @@ static int parse_voipintercept_list(voipintercept_t **voipints,
         newcept->options = 0;
         newcept->common.tostart_time = 0;
         newcept->common.toend_time = 0;
+        newcept->common.lastmodified = 0;
 
         /* Mappings describe the parameters for each intercept */
         for (pair = node->data.mapping.pairs.start;
@@ -658,6 +748,7 @@ static int parse_ipintercept_list(ipintercept_t **ipints, yaml_document_t *doc,
         newcept->options = 0;
         newcept->common.tostart_time = 0;
         newcept->common.toend_time = 0;
+        newcept->common.lastmodified = 0;
 
         /* Mappings describe the parameters for each intercept */
         for (pair = node->data.mapping.pairs.start;
@@ -998,6 +1089,86 @@ static int global_parser(void *arg, yaml_document_t *doc,
                 NULL, 10);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "spooldirectory") == 0) {
+        SET_CONFIG_STRING_OPTION(glob->spoolconf.directory, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "spoolthreshold") == 0) {
+        glob->spoolconf.threshold = strtoull((char *)value->data.scalar.value,
+                NULL, 10) * 1024 * 1024;
+        if (glob->spoolconf.threshold == 0) {
+            logger(LOG_INFO, "OpenLI: 0 is not a valid value for the 'spoolthreshold' config option.");
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "spoolmaxsize") == 0) {
+        glob->spoolconf.maxsize = strtoull((char *)value->data.scalar.value,
+                NULL, 10) * 1024 * 1024;
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "snapshotdirectory") == 0) {
+        SET_CONFIG_STRING_OPTION(glob->snapshotdir, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "iouring") == 0) {
+        glob->use_iouring = check_onoff((char *)value->data.scalar.value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "exportlatency") == 0) {
+        glob->export_latency = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "iriweight") == 0) {
+        glob->iri_weight = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "netbuffermax") == 0) {
+        glob->netbufferlimit = parse_netbuffer_limit(
+                (char *)value->data.scalar.value);
+        if (glob->netbufferlimit == 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "exportcompression") == 0) {
+        int method = parse_export_compression(
+                (char *)value->data.scalar.value);
+        if (method < 0) {
+            return -1;
+        }
+        glob->export_compression = (uint8_t)method;
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SEQUENCE_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "mediatorcompression") == 0) {
+        if (parse_mediator_compression(glob, doc, value) == -1) {
+            return -1;
+        }
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "tlscert") == 0) {
@@ -1092,6 +1263,55 @@ static int global_parser(void *arg, yaml_document_t *doc,
 }
 
 
+static int parse_agency_weights(handover_sched_t *sched,
+        yaml_document_t *doc, yaml_node_t *inputs) {
+
+    yaml_node_item_t *item;
+
+    for (item = inputs->data.sequence.items.start;
+            item != inputs->data.sequence.items.top; item ++) {
+        yaml_node_t *node = yaml_document_get_node(doc, *item);
+        yaml_node_pair_t *pair;
+        char *agencyid = NULL;
+        uint32_t weight = 1;
+
+        for (pair = node->data.mapping.pairs.start;
+                pair < node->data.mapping.pairs.top; pair ++) {
+            yaml_node_t *key, *value;
+
+            key = yaml_document_get_node(doc, pair->key);
+            value = yaml_document_get_node(doc, pair->value);
+
+            if (key->type == YAML_SCALAR_NODE &&
+                    value->type == YAML_SCALAR_NODE &&
+                    strcmp((char *)key->data.scalar.value,
+                            "agencyid") == 0) {
+                SET_CONFIG_STRING_OPTION(agencyid, value);
+            }
+
+            if (key->type == YAML_SCALAR_NODE &&
+                    value->type == YAML_SCALAR_NODE &&
+                    strcmp((char *)key->data.scalar.value,
+                            "weight") == 0) {
+                weight = strtoul((char *)value->data.scalar.value, NULL, 10);
+            }
+        }
+
+        if (agencyid == NULL) {
+            logger(LOG_INFO, "OpenLI: agency weight is missing an agencyid -- skipping.");
+            continue;
+        }
+        if (weight == 0) {
+            logger(LOG_INFO, "OpenLI: weight for agency %s must be at least 1 -- skipping.",
+                    agencyid);
+            free(agencyid);
+            continue;
+        }
+        add_handover_sched_weight(sched, agencyid, weight);
+    }
+    return 0;
+}
+
 static int mediator_parser(void *arg, yaml_document_t *doc,
         yaml_node_t *key, yaml_node_t *value) {
 
@@ -1190,6 +1410,36 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "pcapthreads") == 0) {
+        state->pcapthreadcount = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+        if (state->pcapthreadcount < 1 ||
+                state->pcapthreadcount > MAX_PCAP_THREADS) {
+            logger(LOG_INFO, "OpenLI: 'pcapthreads' must be between 1 and %d.",
+                    MAX_PCAP_THREADS);
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "pcapmaxopen") == 0) {
+        state->pcapmaxopen = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "netbuffermax") == 0) {
+        state->netbufferlimit = parse_netbuffer_limit(
+                (char *)value->data.scalar.value);
+        if (state->netbufferlimit == 0) {
+            return -1;
+        }
+    }
+
     if (key->type == YAML_SCALAR_NODE &&
             value->type == YAML_SCALAR_NODE &&
             strcmp((char *)key->data.scalar.value, "tlscert") == 0) {
@@ -1258,6 +1508,89 @@ static int mediator_parser(void *arg, yaml_document_t *doc,
                 NULL, 10);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "spooldirectory") == 0) {
+        SET_CONFIG_STRING_OPTION(state->spoolconf.directory, value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "spoolthreshold") == 0) {
+        state->spoolconf.threshold = strtoull((char *)value->data.scalar.value,
+                NULL, 10) * 1024 * 1024;
+        if (state->spoolconf.threshold == 0) {
+            logger(LOG_INFO, "OpenLI: 0 is not a valid value for the 'spoolthreshold' config option.");
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "spoolmaxsize") == 0) {
+        state->spoolconf.maxsize = strtoull((char *)value->data.scalar.value,
+                NULL, 10) * 1024 * 1024;
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "iouring") == 0) {
+        state->use_iouring = check_onoff((char *)value->data.scalar.value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "directrelay") == 0) {
+        state->relay.enabled = check_onoff((char *)value->data.scalar.value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "schedulehandovers") == 0) {
+        state->hosched.enabled = check_onoff(
+                (char *)value->data.scalar.value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "handoverquantum") == 0) {
+        state->hosched.quantum = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+        if (state->hosched.quantum == 0) {
+            logger(LOG_INFO, "OpenLI: 0 is not a valid value for the 'handoverquantum' config option.");
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "backpressurethreshold") == 0) {
+        state->backpressure = strtoull((char *)value->data.scalar.value,
+                NULL, 10) * 1024 * 1024;
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SEQUENCE_NODE &&
+            strcmp((char *)key->data.scalar.value, "agencyweights") == 0) {
+        if (parse_agency_weights(&(state->hosched), doc, value) == -1) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "collectorthreads") == 0) {
+        state->collthreadcount = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+        if (state->collthreadcount > MAX_COLLECTOR_THREADS) {
+            logger(LOG_INFO, "OpenLI: 'collectorthreads' must be no larger than %d.",
+                    MAX_COLLECTOR_THREADS);
+            return -1;
+        }
+    }
+
     return 0;
 
 }
@@ -1415,6 +1748,46 @@ static int provisioning_parser(void *arg, yaml_document_t *doc,
         SET_CONFIG_STRING_OPTION(state->restauthkey, value);
     }
 
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "restauthcachettl") == 0) {
+        state->restauthcachettl = strtoul(
+                (char *)value->data.scalar.value, NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "journalcompactrecords") == 0) {
+        state->journal.compactrecords = strtoul(
+                (char *)value->data.scalar.value, NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value,
+                    "journalcompactinterval") == 0) {
+        state->journal.compactinterval = strtoul(
+                (char *)value->data.scalar.value, NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "resynclogsize") == 0) {
+        state->resynclogsize = strtoul(
+                (char *)value->data.scalar.value, NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE &&
+            value->type == YAML_SCALAR_NODE &&
+            strcmp((char *)key->data.scalar.value, "netbuffermax") == 0) {
+        state->netbufferlimit = parse_netbuffer_limit(
+                (char *)value->data.scalar.value);
+        if (state->netbufferlimit == 0) {
+            return -1;
+        }
+    }
+
     return 0;
 }
 
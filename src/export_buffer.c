@@ -27,6 +27,10 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <libwandder_etsili.h>
 
 #include "logger.h"
@@ -37,6 +41,10 @@
 #define BUFFER_WARNING_THRESH (1024 * 1024 * 1024)
 #define BUF_OFFSET_FREQUENCY (1024 * 256)
 
+#define SPOOL_GROW_SIZE (1024 * 1024 * 256)
+#define SPOOL_REPLAY_CHUNK (1024 * 1024 * 16)
+#define SPOOL_REPORT_INTERVAL (1024 * 1024 * 1024)
+
 void init_export_buffer(export_buffer_t *buf) {
     buf->bufhead = NULL;
     buf->buftail = NULL;
@@ -47,21 +55,127 @@ void init_export_buffer(export_buffer_t *buf) {
     buf->nextwarn = BUFFER_WARNING_THRESH;
     buf->record_offsets = NULL;
     buf->since_last_saved_offset = 0;
+    buf->spool = NULL;
+    buf->batchopen = 0;
+    buf->batchoff = 0;
+    buf->rmqinflight = 0;
+}
+
+/* Each record written to a spool file is prefixed with its length, so
+ * that we can replay whole records back into the memory buffer (and
+ * therefore keep the record offsets used for batching accurate).
+ */
+typedef uint32_t spool_reclen_t;
+
+int enable_export_buffer_spool(export_buffer_t *buf,
+        openli_spool_config_t *conf, char *name) {
+
+    export_spool_t *spool;
+    char path[4096];
+    char *c;
+
+    if (conf == NULL || conf->directory == NULL) {
+        return 0;
+    }
+
+    if (buf->spool) {
+        return 1;
+    }
+
+    /* Make sure the name cannot escape the spool directory */
+    snprintf(path, 4096, "%s/", conf->directory);
+    c = path + strlen(path);
+    snprintf(c, 4096 - (c - path), "%s.spool", name);
+    while (*c != '\0') {
+        if (*c == '/') {
+            *c = '_';
+        }
+        c++;
+    }
+
+    spool = (export_spool_t *)calloc(1, sizeof(export_spool_t));
+    if (spool == NULL) {
+        logger(LOG_INFO, "OpenLI: unable to allocate memory for buffer spool %s",
+                path);
+        return -1;
+    }
+
+    spool->path = strdup(path);
+    spool->fd = -1;
+    spool->map = NULL;
+    spool->mapsize = 0;
+    spool->readoff = 0;
+    spool->writeoff = 0;
+    spool->threshold = conf->threshold;
+    spool->maxsize = conf->maxsize;
+    spool->failed = 0;
+    spool->discarded = 0;
+    spool->nextreport = SPOOL_REPORT_INTERVAL;
+    spool->replayed = 0;
+    spool->replaynextreport = SPOOL_REPORT_INTERVAL;
+
+    buf->spool = spool;
+    return 1;
+}
+
+static void unmap_spool(export_spool_t *spool) {
+    if (spool->map) {
+        munmap(spool->map, spool->mapsize);
+    }
+    spool->map = NULL;
+    spool->mapsize = 0;
+    spool->readoff = 0;
+    spool->writeoff = 0;
+    spool->nextreport = SPOOL_REPORT_INTERVAL;
+    spool->replayed = 0;
+    spool->replaynextreport = SPOOL_REPORT_INTERVAL;
+}
+
+static void release_spool(export_spool_t *spool) {
+
+    if (spool->writeoff > spool->readoff) {
+        logger(LOG_INFO,
+                "OpenLI: discarding %lu bytes of unsent records from spool %s",
+                spool->writeoff - spool->readoff, spool->path);
+    }
+    unmap_spool(spool);
+    if (spool->fd != -1) {
+        close(spool->fd);
+        unlink(spool->path);
+    }
+    free(spool->path);
+    free(spool);
 }
 
 void release_export_buffer(export_buffer_t *buf) {
     Word_t rc;
     J1FA(rc, buf->record_offsets);
     free(buf->bufhead);
+    if (buf->spool) {
+        release_spool(buf->spool);
+        buf->spool = NULL;
+    }
 }
 
-uint64_t get_buffered_amount(export_buffer_t *buf) {
+static inline uint64_t get_memory_buffered_amount(export_buffer_t *buf) {
     return (buf->buftail - (buf->bufhead + buf->deadfront));
 }
 
+uint64_t get_spooled_amount(export_buffer_t *buf) {
+    if (buf->spool == NULL) {
+        return 0;
+    }
+    return buf->spool->writeoff - buf->spool->readoff;
+}
+
+uint64_t get_buffered_amount(export_buffer_t *buf) {
+    return get_memory_buffered_amount(buf) + get_spooled_amount(buf);
+}
+
 void reset_export_buffer(export_buffer_t *buf) {
     buf->partialfront = 0;
     buf->partialrem = 0;
+    buf->batchopen = 0;
 }
 
 static inline void dump_buffer_offsets(export_buffer_t *buf) {
@@ -87,11 +201,20 @@ static inline int slide_buffer(export_buffer_t *buf, uint8_t *start,
 
     if (amount == 0) {
         J1FA(rcint, buf->record_offsets);
+        buf->batchopen = 0;
         return 0;
     }
 
     memmove(buf->bufhead, start, amount);
 
+    if (buf->batchopen) {
+        if (buf->batchoff >= slide) {
+            buf->batchoff -= slide;
+        } else {
+            buf->batchopen = 0;
+        }
+    }
+
     J1F(rcint, buf->record_offsets, index);
     while (rcint) {
         J1U(x, buf->record_offsets, index);
@@ -139,79 +262,441 @@ static inline uint64_t extend_buffer(export_buffer_t *buf) {
     return buf->alloced - bufused;
 }
 
-uint64_t append_etsipdu_to_buffer(export_buffer_t *buf,
-        uint8_t *pdustart, uint32_t pdulen, uint32_t beensent) {
+static uint64_t append_iovec_to_memory(export_buffer_t *buf,
+        struct iovec *iov, int iovcnt, uint32_t reclen, uint32_t beensent,
+        uint8_t markoffset) {
 
     uint64_t bufused = buf->buftail - (buf->bufhead);
     uint64_t spaceleft = buf->alloced - bufused;
-    int rcint;
+    int rcint, i;
 
-    if (bufused == 0) {
+    if (get_memory_buffered_amount(buf) == 0) {
         buf->partialfront = beensent;
     }
 
-    while (spaceleft < pdulen) {
+    while (spaceleft < reclen) {
+        /* Add some space to the buffer */
         spaceleft = extend_buffer(buf);
         if (spaceleft == 0) {
             return 0;
         }
+        /* extend_buffer may have slid the existing contents */
+        bufused = buf->buftail - buf->bufhead;
     }
 
-    memcpy(buf->buftail, (void *)pdustart, pdulen);
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        memcpy(buf->buftail, iov[i].iov_base, iov[i].iov_len);
+        buf->buftail += iov[i].iov_len;
+    }
 
-    if (buf->since_last_saved_offset + pdulen >= BUF_OFFSET_FREQUENCY) {
+    /* Records that are added to an existing batch must not be used as
+     * split points, as they are not the start of a frame */
+    if (markoffset &&
+            buf->since_last_saved_offset + reclen >= BUF_OFFSET_FREQUENCY) {
         J1S(rcint, buf->record_offsets, bufused);
         buf->since_last_saved_offset = 0;
     }
-
-    buf->since_last_saved_offset += pdulen;
-    buf->buftail += pdulen;
+    buf->since_last_saved_offset += reclen;
     return (buf->buftail - buf->bufhead);
+}
+
+static int open_spool(export_spool_t *spool) {
+
+    spool->fd = open(spool->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (spool->fd < 0) {
+        logger(LOG_INFO, "OpenLI: unable to open buffer spool file %s: %s",
+                spool->path, strerror(errno));
+        spool->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int grow_spool(export_spool_t *spool, uint64_t required) {
+
+    uint64_t newsize = spool->mapsize;
+    uint8_t *newmap;
+    int err;
+
+    while (newsize < required) {
+        newsize += SPOOL_GROW_SIZE;
+    }
+
+    /* Reserve the disk space up front so that running out of disk is
+     * reported here, rather than as a SIGBUS when we write to the map.
+     */
+    if ((err = posix_fallocate(spool->fd, 0, newsize)) != 0) {
+        logger(LOG_INFO, "OpenLI: unable to grow buffer spool file %s to %lu bytes: %s",
+                spool->path, newsize, strerror(err));
+        return -1;
+    }
+
+    newmap = mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+            spool->fd, 0);
+    if (newmap == MAP_FAILED) {
+        logger(LOG_INFO, "OpenLI: unable to map buffer spool file %s: %s",
+                spool->path, strerror(errno));
+        return -1;
+    }
+
+    if (spool->map) {
+        munmap(spool->map, spool->mapsize);
+    }
+    spool->map = newmap;
+    spool->mapsize = newsize;
+    return 0;
+}
+
+static int append_iovec_to_spool(export_buffer_t *buf, struct iovec *iov,
+        int iovcnt, uint32_t reclen) {
+
+    export_spool_t *spool = buf->spool;
+    spool_reclen_t sreclen = reclen;
+    int i;
+
+    if (spool->fd == -1 && open_spool(spool) < 0) {
+        return -1;
+    }
+
+    if (spool->maxsize > 0 && spool->writeoff - spool->readoff +
+            sizeof(sreclen) + reclen > spool->maxsize) {
+        /* The spool is full -- drop the newest records, rather than
+         * sending them ahead of the ones that are already spooled */
+        if (spool->discarded == 0) {
+            logger(LOG_INFO,
+                    "OpenLI: buffer spool %s has reached its maximum size of %lu MB, discarding new records until it has been replayed",
+                    spool->path, spool->maxsize / (1024 * 1024));
+        }
+        spool->discarded ++;
+        return 0;
+    }
+
+    if (spool->discarded > 0) {
+        logger(LOG_INFO,
+                "OpenLI: buffer spool %s has room again, %lu records were discarded while it was full",
+                spool->path, spool->discarded);
+        spool->discarded = 0;
+    }
+
+    if (spool->writeoff == 0) {
+        logger(LOG_INFO,
+                "OpenLI: buffered records have exceeded %lu MB, spilling to %s",
+                spool->threshold / (1024 * 1024), spool->path);
+    }
+
+    if (spool->writeoff + sizeof(sreclen) + reclen > spool->mapsize) {
+        if (grow_spool(spool, spool->writeoff + sizeof(sreclen) + reclen) < 0) {
+            return -1;
+        }
+    }
+
+    memcpy(spool->map + spool->writeoff, &sreclen, sizeof(sreclen));
+    spool->writeoff += sizeof(sreclen);
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        memcpy(spool->map + spool->writeoff, iov[i].iov_base, iov[i].iov_len);
+        spool->writeoff += iov[i].iov_len;
+    }
+
+    if (spool->writeoff - spool->readoff >= spool->nextreport) {
+        logger(LOG_INFO, "OpenLI: buffer spool %s now holds %lu MB of records",
+                spool->path, (spool->writeoff - spool->readoff) / (1024 * 1024));
+        spool->nextreport += SPOOL_REPORT_INTERVAL;
+    }
+    return 0;
+}
+
+static inline int should_spool(export_buffer_t *buf, uint32_t reclen) {
+
+    export_spool_t *spool = buf->spool;
+    uint64_t inmem = get_memory_buffered_amount(buf);
+
+    /* Once we have started spilling to disk, every new record must go to
+     * the spool until it has been replayed -- otherwise records would be
+     * transmitted out of order.
+     */
+    return (spool && !spool->failed &&
+            (spool->writeoff > spool->readoff ||
+             (inmem > 0 && inmem + reclen > spool->threshold)));
+}
+
+static uint64_t append_iovec_to_buffer(export_buffer_t *buf,
+        struct iovec *iov, int iovcnt, uint32_t reclen, uint32_t beensent) {
+
+    export_spool_t *spool = buf->spool;
+
+    /* Any new frame ends the current batch, otherwise later records could
+     * be added to the batch ahead of this one */
+    buf->batchopen = 0;
+
+    if (should_spool(buf, reclen)) {
+        if (append_iovec_to_spool(buf, iov, iovcnt, reclen) == 0) {
+            return get_buffered_amount(buf);
+        }
+        logger(LOG_INFO,
+                "OpenLI: buffer spool %s is unusable, falling back to memory (records may be transmitted out of order)",
+                spool->path);
+        spool->failed = 1;
+    }
+
+    return append_iovec_to_memory(buf, iov, iovcnt, reclen, beensent, 1);
+}
+
+static void report_replay_rate(export_spool_t *spool, uint8_t finished) {
+
+    struct timeval tv;
+    double elapsed;
+
+    gettimeofday(&tv, NULL);
+    elapsed = (tv.tv_sec - spool->replaystart.tv_sec) +
+            ((tv.tv_usec - spool->replaystart.tv_usec) / 1000000.0);
+    if (elapsed <= 0) {
+        elapsed = 0.000001;
+    }
+
+    if (finished) {
+        logger(LOG_INFO,
+                "OpenLI: finished replaying %lu MB of spooled records from %s in %.1f seconds (%.2f MB/s)",
+                spool->replayed / (1024 * 1024), spool->path, elapsed,
+                (spool->replayed / (1024.0 * 1024.0)) / elapsed);
+    } else {
+        logger(LOG_INFO,
+                "OpenLI: replayed %lu MB from %s, %lu MB still spooled (%.2f MB/s)",
+                spool->replayed / (1024 * 1024), spool->path,
+                (spool->writeoff - spool->readoff) / (1024 * 1024),
+                (spool->replayed / (1024.0 * 1024.0)) / elapsed);
+    }
+}
+
+/* Moves the records that have not been replayed yet to the start of the
+ * spool file and gives back the space that the replayed records were using.
+ *
+ * Only called once the replayed records take up at least as much of the
+ * file as the remaining ones, so that each replayed byte pays for at most
+ * one byte being moved and the file never grows beyond about twice the
+ * amount of unsent records.
+ */
+static void compact_spool(export_spool_t *spool) {
+
+    uint64_t live = spool->writeoff - spool->readoff;
+    uint64_t newsize;
+
+    memmove(spool->map, spool->map + spool->readoff, live);
+    spool->readoff = 0;
+    spool->writeoff = live;
+
+    newsize = ((live / SPOOL_GROW_SIZE) + 1) * SPOOL_GROW_SIZE;
+    if (newsize >= spool->mapsize) {
+        return;
+    }
+
+    munmap(spool->map + newsize, spool->mapsize - newsize);
+    spool->mapsize = newsize;
+    if (ftruncate(spool->fd, newsize) < 0) {
+        logger(LOG_INFO, "OpenLI: unable to shrink buffer spool file %s: %s",
+                spool->path, strerror(errno));
+    }
+}
+
+static void refill_from_spool(export_buffer_t *buf) {
+
+    export_spool_t *spool = buf->spool;
+    uint64_t chunk = SPOOL_REPLAY_CHUNK;
+    spool_reclen_t reclen;
+    struct iovec iov;
+
+    if (spool == NULL || spool->writeoff == spool->readoff) {
+        return;
+    }
+
+    if (spool->threshold < chunk) {
+        chunk = spool->threshold;
+    }
+
+    if (get_memory_buffered_amount(buf) >= chunk) {
+        return;
+    }
+
+    if (spool->replayed == 0) {
+        gettimeofday(&(spool->replaystart), NULL);
+    }
+
+    while (spool->readoff < spool->writeoff &&
+            get_memory_buffered_amount(buf) < chunk) {
+
+        memcpy(&reclen, spool->map + spool->readoff, sizeof(reclen));
+        iov.iov_base = spool->map + spool->readoff + sizeof(reclen);
+        iov.iov_len = reclen;
+
+        if (append_iovec_to_memory(buf, &iov, 1, reclen, 0, 1) == 0) {
+            /* Try again once some of the memory buffer has drained */
+            break;
+        }
+        spool->readoff += (sizeof(reclen) + reclen);
+        spool->replayed += reclen;
+    }
 
+    if (spool->replayed >= spool->replaynextreport) {
+        report_replay_rate(spool, 0);
+        spool->replaynextreport += SPOOL_REPORT_INTERVAL;
+    }
+
+    if (spool->readoff == spool->writeoff) {
+        /* Spool is empty, so we can give the disk space back */
+        report_replay_rate(spool, 1);
+        unmap_spool(spool);
+        if (ftruncate(spool->fd, 0) < 0) {
+            logger(LOG_INFO, "OpenLI: unable to truncate buffer spool file %s: %s",
+                    spool->path, strerror(errno));
+        }
+        spool->failed = 0;
+    } else if (spool->readoff >= SPOOL_REPLAY_CHUNK &&
+            spool->readoff >= spool->writeoff - spool->readoff) {
+        /* New records are still arriving while we replay, so the spool
+         * may never empty completely -- reclaim the replayed part */
+        compact_spool(spool);
+    }
+}
+
+uint64_t append_etsipdu_to_buffer(export_buffer_t *buf,
+        uint8_t *pdustart, uint32_t pdulen, uint32_t beensent) {
+
+    struct iovec iov;
+
+    iov.iov_base = pdustart;
+    iov.iov_len = pdulen;
+
+    return append_iovec_to_buffer(buf, &iov, 1, pdulen, beensent);
 }
 
 uint64_t append_message_to_buffer(export_buffer_t *buf,
         openli_encoded_result_t *res, uint32_t beensent) {
 
-    uint32_t enclen = res->msgbody->len - res->ipclen;
-    uint64_t bufused = buf->buftail - buf->bufhead;
-    uint64_t spaceleft = buf->alloced - bufused;
-    uint32_t added = 0;
-    int rcint;
+    struct iovec iov[3];
 
-    if (bufused == 0) {
-        buf->partialfront = beensent;
+    iov[0].iov_base = &(res->header);
+    iov[0].iov_len = sizeof(res->header);
+    iov[1].iov_base = res->msgbody->encoded;
+    iov[1].iov_len = res->msgbody->len - res->ipclen;
+    iov[2].iov_base = res->ipcontents;
+    iov[2].iov_len = res->ipclen;
+
+    return append_iovec_to_buffer(buf, iov, 3,
+            res->msgbody->len + sizeof(res->header), beensent);
+}
+
+/* Adds an encoded record to the buffer using the batched record framing.
+ *
+ * If the most recent frame in the buffer is a batch for the same LIID,
+ * the record is simply added to the end of that batch. Otherwise, a new
+ * batch containing just this record is started.
+ */
+uint64_t append_batched_message_to_buffer(export_buffer_t *buf,
+        openli_encoded_result_t *res) {
+
+    struct iovec iov[5];
+    ii_batch_header_t bhdr;
+    ii_batch_record_t rhdr;
+    uint8_t *segs[2];
+    uint32_t seglens[2];
+    uint8_t *prefix, *bstart;
+    uint16_t liidlen;
+    uint32_t reclen, total;
+    uint64_t inmem, ret;
+    int first;
+
+    /* The LIID prefix is at the front of the encoded part of the record,
+     * or at the front of the IP contents for raw IP records */
+    segs[0] = res->msgbody->encoded;
+    seglens[0] = res->msgbody->len - res->ipclen;
+    segs[1] = res->ipcontents;
+    seglens[1] = res->ipclen;
+    first = (seglens[0] == 0) ? 1 : 0;
+
+    if (seglens[first] < sizeof(liidlen)) {
+        return append_message_to_buffer(buf, res, 0);
+    }
+    prefix = segs[first];
+    memcpy(&liidlen, prefix, sizeof(liidlen));
+    liidlen = ntohs(liidlen);
+    if (seglens[first] < sizeof(liidlen) + liidlen) {
+        return append_message_to_buffer(buf, res, 0);
     }
 
-    while (spaceleft < res->msgbody->len + sizeof(res->header)) {
-        /* Add some space to the buffer */
-        spaceleft = extend_buffer(buf);
-        if (spaceleft == 0) {
-            return 0;
+    reclen = res->msgbody->len - (sizeof(liidlen) + liidlen);
+
+    rhdr.rectype = res->header.intercepttype;
+    rhdr.reclen = htonl(reclen);
+
+    iov[2].iov_base = &rhdr;
+    iov[2].iov_len = sizeof(rhdr);
+    iov[3].iov_base = prefix + sizeof(liidlen) + liidlen;
+    iov[3].iov_len = seglens[first] - (sizeof(liidlen) + liidlen);
+    iov[4].iov_base = segs[1];
+    iov[4].iov_len = (first == 0) ? seglens[1] : 0;
+
+    if (buf->batchopen) {
+        bstart = buf->bufhead + buf->batchoff;
+        memcpy(&bhdr, bstart, sizeof(bhdr));
+
+        if (ntohs(bhdr.liidlen) == liidlen &&
+                memcmp(bstart + sizeof(bhdr), prefix + sizeof(liidlen),
+                    liidlen) == 0 &&
+                ntohs(bhdr.reccount) < 65535 &&
+                ntohl(bhdr.batchlen) + sizeof(rhdr) + reclen <=
+                    EXPORT_BATCH_MAX_SIZE &&
+                !should_spool(buf, sizeof(rhdr) + reclen)) {
+
+            ret = append_iovec_to_memory(buf, &(iov[2]), 3,
+                    sizeof(rhdr) + reclen, 0, 0);
+            if (ret == 0) {
+                return 0;
+            }
+
+            /* The buffer may have moved while we were appending */
+            bstart = buf->bufhead + buf->batchoff;
+            bhdr.batchlen = htonl(ntohl(bhdr.batchlen) + sizeof(rhdr) +
+                    reclen);
+            bhdr.reccount = htons(ntohs(bhdr.reccount) + 1);
+            memcpy(bstart, &bhdr, sizeof(bhdr));
+            return ret;
         }
     }
 
-    memcpy(buf->buftail, &res->header, sizeof(res->header));
-    buf->buftail += sizeof(res->header);
-    added += sizeof(res->header);
+    memcpy(&(bhdr.hdr), &(res->header), sizeof(ii_header_t));
+    bhdr.hdr.bodylen = 0;
+    bhdr.hdr.intercepttype = htons(OPENLI_PROTO_ETSI_BATCH);
+    bhdr.batchlen = htonl((sizeof(bhdr) - sizeof(ii_header_t) -
+            sizeof(bhdr.batchlen)) + liidlen + sizeof(rhdr) + reclen);
+    bhdr.reccount = htons(1);
+    bhdr.liidlen = htons(liidlen);
 
-    if (enclen > 0) {
-        memcpy(buf->buftail, res->msgbody->encoded, enclen);
-        buf->buftail += enclen;
-    }
+    iov[0].iov_base = &bhdr;
+    iov[0].iov_len = sizeof(bhdr);
+    iov[1].iov_base = prefix + sizeof(liidlen);
+    iov[1].iov_len = liidlen;
 
-    if (res->ipclen > 0) {
-        memcpy(buf->buftail, res->ipcontents, res->ipclen);
-        buf->buftail += res->ipclen;
+    total = sizeof(bhdr) + liidlen + sizeof(rhdr) + reclen;
+    inmem = get_memory_buffered_amount(buf);
+
+    ret = append_iovec_to_buffer(buf, iov, 5, total, 0);
+    if (ret == 0) {
+        return 0;
     }
-    added += res->msgbody->len;
 
-    if (buf->since_last_saved_offset + added >= BUF_OFFSET_FREQUENCY) {
-        J1S(rcint, buf->record_offsets, bufused);
-        buf->since_last_saved_offset = 0;
+    /* Only batches that are in memory can be extended (the batch may also
+     * have been spooled or discarded because the spool is full) */
+    if (get_memory_buffered_amount(buf) == inmem + total) {
+        buf->batchopen = 1;
+        buf->batchoff = (buf->buftail - buf->bufhead) - total;
     }
-    buf->since_last_saved_offset += added;
-    return (buf->buftail - buf->bufhead);
+    return ret;
 }
 
 int transmit_heartbeat(int fd, SSL *ssl) {
@@ -259,6 +744,57 @@ int transmit_heartbeat(int fd, SSL *ssl) {
     return (int)(sizeof(hbeat));
 }
 
+int transmit_heartbeat_nonblocking(int fd, SSL *ssl, ii_header_t *hbeat,
+        uint32_t *hbsent) {
+
+    int ret;
+    int tosend;
+
+    if (*hbsent == 0) {
+        hbeat->magic = htonl(OPENLI_PROTO_MAGIC);
+        hbeat->bodylen = 0;
+        hbeat->intercepttype = htons((uint16_t)OPENLI_PROTO_HEARTBEAT);
+        hbeat->internalid = 0;
+    }
+
+    /* A heartbeat that was held up last time must be retried from the
+     * same buffer, as SSL_write() insists on it */
+    tosend = sizeof(ii_header_t) - *hbsent;
+    while (tosend > 0) {
+        if (ssl) {
+            ret = SSL_write(ssl, ((uint8_t *)hbeat) + *hbsent, tosend);
+            if (ret <= 0) {
+                char errstring[128];
+                int errr = SSL_get_error(ssl, ret);
+                if (errr == SSL_ERROR_WANT_WRITE) {
+                    return 0;
+                }
+                logger(LOG_INFO,
+                        "OpenLI: ssl_write error (%d) when sending heartbeat: %s",
+                        errr, ERR_error_string(ERR_get_error(), errstring));
+                return -1;
+            }
+        } else {
+            ret = send(fd, ((uint8_t *)hbeat) + *hbsent, tosend,
+                    MSG_DONTWAIT);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                logger(LOG_INFO,
+                        "OpenLI: error while sending heartbeat: %s",
+                        strerror(errno));
+                return -1;
+            }
+        }
+        *hbsent += ret;
+        tosend -= ret;
+    }
+
+    *hbsent = 0;
+    return 1;
+}
+
 static inline void post_transmit(export_buffer_t *buf) {
 
     uint64_t rem = 0;
@@ -292,36 +828,82 @@ static inline void post_transmit(export_buffer_t *buf) {
     buf->partialrem = 0;
 }
 
-int transmit_buffered_records(export_buffer_t *buf, int fd,
-        uint64_t bytelimit, SSL *ssl) {
+uint64_t prepare_buffered_transmit(export_buffer_t *buf, uint64_t bytelimit,
+        uint8_t **start) {
 
     uint64_t sent = 0;
-    uint8_t *bhead = buf->bufhead + buf->deadfront;
+    uint8_t *bhead;
     uint64_t offset = buf->partialfront;
-    int ret, rcint;
+    int rcint;
     Word_t index = 0;
 
+    /* Don't modify any batch that we are about to send */
+    buf->batchopen = 0;
+
+    if (buf->partialrem == 0) {
+        refill_from_spool(buf);
+    }
+    bhead = buf->bufhead + buf->deadfront;
+
     if (buf->partialrem > 0) {
         sent = buf->partialrem;
     } else {
         sent = (buf->buftail - (bhead + offset));
 
         if (sent > bytelimit) {
-            index = bytelimit + 1 + buf->deadfront;
+            /* Split at the last record that starts within the limit. If
+             * there isn't one, we'll just have to send everything */
+            index = bytelimit + 1 + buf->deadfront + offset;
             J1P(rcint, buf->record_offsets, index);
-            if (rcint == 0) {
-                assert(rcint != 0);
-                return 0;
+            if (rcint != 0 && index > buf->deadfront + offset) {
+                sent = index - (buf->deadfront + offset);
             }
-            sent = index - buf->deadfront;
         }
         buf->partialrem = sent;
     }
 
+    *start = bhead + offset;
+    return sent;
+}
+
+int finish_buffered_transmit(export_buffer_t *buf, uint64_t attempted,
+        int ret) {
+
+    if (attempted != 0) {
+        if (ret < 0) {
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            return 0;
+        } else if (ret < attempted) {
+            /* Partial send, move partialfront ahead by whatever we did send. */
+            buf->partialfront += (uint32_t)ret;
+            buf->partialrem -= (uint32_t)ret;
+            return ret;
+        }
+        buf->deadfront += ((uint32_t)ret + buf->partialfront);
+    }
+
+    post_transmit(buf);
+    return attempted;
+}
+
+int transmit_buffered_records(export_buffer_t *buf, int fd,
+        uint64_t bytelimit, SSL *ssl) {
+
+    uint64_t sent = 0;
+    uint8_t *start = NULL;
+    int ret = 0;
+
+    sent = prepare_buffered_transmit(buf, bytelimit, &start);
+    if (start == NULL) {
+        return 0;
+    }
+
     if (sent != 0) {
         if (ssl != NULL) {
             while (1) {
-                ret = SSL_write(ssl, bhead + offset, (int)sent);
+                ret = SSL_write(ssl, start, (int)sent);
 
                 if ((ret) <= 0 ) {
                     char errstring[128];
@@ -338,25 +920,11 @@ int transmit_buffered_records(export_buffer_t *buf, int fd,
             }
         }
         else {
-            ret = send(fd, bhead + offset, (int)sent, MSG_DONTWAIT);
-        }
-
-        if (ret < 0) {
-            if (errno != EAGAIN) {
-                return -1;
-            }
-            return 0;
-        } else if (ret < sent) {
-            /* Partial send, move partialfront ahead by whatever we did send. */
-            buf->partialfront += (uint32_t)ret;
-            buf->partialrem -= (uint32_t)ret;
-            return ret;
+            ret = send(fd, start, (int)sent, MSG_DONTWAIT);
         }
-        buf->deadfront += ((uint32_t)ret + buf->partialfront);
     }
 
-    post_transmit(buf);
-    return sent;
+    return finish_buffered_transmit(buf, sent, ret);
 }
 
 int transmit_buffered_records_RMQ(export_buffer_t *buf, 
@@ -365,47 +933,80 @@ int transmit_buffered_records_RMQ(export_buffer_t *buf,
         uint64_t bytelimit) {
 
     uint64_t sent = 0;
-    uint8_t *bhead = buf->bufhead + buf->deadfront;
-    int ret;
+    uint64_t offset;
+    uint8_t *bhead;
+    int rcint;
+    Word_t index = 0;
+    amqp_bytes_t message_bytes;
+    amqp_basic_properties_t props;
+    int pub_ret;
 
-    sent = (buf->buftail - (bhead));
+    buf->batchopen = 0;
+    refill_from_spool(buf);
+
+    /* Anything that is still waiting on a confirm has already been
+     * published, so carry on from the end of that */
+    offset = buf->deadfront + buf->rmqinflight;
+    bhead = buf->bufhead + offset;
+    sent = (buf->buftail - bhead);
 
     if (sent > bytelimit) {
-        sent = bytelimit;
+        /* Split at a record boundary, so that if we ever have to publish
+         * this data again then the mediator won't see half a record */
+        index = bytelimit + 1 + offset;
+        J1P(rcint, buf->record_offsets, index);
+        if (rcint != 0 && index > offset) {
+            sent = index - offset;
+        }
     }
 
-    if (sent != 0) {
-        amqp_bytes_t message_bytes;
-        amqp_basic_properties_t props;
-        message_bytes.len = sent;
-        message_bytes.bytes = bhead;
-
-        props._flags = AMQP_BASIC_DELIVERY_MODE_FLAG;
-        props.delivery_mode = 2;        /* persistent mode */
-
-        int pub_ret = amqp_basic_publish(
-                amqp_state,
-                channel,
-                exchange,
-                routing_key,
-                0,
-                0,
-                &props,
-                message_bytes);
-
-        if ( pub_ret != 0 ){
-            logger(LOG_INFO,
-                    "OpenLI: RMQ publish error %d", pub_ret);
-            ret = 0;
-        } else {
-            ret = sent;
-        }
+    if (sent == 0) {
+        return 0;
+    }
 
-        buf->deadfront += ((uint32_t)ret);
+    message_bytes.len = sent;
+    message_bytes.bytes = bhead;
+
+    props._flags = AMQP_BASIC_DELIVERY_MODE_FLAG;
+    props.delivery_mode = 2;        /* persistent mode */
+
+    pub_ret = amqp_basic_publish(
+            amqp_state,
+            channel,
+            exchange,
+            routing_key,
+            0,
+            0,
+            &props,
+            message_bytes);
+
+    if (pub_ret != 0) {
+        logger(LOG_INFO,
+                "OpenLI: RMQ publish error: %s", amqp_error_string2(pub_ret));
+        return -1;
     }
 
-    post_transmit(buf);
+    /* The data stays in the buffer until the broker confirms it */
+    buf->rmqinflight += sent;
     return sent;
 }
 
+void confirm_buffered_records_RMQ(export_buffer_t *buf, uint64_t amount) {
+
+    if (amount > buf->rmqinflight) {
+        amount = buf->rmqinflight;
+    }
+    buf->deadfront += (uint32_t)amount;
+    buf->rmqinflight -= amount;
+    post_transmit(buf);
+}
+
+void rewind_buffered_records_RMQ(export_buffer_t *buf) {
+    buf->rmqinflight = 0;
+}
+
+uint64_t get_unpublished_amount_RMQ(export_buffer_t *buf) {
+    return get_buffered_amount(buf) - buf->rmqinflight;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -28,12 +28,23 @@
 #define OPENLI_COLLECTOR_BUFFER_H_
 
 #include "config.h"
+#include <sys/time.h>
 #include <libwandder.h>
 #include <libwandder_etsili.h>
 #include <Judy.h>
 #include "netcomms.h"
 #include "collector/collector_publish.h"
 
+/* Default amount of buffered data (in bytes) that we will keep in memory
+ * before spilling to disk, if a spool directory has been configured.
+ */
+#define DEFAULT_SPOOL_THRESHOLD (512ULL * 1024 * 1024)
+
+/* Maximum size of a single record batch frame, in bytes. Once a batch
+ * reaches this size, a new batch is started for any subsequent records.
+ */
+#define EXPORT_BATCH_MAX_SIZE (1024 * 1024)
+
 typedef struct encoder_result {
     ii_header_t header;
     wandder_encoded_result_t *msgbody;
@@ -48,6 +59,36 @@ typedef struct encoder_result {
 } PACKED openli_encoded_result_t;
 
 
+typedef struct openli_spool_config {
+    char *directory;
+    uint64_t threshold;
+    /* Maximum amount of unsent records to keep in each spool file, or
+     * zero for no limit */
+    uint64_t maxsize;
+} openli_spool_config_t;
+
+typedef struct export_spool {
+    char *path;
+    int fd;
+    uint8_t *map;
+    uint64_t mapsize;
+
+    uint64_t readoff;
+    uint64_t writeoff;
+    uint64_t threshold;
+    uint64_t maxsize;
+    uint8_t failed;
+
+    /* Number of records that have been discarded since the spool last
+     * reached its maximum size */
+    uint64_t discarded;
+
+    uint64_t nextreport;
+    uint64_t replayed;
+    uint64_t replaynextreport;
+    struct timeval replaystart;
+} export_spool_t;
+
 typedef struct export_buffer {
     uint8_t *bufhead;
     uint8_t *buftail;
@@ -61,6 +102,18 @@ typedef struct export_buffer {
 
     Pvoid_t record_offsets;
     uint32_t since_last_saved_offset;
+
+    export_spool_t *spool;
+
+    /* Set if the last frame in the buffer is a record batch that we can
+     * still add more records to */
+    uint8_t batchopen;
+    /* Offset of the start of the open record batch, relative to bufhead */
+    uint64_t batchoff;
+
+    /* Amount of data after deadfront that has been published to RabbitMQ
+     * but not yet confirmed by the broker */
+    uint64_t rmqinflight;
 } export_buffer_t;
 
 
@@ -68,17 +121,31 @@ void init_export_buffer(export_buffer_t *buf);
 void reset_export_buffer(export_buffer_t *buf);
 void release_export_buffer(export_buffer_t *buf);
 uint64_t get_buffered_amount(export_buffer_t *buf);
+uint64_t get_spooled_amount(export_buffer_t *buf);
+int enable_export_buffer_spool(export_buffer_t *buf,
+        openli_spool_config_t *conf, char *name);
 uint64_t append_message_to_buffer(export_buffer_t *buf,
         openli_encoded_result_t *msg, uint32_t beensent);
+uint64_t append_batched_message_to_buffer(export_buffer_t *buf,
+        openli_encoded_result_t *res);
 uint64_t append_etsipdu_to_buffer(export_buffer_t *buf,
         uint8_t *pdustart, uint32_t pdulen, uint32_t beensent);
 int transmit_buffered_records(export_buffer_t *buf, int fd,
         uint64_t bytelimit, SSL *ssl);
+uint64_t prepare_buffered_transmit(export_buffer_t *buf, uint64_t bytelimit,
+        uint8_t **start);
+int finish_buffered_transmit(export_buffer_t *buf, uint64_t attempted,
+        int ret);
 int transmit_buffered_records_RMQ(export_buffer_t *buf, 
         amqp_connection_state_t amqp_state, amqp_channel_t channel, 
         amqp_bytes_t exchange, amqp_bytes_t routing_key,
         uint64_t bytelimit);
+void confirm_buffered_records_RMQ(export_buffer_t *buf, uint64_t amount);
+void rewind_buffered_records_RMQ(export_buffer_t *buf);
+uint64_t get_unpublished_amount_RMQ(export_buffer_t *buf);
 int transmit_heartbeat(int fd, SSL *ssl);
+int transmit_heartbeat_nonblocking(int fd, SSL *ssl, ii_header_t *hbeat,
+        uint32_t *hbsent);
 
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -86,6 +86,10 @@ typedef struct intercept_common {
     uint32_t hi1_seqno;
     uint64_t tostart_time;
     uint64_t toend_time;
+
+    /* Only used by the provisioner -- when this intercept was last changed
+     * via the update socket, or 0 if it came from the intercept config */
+    uint64_t lastmodified;
 } intercept_common_t;
 
 typedef struct hi1_notify_data {
@@ -0,0 +1,302 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "logger.h"
+#include "collthread.h"
+
+/** Initial size of the buffer used to stage records for a handover */
+#define HANDOFF_INIT_SIZE (64 * 1024)
+
+/** Maximum time to wait in epoll_wait() before checking the halt flag,
+ *  in milliseconds */
+#define WORKER_EPOLL_TIMEOUT 100
+
+/** Main loop for a collector receive thread.
+ *
+ *  Reads from each of the collector sockets that have been assigned to this
+ *  thread as they become readable, until the thread is told to halt.
+ *
+ *  @param arg          The state for this receive thread
+ */
+static void *run_collector_worker(void *arg) {
+
+    coll_recv_worker_t *worker = (coll_recv_worker_t *)arg;
+    struct epoll_event evs[64];
+    med_epoll_ev_t *mev;
+    int i, nfds, ret;
+
+    while (!worker->halt) {
+        nfds = epoll_wait(worker->epoll_fd, evs, 64, WORKER_EPOLL_TIMEOUT);
+        if (nfds < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while waiting for epoll events in collector receive thread %d: %s.",
+                    worker->workerid, strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            mev = (med_epoll_ev_t *)(evs[i].data.ptr);
+            ret = 0;
+
+            switch(mev->fdtype) {
+                case MED_EPOLL_COLLECTOR_HANDSHAKE:
+                    /* socket with an incomplete SSL handshake is available */
+                    ret = continue_collector_handshake(worker->medcol, mev);
+                    break;
+                case MED_EPOLL_COLLECTOR:
+                    /* a collector is sending us some data */
+                    if (evs[i].events & EPOLLRDHUP) {
+                        ret = -1;
+                    } else if (evs[i].events & EPOLLIN) {
+                        ret = worker->recvfunc(worker->recvdata, mev, worker);
+                    }
+                    break;
+                default:
+                    logger(LOG_INFO,
+                            "OpenLI Mediator: invalid fd triggering epoll event in collector receive thread %d.",
+                            worker->workerid);
+                    ret = -1;
+                    break;
+            }
+
+            if (ret == -1) {
+                drop_collector(worker->medcol, mev, 1);
+            }
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+int init_collector_worker(coll_recv_worker_t *worker, int workerid,
+        mediator_collector_t *medcol, int main_epoll,
+        coll_recv_func_t recvfunc, void *recvdata) {
+
+    memset(worker, 0, sizeof(coll_recv_worker_t));
+    worker->workerid = workerid;
+    worker->medcol = medcol;
+    worker->recvfunc = recvfunc;
+    worker->recvdata = recvdata;
+    worker->wakefd = -1;
+
+    worker->epoll_fd = epoll_create1(0);
+    if (worker->epoll_fd == -1) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to create epoll fd for collector receive thread %d: %s",
+                workerid, strerror(errno));
+        return -1;
+    }
+
+    worker->wakefd = eventfd(0, EFD_NONBLOCK);
+    if (worker->wakefd == -1) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to create eventfd for collector receive thread %d: %s",
+                workerid, strerror(errno));
+        return -1;
+    }
+
+    worker->wakeev = create_mediator_fdevent(main_epoll, worker,
+            MED_EPOLL_COLL_HANDOFF, worker->wakefd, EPOLLIN);
+    if (worker->wakeev == NULL) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to add eventfd for collector receive thread %d to epoll: %s",
+                workerid, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int start_collector_worker(coll_recv_worker_t *worker) {
+
+    worker->halt = 0;
+    if (pthread_create(&(worker->threadid), NULL, run_collector_worker,
+                worker) != 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to start collector receive thread %d",
+                worker->workerid);
+        return -1;
+    }
+    worker->running = 1;
+    return 0;
+}
+
+void halt_collector_worker(coll_recv_worker_t *worker) {
+
+    if (!worker->running) {
+        return;
+    }
+    worker->halt = 1;
+    pthread_join(worker->threadid, NULL);
+    worker->running = 0;
+}
+
+void free_collector_handoff(coll_handoff_t *hand) {
+    if (hand->records) {
+        free(hand->records);
+    }
+    free(hand);
+}
+
+void destroy_collector_worker(coll_recv_worker_t *worker) {
+
+    coll_handoff_t *hand, *tmp;
+
+    halt_collector_worker(worker);
+
+    hand = worker->staged;
+    while (hand) {
+        tmp = hand;
+        hand = hand->next;
+        free_collector_handoff(tmp);
+    }
+    worker->staged = NULL;
+
+    hand = take_collector_handoffs(worker);
+    while (hand) {
+        tmp = hand;
+        hand = hand->next;
+        free_collector_handoff(tmp);
+    }
+
+    if (worker->wakeev) {
+        /* also closes the eventfd */
+        remove_mediator_fdevent(worker->wakeev);
+        worker->wakeev = NULL;
+    } else if (worker->wakefd != -1) {
+        close(worker->wakefd);
+    }
+    worker->wakefd = -1;
+
+    if (worker->epoll_fd != -1) {
+        close(worker->epoll_fd);
+        worker->epoll_fd = -1;
+    }
+}
+
+int stage_collector_record(coll_recv_worker_t *worker, handover_t *ho,
+        uint8_t *rec, uint32_t reclen) {
+
+    coll_handoff_t *hand = worker->staged;
+    uint32_t required = reclen + sizeof(uint32_t);
+    uint32_t newsize;
+    uint8_t *tmp;
+
+    while (hand && hand->ho != ho) {
+        hand = hand->next;
+    }
+
+    if (hand == NULL) {
+        hand = (coll_handoff_t *)calloc(1, sizeof(coll_handoff_t));
+        if (hand == NULL) {
+            return -1;
+        }
+        hand->ho = ho;
+        hand->next = worker->staged;
+        worker->staged = hand;
+    }
+
+    if (hand->alloc - hand->used < required) {
+        newsize = hand->alloc ? hand->alloc * 2 : HANDOFF_INIT_SIZE;
+        while (newsize - hand->used < required) {
+            newsize *= 2;
+        }
+        tmp = realloc(hand->records, newsize);
+        if (tmp == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: OOM while staging records in collector receive thread %d",
+                    worker->workerid);
+            return -1;
+        }
+        hand->records = tmp;
+        hand->alloc = newsize;
+    }
+
+    memcpy(hand->records + hand->used, &reclen, sizeof(uint32_t));
+    memcpy(hand->records + hand->used + sizeof(uint32_t), rec, reclen);
+    hand->used += required;
+    return 0;
+}
+
+void publish_collector_records(coll_recv_worker_t *worker) {
+
+    coll_handoff_t *first, *last, *head;
+    uint64_t one = 1;
+
+    first = worker->staged;
+    if (first == NULL) {
+        return;
+    }
+    last = first;
+    while (last->next) {
+        last = last->next;
+    }
+    worker->staged = NULL;
+
+    /* Push the whole staged list onto the front of the handoff stack */
+    head = __atomic_load_n(&(worker->handoffs), __ATOMIC_RELAXED);
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&(worker->handoffs), &head, first,
+                1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* If the stack wasn't empty, the main thread has yet to take the
+     * earlier handoffs and so has already been woken */
+    if (head == NULL) {
+        if (write(worker->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: unable to wake main thread from collector receive thread %d: %s",
+                    worker->workerid, strerror(errno));
+        }
+    }
+}
+
+coll_handoff_t *take_collector_handoffs(coll_recv_worker_t *worker) {
+
+    coll_handoff_t *hand, *next, *ordered = NULL;
+
+    hand = __atomic_exchange_n(&(worker->handoffs), NULL, __ATOMIC_ACQUIRE);
+
+    /* The stack has the most recent handoff first, so reverse it */
+    while (hand) {
+        next = hand->next;
+        hand->next = ordered;
+        ordered = hand;
+        hand = next;
+    }
+    return ordered;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,198 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_MEDIATOR_COLLTHREAD_H_
+#define OPENLI_MEDIATOR_COLLTHREAD_H_
+
+#include <pthread.h>
+#include <inttypes.h>
+#include "med_epoll.h"
+#include "handover.h"
+#include "mediator_coll.h"
+
+/** The maximum number of collector receive threads that may be configured */
+#define MAX_COLLECTOR_THREADS 64
+
+typedef struct coll_handoff coll_handoff_t;
+typedef struct coll_recv_worker coll_recv_worker_t;
+
+/** A set of ETSI records that a collector receive thread has matched to a
+ *  handover, waiting for the main thread to append them to the handover's
+ *  outgoing buffer.
+ */
+struct coll_handoff {
+    /** The handover that these records are destined for */
+    handover_t *ho;
+
+    /** The records themselves -- each record is preceded by its length,
+     *  as a 32 bit integer in host byte order */
+    uint8_t *records;
+
+    /** The number of bytes used in the records buffer */
+    uint32_t used;
+
+    /** The allocated size of the records buffer */
+    uint32_t alloc;
+
+    /** The next set of records in the queue */
+    coll_handoff_t *next;
+};
+
+/** Callback used by a collector receive thread to read and action the
+ *  messages that are available on a collector socket.
+ *
+ *  @param data         The opaque pointer provided when the thread was
+ *                      created.
+ *  @param mev          The epoll event for the collector socket.
+ *  @param worker       The receive thread that is calling the function.
+ *
+ *  @return -1 if the collector should be dropped, 0 otherwise.
+ */
+typedef int (*coll_recv_func_t)(void *data, med_epoll_ev_t *mev,
+        coll_recv_worker_t *worker);
+
+/** State for a single collector receive thread */
+struct coll_recv_worker {
+    /** A number identifying this thread, for logging */
+    int workerid;
+
+    /** The pthread ID for the thread */
+    pthread_t threadid;
+
+    /** Set to 1 once the thread has been started */
+    uint8_t running;
+
+    /** Set to 1 to ask the thread to stop */
+    volatile int halt;
+
+    /** The epoll fd that the thread uses to watch its collector sockets */
+    int epoll_fd;
+
+    /** An eventfd used to tell the main thread that there are new
+     *  handoffs to be taken from this thread */
+    int wakefd;
+
+    /** The epoll event for the eventfd, registered with the main epoll fd */
+    med_epoll_ev_t *wakeev;
+
+    /** The global state for all collectors seen by the mediator */
+    mediator_collector_t *medcol;
+
+    /** The function to call when a collector socket is readable */
+    coll_recv_func_t recvfunc;
+
+    /** The opaque pointer to pass into recvfunc */
+    void *recvdata;
+
+    /** Records that have been matched to a handover during the current
+     *  receive, but not yet published to the main thread. Only ever touched
+     *  by this thread. */
+    coll_handoff_t *staged;
+
+    /** Records that have been published to the main thread, most recent
+     *  first. Pushed by this thread and taken by the main thread, without
+     *  locking. */
+    coll_handoff_t *handoffs;
+};
+
+/** Initialises the state for a collector receive thread, but does not
+ *  start the thread itself.
+ *
+ *  @param worker       The receive thread state to initialise
+ *  @param workerid     A number identifying this receive thread
+ *  @param medcol       The global state for all collectors
+ *  @param main_epoll   The epoll fd used by the main mediator thread
+ *  @param recvfunc     The function to call when a collector is readable
+ *  @param recvdata     The opaque pointer to pass into recvfunc
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int init_collector_worker(coll_recv_worker_t *worker, int workerid,
+        mediator_collector_t *medcol, int main_epoll,
+        coll_recv_func_t recvfunc, void *recvdata);
+
+/** Starts a collector receive thread.
+ *
+ *  @param worker       The receive thread to start
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int start_collector_worker(coll_recv_worker_t *worker);
+
+/** Stops a collector receive thread and waits for it to exit.
+ *
+ *  The thread's collector sockets remain registered with its epoll fd, so
+ *  they can be dropped by the caller afterwards.
+ *
+ *  @param worker       The receive thread to stop
+ */
+void halt_collector_worker(coll_recv_worker_t *worker);
+
+/** Releases all resources used by a (halted) collector receive thread,
+ *  including any records that have not been taken by the main thread.
+ *
+ *  @param worker       The receive thread to destroy
+ */
+void destroy_collector_worker(coll_recv_worker_t *worker);
+
+/** Copies an ETSI record into the set of records that a receive thread
+ *  is preparing for a handover.
+ *
+ *  @param worker       The receive thread that received the record
+ *  @param ho           The handover that should send the record
+ *  @param rec          Pointer to the start of the ETSI record
+ *  @param reclen       The length of the ETSI record, in bytes
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int stage_collector_record(coll_recv_worker_t *worker, handover_t *ho,
+        uint8_t *rec, uint32_t reclen);
+
+/** Passes all of the records staged by a receive thread over to the main
+ *  thread, waking the main thread if required.
+ *
+ *  @param worker       The receive thread that staged the records
+ */
+void publish_collector_records(coll_recv_worker_t *worker);
+
+/** Takes all of the records that a receive thread has published so far.
+ *
+ *  Must only be called by the main thread.
+ *
+ *  @param worker       The receive thread to take the records from
+ *
+ *  @return a list of handoffs, in the order in which they were published.
+ */
+coll_handoff_t *take_collector_handoffs(coll_recv_worker_t *worker);
+
+/** Frees a single handoff that has been taken by the main thread.
+ *
+ *  @param hand         The handoff to free
+ */
+void free_collector_handoff(coll_handoff_t *hand);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -26,25 +26,81 @@
 
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
 
 #include "logger.h"
 #include "util.h"
 #include "netcomms.h"
 #include "etsili_core.h"
 #include "handover.h"
+#include "hosched.h"
 #include "med_epoll.h"
 
-/** Send some buffered ETSI records out via a handover.
+/** Updates the state of a handover after some of its buffered records
+ *  have been successfully transmitted.
  *
- *  If there is a keep alive message pending for this handover, that will
- *  be sent before sending any buffered records.
- *
- *  @param mev              The epoll event for the handover
+ *  @param ho               The handover that has transmitted records
  *
  *  @return -1 is an error occurs, 0 otherwise.
  */
-int xmit_handover(med_epoll_ev_t *mev) {
-	handover_t *ho = (handover_t *)(mev->state);
+static int handover_xmit_complete(handover_t *ho) {
+
+    struct timeval tv;
+
+    /* If we've sent everything that we've got, we can disable the epoll
+     * write event for this handover.
+     */
+    if (get_buffered_amount(&(ho->ho_state->buf)) == 0) {
+        if (disable_handover_writing(ho) < 0) {
+            return -1;
+        }
+    }
+
+    /* Reset the keep alive timer -- this just moves the timer to a new
+     * slot in the timer wheel, but there's no point doing that more than
+     * once per second */
+    gettimeofday(&tv, NULL);
+    if (ho->aliveev && ho->ho_state->katimer_setsec < tv.tv_sec) {
+        if (start_mediator_timer(ho->aliveev, ho->ho_state->kafreq) == -1) {
+            if (ho->disconnect_msg == 0) {
+                logger(LOG_INFO,
+                    "OpenLI Mediator: error while trying to disable xmit for handover %s:%s HI%d -- %s",
+                    ho->ipstr, ho->portstr, ho->handover_type, strerror(errno));
+            }
+            return -1;
+        }
+        ho->ho_state->katimer_setsec = tv.tv_sec;
+    }
+
+    if (ho->aliveev == NULL && ho->disconnect_msg == 1) {
+        /* Keep alives are disabled, so we are going to use a successful
+         * transmit as an indicator that the connection is stable again
+         * and we can stop suppressing logs */
+        logger(LOG_INFO,
+                "OpenLI Mediator: reconnected to handover %s:%s HI%d successfully.",
+                ho->ipstr, ho->portstr, ho->handover_type);
+
+        ho->disconnect_msg = 0;
+    }
+
+    return 0;
+}
+
+/** Sends a handover's pending keep alive, or some of its buffered ETSI
+ *  records, without sending more than a given number of bytes (although
+ *  the limit may be exceeded so as to not split a record).
+ *
+ *  @param ho               The handover to send from
+ *  @param limit            The number of bytes to try to send
+ *  @param sent[out]        Set to the number of bytes that were sent
+ *
+ *  @return -1 if an error occurs, 1 if the handover is able to send more
+ *          straight away, 0 if it has nothing more to send or needs to
+ *          wait for the socket to become writable again.
+ */
+int xmit_handover_limited(handover_t *ho, uint64_t limit, uint64_t *sent) {
 
 	/* We don't lock the handover mutex here, because we're going to be
      * doing this a lot and the mutex is mostly protecting logging-related
@@ -53,11 +109,17 @@ int xmit_handover(med_epoll_ev_t *mev) {
      * everytime we want to send a record to a client.
      */
 	int ret = 0;
-    struct timeval tv;
+    uint8_t *start = NULL;
+    uint64_t attempt;
+
+    *sent = 0;
+    if (ho->outev == NULL) {
+        return 0;
+    }
 
     if (ho->ho_state->pending_ka) {
         /* There's a keep alive to be sent */
-        ret = send(mev->fd, ho->ho_state->pending_ka->encoded,
+        ret = send(ho->outev->fd, ho->ho_state->pending_ka->encoded,
 				ho->ho_state->pending_ka->len, MSG_DONTWAIT);
         if (ret < 0) {
             /* XXX should be worry about EAGAIN here? */
@@ -73,6 +135,7 @@ int xmit_handover(med_epoll_ev_t *mev) {
         if (ret == 0) {
             return -1;
         }
+        *sent = ret;
         if (ret == ho->ho_state->pending_ka->len) {
             /* Sent the whole thing successfully */
             wandder_release_encoded_result(NULL, ho->ho_state->pending_ka);
@@ -112,7 +175,9 @@ int xmit_handover(med_epoll_ev_t *mev) {
                 {
                     return -1;
                 }
+                return 0;
             }
+            return !mediator_timer_running(ho->aliverespev);
 
         } else {
             /* Partial send -- try the rest next time */
@@ -129,60 +194,138 @@ int xmit_handover(med_epoll_ev_t *mev) {
      * be better off to keep those records in our buffer until we're
      * confident that they're able to receive them.
      */
-    if (ho->aliverespev && ho->aliverespev->fd != -1) {
+    if (mediator_timer_running(ho->aliverespev)) {
         return 0;
     }
 
+    attempt = prepare_buffered_transmit(&(ho->ho_state->buf), limit, &start);
+    if (start == NULL) {
+        return 0;
+    }
+    if (attempt == 0) {
+        finish_buffered_transmit(&(ho->ho_state->buf), 0, 0);
+        return 0;
+    }
+
+    ret = send(ho->outev->fd, start, attempt, MSG_DONTWAIT);
+    if ((ret = finish_buffered_transmit(&(ho->ho_state->buf), attempt,
+            ret)) <= 0) {
+        /* either an error or the socket is full */
+        return ret;
+    }
+    *sent = ret;
+
+    if (handover_xmit_complete(ho) < 0) {
+        return -1;
+    }
+    if ((uint64_t)ret < attempt) {
+        /* The socket is full */
+        return 0;
+    }
+    return (get_buffered_amount(&(ho->ho_state->buf)) > 0);
+}
+
+/** Send some buffered ETSI records out via a handover.
+ *
+ *  If there is a keep alive message pending for this handover, that will
+ *  be sent before sending any buffered records.
+ *
+ *  @param mev              The epoll event for the handover
+ *
+ *  @return -1 is an error occurs, 0 otherwise.
+ */
+int xmit_handover(med_epoll_ev_t *mev) {
+	handover_t *ho = (handover_t *)(mev->state);
+    uint64_t sent;
+
     /* Send some of our buffered records, but no more than 1MB at
      * a time -- we need to go back to our epoll loop to handle other events
      * rather than getting stuck trying to send massive amounts of data in
      * one go.
      */
-    if ((ret = transmit_buffered_records(&(ho->ho_state->buf), mev->fd,
-			(1024 * 1024), NULL)) == -1) {
+    if (xmit_handover_limited(ho, (1024 * 1024), &sent) < 0) {
         return -1;
     }
+    return 0;
+}
 
-    if (ret == 0) {
+/** Adds a send of some buffered ETSI records for a handover to a batch
+ *  of io_uring transmissions.
+ *
+ *  Handovers with a pending keep alive are not batched -- the keep alive
+ *  must go out first, so xmit_handover() should be used instead.
+ *
+ *  @param mev              The epoll event for the handover
+ *  @param ur               The io_uring to add the send to
+ *
+ *  @return -1 if the handover should be serviced by xmit_handover(),
+ *          1 if a send was added to the batch, 0 if there was nothing
+ *          to send.
+ */
+int queue_handover_xmit(med_epoll_ev_t *mev, openli_uring_t *ur) {
+	handover_t *ho = (handover_t *)(mev->state);
+    uint8_t *start = NULL;
+    uint64_t len;
+
+    if (ho->ho_state->pending_ka) {
+        return -1;
+    }
+
+    /* Same as xmit_handover(): don't send anything until our keep alive
+     * has been answered */
+    if (mediator_timer_running(ho->aliverespev)) {
         return 0;
     }
 
-    /* If we've sent everything that we've got, we can disable the epoll
-     * write event for this handover.
-     */
-    if (get_buffered_amount(&(ho->ho_state->buf)) == 0) {
-        if (disable_handover_writing(ho) < 0) {
-            return -1;
-        }
+    len = prepare_buffered_transmit(&(ho->ho_state->buf), (1024 * 1024),
+            &start);
+    if (start == NULL) {
+        return 0;
+    }
+    if (len == 0) {
+        finish_buffered_transmit(&(ho->ho_state->buf), 0, 0);
+        return 0;
     }
 
-    /* Reset the keep alive timer */
-    gettimeofday(&tv, NULL);
-    if (ho->aliveev && ho->ho_state->katimer_setsec < tv.tv_sec) {
-        halt_mediator_timer(ho->aliveev);
-        if (start_mediator_timer(ho->aliveev, ho->ho_state->kafreq) == -1) {
-            if (ho->disconnect_msg == 0) {
-                logger(LOG_INFO,
-                    "OpenLI Mediator: error while trying to disable xmit for handover %s:%s HI%d -- %s",
-                    ho->ipstr, ho->portstr, ho->handover_type, strerror(errno));
-            }
-            return -1;
-        }
-        ho->ho_state->katimer_setsec = tv.tv_sec;
+    if (queue_uring_send(ur, mev->fd, start, len, mev) < 0) {
+        return -1;
     }
+    return 1;
+}
 
-    if (ho->aliveev == NULL && ho->disconnect_msg == 1) {
-        /* Keep alives are disabled, so we are going to use a successful
-         * transmit as an indicator that the connection is stable again
-         * and we can stop suppressing logs */
-        logger(LOG_INFO,
-                "OpenLI Mediator: reconnected to handover %s:%s HI%d successfully.",
-                ho->ipstr, ho->portstr, ho->handover_type);
+/** Applies the result of a batched io_uring send to a handover.
+ *
+ *  @param mev              The epoll event for the handover
+ *  @param sent             The completed send for this handover
+ *
+ *  @return -1 is an error occurs, 0 otherwise.
+ */
+int finish_handover_xmit(med_epoll_ev_t *mev, openli_uring_send_t *sent) {
+	handover_t *ho = (handover_t *)(mev->state);
+    int ret;
 
-        ho->disconnect_msg = 0;
+    if (sent->result < 0) {
+        errno = -(sent->result);
+        ret = -1;
+    } else {
+        ret = sent->result;
     }
 
-    return 0;
+    ret = finish_buffered_transmit(&(ho->ho_state->buf), sent->len, ret);
+    if (ret == -1) {
+        if (ho->disconnect_msg == 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while transmitting records for handover %s:%s HI%d -- %s",
+                    ho->ipstr, ho->portstr, ho->handover_type,
+                    strerror(errno));
+        }
+        return -1;
+    }
+
+    if (ret == 0) {
+        return 0;
+    }
+    return handover_xmit_complete(ho);
 }
 
 /** Disconnects a single mediator handover connection to an LEA.
@@ -315,6 +458,84 @@ int disable_handover_writing(handover_t *ho) {
 	return ret;
 }
 
+int handover_can_send_directly(handover_t *ho) {
+
+    if (ho == NULL || ho->outev == NULL || ho->outev->fd == -1) {
+        return 0;
+    }
+    if (ho->ho_state->pending_ka) {
+        return 0;
+    }
+    /* Hold off while a keep alive is unanswered, same as xmit_handover() */
+    if (mediator_timer_running(ho->aliverespev)) {
+        return 0;
+    }
+    if (get_buffered_amount(&(ho->ho_state->buf)) > 0) {
+        return 0;
+    }
+    return 1;
+}
+
+int64_t send_handover_records_directly(handover_t *ho, struct iovec *iov,
+        int iovcnt, uint64_t total) {
+
+    struct msghdr mh;
+    ssize_t ret;
+    uint64_t done;
+    int i;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+
+    ret = sendmsg(ho->outev->fd, &mh, MSG_DONTWAIT);
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                ho->disconnect_msg == 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: error while transmitting to handover %s:%s HI%d -- %s",
+                    ho->ipstr, ho->portstr, ho->handover_type,
+                    strerror(errno));
+        }
+        /* Buffer everything -- if the handover is broken, xmit_handover()
+         * will notice and take care of it */
+        ret = 0;
+    }
+
+    if ((uint64_t)ret == total) {
+        if (handover_xmit_complete(ho) < 0) {
+            return -1;
+        }
+        return ret;
+    }
+
+    /* Save whatever we couldn't send, making sure the buffer knows how
+     * much of the first record has already been sent */
+    done = ret;
+    for (i = 0; i < iovcnt; i++) {
+        if (done >= iov[i].iov_len) {
+            done -= iov[i].iov_len;
+            continue;
+        }
+        if (append_etsipdu_to_buffer(&(ho->ho_state->buf),
+                    (uint8_t *)iov[i].iov_base, iov[i].iov_len,
+                    (uint32_t)done) == 0) {
+            if (ho->disconnect_msg == 0) {
+                logger(LOG_INFO,
+                        "OpenLI Mediator: was unable to enqueue ETSI PDU for handover %s:%s HI%d",
+                        ho->ipstr, ho->portstr, ho->handover_type);
+            }
+            return -1;
+        }
+        done = 0;
+    }
+
+    if (enable_handover_writing(ho) < 0) {
+        return -1;
+    }
+    return ret;
+}
+
 /** Modify a handover's epoll event to check if writing is possible.
  *
  *  If an error occurs, the handover will be disconnected.
@@ -354,6 +575,9 @@ void drop_all_agencies(handover_state_t *state) {
 
 	pthread_mutex_lock(state->agency_mutex);
 
+    /* The scheduler must let go of the handovers before we free them */
+    destroy_handover_sched(state->sched);
+
     while (libtrace_list_get_size(a) > 0) {
         libtrace_list_pop_back(a, &ag);
         /* Disconnect the HI2 and HI3 handovers */
@@ -555,7 +779,7 @@ static void *start_connect_thread(void *params) {
 
 /* Creates a new instance of a handover.
  *
- * @param epoll_fd		The global epoll fd for the mediator.
+ * @param timers		The timer wheel for the handover keep alive timers.
  * @param ipstr         The IP address of the handover recipient (as a string).
  * @param portstr       The port that the handover recipient is listening on
  *                      (as a string).
@@ -567,7 +791,8 @@ static void *start_connect_thread(void *params) {
  *
  * @return a pointer to a new handover instance, or NULL if an error occurs.
  */
-static handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
+static handover_t *create_new_handover(med_timer_wheel_t *timers,
+        char *ipstr, char *portstr,
         int handover_type, uint32_t kafreq, uint32_t kawait) {
 
     handover_t *ho = (handover_t *)malloc(sizeof(handover_t));
@@ -595,14 +820,19 @@ static handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
     ho->ho_state->kafreq = kafreq;
     ho->ho_state->kawait = kawait;
 
+    ho->schedag = NULL;
+    ho->schedready = 0;
+    ho->readysince = 0;
+    memset(&(ho->schedstats), 0, sizeof(ho->schedstats));
+
 	pthread_mutex_init(&(ho->ho_state->ho_mutex), NULL);
 
     /* Keep alive frequency of 0 (or less) will mean that no keep alives are
      * sent (this may necessary for some agencies).
      */
     if (kafreq > 0) {
-		ho->aliveev = create_mediator_timer(epoll_fd, ho, MED_EPOLL_KA_TIMER,
-				0);
+		ho->aliveev = create_mediator_wheel_timer(timers, ho,
+				MED_EPOLL_KA_TIMER, 0);
 		if (ho->aliveev == NULL) {
 			logger(LOG_INFO, "OpenLI Mediator: unable to create keep alive timer for agency %s:%s", ipstr, portstr);
 		}
@@ -615,7 +845,7 @@ static handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
      * for a successful keep alive.
      */
     if (kawait > 0) {
-		ho->aliverespev = create_mediator_timer(epoll_fd, ho,
+		ho->aliverespev = create_mediator_wheel_timer(timers, ho,
 				MED_EPOLL_KA_RESPONSE_TIMER, 0);
 		if (ho->aliverespev == NULL) {
 			logger(LOG_INFO, "OpenLI Mediator: unable to create keep alive response timer for agency %s:%s", ipstr, portstr);
@@ -638,6 +868,30 @@ static handover_t *create_new_handover(int epoll_fd, char *ipstr, char *portstr,
     return ho;
 }
 
+/** Allows the buffer for a handover to spill to disk if it grows too
+ *  large (e.g. because the agency has been unavailable for a long time).
+ *
+ *  @param state        The global handover state for this mediator.
+ *  @param ho           The handover to enable spilling for.
+ *  @param agencyid     The ID of the agency that the handover belongs to.
+ */
+static void enable_handover_spool(handover_state_t *state, handover_t *ho,
+        char *agencyid) {
+
+    char spoolname[1024];
+
+    if (ho == NULL) {
+        return;
+    }
+
+    snprintf(spoolname, 1024, "agency-%s-hi%d", agencyid, ho->handover_type);
+    if (enable_export_buffer_spool(&(ho->ho_state->buf), state->spoolconf,
+                spoolname) < 0) {
+        logger(LOG_INFO, "OpenLI Mediator: records for handover %s:%s HI%d will only be buffered in memory",
+                ho->ipstr, ho->portstr, ho->handover_type);
+    }
+}
+
 /** Creates a new instance of an agency.
  *
  *  @param state        The global handover state for this mediator.
@@ -651,15 +905,23 @@ static void create_new_agency(handover_state_t *state, liagency_t *lea) {
     newagency.awaitingconfirm = 0;
     newagency.disabled = 0;
     newagency.disabled_msg = 0;
+    newagency.congested = 0;
 
     /* Create the HI2 and HI3 handovers */
-    newagency.hi2 = create_new_handover(state->epoll_fd,
+    newagency.hi2 = create_new_handover(state->timers,
 			lea->hi2_ipstr, lea->hi2_portstr,
             HANDOVER_HI2, lea->keepalivefreq, lea->keepalivewait);
-    newagency.hi3 = create_new_handover(state->epoll_fd,
+    newagency.hi3 = create_new_handover(state->timers,
 			lea->hi3_ipstr, lea->hi3_portstr,
             HANDOVER_HI3, lea->keepalivefreq, lea->keepalivewait);
 
+    enable_handover_spool(state, newagency.hi2, lea->agencyid);
+    enable_handover_spool(state, newagency.hi3, lea->agencyid);
+
+    /* If this fails, the agency just won't be scheduled */
+    add_handover_sched_agency(state->sched, lea->agencyid, newagency.hi2,
+            newagency.hi3);
+
     /* This lock protects the agency list that may be being iterated over
      * by the handover connection thread */
     pthread_mutex_lock(state->agency_mutex);
@@ -791,7 +1053,7 @@ static int has_handover_changed(handover_state_t *state,
                         existing->agencyid);
             }
             if (ho->aliverespev == NULL) {
-				ho->aliverespev = create_mediator_timer(state->epoll_fd,
+				ho->aliverespev = create_mediator_wheel_timer(state->timers,
 						ho, MED_EPOLL_KA_RESPONSE_TIMER, 0);
             }
         }
@@ -824,7 +1086,7 @@ static int has_handover_changed(handover_state_t *state,
 
             /* Start a new keep alive timer with the new frequency */
             if (ho->aliveev == NULL) {
-                ho->aliveev = create_mediator_timer(state->epoll_fd, ho,
+                ho->aliveev = create_mediator_wheel_timer(state->timers, ho,
 						MED_EPOLL_KA_TIMER, 0);
 			} else {
                 halt_mediator_timer(ho->aliveev);
@@ -1141,5 +1403,45 @@ mediator_agency_t *lookup_agency(handover_state_t *state, char *id) {
     return NULL;
 }
 
+void update_agency_backpressure(handover_state_t *state, uint64_t threshold) {
+
+    mediator_agency_t *ma;
+    libtrace_list_node_t *n;
+    uint64_t hi2amt, hi3amt;
+    uint8_t congested;
+
+    pthread_mutex_lock(state->agency_mutex);
+    n = state->agencies->head;
+    while (n) {
+        ma = (mediator_agency_t *)(n->data);
+        n = n->next;
+
+        congested = __atomic_load_n(&(ma->congested), __ATOMIC_RELAXED);
+        if (threshold == 0) {
+            if (congested) {
+                __atomic_store_n(&(ma->congested), 0, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+
+        hi2amt = get_buffered_amount(&(ma->hi2->ho_state->buf));
+        hi3amt = get_buffered_amount(&(ma->hi3->ho_state->buf));
+
+        if (!congested && (hi2amt > threshold || hi3amt > threshold)) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: agency %s has %lu KB (HI2) and %lu KB (HI3) waiting to be sent -- asking collectors to hold back its records.",
+                    ma->agencyid, hi2amt / 1024, hi3amt / 1024);
+            __atomic_store_n(&(ma->congested), 1, __ATOMIC_RELAXED);
+        } else if (congested && hi2amt < threshold / 2 &&
+                hi3amt < threshold / 2) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: agency %s has caught up -- collectors may resume sending its records.",
+                    ma->agencyid);
+            __atomic_store_n(&(ma->congested), 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(state->agency_mutex);
+}
+
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
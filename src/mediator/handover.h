@@ -33,6 +33,7 @@
 
 #include "export_buffer.h"
 #include "med_epoll.h"
+#include "openli_uring.h"
 
 enum {
     HANDOVER_HI2 = 2,
@@ -53,6 +54,25 @@ typedef struct per_handover_state {
     pthread_mutex_t ho_mutex;
 } per_handover_state_t;
 
+typedef struct ho_sched_agency ho_sched_agency_t;
+
+/** Transmission statistics for a handover, kept by the handover scheduler */
+typedef struct handover_sched_stats {
+    /** Bytes sent since the statistics were last logged */
+    uint64_t sent;
+
+    /** Total time that the handover has spent waiting to be served after
+     *  becoming writable, in microseconds */
+    uint64_t delaytotal;
+
+    /** The longest time that the handover has waited to be served, in
+     *  microseconds */
+    uint64_t delaymax;
+
+    /** The number of times that the handover has been served */
+    uint32_t delaycount;
+} handover_sched_stats_t;
+
 typedef struct handover {
     char *ipstr;
     char *portstr;
@@ -62,15 +82,31 @@ typedef struct handover {
     med_epoll_ev_t *aliverespev;
     per_handover_state_t *ho_state;
     uint8_t disconnect_msg;
+
+    /** The scheduling state for this handover's agency */
+    ho_sched_agency_t *schedag;
+
+    /** Set to 1 if this handover is writable and waiting to be served by
+     *  the handover scheduler */
+    uint8_t schedready;
+
+    /** When this handover became writable, in microseconds */
+    uint64_t readysince;
+
+    /** Statistics kept by the handover scheduler */
+    handover_sched_stats_t schedstats;
 } handover_t;
 
 typedef struct handover_state {
     uint16_t next_handover_id;
     int epoll_fd;
+    med_timer_wheel_t *timers;
+    struct handover_sched *sched;
     libtrace_list_t *agencies;
     pthread_mutex_t *agency_mutex;
     int halt_flag;
     pthread_t connectthread;
+    openli_spool_config_t *spoolconf;
 } handover_state_t;
 
 typedef struct mediator_agency {
@@ -80,8 +116,27 @@ typedef struct mediator_agency {
     int disabled_msg;
     handover_t *hi2;
     handover_t *hi3;
+
+    /** Set to 1 while this agency's handovers are too backlogged to accept
+     *  more records, so collectors should be asked to hold them back. Read
+     *  by the collector receive threads, so use atomic accesses. */
+    uint8_t congested;
 } mediator_agency_t;
 
+/** Sends a handover's pending keep alive, or some of its buffered ETSI
+ *  records, without sending more than a given number of bytes (although
+ *  the limit may be exceeded so as to not split a record).
+ *
+ *  @param ho               The handover to send from
+ *  @param limit            The number of bytes to try to send
+ *  @param sent[out]        Set to the number of bytes that were sent
+ *
+ *  @return -1 if an error occurs, 1 if the handover is able to send more
+ *          straight away, 0 if it has nothing more to send or needs to
+ *          wait for the socket to become writable again.
+ */
+int xmit_handover_limited(handover_t *ho, uint64_t limit, uint64_t *sent);
+
 /** Send some buffered ETSI records out via a handover.
  *
  *  If there is a keep alive message pending for this handover, that will
@@ -93,6 +148,27 @@ typedef struct mediator_agency {
  */
 int xmit_handover(med_epoll_ev_t *mev);
 
+/** Adds a send of some buffered ETSI records for a handover to a batch
+ *  of io_uring transmissions.
+ *
+ *  @param mev              The epoll event for the handover
+ *  @param ur               The io_uring to add the send to
+ *
+ *  @return -1 if the handover should be serviced by xmit_handover(),
+ *          1 if a send was added to the batch, 0 if there was nothing
+ *          to send.
+ */
+int queue_handover_xmit(med_epoll_ev_t *mev, openli_uring_t *ur);
+
+/** Applies the result of a batched io_uring send to a handover.
+ *
+ *  @param mev              The epoll event for the handover
+ *  @param sent             The completed send for this handover
+ *
+ *  @return -1 is an error occurs, 0 otherwise.
+ */
+int finish_handover_xmit(med_epoll_ev_t *mev, openli_uring_send_t *sent);
+
 /** Disconnects a single mediator handover connection to an LEA.
  *
  *  Typically triggered when an LEA is withdrawn, becomes unresponsive,
@@ -177,6 +253,36 @@ int restart_handover_keepalive(handover_t *ho);
  */
 int receive_handover(med_epoll_ev_t *mev);
 
+/** Checks whether records can be sent straight to a handover's socket,
+ *  rather than being copied into the handover's buffer first.
+ *
+ *  This is only possible if the handover is connected, has nothing
+ *  buffered (in memory or spooled) and is not waiting on a keep alive.
+ *
+ *  @param ho               The handover to check
+ *
+ *  @return 1 if records can be sent directly, 0 otherwise.
+ */
+int handover_can_send_directly(handover_t *ho);
+
+/** Sends a set of ETSI records straight to a handover's socket. Any
+ *  records (or parts of records) that cannot be sent immediately are
+ *  added to the handover's buffer instead.
+ *
+ *  Only use this if handover_can_send_directly() has returned 1 and nothing
+ *  has been added to the handover's buffer since.
+ *
+ *  @param ho               The handover to send the records to
+ *  @param iov              The records to send, one per iovec
+ *  @param iovcnt           The number of records to send
+ *  @param total            The total length of the records, in bytes
+ *
+ *  @return -1 if an error occurs, otherwise the number of bytes that were
+ *          sent directly.
+ */
+int64_t send_handover_records_directly(handover_t *ho, struct iovec *iov,
+        int iovcnt, uint64_t total);
+
 /** Finds an agency that matches a given ID in the agency list
  *
  *  @param state        The global handover state for the mediator
@@ -187,6 +293,20 @@ int receive_handover(med_epoll_ev_t *mev);
  */
 mediator_agency_t *lookup_agency(handover_state_t *state, char *id);
 
+/** Checks how much each agency has buffered for its handovers and updates
+ *  whether the agency is congested, i.e. whether collectors should be
+ *  asked to stop sending records for its LIIDs.
+ *
+ *  An agency becomes congested once either of its handovers has more than
+ *  the threshold buffered, and stops being congested once both have
+ *  drained below half of the threshold.
+ *
+ *  @param state        The global handover state for the mediator
+ *  @param threshold    The backlog (in bytes) at which an agency becomes
+ *                      congested, or zero if backpressure is disabled
+ */
+void update_agency_backpressure(handover_state_t *state, uint64_t threshold);
+
 #endif
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,377 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+#include "hosched.h"
+
+/** Returns the current time in microseconds, for measuring how long
+ *  handovers wait to be served */
+static inline uint64_t sched_time_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/** Looks up the configured weight for an agency.
+ *
+ *  @param sched        The scheduler
+ *  @param agencyid     The ID of the agency
+ *
+ *  @return the weight for the agency, or 1 if no weight is configured.
+ */
+static uint32_t lookup_sched_weight(handover_sched_t *sched, char *agencyid) {
+    ho_sched_weight_t *w;
+
+    HASH_FIND(hh, sched->weights, agencyid, strlen(agencyid), w);
+    if (w == NULL) {
+        return 1;
+    }
+    return w->weight;
+}
+
+void init_handover_sched(handover_sched_t *sched) {
+    memset(sched, 0, sizeof(handover_sched_t));
+    sched->quantum = DEFAULT_HANDOVER_QUANTUM;
+}
+
+void clear_handover_sched_weights(handover_sched_t *sched) {
+    ho_sched_weight_t *w, *tmp;
+
+    HASH_ITER(hh, sched->weights, w, tmp) {
+        HASH_DELETE(hh, sched->weights, w);
+        free(w->agencyid);
+        free(w);
+    }
+}
+
+void destroy_handover_sched(handover_sched_t *sched) {
+    ho_sched_agency_t *ag, *tmp;
+
+    ag = sched->all;
+    while (ag) {
+        tmp = ag;
+        ag = ag->allnext;
+        tmp->hi2->schedag = NULL;
+        tmp->hi3->schedag = NULL;
+        free(tmp);
+    }
+    sched->all = NULL;
+    sched->head = NULL;
+    sched->tail = NULL;
+}
+
+void add_handover_sched_weight(handover_sched_t *sched, char *agencyid,
+        uint32_t weight) {
+    ho_sched_weight_t *w;
+
+    HASH_FIND(hh, sched->weights, agencyid, strlen(agencyid), w);
+    if (w) {
+        free(agencyid);
+        w->weight = weight;
+        return;
+    }
+
+    w = (ho_sched_weight_t *)malloc(sizeof(ho_sched_weight_t));
+    w->agencyid = agencyid;
+    w->weight = weight;
+    HASH_ADD_KEYPTR(hh, sched->weights, w->agencyid, strlen(w->agencyid), w);
+}
+
+int update_handover_sched_config(handover_sched_t *sched,
+        handover_sched_t *newsched) {
+
+    ho_sched_agency_t *ag;
+    uint32_t weight;
+    int changed = 0;
+
+    if (sched->enabled != newsched->enabled) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: handover scheduling is now %s.",
+                newsched->enabled ? "enabled" : "disabled");
+        sched->enabled = newsched->enabled;
+        changed = 1;
+    }
+
+    if (sched->quantum != newsched->quantum) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: handover scheduling quantum is now %u bytes.",
+                newsched->quantum);
+        sched->quantum = newsched->quantum;
+        changed = 1;
+    }
+
+    clear_handover_sched_weights(sched);
+    sched->weights = newsched->weights;
+    newsched->weights = NULL;
+
+    for (ag = sched->all; ag != NULL; ag = ag->allnext) {
+        weight = lookup_sched_weight(sched, ag->agencyid);
+        if (weight != ag->weight) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: scheduling weight for agency %s is now %u.",
+                    ag->agencyid, weight);
+            ag->weight = weight;
+            changed = 1;
+        }
+    }
+
+    if (!sched->enabled) {
+        /* Anything still waiting will be written by xmit_handover() the
+         * next time that epoll tells us that the handover is writable */
+        while (sched->head) {
+            ag = sched->head;
+            sched->head = ag->next;
+            ag->next = NULL;
+            ag->queued = 0;
+            ag->deficit = 0;
+            ag->hi2->schedready = 0;
+            ag->hi3->schedready = 0;
+        }
+        sched->tail = NULL;
+    }
+    return changed;
+}
+
+int add_handover_sched_agency(handover_sched_t *sched, char *agencyid,
+        handover_t *hi2, handover_t *hi3) {
+
+    ho_sched_agency_t *ag;
+
+    if (hi2 == NULL || hi3 == NULL) {
+        return -1;
+    }
+
+    ag = (ho_sched_agency_t *)calloc(1, sizeof(ho_sched_agency_t));
+    if (ag == NULL) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: OOM while creating scheduling state for agency %s",
+                agencyid);
+        return -1;
+    }
+
+    ag->agencyid = agencyid;
+    ag->hi2 = hi2;
+    ag->hi3 = hi3;
+    ag->weight = lookup_sched_weight(sched, agencyid);
+
+    hi2->schedag = ag;
+    hi3->schedag = ag;
+
+    ag->allnext = sched->all;
+    sched->all = ag;
+    return 0;
+}
+
+void schedule_handover_xmit(handover_sched_t *sched, handover_t *ho) {
+
+    ho_sched_agency_t *ag = ho->schedag;
+
+    if (ho->schedready) {
+        return;
+    }
+    ho->schedready = 1;
+    ho->readysince = sched_time_usec();
+
+    if (ag->queued) {
+        return;
+    }
+
+    ag->queued = 1;
+    ag->next = NULL;
+    if (sched->tail) {
+        sched->tail->next = ag;
+    } else {
+        sched->head = ag;
+    }
+    sched->tail = ag;
+}
+
+/** Sends from a single handover until either its agency has used up its
+ *  deficit or the handover is unable to send any more.
+ *
+ *  @param ag           The agency that the handover belongs to
+ *  @param ho           The handover to send from
+ *  @param now          The current time, in microseconds
+ */
+static void serve_sched_handover(ho_sched_agency_t *ag, handover_t *ho,
+        uint64_t now) {
+
+    uint64_t sent, delay;
+    int ret;
+
+    if (ho->outev == NULL) {
+        /* disconnected since it became writable */
+        ho->schedready = 0;
+        return;
+    }
+
+    if (ag->deficit <= 0) {
+        /* Still paying off a record that overran an earlier deficit */
+        return;
+    }
+
+    delay = (now > ho->readysince) ? now - ho->readysince : 0;
+    ho->schedstats.delaytotal += delay;
+    ho->schedstats.delaycount ++;
+    if (delay > ho->schedstats.delaymax) {
+        ho->schedstats.delaymax = delay;
+    }
+
+    while (ag->deficit > 0) {
+        ret = xmit_handover_limited(ho, (uint64_t)ag->deficit, &sent);
+        ag->deficit -= (int64_t)sent;
+        ho->schedstats.sent += sent;
+
+        if (ret == -1) {
+            ho->schedready = 0;
+            disconnect_handover(ho);
+            return;
+        }
+        if (ret == 0) {
+            /* epoll will let us know when there is room to send again */
+            ho->schedready = 0;
+            return;
+        }
+    }
+
+    /* Still more to send, so this handover will have to wait for the
+     * next round */
+    ho->readysince = now;
+}
+
+void run_handover_sched(handover_sched_t *sched) {
+
+    ho_sched_agency_t *ag, *last;
+    uint64_t now;
+
+    if (sched->head == NULL) {
+        return;
+    }
+
+    now = sched_time_usec();
+
+    /* Only serve the agencies that were waiting when the round began --
+     * anything that is put back on the list waits for the next round */
+    last = sched->tail;
+    do {
+        ag = sched->head;
+        sched->head = ag->next;
+        if (sched->head == NULL) {
+            sched->tail = NULL;
+        }
+        ag->next = NULL;
+
+        ag->deficit += ((int64_t)sched->quantum) * ag->weight;
+
+        /* HI2 always goes first -- HI3 only gets to use whatever is left
+         * of the deficit once HI2 has nothing more to send */
+        if (ag->hi2->schedready) {
+            serve_sched_handover(ag, ag->hi2, now);
+        }
+        if (!ag->hi2->schedready && ag->hi3->schedready) {
+            serve_sched_handover(ag, ag->hi3, now);
+        }
+
+        if (!ag->hi2->schedready && !ag->hi3->schedready) {
+            /* An idle agency can't save up its deficit */
+            ag->queued = 0;
+            ag->deficit = 0;
+            continue;
+        }
+
+        if (sched->tail) {
+            sched->tail->next = ag;
+        } else {
+            sched->head = ag;
+        }
+        sched->tail = ag;
+    } while (ag != last && sched->head != NULL);
+}
+
+/** Logs the scheduling statistics for a single handover, then resets them.
+ *
+ *  @param ho           The handover to log the statistics for
+ *  @param agencyid     The ID of the agency that the handover belongs to
+ *  @param elapsed      The number of seconds since the statistics were
+ *                      last logged
+ */
+static void report_sched_handover(handover_t *ho, char *agencyid,
+        uint64_t elapsed) {
+
+    handover_sched_stats_t *st = &(ho->schedstats);
+    uint64_t backlog = get_buffered_amount(&(ho->ho_state->buf));
+
+    if (st->sent == 0 && backlog == 0) {
+        return;
+    }
+
+    logger(LOG_INFO,
+            "OpenLI Mediator: agency %s HI%d -- backlog %" PRIu64 " KB, sent %" PRIu64 " KB/s, scheduling delay avg %" PRIu64 " us max %" PRIu64 " us",
+            agencyid, ho->handover_type, backlog / 1024,
+            (st->sent / 1024) / elapsed,
+            st->delaycount ? st->delaytotal / st->delaycount : 0,
+            st->delaymax);
+
+    memset(st, 0, sizeof(handover_sched_stats_t));
+}
+
+void report_handover_sched_stats(handover_sched_t *sched) {
+
+    ho_sched_agency_t *ag;
+    struct timespec ts;
+    uint64_t now;
+
+    if (!sched->enabled) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec;
+
+    if (sched->nextreport == 0) {
+        sched->nextreport = now + HOSCHED_REPORT_INTERVAL;
+        return;
+    }
+    if (now < sched->nextreport) {
+        return;
+    }
+
+    for (ag = sched->all; ag != NULL; ag = ag->allnext) {
+        report_sched_handover(ag->hi2, ag->agencyid,
+                HOSCHED_REPORT_INTERVAL + (now - sched->nextreport));
+        report_sched_handover(ag->hi3, ag->agencyid,
+                HOSCHED_REPORT_INTERVAL + (now - sched->nextreport));
+    }
+    sched->nextreport = now + HOSCHED_REPORT_INTERVAL;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,189 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_MEDIATOR_HOSCHED_H_
+#define OPENLI_MEDIATOR_HOSCHED_H_
+
+#include <inttypes.h>
+#include <uthash.h>
+#include "handover.h"
+
+/** The default number of bytes that each agency may send per scheduling
+ *  round, before weighting */
+#define DEFAULT_HANDOVER_QUANTUM (64 * 1024)
+
+/** How often to log the handover scheduling statistics, in seconds */
+#define HOSCHED_REPORT_INTERVAL 300
+
+/** A configured scheduling weight for an agency */
+typedef struct ho_sched_weight {
+    /** The ID of the agency */
+    char *agencyid;
+
+    /** The weight to apply to the agency's quantum */
+    uint32_t weight;
+
+    UT_hash_handle hh;
+} ho_sched_weight_t;
+
+/** Scheduling state for an agency, shared by its HI2 and HI3 handovers */
+struct ho_sched_agency {
+    /** The ID of the agency (owned by the agency itself) */
+    char *agencyid;
+
+    /** The handovers for this agency */
+    handover_t *hi2;
+    handover_t *hi3;
+
+    /** The weight to apply to this agency's quantum */
+    uint32_t weight;
+
+    /** The number of bytes that this agency may still send -- may go
+     *  negative, as sends are only split at record boundaries */
+    int64_t deficit;
+
+    /** Set to 1 if this agency is in the list of agencies waiting to send */
+    uint8_t queued;
+
+    /** The next agency in the list of agencies waiting to send */
+    ho_sched_agency_t *next;
+
+    /** The next agency in the list of all agencies */
+    ho_sched_agency_t *allnext;
+};
+
+/** State for scheduling transmissions across all of the handovers, using
+ *  deficit round robin.
+ *
+ *  Handovers that become writable are queued rather than being written to
+ *  straight away. Each scheduling round, every queued agency is given its
+ *  weighted quantum of bytes to send. An agency's HI2 handover is always
+ *  served before its HI3 handover.
+ */
+typedef struct handover_sched {
+    /** Set to 1 if handover transmissions should be scheduled */
+    uint8_t enabled;
+
+    /** The number of bytes that each agency may send per round, before
+     *  weighting */
+    uint32_t quantum;
+
+    /** The configured weights for each agency -- agencies without an
+     *  entry have a weight of 1 */
+    ho_sched_weight_t *weights;
+
+    /** The agencies that have a handover waiting to send */
+    ho_sched_agency_t *head;
+    ho_sched_agency_t *tail;
+
+    /** All of the agencies known to the scheduler */
+    ho_sched_agency_t *all;
+
+    /** The time at which the statistics should next be logged */
+    uint64_t nextreport;
+} handover_sched_t;
+
+/** Initialises the scheduler configuration for a mediator.
+ *
+ *  @param sched        The scheduler to initialise
+ */
+void init_handover_sched(handover_sched_t *sched);
+
+/** Frees the configured agency weights for a scheduler.
+ *
+ *  @param sched        The scheduler to free the weights for
+ */
+void clear_handover_sched_weights(handover_sched_t *sched);
+
+/** Releases the scheduling state for all agencies. Must be called before
+ *  the handovers themselves are freed.
+ *
+ *  @param sched        The scheduler to destroy
+ */
+void destroy_handover_sched(handover_sched_t *sched);
+
+/** Adds (or updates) the configured weight for an agency.
+ *
+ *  @param sched        The scheduler to add the weight to
+ *  @param agencyid     The ID of the agency -- the scheduler takes ownership
+ *                      of this string
+ *  @param weight       The weight for the agency
+ */
+void add_handover_sched_weight(handover_sched_t *sched, char *agencyid,
+        uint32_t weight);
+
+/** Replaces the configuration of a running scheduler with that of another,
+ *  e.g. following a config reload. The weights are moved from the new
+ *  scheduler into the running one.
+ *
+ *  @param sched        The running scheduler
+ *  @param newsched     The scheduler holding the new configuration
+ *
+ *  @return 1 if the configuration changed, 0 otherwise.
+ */
+int update_handover_sched_config(handover_sched_t *sched,
+        handover_sched_t *newsched);
+
+/** Creates the scheduling state for a newly announced agency.
+ *
+ *  @param sched        The scheduler
+ *  @param agencyid     The ID of the agency
+ *  @param hi2          The HI2 handover for the agency
+ *  @param hi3          The HI3 handover for the agency
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int add_handover_sched_agency(handover_sched_t *sched, char *agencyid,
+        handover_t *hi2, handover_t *hi3);
+
+/** Marks a handover as being able to send, so that it will be served
+ *  during the next scheduling round.
+ *
+ *  Only call this for handovers that have scheduling state, i.e. where
+ *  ho->schedag is not NULL.
+ *
+ *  @param sched        The scheduler
+ *  @param ho           The handover that is now writable
+ */
+void schedule_handover_xmit(handover_sched_t *sched, handover_t *ho);
+
+/** Runs a single round of the scheduler, giving each waiting agency the
+ *  chance to send its quantum. Handovers that fail while sending are
+ *  disconnected.
+ *
+ *  @param sched        The scheduler
+ */
+void run_handover_sched(handover_sched_t *sched);
+
+/** Logs the backlog, send rate and scheduling delay for each handover,
+ *  if enough time has passed since the statistics were last logged.
+ *
+ *  @param sched        The scheduler
+ */
+void report_handover_sched_stats(handover_sched_t *sched);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -86,8 +86,8 @@ int add_liid_agency_mapping(liid_map_t *map, char *liidstr,
         m = (liid_map_entry_t *)(*jval);
 
         if (m->ceasetimer) {
-            /* was scheduled to be ceased, so halt the timer */
-            halt_mediator_timer(m->ceasetimer);
+            /* was scheduled to be ceased, so cancel the timer */
+            destroy_mediator_timer(m->ceasetimer);
         }
 
         if (m->agency == NULL && agency != NULL) {
@@ -143,18 +143,23 @@ int add_liid_agency_mapping(liid_map_t *map, char *liidstr,
  */
 int add_missing_liid(liid_map_t *map, char *liidstr) {
     PWord_t jval;
+    Word_t seen;
 
+    pthread_mutex_lock(&(map->missing_mutex));
     JSLI(jval, map->missing_liids, (unsigned char *)liidstr);
     if (jval == NULL) {
+        pthread_mutex_unlock(&(map->missing_mutex));
         logger(LOG_INFO, "OpenLI Mediator: OOM when allocating memory for missing LIID.");
         return -1;
     }
 
-    if ((*jval) == 0) {
+    seen = *jval;
+    (*jval) = 1;
+    pthread_mutex_unlock(&(map->missing_mutex));
+
+    if (seen == 0) {
         logger(LOG_INFO, "OpenLI Mediator: was unable to find LIID %s in its set of mappings.", liidstr);
     }
-
-    (*jval) = 1;
     return 0;
 }
 
@@ -28,6 +28,7 @@
 #define OPENLI_LIID_AGENCY_MAPPING_H_
 
 #include <Judy.h>
+#include <pthread.h>
 #include "med_epoll.h"
 #include "handover.h"
 
@@ -43,7 +44,7 @@ struct liidmapping {
     /** The agency that should receive this LIID */
     mediator_agency_t *agency;
 
-    /** The epoll timer event for a scheduled removal of this mapping */
+    /** The (timer wheel) timer for a scheduled removal of this mapping */
     med_epoll_ev_t *ceasetimer;
 };
 
@@ -53,6 +54,13 @@ typedef struct liid_map {
 	Pvoid_t liid_array;
     /** A set of LIIDs which have no known corresponding agency (yet) */
 	Pvoid_t missing_liids;
+    /** Protects the missing LIID set, which may be updated by more than
+     *  one collector receive thread at a time */
+    pthread_mutex_t missing_mutex;
+    /** Incremented whenever the map or the agencies may have changed, so
+     *  that any LIID lookups cached by the collector connections can be
+     *  recognised as stale */
+    uint32_t generation;
 } liid_map_t;
 
 /** Finds an LIID in an LIID map and returns its corresponding agency
@@ -26,10 +26,264 @@
 
 #include <sys/epoll.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "med_epoll.h"
 #include "util.h"
 
+#define WHEEL_SLOT_MASK (MED_TIMER_WHEEL_SLOTS - 1)
+
+/** The number of ticks that the whole wheel can cover */
+#define WHEEL_SPAN (1ULL << (MED_TIMER_WHEEL_BITS * MED_TIMER_WHEEL_LEVELS))
+
+/** Returns the current time, in seconds, for the purposes of the timer
+ *  wheel. */
+static inline uint64_t wheel_time_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+/** Adds a timer to the front of a wheel slot (or the expired list) */
+static inline void link_wheel_timer(med_epoll_ev_t **head,
+        med_epoll_ev_t *timerev) {
+
+    timerev->wnext = *head;
+    if (*head) {
+        (*head)->wpprev = &(timerev->wnext);
+    }
+    *head = timerev;
+    timerev->wpprev = head;
+}
+
+/** Removes a timer from whichever wheel slot (or expired list) it is in */
+static inline void unlink_wheel_timer(med_epoll_ev_t *timerev) {
+
+    *(timerev->wpprev) = timerev->wnext;
+    if (timerev->wnext) {
+        timerev->wnext->wpprev = timerev->wpprev;
+    }
+    timerev->wnext = NULL;
+    timerev->wpprev = NULL;
+}
+
+/** Files a timer into the appropriate wheel slot, based on how far into
+ *  the future it is due to expire.
+ *
+ *  Must be called with the wheel mutex held.
+ *
+ *  @param wheel        The timer wheel
+ *  @param timerev      The timer to file, with its expiry already set
+ */
+static void file_wheel_timer(med_timer_wheel_t *wheel,
+        med_epoll_ev_t *timerev) {
+
+    uint64_t when = timerev->expiry;
+    uint64_t delta, offset;
+    int level, shift;
+
+    if (when < wheel->nexttick) {
+        when = wheel->nexttick;
+    }
+    delta = when - wheel->nexttick;
+
+    if (delta >= WHEEL_SPAN) {
+        /* Too far away for the wheel to cover -- park it in the furthest
+         * slot that we can, and it will be re-filed when we get there */
+        when = wheel->nexttick + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    for (level = 0; level < MED_TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (MED_TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    /* Work out the slot relative to the slot for the current tick. At the
+     * upper levels, the current slot has already been cascaded for this
+     * rotation, so a timer must always go into a later slot -- otherwise
+     * it would not be looked at again until the wheel came back around.
+     * Filing a timer too early is harmless, as it will be re-filed when
+     * its slot is cascaded.
+     */
+    shift = MED_TIMER_WHEEL_BITS * level;
+    offset = (when >> shift) - (wheel->nexttick >> shift);
+    if (level > 0 && offset == 0) {
+        offset = 1;
+    }
+
+    link_wheel_timer(&(wheel->slots[level][
+            ((wheel->nexttick >> shift) + offset) & WHEEL_SLOT_MASK]),
+            timerev);
+}
+
+/** Re-files all of the timers in a slot from one of the upper levels of
+ *  the wheel, now that they are close enough to go into a lower level.
+ *
+ *  Must be called with the wheel mutex held.
+ *
+ *  @param wheel        The timer wheel
+ *  @param level        The level of the slot to re-file
+ *  @param slot         The index of the slot to re-file
+ */
+static void cascade_wheel_slot(med_timer_wheel_t *wheel, int level,
+        int slot) {
+
+    med_epoll_ev_t *timerev = wheel->slots[level][slot];
+    med_epoll_ev_t *next;
+
+    wheel->slots[level][slot] = NULL;
+    while (timerev) {
+        next = timerev->wnext;
+        file_wheel_timer(wheel, timerev);
+        timerev = next;
+    }
+}
+
+/** Starts a timer that runs on a timer wheel, replacing any existing
+ *  expiry time if the timer was already running.
+ *
+ *  @param timerev      The timer to start
+ *  @param timeoutval   The number of seconds to wait before triggering the
+ *                      timer.
+ */
+static void start_wheel_timer(med_epoll_ev_t *timerev, int timeoutval) {
+
+    med_timer_wheel_t *wheel = timerev->wheel;
+
+    pthread_mutex_lock(&(wheel->mutex));
+    if (timerev->wpprev) {
+        unlink_wheel_timer(timerev);
+        wheel->running --;
+    }
+    timerev->expiry = wheel_time_now() + timeoutval;
+    file_wheel_timer(wheel, timerev);
+    wheel->running ++;
+    pthread_mutex_unlock(&(wheel->mutex));
+}
+
+/** Halts a timer that runs on a timer wheel.
+ *
+ *  @param timerev      The timer to halt
+ */
+static void halt_wheel_timer(med_epoll_ev_t *timerev) {
+
+    med_timer_wheel_t *wheel = timerev->wheel;
+
+    pthread_mutex_lock(&(wheel->mutex));
+    if (timerev->wpprev) {
+        unlink_wheel_timer(timerev);
+        wheel->running --;
+    }
+    pthread_mutex_unlock(&(wheel->mutex));
+}
+
+/** Initialises an empty timer wheel.
+ *
+ *  @param wheel        The timer wheel to initialise.
+ */
+void init_mediator_timer_wheel(med_timer_wheel_t *wheel) {
+
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->expired = NULL;
+    wheel->running = 0;
+    wheel->nexttick = wheel_time_now();
+    pthread_mutex_init(&(wheel->mutex), NULL);
+}
+
+/** Releases the resources used by a timer wheel. Any timers that are
+ *  still on the wheel are halted, but not freed.
+ *
+ *  @param wheel        The timer wheel to destroy.
+ */
+void destroy_mediator_timer_wheel(med_timer_wheel_t *wheel) {
+
+    int level, slot;
+
+    pthread_mutex_lock(&(wheel->mutex));
+    for (level = 0; level < MED_TIMER_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < MED_TIMER_WHEEL_SLOTS; slot++) {
+            while (wheel->slots[level][slot]) {
+                unlink_wheel_timer(wheel->slots[level][slot]);
+            }
+        }
+    }
+    while (wheel->expired) {
+        unlink_wheel_timer(wheel->expired);
+    }
+    wheel->running = 0;
+    pthread_mutex_unlock(&(wheel->mutex));
+    pthread_mutex_destroy(&(wheel->mutex));
+}
+
+/** Advances a timer wheel to the current time, triggering any timers that
+ *  have expired along the way.
+ *
+ *  @param wheel        The timer wheel to advance.
+ *  @param callback     The function to call for each expired timer.
+ *  @param data         An opaque pointer to pass into the callback.
+ *
+ *  @return -1 if any callback returned -1, 0 otherwise.
+ */
+int advance_mediator_timer_wheel(med_timer_wheel_t *wheel,
+        med_timer_func_t callback, void *data) {
+
+    uint64_t now = wheel_time_now();
+    uint64_t tick;
+    med_epoll_ev_t **slot;
+    med_epoll_ev_t *timerev;
+    int level, ret = 0;
+
+    pthread_mutex_lock(&(wheel->mutex));
+
+    if (wheel->running == 0 && wheel->nexttick <= now) {
+        /* Nothing can expire, so jump straight to the present */
+        wheel->nexttick = now + 1;
+    }
+
+    while (wheel->nexttick <= now) {
+        tick = wheel->nexttick;
+
+        /* Bring down any timers from the upper levels that are now due
+         * within the span of the level below, starting from the top */
+        for (level = MED_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1ULL << (MED_TIMER_WHEEL_BITS * level)) - 1))
+                    == 0) {
+                cascade_wheel_slot(wheel, level,
+                        (tick >> (MED_TIMER_WHEEL_BITS * level)) &
+                        WHEEL_SLOT_MASK);
+            }
+        }
+
+        slot = &(wheel->slots[0][tick & WHEEL_SLOT_MASK]);
+        while (*slot) {
+            timerev = *slot;
+            unlink_wheel_timer(timerev);
+            link_wheel_timer(&(wheel->expired), timerev);
+        }
+        wheel->nexttick ++;
+    }
+
+    /* Drop the mutex while triggering each timer, as the callbacks are
+     * likely to start or halt other timers */
+    while ((timerev = wheel->expired) != NULL) {
+        unlink_wheel_timer(timerev);
+        wheel->running --;
+        pthread_mutex_unlock(&(wheel->mutex));
+
+        if (callback(data, timerev) < 0) {
+            ret = -1;
+        }
+        pthread_mutex_lock(&(wheel->mutex));
+    }
+
+    pthread_mutex_unlock(&(wheel->mutex));
+    return ret;
+}
+
 /** Starts an existing timer and adds it to the global epoll event set.
  *
  *  Examples of timers that would use this function:
@@ -56,6 +310,11 @@ int start_mediator_timer(med_epoll_ev_t *timerev, int timeoutval) {
         return 0;
     }
 
+    if (timerev->wheel) {
+        start_wheel_timer(timerev, timeoutval);
+        return 0;
+    }
+
     if ((sock = epoll_add_timer(timerev->epoll_fd, timeoutval,
             timerev)) == -1) {
         return -1;
@@ -86,6 +345,11 @@ int halt_mediator_timer(med_epoll_ev_t *timerev) {
         return 0;
     }
 
+    if (timerev->wheel) {
+        halt_wheel_timer(timerev);
+        return 0;
+    }
+
     if (epoll_ctl(timerev->epoll_fd, EPOLL_CTL_DEL, timerev->fd, &ev) == -1) {
         return -1;
     }
@@ -107,12 +371,63 @@ void destroy_mediator_timer(med_epoll_ev_t *timerev) {
 		return;
 	}
 
-	if (timerev->fd != -1) {
+	if (mediator_timer_running(timerev)) {
 		halt_mediator_timer(timerev);
 	}
 	free(timerev);
 }
 
+/** Checks whether a timer is currently running.
+ *
+ *  @param timerev      The mediator epoll event for the timer.
+ *
+ *  @return 1 if the timer is running, 0 otherwise.
+ */
+int mediator_timer_running(med_epoll_ev_t *timerev) {
+
+    if (timerev == NULL) {
+        return 0;
+    }
+    if (timerev->wheel) {
+        return (timerev->wpprev != NULL);
+    }
+    return (timerev->fd != -1);
+}
+
+/** Creates a timer that runs on a timer wheel, rather than using its own
+ *  timerfd.
+ *
+ *  @param wheel            The timer wheel to run the timer on
+ *  @param state            A pointer to the state to save with the timer
+ *  @param timertype        The type of timer to create, e.g. MED_EPOLL_KA_TIMER
+ *  @param duration         The duration of the timer, in seconds. If zero,
+ *                          the timer is created but not started.
+ *
+ *  @return NULL if an error occurs, otherwise a pointer to a new mediator
+ *          epoll event.
+ */
+med_epoll_ev_t *create_mediator_wheel_timer(med_timer_wheel_t *wheel,
+        void *state, int timertype, int duration) {
+
+    med_epoll_ev_t *newtimer = NULL;
+
+    newtimer = (med_epoll_ev_t *)calloc(1, sizeof(med_epoll_ev_t));
+    if (!newtimer) {
+        return NULL;
+    }
+
+    newtimer->fd = -1;
+    newtimer->fdtype = timertype;
+    newtimer->state = state;
+    newtimer->epoll_fd = -1;
+    newtimer->wheel = wheel;
+
+    if (duration > 0) {
+        start_wheel_timer(newtimer, duration);
+    }
+    return newtimer;
+}
+
 /** Creates an epoll event for a timer. If the timer is given a non-zero
  *  duration, the timer is also started.
  *
@@ -131,7 +446,7 @@ med_epoll_ev_t *create_mediator_timer(int epoll_fd, void *state,
 	med_epoll_ev_t *newtimer = NULL;
 	int sock = -1;
 
-	newtimer = (med_epoll_ev_t *)malloc(sizeof(med_epoll_ev_t));
+	newtimer = (med_epoll_ev_t *)calloc(1, sizeof(med_epoll_ev_t));
 	if (!newtimer) {
 		return NULL;
 	}
@@ -152,26 +467,27 @@ med_epoll_ev_t *create_mediator_timer(int epoll_fd, void *state,
 	return newtimer;
 }
 
-/** Creates an epoll event for an active file descriptor.
+/** Creates an epoll event for a file descriptor, without adding the
+ *  file descriptor to the epoll set yet.
  *
- *  @param epoll_fd			The global epoll fd being used by the mediator.
- *  @param state			A pointer to the state to save with the timer.
+ *  This allows the caller to finish setting up any state that refers to
+ *  the event before another thread can be woken by it.
+ *
+ *  @param epoll_fd			The epoll fd that the event will be added to.
+ *  @param state			A pointer to the state to save with the event.
  *  @param fdtype			The purpose of the file descriptor, e.g.
  * 							MED_EPOLL_PROVISIONER.
  *	@param fd				The file descriptor to create an event for.
- *  @param events			The epoll events to apply to the fd, as a bitmask.
- *							An example would be EPOLLIN | EPOLLOUT.
  *
  *  @return NULL if an error occurs, otherwise a pointer to a new mediator
  *  		epoll event.
  */
-med_epoll_ev_t *create_mediator_fdevent(int epoll_fd, void *state,
-		int fdtype, int fd, uint32_t events) {
+med_epoll_ev_t *prepare_mediator_fdevent(int epoll_fd, void *state,
+		int fdtype, int fd) {
 
 	med_epoll_ev_t *newev = NULL;
-	struct epoll_event epollev;
 
-	newev = (med_epoll_ev_t *)malloc(sizeof(med_epoll_ev_t));
+	newev = (med_epoll_ev_t *)calloc(1, sizeof(med_epoll_ev_t));
 	if (!newev) {
 		return NULL;
 	}
@@ -180,11 +496,53 @@ med_epoll_ev_t *create_mediator_fdevent(int epoll_fd, void *state,
 	newev->fdtype = fdtype;
 	newev->state = state;
 	newev->epoll_fd = epoll_fd;
+	return newev;
+}
+
+/** Adds the file descriptor for a prepared epoll event to its epoll set.
+ *
+ *  @param newev			The epoll event to add.
+ *  @param events			The epoll events to apply to the fd, as a bitmask.
+ *							An example would be EPOLLIN | EPOLLOUT.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int register_mediator_fdevent(med_epoll_ev_t *newev, uint32_t events) {
+	struct epoll_event epollev;
 
 	epollev.data.ptr = newev;
 	epollev.events = events;
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &epollev) == -1) {
+	if (epoll_ctl(newev->epoll_fd, EPOLL_CTL_ADD, newev->fd, &epollev) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/** Creates an epoll event for an active file descriptor.
+ *
+ *  @param epoll_fd			The global epoll fd being used by the mediator.
+ *  @param state			A pointer to the state to save with the timer.
+ *  @param fdtype			The purpose of the file descriptor, e.g.
+ * 							MED_EPOLL_PROVISIONER.
+ *	@param fd				The file descriptor to create an event for.
+ *  @param events			The epoll events to apply to the fd, as a bitmask.
+ *							An example would be EPOLLIN | EPOLLOUT.
+ *
+ *  @return NULL if an error occurs, otherwise a pointer to a new mediator
+ *  		epoll event.
+ */
+med_epoll_ev_t *create_mediator_fdevent(int epoll_fd, void *state,
+		int fdtype, int fd, uint32_t events) {
+
+	med_epoll_ev_t *newev = NULL;
+
+	newev = prepare_mediator_fdevent(epoll_fd, state, fdtype, fd);
+	if (!newev) {
+		return NULL;
+	}
+
+	if (register_mediator_fdevent(newev, events) < 0) {
 		free(newev);
 		return NULL;
 	}
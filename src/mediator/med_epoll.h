@@ -28,6 +28,20 @@
 #define OPENLI_MEDIATOR_EPOLL_H_
 
 #include <inttypes.h>
+#include <pthread.h>
+
+/** Number of bits of the expiry time used to index each level of the
+ *  timer wheel */
+#define MED_TIMER_WHEEL_BITS 6
+
+/** Number of slots in each level of the timer wheel */
+#define MED_TIMER_WHEEL_SLOTS (1 << MED_TIMER_WHEEL_BITS)
+
+/** Number of levels in the timer wheel -- timers that are further into the
+ *  future than the top level can cover are parked in the top level and
+ *  re-filed when that slot comes around.
+ */
+#define MED_TIMER_WHEEL_LEVELS 3
 
 /** Structure that stores state for a single epoll event */
 typedef struct med_epoll_ev {
@@ -44,8 +58,56 @@ typedef struct med_epoll_ev {
      *  the event.
      */
     void *state;
+
+    /** The timer wheel that this timer belongs to, or NULL if this event
+     *  is backed by its own file descriptor */
+    struct med_timer_wheel *wheel;
+
+    /** The time (in seconds) at which this wheel timer expires */
+    uint64_t expiry;
+
+    /** The next timer in the same wheel slot */
+    struct med_epoll_ev *wnext;
+
+    /** Points to whatever refers to this timer in its wheel slot, or NULL
+     *  if this wheel timer is not running */
+    struct med_epoll_ev **wpprev;
 } med_epoll_ev_t;
 
+/** A hierarchical timing wheel with one second resolution, used for the
+ *  timers that the mediator can have many thousands of (i.e. handover
+ *  keep alives and LIID cease timers), so that these don't each need their
+ *  own timerfd. The wheel is advanced by the main epoll loop timer.
+ */
+typedef struct med_timer_wheel {
+    /** The next tick (in seconds since an arbitrary point) that the wheel
+     *  will process */
+    uint64_t nexttick;
+
+    /** The number of timers currently running on the wheel */
+    uint32_t running;
+
+    /** The running timers, by level and slot */
+    med_epoll_ev_t *slots[MED_TIMER_WHEEL_LEVELS][MED_TIMER_WHEEL_SLOTS];
+
+    /** Timers that have expired but have not yet been triggered */
+    med_epoll_ev_t *expired;
+
+    /** Protects the wheel, as handovers may start their keep alive timers
+     *  from the agency connection thread */
+    pthread_mutex_t mutex;
+} med_timer_wheel_t;
+
+/** Callback used to trigger a wheel timer that has expired.
+ *
+ *  @param data         The opaque pointer passed into
+ *                      advance_mediator_timer_wheel().
+ *  @param timerev      The timer that has expired.
+ *
+ *  @return -1 if the main epoll loop should be restarted, 0 otherwise.
+ */
+typedef int (*med_timer_func_t)(void *data, med_epoll_ev_t *timerev);
+
 /** The different types of events that are triggered through the mediator epoll
  *  interface.
  */
@@ -91,6 +153,9 @@ enum {
 
     /** The mediator needs to send heartbeats to the RabbitMQ connections */
     MED_EPOLL_RMQCHECK_TIMER,
+
+    /** A collector receive thread has records ready for the handovers */
+    MED_EPOLL_COLL_HANDOFF,
 };
 
 /** Starts an existing timer and adds it to the global epoll event set.
@@ -101,7 +166,9 @@ enum {
  *      - deciding that a handover has failed to respond to a keep alive
  *
  *  Only call this on timers that have had their state and epoll_fd
- *  members already set via a call to create_mediator_timer().
+ *  members already set via a call to create_mediator_timer(), or that
+ *  were created by create_mediator_wheel_timer(). Wheel timers that are
+ *  already running are simply moved to their new expiry time.
  *
  *  @param timerev      The mediator epoll event for the timer.
  *  @param timeoutval   The number of seconds to wait before triggering the
@@ -149,6 +216,87 @@ med_epoll_ev_t *create_mediator_timer(int epoll_fd, void *state,
  */
 void destroy_mediator_timer(med_epoll_ev_t *timerev);
 
+/** Creates a timer that runs on a timer wheel, rather than using its own
+ *  timerfd. The timer can then be used with start_mediator_timer(),
+ *  halt_mediator_timer() and destroy_mediator_timer() like any other
+ *  timer.
+ *
+ *  @param wheel            The timer wheel to run the timer on
+ *  @param state            A pointer to the state to save with the timer
+ *  @param timertype        The type of timer to create, e.g. MED_EPOLL_KA_TIMER
+ *  @param duration         The duration of the timer, in seconds. If zero,
+ *                          the timer is created but not started.
+ *
+ *  @return NULL if an error occurs, otherwise a pointer to a new mediator
+ *          epoll event.
+ */
+med_epoll_ev_t *create_mediator_wheel_timer(med_timer_wheel_t *wheel,
+        void *state, int timertype, int duration);
+
+/** Checks whether a timer is currently running.
+ *
+ *  @param timerev      The mediator epoll event for the timer.
+ *
+ *  @return 1 if the timer is running, 0 otherwise.
+ */
+int mediator_timer_running(med_epoll_ev_t *timerev);
+
+/** Initialises an empty timer wheel.
+ *
+ *  @param wheel        The timer wheel to initialise.
+ */
+void init_mediator_timer_wheel(med_timer_wheel_t *wheel);
+
+/** Releases the resources used by a timer wheel. Any timers that are
+ *  still on the wheel are halted, but not freed.
+ *
+ *  @param wheel        The timer wheel to destroy.
+ */
+void destroy_mediator_timer_wheel(med_timer_wheel_t *wheel);
+
+/** Advances a timer wheel to the current time, triggering any timers that
+ *  have expired along the way.
+ *
+ *  Expired timers are halted before their callback is invoked, so the
+ *  callback may restart or destroy the timer.
+ *
+ *  @param wheel        The timer wheel to advance.
+ *  @param callback     The function to call for each expired timer.
+ *  @param data         An opaque pointer to pass into the callback.
+ *
+ *  @return -1 if any callback returned -1, 0 otherwise.
+ */
+int advance_mediator_timer_wheel(med_timer_wheel_t *wheel,
+        med_timer_func_t callback, void *data);
+
+/** Creates an epoll event for a file descriptor, without adding the
+ *  file descriptor to the epoll set yet.
+ *
+ *  This allows the caller to finish setting up any state that refers to
+ *  the event before another thread can be woken by it.
+ *
+ *  @param epoll_fd         The epoll fd that the event will be added to.
+ *  @param state            A pointer to the state to save with the event.
+ *  @param fdtype           The purpose of the file descriptor, e.g.
+ *                          MED_EPOLL_PROVISIONER.
+ *  @param fd               The file descriptor to create an event for.
+ *
+ *  @return NULL if an error occurs, otherwise a pointer to a new mediator
+ *          epoll event.
+ */
+med_epoll_ev_t *prepare_mediator_fdevent(int epoll_fd, void *state,
+        int fdtype, int fd);
+
+/** Adds the file descriptor for a prepared epoll event to its epoll set.
+ *
+ *  @param newev            The epoll event to add.
+ *  @param events           The epoll events to apply to the fd, as a bitmask.
+ *                          An example would be EPOLLIN | EPOLLOUT.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int register_mediator_fdevent(med_epoll_ev_t *newev, uint32_t events);
+
 /** Creates an epoll event for an active file descriptor.
  *
  *  @param epoll_fd         The global epoll fd being used by the mediator.
@@ -24,6 +24,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,6 +58,7 @@
 #include "handover.h"
 #include "med_epoll.h"
 #include "pcapthread.h"
+#include "collthread.h"
 
 #define AMPQ_BYTES_FROM(x) (amqp_bytes_t){.len=sizeof(x),.bytes=&x}
 
@@ -129,10 +131,40 @@ static void clear_med_config(mediator_state_t *state) {
     if (state->RMQ_conf.pass) {
         free(state->RMQ_conf.pass);
     }
+    if (state->spoolconf.directory) {
+        free(state->spoolconf.directory);
+    }
 
+    clear_handover_sched_weights(&(state->hosched));
     free_ssl_config(&(state->sslconf));
 }
 
+/** Releases the state for all of the collector receive threads. The
+ *  threads must have already been halted and any collectors that they
+ *  were reading from must have already been dropped.
+ *
+ *  @param state        The global state for the mediator instance
+ */
+static void free_collector_threads(mediator_state_t *state) {
+
+    int i;
+
+    if (state->collthreads == NULL) {
+        return;
+    }
+
+    for (i = 0; i < state->collectors.workercount; i++) {
+        destroy_collector_worker(&(state->collthreads[i]));
+    }
+
+    free(state->collthreads);
+    free(state->collectors.worker_epoll_fds);
+    state->collthreads = NULL;
+    state->collectors.worker_epoll_fds = NULL;
+    state->collectors.workercount = 0;
+    state->collectors.nextworker = 0;
+}
+
 /** Frees all global state for a mediator instance.
  *
  *  @param state        The global state for the mediator instance
@@ -149,6 +181,7 @@ static void destroy_med_state(mediator_state_t *state) {
     free_provisioner(&(state->provisioner));
 
     destroy_med_collector_state(&(state->collectors));
+    free_collector_threads(state);
 
     /* Delete all of the agencies and shut down any active handovers */
     drop_all_agencies(&(state->handover_state));
@@ -185,7 +218,8 @@ static void destroy_med_state(mediator_state_t *state) {
         free(state->RMQtimerev);
     }
 
-    pthread_join(state->pcapthread, NULL);
+    /* Stop the pcap writing threads */
+    halt_pcap_writers(&(state->pcapwriters));
 
     /* Halt the pcap file rotation timer */
     if (state->pcaptimerev) {
@@ -195,8 +229,8 @@ static void destroy_med_state(mediator_state_t *state) {
         free(state->pcaptimerev);
     }
 
-    /* Clean up the message queue for packets to be written as pcap */
-    libtrace_message_queue_destroy(&(state->pcapqueue));
+    /* Clean up the batches used to send packets to be written as pcap */
+    destroy_pcap_batch_pool(&(state->pcapwriters.pool));
 
     /* Wait for the thread that keeps the handovers up to stop */
     pthread_mutex_lock(state->handover_state.agency_mutex);
@@ -209,6 +243,13 @@ static void destroy_med_state(mediator_state_t *state) {
 
     pthread_mutex_destroy(state->handover_state.agency_mutex);
     free(state->handover_state.agency_mutex);
+
+    pthread_mutex_destroy(&(state->liidmap.missing_mutex));
+    pthread_rwlock_destroy(&(state->liidmap_lock));
+
+    /* Every handover and LIID mapping has been freed by now, so nothing
+     * should be left on the timer wheel */
+    destroy_mediator_timer_wheel(&(state->timers));
 }
 
 /** Sends the current pcap output configuration to the pcap writing thread
@@ -216,35 +257,26 @@ static void destroy_med_state(mediator_state_t *state) {
  * @param medstate      The global state for this mediator instance
  */
 static inline void update_pcap_msg_thread(mediator_state_t *medstate) {
-    mediator_pcap_msg_t pcapmsg;
-
-    memset(&pcapmsg, 0, sizeof(pcapmsg));
-    pcapmsg.msgtype = PCAP_MESSAGE_CHANGE_DIR;
-    if (medstate->pcapdirectory != NULL) {
-        pcapmsg.msgbody = (uint8_t *)strdup(medstate->pcapdirectory);
-        pcapmsg.msglen = strlen(medstate->pcapdirectory);
-    } else {
-        pcapmsg.msgbody = NULL;
-        pcapmsg.msglen = 0;
+    pcap_writer_set_t *set = &(medstate->pcapwriters);
+    uint32_t *openlimit;
+    int i;
+
+    broadcast_pcap_string(set, PCAP_MESSAGE_CHANGE_DIR,
+            medstate->pcapdirectory);
+    broadcast_pcap_string(set, PCAP_MESSAGE_CHANGE_TEMPLATE,
+            medstate->pcaptemplate);
+
+    for (i = 0; i < set->count; i++) {
+        send_pcap_message(&(set->writers[i]), PCAP_MESSAGE_CHANGE_COMPRESS,
+                (uint8_t *)&(medstate->pcapcompress),
+                sizeof(medstate->pcapcompress));
+
+        /* Each writing thread gets an even share of the open file limit */
+        openlimit = (uint32_t *)malloc(sizeof(uint32_t));
+        *openlimit = (medstate->pcapmaxopen + set->count - 1) / set->count;
+        send_pcap_message(&(set->writers[i]), PCAP_MESSAGE_CHANGE_MAXOPEN,
+                (uint8_t *)openlimit, sizeof(uint32_t));
     }
-    libtrace_message_queue_put(&(medstate->pcapqueue), &pcapmsg);
-
-    memset(&pcapmsg, 0, sizeof(pcapmsg));
-    pcapmsg.msgtype = PCAP_MESSAGE_CHANGE_TEMPLATE;
-    if (medstate->pcaptemplate != NULL) {
-        pcapmsg.msgbody = (uint8_t *)strdup(medstate->pcaptemplate);
-        pcapmsg.msglen = strlen(medstate->pcaptemplate);
-    } else {
-        pcapmsg.msgbody = NULL;
-        pcapmsg.msglen = 0;
-    }
-    libtrace_message_queue_put(&(medstate->pcapqueue), &pcapmsg);
-
-    memset(&pcapmsg, 0, sizeof(pcapmsg));
-    pcapmsg.msgtype = PCAP_MESSAGE_CHANGE_COMPRESS;
-    pcapmsg.msgbody = (uint8_t *)&(medstate->pcapcompress);
-    pcapmsg.msglen = sizeof(medstate->pcapcompress);
-    libtrace_message_queue_put(&(medstate->pcapqueue), &pcapmsg);
 }
 
 /** Initialises the global state for a mediator instance.
@@ -282,13 +314,27 @@ static int init_med_state(mediator_state_t *state, char *configfile) {
     state->RMQ_conf.enabled = 0;
     state->RMQ_conf.SSLenabled = 0;
 
+    state->spoolconf.directory = NULL;
+    state->spoolconf.threshold = DEFAULT_SPOOL_THRESHOLD;
+    state->spoolconf.maxsize = 0;
+    state->use_iouring = 0;
+    memset(&(state->uring), 0, sizeof(state->uring));
+    state->collthreadcount = 0;
+    state->collthreads = NULL;
+    memset(&(state->relay), 0, sizeof(state->relay));
+    init_handover_sched(&(state->hosched));
+    state->backpressure = 0;
+
     state->operatorid = NULL;
     state->shortoperatorid = NULL;
     state->pcapdirectory = NULL;
     state->pcaptemplate = NULL;
     state->pcapcompress = 1;
-    state->pcapthread = -1;
+    state->pcapthreadcount = 1;
+    state->pcapmaxopen = 0;
+    state->netbufferlimit = NETBUF_DEFAULT_LIMIT;
     state->pcaprotatefreq = 30;
+    memset(&(state->pcapwriters), 0, sizeof(state->pcapwriters));
     state->listenerev = NULL;
     state->timerev = NULL;
     state->pcaptimerev = NULL;
@@ -300,21 +346,21 @@ static int init_med_state(mediator_state_t *state, char *configfile) {
     state->handover_state.agency_mutex = calloc(1, sizeof(pthread_mutex_t));
     state->handover_state.connectthread = -1;
     state->handover_state.next_handover_id = 1;
+    state->handover_state.spoolconf = &(state->spoolconf);
 
     pthread_mutex_init(state->handover_state.agency_mutex, NULL);
 
 
     state->liidmap.liid_array = NULL;
     state->liidmap.missing_liids = NULL;
-
-    libtrace_message_queue_init(&(state->pcapqueue),
-            sizeof(mediator_pcap_msg_t));
+    state->liidmap.generation = 1;
 
     init_provisioner_instance(&(state->provisioner), &(state->sslconf.ctx));
     /* Parse the provided config file */
     if (parse_mediator_config(configfile, state) == -1) {
         return -1;
     }
+    set_net_buffer_limit(state->netbufferlimit);
 
     if (create_ssl_context(&(state->sslconf)) < 0) {
         return -1;
@@ -369,11 +415,26 @@ static int init_med_state(mediator_state_t *state, char *configfile) {
  */
 static void prepare_mediator_state(mediator_state_t *state) {
     sigset_t sigmask;
+    pthread_rwlockattr_t lockattr;
 
     state->epoll_fd = epoll_create1(0);
 
+    /* The collector receive threads hold the read lock almost constantly,
+     * so make sure that the main thread can still get in to update the
+     * LIID map */
+    pthread_rwlockattr_init(&lockattr);
+    pthread_rwlockattr_setkind_np(&lockattr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&(state->liidmap_lock), &lockattr);
+    pthread_rwlockattr_destroy(&lockattr);
+    pthread_mutex_init(&(state->liidmap.missing_mutex), NULL);
+    init_pcap_batch_pool(&(state->pcapwriters.pool));
+    init_mediator_timer_wheel(&(state->timers));
+
     state->handover_state.agencies = libtrace_list_init(sizeof(mediator_agency_t));
     state->handover_state.epoll_fd = state->epoll_fd;
+    state->handover_state.timers = &(state->timers);
+    state->handover_state.sched = &(state->hosched);
     state->provisioner.epoll_fd = state->epoll_fd;
     state->collectors.epoll_fd = state->epoll_fd;
     state->collectors.collectors =
@@ -397,7 +458,8 @@ static void prepare_mediator_state(mediator_state_t *state) {
     return;
 }
 
-/** Creates a flush or rotate message and sends it to the pcap writing thread.
+/** Creates a flush or rotate message and sends it to each pcap writing
+ *  thread.
  *
  *  On its own, the pcap trace output would be flushed intermittently
  *  which often gives the impression that no packets are being captured.
@@ -408,29 +470,38 @@ static void prepare_mediator_state(mediator_state_t *state) {
  *  regular basis as pcap tools tend to have issues working with incomplete
  *  files -- regular file rotation means that only the file with the most
  *  recent packets will be incomplete; the others can be given to LEAs.
+ *
+ *  When there are multiple pcap writing threads, the rotations are spread
+ *  evenly across the rotation period so that the threads are not all
+ *  closing and re-opening their files at the same moment.
  */
 static int trigger_pcap_flush(mediator_state_t *state, med_epoll_ev_t *mev) {
 
-    mediator_pcap_msg_t pmsg;
+    pcap_writer_set_t *set = &(state->pcapwriters);
     struct timeval tv;
+    uint64_t minute, offset;
+    int i;
 
-    memset(&pmsg, 0, sizeof(pmsg));
     gettimeofday(&tv, NULL);
+    minute = tv.tv_sec / 60;
 
-    /* Check if we should be rotating -- the time check here is fairly coarse
-     * because we cannot guarantee that this event will be triggered in the
-     * exact second that the rotation should happen.
-     */
-    if (tv.tv_sec % (60 * state->pcaprotatefreq) < 60) {
-        pmsg.msgtype = PCAP_MESSAGE_ROTATE;
-    } else {
-        /* Otherwise, just get the thread to flush any outstanding output */
-        pmsg.msgtype = PCAP_MESSAGE_FLUSH;
-    }
-    pmsg.msgbody = NULL;
-    pmsg.msglen = 0;
+    for (i = 0; i < set->count; i++) {
+        offset = ((uint64_t)i * state->pcaprotatefreq) / set->count;
 
-    libtrace_message_queue_put(&(state->pcapqueue), (void *)(&pmsg));
+        /* Check if we should be rotating -- the time check here is fairly
+         * coarse because we cannot guarantee that this event will be
+         * triggered in the exact second that the rotation should happen.
+         */
+        if ((minute + offset) % state->pcaprotatefreq == 0) {
+            send_pcap_message(&(set->writers[i]), PCAP_MESSAGE_ROTATE,
+                    NULL, 0);
+        } else {
+            /* Otherwise, just get the thread to flush any outstanding
+             * output */
+            send_pcap_message(&(set->writers[i]), PCAP_MESSAGE_FLUSH,
+                    NULL, 0);
+        }
+    }
 
     /* Restart the timer */
     if (halt_mediator_timer(mev) < 0) {
@@ -666,6 +737,7 @@ static int receive_lea_announce(mediator_state_t *state, uint8_t *msgbody,
  * of the liidlen output parameter.
  *
  * @param state         The global state for this mediator.
+ * @param cs            The collector that sent the message.
  * @param etsimsg       The start of the message received.
  * @param msglen        The length of the message received.
  * @param liidlen[out]  The number of bytes to strip from the front of the
@@ -675,11 +747,19 @@ static int receive_lea_announce(mediator_state_t *state, uint8_t *msgbody,
  *         to, or NULL if the LIID is not known by this mediator.
  */
 static liid_map_entry_t *match_etsi_to_agency(mediator_state_t *state,
-        uint8_t *etsimsg, uint16_t msglen, uint16_t *liidlen) {
+        single_coll_state_t *cs, uint8_t *etsimsg, uint16_t msglen,
+        uint16_t *liidlen) {
 
     unsigned char liidstr[65536];
     liid_map_entry_t *found = NULL;
 
+    /* Collectors tend to send us the same few LIIDs over and over, so
+     * check the LIIDs that we've recently seen from this collector first */
+    if (lookup_collector_liid_cache(cs, state->liidmap.generation, etsimsg,
+                msglen, liidlen, &found)) {
+        return found;
+    }
+
     /* Figure out the LIID for this ETSI record */
     extract_liid_from_exported_msg(etsimsg, msglen, liidstr, 65536, liidlen);
 
@@ -689,26 +769,50 @@ static liid_map_entry_t *match_etsi_to_agency(mediator_state_t *state,
         if (add_missing_liid(&(state->liidmap), (char *)liidstr) < 0) {
             exit(-2);
         }
-        return NULL;
     }
 
+    /* Unknown LIIDs are cached too, so we only complain about them once
+     * per map update */
+    add_collector_liid_cache(cs, state->liidmap.generation, (char *)liidstr,
+            *liidlen - sizeof(uint16_t), found);
     return found;
 }
 
 /** Append an ETSI record to the outgoing queue for the appropriate handover.
+ *
+ *  If the record was received by a collector receive thread, it is staged
+ *  and later passed on to the main thread, which owns the handovers.
+ *
+ *  If direct relaying is active, the record may be sent straight to the
+ *  handover socket instead of being copied into the handover's buffer.
  *
  *  @param state        The global state for this mediator
+ *  @param worker       The collector receive thread that received the
+ *                      record, or NULL if called from the main thread.
  *  @param ho           The handover that will send this record
  *  @param etsimsg      Pointer to the start of the ETSI record
  *  @param msglen       Length of the ETSI record, in bytes.
  *
  *  @return -1 if an error occurs, 0 otherwise.
  */
-static int enqueue_etsi(mediator_state_t *state, handover_t *ho,
-        uint8_t *etsimsg, uint16_t msglen) {
+static int enqueue_etsi(mediator_state_t *state, coll_recv_worker_t *worker,
+        handover_t *ho, uint8_t *etsimsg, uint32_t msglen) {
+
+    int ret;
+
+    if (worker) {
+        return stage_collector_record(worker, ho, etsimsg, msglen);
+    }
+
+    if (state->relay.active) {
+        ret = relay_handover_record(&(state->relay), ho, etsimsg, msglen);
+        if (ret != 0) {
+            return (ret < 0) ? -1 : 0;
+        }
+    }
 
     if (append_etsipdu_to_buffer(&(ho->ho_state->buf), etsimsg,
-            (uint32_t)msglen, 0) == 0) {
+            msglen, 0) == 0) {
 
         if (ho->disconnect_msg == 0) {
             logger(LOG_INFO,
@@ -795,7 +899,7 @@ static int receive_hi1_notification(mediator_state_t *state, uint8_t *msgbody,
         goto freehi1;
     }
 
-    if (enqueue_etsi(state, agency->hi2, encoded_hi1->encoded,
+    if (enqueue_etsi(state, NULL, agency->hi2, encoded_hi1->encoded,
             encoded_hi1->len) < 0) {
         wandder_release_encoded_result(agency->hi2->ho_state->encoder,
                 encoded_hi1);
@@ -836,7 +940,6 @@ static int receive_cease(mediator_state_t *state, uint8_t *msgbody,
 
     char *liid = NULL;
     liid_map_entry_t *m;
-    mediator_pcap_msg_t pcapmsg;
 
     /** See netcomms.c for this method */
     if (decode_cease_mediation(msgbody, msglen, &liid) == -1) {
@@ -862,12 +965,7 @@ static int receive_cease(mediator_state_t *state, uint8_t *msgbody,
 
     /* end any pcap trace for this LIID */
     if (m->agency == NULL) {
-        memset(&pcapmsg, 0, sizeof(pcapmsg));
-
-        pcapmsg.msgtype = PCAP_MESSAGE_DISABLE_LIID;
-        pcapmsg.msgbody = (unsigned char *)strdup(liid);
-        pcapmsg.msglen = strlen(liid) + 1;
-        libtrace_message_queue_put(&(state->pcapqueue), &pcapmsg);
+        disable_pcap_liid(&(state->pcapwriters), liid);
     }
 
     /* We cease mediation on a time-wait basis, i.e. we wait 15 seconds
@@ -888,7 +986,7 @@ static int receive_cease(mediator_state_t *state, uint8_t *msgbody,
             "OpenLI Mediator: scheduling removal of agency mapping for LIID %s.",
             m->liid);
 
-    m->ceasetimer = create_mediator_timer(state->epoll_fd, (void *)m,
+    m->ceasetimer = create_mediator_wheel_timer(&(state->timers), (void *)m,
             MED_EPOLL_CEASE_LIID_TIMER, 15);
 
     if (m->ceasetimer == NULL) {
@@ -902,8 +1000,7 @@ static int receive_cease(mediator_state_t *state, uint8_t *msgbody,
  *  a "cease mediation" timer.
  *
  *  @param state            The global state for this mediator
- *  @param mev              The epoll event for the cease mediation timer that
- *                          has triggered.
+ *  @param mev              The cease mediation timer that has triggered.
  *
  *  @return -1 if an error occurs, 0 otherwise.
  */
@@ -914,9 +1011,8 @@ static inline int remove_mediator_liid_mapping(mediator_state_t *state,
 
     remove_liid_agency_mapping(&(state->liidmap), m->liid);
 
-    /* Make sure that the timer event is removed from epoll */
-    halt_mediator_timer(mev);
-    free(m->ceasetimer);
+    /* The timer wheel has already halted the timer */
+    destroy_mediator_timer(m->ceasetimer);
     free(m->liid);
     free(m);
     return 0;
@@ -985,13 +1081,7 @@ static int receive_liid_mapping(mediator_state_t *state, uint8_t *msgbody,
 
     if (err == 1) {
         /* tell pcap thread that it no longer gets this LIID */
-        mediator_pcap_msg_t pcapmsg;
-        memset(&pcapmsg, 0, sizeof(pcapmsg));
-
-        pcapmsg.msgtype = PCAP_MESSAGE_DISABLE_LIID;
-        pcapmsg.msgbody = (unsigned char *)strdup(liid);
-        pcapmsg.msglen = strlen(liid) + 1;
-        libtrace_message_queue_put(&(state->pcapqueue), &pcapmsg);
+        disable_pcap_liid(&(state->pcapwriters), liid);
     }
 
     return 0;
@@ -1086,6 +1176,21 @@ static int receive_provisioner(mediator_state_t *state, med_epoll_ev_t *mev) {
                     return -1;
                 }
                 break;
+            case OPENLI_PROTO_CONFIG_DELTA:
+                /* The agencies and LIID mappings that we already have are
+                 * still valid, so there is nothing to do here */
+                break;
+            case OPENLI_PROTO_CONFIG_VERSION:
+                if (decode_config_version(msgbody, msglen,
+                            &(state->provisioner.confepoch),
+                            &(state->provisioner.confversion)) <= 0) {
+                    if (state->provisioner.disable_log == 0) {
+                        logger(LOG_INFO,
+                                "OpenLI Mediator: received invalid configuration version from provisioner.");
+                    }
+                    return -1;
+                }
+                break;
             default:
                 if (state->provisioner.disable_log == 0) {
                     logger(LOG_INFO,
@@ -1101,32 +1206,217 @@ static int receive_provisioner(mediator_state_t *state, med_epoll_ev_t *mev) {
 
 #define MAX_COLL_RECV (10 * 1024 * 1024)
 
+/** Lets a collector know whether it should hold back the records for an
+ *  LIID, based on whether the agency for that LIID is congested.
+ *
+ *  @param mev              The epoll event for the collector connection.
+ *  @param cs               The state for the collector connection.
+ *  @param thisint          The LIID->agency mapping for the record.
+ */
+static inline void check_collector_flow(med_epoll_ev_t *mev,
+        single_coll_state_t *cs, liid_map_entry_t *thisint) {
+
+    /* RMQ collectors don't read from their socket and the broker is
+     * already buffering their records for us */
+    if (mev->fdtype != MED_EPOLL_COLLECTOR) {
+        return;
+    }
+    update_collector_flow(cs, mev->fd, thisint);
+}
+
+/** Adds a record that is to be written to a pcap file to the batch of
+ *  pcap records for the collector that sent it.
+ *
+ *  @param state        The global state for this mediator
+ *  @param cs           The collector that sent the record
+ *  @param rectype      The type of record, e.g. PCAP_MESSAGE_PACKET
+ *  @param liidmsg      Pointer to the LIID for the record, including the
+ *                      preceding LIID length
+ *  @param liidlen      The length of the LIID, including the LIID length
+ *  @param rec          Pointer to the start of the record
+ *  @param reclen       The length of the record, in bytes
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int enqueue_pcap(mediator_state_t *state, single_coll_state_t *cs,
+        uint8_t rectype, uint8_t *liidmsg, uint16_t liidlen, uint8_t *rec,
+        uint32_t reclen) {
+
+    return append_pcap_batch_record(&(state->pcapwriters), cs->pcapbatch,
+            rectype, liidmsg + sizeof(uint16_t), liidlen - sizeof(uint16_t),
+            rec, reclen);
+}
+
+/** Actions each of the records in a batch received from a collector.
+ *
+ *  Every record in a batch belongs to the same LIID, so we only need to
+ *  work out where the records are going once for the whole batch.
+ *
+ *  @param state            The global state for this mediator.
+ *  @param worker           The collector receive thread that received the
+ *                          batch, or NULL if called from the main thread.
+ *  @param mev              The epoll event for the collector connection.
+ *  @param cs               The state for the collector that sent the batch.
+ *  @param msgbody          Pointer to the start of the batch contents.
+ *  @param msglen           The length of the batch contents, in bytes.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int receive_collector_batch(mediator_state_t *state,
+        coll_recv_worker_t *worker, med_epoll_ev_t *mev,
+        single_coll_state_t *cs, uint8_t *msgbody, uint32_t msglen) {
+
+    liid_map_entry_t *thisint;
+    openli_proto_msgtype_t rectype;
+    uint8_t *liidprefix, *ptr, *rec;
+    uint16_t prefixlen, reccount, liidlen;
+    uint32_t reclen;
+    int ret;
+
+    if (decode_etsi_batch(msgbody, msglen, &reccount, &liidprefix,
+                &prefixlen, &ptr) < 0) {
+        return -1;
+    }
+
+    thisint = match_etsi_to_agency(state, cs, liidprefix, prefixlen,
+            &liidlen);
+    if (thisint == NULL) {
+        return 0;
+    }
+    if (cs->disabled_log == 1) {
+        reenable_collector_logging(&(state->collectors), cs);
+    }
+    check_collector_flow(mev, cs, thisint);
+
+    while ((ret = next_etsi_batch_record(&ptr, msgbody + msglen, &rectype,
+                    &rec, &reclen)) > 0) {
+
+        switch(rectype) {
+            case OPENLI_PROTO_RAWIP_SYNC:
+                if (thisint->agency == NULL && enqueue_pcap(state, cs,
+                            PCAP_MESSAGE_RAWIP, liidprefix, liidlen, rec,
+                            reclen) < 0) {
+                    return -1;
+                }
+                break;
+            case OPENLI_PROTO_ETSI_CC:
+                if (thisint->agency == NULL) {
+                    /* Destined for a pcap file rather than an agency */
+                    if (enqueue_pcap(state, cs, PCAP_MESSAGE_PACKET,
+                                liidprefix, liidlen, rec, reclen) < 0) {
+                        return -1;
+                    }
+                } else if (enqueue_etsi(state, worker, thisint->agency->hi3,
+                            rec, reclen) == -1) {
+                    return -1;
+                }
+                break;
+            case OPENLI_PROTO_ETSI_IRI:
+                /* IRIs don't make sense for a pcap, so just ignore them */
+                if (thisint->agency == NULL) {
+                    break;
+                }
+                if (enqueue_etsi(state, worker, thisint->agency->hi2, rec,
+                            reclen) == -1) {
+                    return -1;
+                }
+                break;
+            default:
+                if (cs->disabled_log == 0) {
+                    logger(LOG_INFO,
+                            "OpenLI Mediator: unexpected record type %d in batch received from collector.",
+                            rectype);
+                }
+                return -1;
+        }
+    }
+
+    return ret;
+}
+
+/** Switches a collector connection over to decompressing the records
+ *  that the collector sends us.
+ *
+ *  @param cs               The state for the collector connection.
+ *  @param mev              The epoll event for the collector socket.
+ *  @param msgbody          The body of the start compression message.
+ *  @param msglen           The length of the message body.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int receive_collector_compression(single_coll_state_t *cs,
+        med_epoll_ev_t *mev, uint8_t *msgbody, uint32_t msglen) {
+
+    uint8_t method;
+
+    /* We never offer compression to collectors that are using RMQ */
+    if (mev->fdtype == MED_EPOLL_COL_RMQ) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: collector %s tried to start compression on an RMQ connection.",
+                cs->ipaddr);
+        return -1;
+    }
+
+    if (decode_start_compression(msgbody, msglen, &method) == -1) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: invalid start compression message received from collector %s.",
+                cs->ipaddr);
+        return -1;
+    }
+
+    if (enable_net_buffer_decompression(cs->incoming, method) == -1) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to decompress %s stream from collector %s.",
+                compression_method_string(method), cs->ipaddr);
+        return -1;
+    }
+
+    logger(LOG_INFO,
+            "OpenLI Mediator: collector %s is sending %s compressed records.",
+            cs->ipaddr, compression_method_string(method));
+    return 0;
+}
+
 /** Receives and actions a message from a collector, which can include
  *  an encoded ETSI CC or IRI.
  *
  *  @param state            The global state for this mediator.
  *  @param mev              The epoll event for the collector socket.
+ *  @param worker           The collector receive thread that is reading
+ *                          from the collector, or NULL if called from the
+ *                          main thread.
  *
  *  @return -1 if an error occurs, 0 otherwise.
  */
-static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
+static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev,
+        coll_recv_worker_t *worker) {
 
     uint8_t *msgbody = NULL;
-    uint16_t msglen = 0;
+    uint32_t msglen = 0;
+    uint16_t rmqlen = 0;
     uint64_t internalid;
     liid_map_entry_t *thisint;
     single_coll_state_t *cs = (single_coll_state_t *)(mev->state);
     openli_proto_msgtype_t msgtype;
-    mediator_pcap_msg_t pcapmsg;
     uint16_t liidlen;
     uint32_t total_recvd = 0;
 
     do {
         if (mev->fdtype == MED_EPOLL_COL_RMQ) {
             msgtype = receive_RMQ_buffer(cs->incoming_rmq, cs->amqp_state,
-                    &msgbody, &msglen, &internalid);
+                    &msgbody, &rmqlen, &internalid);
+            msglen = rmqlen;
         } else {
-            msgtype = receive_net_buffer(cs->incoming, &msgbody,
+            /* Any records waiting to be relayed still live in the receive
+             * buffer, so send them before anything more is read into it */
+            if (state->relay.active &&
+                    handover_relay_pending(&(state->relay)) &&
+                    !net_buffer_message_ready(cs->incoming)) {
+                if (flush_handover_relay(&(state->relay)) < 0) {
+                    return -1;
+                }
+            }
+            msgtype = receive_net_buffer_ext(cs->incoming, &msgbody,
                         &msglen, &internalid);
         }
 
@@ -1154,7 +1444,7 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
                 /* This is a raw IP packet capture, rather than a properly
                  * encoded ETSI CC. */
                 /* msgbody should be an LIID + an IP packet */
-                thisint = match_etsi_to_agency(state, msgbody, msglen,
+                thisint = match_etsi_to_agency(state, cs, msgbody, msglen,
                         &liidlen);
                 if (thisint == NULL) {
                     break;
@@ -1165,17 +1455,17 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
 
                 if (thisint->agency == NULL) {
                     /* Write IP packet directly to pcap */
-                    pcapmsg.msgtype = PCAP_MESSAGE_RAWIP;
-                    pcapmsg.msgbody = (uint8_t *)malloc(msglen);
-                    memcpy(pcapmsg.msgbody, msgbody, msglen);
-                    pcapmsg.msglen = msglen;
-                    libtrace_message_queue_put(&(state->pcapqueue), &pcapmsg);
+                    if (enqueue_pcap(state, cs, PCAP_MESSAGE_RAWIP, msgbody,
+                            liidlen, msgbody + liidlen,
+                            msglen - liidlen) < 0) {
+                        return -1;
+                    }
                 }
 
                 break;
             case OPENLI_PROTO_ETSI_CC:
                 /* msgbody should contain an LIID + a full ETSI CC record */
-                thisint = match_etsi_to_agency(state, msgbody, msglen,
+                thisint = match_etsi_to_agency(state, cs, msgbody, msglen,
                         &liidlen);
                 if (thisint == NULL) {
                     break;
@@ -1183,23 +1473,22 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
                 if (cs->disabled_log == 1) {
                     reenable_collector_logging(&(state->collectors), cs);
                 }
+                check_collector_flow(mev, cs, thisint);
                 if (thisint->agency == NULL) {
                     /* Destined for a pcap file rather than an agency */
-                    /* TODO freelist rather than repeated malloc/free */
-                    pcapmsg.msgtype = PCAP_MESSAGE_PACKET;
-                    pcapmsg.msgbody = (uint8_t *)malloc(msglen - liidlen);
-                    memcpy(pcapmsg.msgbody, msgbody + liidlen,
-                            msglen - liidlen);
-                    pcapmsg.msglen = msglen - liidlen;
-                    libtrace_message_queue_put(&(state->pcapqueue), &pcapmsg);
-                } else if (enqueue_etsi(state, thisint->agency->hi3,
+                    if (enqueue_pcap(state, cs, PCAP_MESSAGE_PACKET, msgbody,
+                            liidlen, msgbody + liidlen,
+                            msglen - liidlen) < 0) {
+                        return -1;
+                    }
+                } else if (enqueue_etsi(state, worker, thisint->agency->hi3,
                         msgbody + liidlen, msglen - liidlen) == -1) {
                     return -1;
                 }
                 break;
             case OPENLI_PROTO_ETSI_IRI:
                 /* msgbody should contain an LIID + a full ETSI IRI record */
-                thisint = match_etsi_to_agency(state, msgbody, msglen,
+                thisint = match_etsi_to_agency(state, cs, msgbody, msglen,
                         &liidlen);
                 if (thisint == NULL) {
                     break;
@@ -1207,13 +1496,32 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
                 if (cs->disabled_log == 1) {
                     reenable_collector_logging(&(state->collectors), cs);
                 }
+                check_collector_flow(mev, cs, thisint);
                 if (thisint->agency == NULL) {
                     /* Destined for a pcap file rather than an agency */
                     /* IRIs don't make sense for a pcap, so just ignore it */
                     break;
                 }
-                if (enqueue_etsi(state, thisint->agency->hi2, msgbody + liidlen,
-                            msglen - liidlen) == -1) {
+                if (enqueue_etsi(state, worker, thisint->agency->hi2,
+                            msgbody + liidlen, msglen - liidlen) == -1) {
+                    return -1;
+                }
+                break;
+            case OPENLI_PROTO_ETSI_BATCH:
+                /* msgbody should contain an LIID + one or more records */
+                if (receive_collector_batch(state, worker, mev, cs, msgbody,
+                            msglen) == -1) {
+                    return -1;
+                }
+                break;
+            case OPENLI_PROTO_START_COMPRESSION:
+                /* Everything after this message is compressed */
+                if (state->relay.active &&
+                        flush_handover_relay(&(state->relay)) < 0) {
+                    return -1;
+                }
+                if (receive_collector_compression(cs, mev, msgbody,
+                            msglen) == -1) {
                     return -1;
                 }
                 break;
@@ -1230,6 +1538,289 @@ static int receive_collector(mediator_state_t *state, med_epoll_ev_t *mev) {
     return 0;
 }
 
+/** Appends all of the records that a collector receive thread has passed
+ *  over to the main thread to the outgoing buffers for their handovers.
+ *
+ *  @param state            The global state for this mediator.
+ *  @param worker           The collector receive thread to take records from.
+ */
+static void apply_collector_handoffs(mediator_state_t *state,
+        coll_recv_worker_t *worker) {
+
+    coll_handoff_t *hand, *next;
+    uint32_t offset, reclen;
+
+    hand = take_collector_handoffs(worker);
+    while (hand) {
+        next = hand->next;
+
+        offset = 0;
+        while (offset + sizeof(uint32_t) <= hand->used) {
+            memcpy(&reclen, hand->records + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+
+            if (enqueue_etsi(state, NULL, hand->ho, hand->records + offset,
+                        reclen) == -1) {
+                break;
+            }
+            offset += reclen;
+        }
+
+        free_collector_handoff(hand);
+        hand = next;
+    }
+}
+
+/** Reacts to a collector receive thread signalling that it has records
+ *  ready to be sent to the handovers.
+ *
+ *  @param state            The global state for this mediator.
+ *  @param mev              The epoll event for the receive thread's eventfd.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int receive_collector_handoffs(mediator_state_t *state,
+        med_epoll_ev_t *mev) {
+
+    uint64_t count;
+
+    /* Clear the eventfd before taking the records, otherwise we could
+     * miss a wake up for records that arrive in between */
+    if (read(mev->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: error reading eventfd for collector receive thread: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    apply_collector_handoffs(state, (coll_recv_worker_t *)(mev->state));
+    return 0;
+}
+
+/** Receives from a collector within a collector receive thread.
+ *
+ *  The LIID map read lock is held for the whole receive, so none of the
+ *  agencies or handovers that we've matched records to can change until
+ *  the records have been handed over to the main thread.
+ *
+ *  @param data             The global state for this mediator.
+ *  @param mev              The epoll event for the collector socket.
+ *  @param worker           The receive thread that is doing the reading.
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int receive_collector_in_thread(void *data, med_epoll_ev_t *mev,
+        coll_recv_worker_t *worker) {
+
+    mediator_state_t *state = (mediator_state_t *)data;
+    int ret;
+
+    pthread_rwlock_rdlock(&(state->liidmap_lock));
+    ret = receive_collector(state, mev, worker);
+
+    /* Pass on whatever we matched, even if the collector has failed */
+    send_pcap_batches(&(state->pcapwriters),
+            ((single_coll_state_t *)(mev->state))->pcapbatch);
+    publish_collector_records(worker);
+    pthread_rwlock_unlock(&(state->liidmap_lock));
+
+    return ret;
+}
+
+/** Takes exclusive access to the LIID map and agencies, so that they can be
+ *  safely modified.
+ *
+ *  Any records that the collector receive threads have already matched
+ *  are delivered to their handovers first, so that no handoffs are left
+ *  referring to a handover that is about to be removed. The LIID map
+ *  generation is also bumped, which discards the LIID caches for every
+ *  collector connection.
+ *
+ *  @param state            The global state for this mediator.
+ */
+static void lock_liid_map(mediator_state_t *state) {
+
+    int i;
+
+    pthread_rwlock_wrlock(&(state->liidmap_lock));
+    for (i = 0; i < state->collectors.workercount; i++) {
+        apply_collector_handoffs(state, &(state->collthreads[i]));
+    }
+
+    /* Any LIID lookups cached by the collectors may be about to become
+     * stale */
+    state->liidmap.generation ++;
+}
+
+/** Releases the exclusive access taken by lock_liid_map().
+ *
+ *  @param state            The global state for this mediator.
+ */
+static inline void unlock_liid_map(mediator_state_t *state) {
+    pthread_rwlock_unlock(&(state->liidmap_lock));
+}
+
+/** Halts all of the collector receive threads and delivers any records
+ *  that they had already received.
+ *
+ *  The collector sockets remain open so that they can be dropped
+ *  afterwards; use free_collector_threads() to release the rest of the
+ *  thread state once that has happened.
+ *
+ *  @param state            The global state for this mediator.
+ */
+static void halt_collector_threads(mediator_state_t *state) {
+
+    int i;
+
+    for (i = 0; i < state->collectors.workercount; i++) {
+        halt_collector_worker(&(state->collthreads[i]));
+        apply_collector_handoffs(state, &(state->collthreads[i]));
+    }
+}
+
+/** Starts the configured number of collector receive threads.
+ *
+ *  If the threads cannot be started, the mediator will fall back to
+ *  receiving from collectors using the main thread.
+ *
+ *  @param state            The global state for this mediator.
+ *
+ *  @return -1 if the threads could not be started, 0 otherwise.
+ */
+static int start_collector_threads(mediator_state_t *state) {
+
+    mediator_collector_t *medcol = &(state->collectors);
+    coll_recv_worker_t *worker;
+    uint32_t i;
+
+    if (state->collthreadcount == 0) {
+        return 0;
+    }
+
+    /* Records received via RMQ are read on the main thread's timers, so
+     * there's nothing to gain from receive threads */
+    if (state->RMQ_conf.enabled) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: collector receive threads are not supported when using RabbitMQ -- collectors will be read by the main thread.");
+        return 0;
+    }
+
+    state->collthreads = (coll_recv_worker_t *)calloc(state->collthreadcount,
+            sizeof(coll_recv_worker_t));
+    medcol->worker_epoll_fds = (int *)calloc(state->collthreadcount,
+            sizeof(int));
+
+    for (i = 0; i < state->collthreadcount; i++) {
+        worker = &(state->collthreads[i]);
+        if (init_collector_worker(worker, i, medcol, state->epoll_fd,
+                    receive_collector_in_thread, state) < 0 ||
+                start_collector_worker(worker) < 0) {
+
+            destroy_collector_worker(worker);
+            halt_collector_threads(state);
+            free_collector_threads(state);
+            logger(LOG_INFO,
+                    "OpenLI Mediator: collectors will be read by the main thread instead.");
+            return -1;
+        }
+        medcol->worker_epoll_fds[i] = worker->epoll_fd;
+        medcol->workercount ++;
+    }
+
+    logger(LOG_INFO, "OpenLI Mediator: started %u collector receive threads.",
+            state->collthreadcount);
+    return 0;
+}
+
+/** Transmits buffered records for every writable handover in a set of
+ *  epoll events using a single batch of io_uring sends.
+ *
+ *  Events that are dealt with here have their event mask cleared so that
+ *  they are skipped by the main epoll loop. Anything that can't be batched
+ *  (e.g. a handover with a keep alive waiting to go out) is left alone
+ *  and will be handled by check_epoll_fd() as normal.
+ *
+ *  @param state            The global state for the mediator
+ *  @param evs              The events returned by epoll_wait()
+ *  @param nfds             The number of events in evs
+ */
+static void batch_handover_writes(mediator_state_t *state,
+        struct epoll_event *evs, int nfds) {
+
+    med_epoll_ev_t *mev;
+    uint32_t i;
+
+    for (i = 0; i < (uint32_t)nfds; i++) {
+        mev = (med_epoll_ev_t *)(evs[i].data.ptr);
+
+        if (mev->fdtype != MED_EPOLL_LEA) {
+            continue;
+        }
+        /* hangups and keep alive responses take priority over writing */
+        if (evs[i].events != EPOLLOUT) {
+            continue;
+        }
+
+        if (queue_handover_xmit(mev, &(state->uring)) >= 0) {
+            evs[i].events = 0;
+        }
+    }
+
+    if (state->uring.batchcount == 0) {
+        return;
+    }
+
+    /* If the ring fails, unsent handovers will just see EAGAIN and we'll
+     * try them again via xmit_handover() */
+    submit_uring_batch(&(state->uring));
+
+    for (i = 0; i < state->uring.batchcount; i++) {
+        mev = (med_epoll_ev_t *)(state->uring.batch[i].owner);
+        if (finish_handover_xmit(mev, &(state->uring.batch[i])) == -1) {
+            disconnect_handover((handover_t *)(mev->state));
+        }
+    }
+    clear_uring_batch(&(state->uring));
+}
+
+/** React to the expiry of a timer on the mediator's timer wheel.
+ *
+ *  @param data             The global state for the mediator
+ *  @param mev              The timer that has expired
+ *
+ *  @return -1 if the epoll loop should be restarted, 0 otherwise.
+ */
+static int trigger_wheel_timer(void *data, med_epoll_ev_t *mev) {
+
+    mediator_state_t *state = (mediator_state_t *)data;
+    int ret = 0;
+
+    switch(mev->fdtype) {
+        case MED_EPOLL_CEASE_LIID_TIMER:
+            /* an LIID->agency mapping can now be safely removed */
+            lock_liid_map(state);
+            ret = remove_mediator_liid_mapping(state, mev);
+            unlock_liid_map(state);
+            break;
+        case MED_EPOLL_KA_TIMER:
+            /* a handover is due to send a keep alive message */
+            ret = trigger_keepalive(state, mev);
+            break;
+        case MED_EPOLL_KA_RESPONSE_TIMER:
+            /* a handover target has not responded to a keep alive message
+             * and is due to be disconnected */
+            ret = trigger_ka_failure(mev);
+            break;
+        default:
+            logger(LOG_INFO,
+                    "OpenLI Mediator: invalid timer on the timer wheel.");
+            assert(0);
+            return -1;
+    }
+    return ret;
+}
+
 /** React to an event on a file descriptor reported by our epoll loop.
  *
  *  @param state            The global state for the mediator
@@ -1275,22 +1866,6 @@ static int check_epoll_fd(mediator_state_t *state, struct epoll_event *ev) {
             ret = mediator_accept_collector(&(state->collectors),
                     state->listenerev->fd);
             break;
-        case MED_EPOLL_CEASE_LIID_TIMER:
-            /* an LIID->agency mapping can now be safely removed */
-            assert(ev->events == EPOLLIN);
-            ret = remove_mediator_liid_mapping(state, mev);
-            break;
-        case MED_EPOLL_KA_TIMER:
-            /* a handover is due to send a keep alive message */
-            assert(ev->events == EPOLLIN);
-            ret = trigger_keepalive(state, mev);
-            break;
-        case MED_EPOLL_KA_RESPONSE_TIMER:
-            /* a handover target has not responded to a keep alive message
-             * and is due to be disconnected */
-            assert(ev->events == EPOLLIN);
-            ret = trigger_ka_failure(mev);
-            break;
         case MED_EPOLL_PROVRECONNECT:
             /* we're due to try reconnecting to a lost provisioner */
             assert(ev->events == EPOLLIN);
@@ -1306,8 +1881,15 @@ static int check_epoll_fd(mediator_state_t *state, struct epoll_event *ev) {
                 /* message from LEA -- hopefully a keep-alive response */
                 ret = receive_handover(mev);
             } else if (ev->events & EPOLLOUT) {
-                /* handover is able to send buffered records */
-                ret = xmit_handover(mev);
+                /* handover is able to send buffered records -- if we're
+                 * scheduling handovers, it will be sent from when it is
+                 * its turn */
+                handover_t *ho = (handover_t *)(mev->state);
+                if (state->hosched.enabled && ho->schedag) {
+                    schedule_handover_xmit(&(state->hosched), ho);
+                } else {
+                    ret = xmit_handover(mev);
+                }
             } else {
                 ret = -1;
             }
@@ -1326,7 +1908,9 @@ static int check_epoll_fd(mediator_state_t *state, struct epoll_event *ev) {
                 ret = transmit_provisioner(&(state->provisioner), mev);
             } else if (ev->events & EPOLLIN) {
                 /* provisioner has sent us an instruction */
+                lock_liid_map(state);
                 ret = receive_provisioner(state, mev);
+                unlock_liid_map(state);
                 if (ret == 0 && state->provisioner.disable_log == 1) {
                     logger(LOG_INFO,
                             "OpenLI Mediator: Connected to provisioner at %s:%s",
@@ -1355,12 +1939,30 @@ static int check_epoll_fd(mediator_state_t *state, struct epoll_event *ev) {
             if (ev->events & EPOLLRDHUP) {
                 ret = -1;
             } else if (ev->events & EPOLLIN) {
-                ret = receive_collector(state, mev);
+                /* Records from RMQ can't be relayed, as each message is
+                 * only valid until the next one is read */
+                state->relay.active = (state->relay.enabled &&
+                        mev->fdtype == MED_EPOLL_COLLECTOR);
+                ret = receive_collector(state, mev, NULL);
+            }
+            /* Send any relayed or pcap records before the collector is
+             * dropped */
+            if (state->relay.active) {
+                if (flush_handover_relay(&(state->relay)) < 0) {
+                    ret = -1;
+                }
+                state->relay.active = 0;
             }
+            send_pcap_batches(&(state->pcapwriters),
+                    ((single_coll_state_t *)(mev->state))->pcapbatch);
             if (ret == -1) {
                 drop_collector(&(state->collectors), mev, 1);
             }
             break;
+        case MED_EPOLL_COLL_HANDOFF:
+            /* a collector receive thread has records for the handovers */
+            ret = receive_collector_handoffs(state, mev);
+            break;
         default:
             logger(LOG_INFO,
                     "OpenLI Mediator: invalid fd triggering epoll event.");
@@ -1432,6 +2034,8 @@ static inline void drop_provisioner(mediator_state_t *currstate) {
     /* Disconnect from provisioner and reset all state received
      * from the old provisioner (just to be safe). */
 
+    lock_liid_map(currstate);
+
     /* Purge the LIID->agency mappings */
     purge_liid_map(&(currstate->liidmap));
 
@@ -1441,20 +2045,43 @@ static inline void drop_provisioner(mediator_state_t *currstate) {
      * provisioner again */
     drop_all_agencies(&(currstate->handover_state));
 
+    /* Make sure the provisioner sends us everything again */
+    currstate->provisioner.confepoch = 0;
+    currstate->provisioner.confversion = 0;
+
+    unlock_liid_map(currstate);
+
 }
 
-/** Closes the socket that is listening for collector connections and
- *  drops any collectors that are connected through it.
+/** Drops all of the collectors that are currently connected to the
+ *  mediator.
+ *
+ *  Any collector receive threads are halted while the collectors are
+ *  dropped and are then restarted, ready for new collectors.
  *
  *  @param currstate            The global state for the mediator
  */
-static inline void halt_listening_socket(mediator_state_t *currstate) {
+static void reset_collectors(mediator_state_t *currstate) {
+
+    halt_collector_threads(currstate);
 
     /* Disconnect all collectors */
     drop_all_collectors(&(currstate->collectors));
     currstate->collectors.collectors = libtrace_list_init(
             sizeof(active_collector_t *));
 
+    free_collector_threads(currstate);
+    start_collector_threads(currstate);
+}
+
+/** Closes the socket that is listening for collector connections and
+ *  drops any collectors that are connected through it.
+ *
+ *  @param currstate            The global state for the mediator
+ */
+static inline void halt_listening_socket(mediator_state_t *currstate) {
+
+    reset_collectors(currstate);
 
     /* Close listen socket and disable epoll event */
     remove_mediator_fdevent(currstate->listenerev);
@@ -1500,9 +2127,19 @@ static int reload_pcap_config(mediator_state_t *currstate,
         changed = 1;
     }
 
+    if (currstate->pcapmaxopen != newstate->pcapmaxopen) {
+        changed = 1;
+    }
+
+    if (currstate->pcapthreadcount != newstate->pcapthreadcount) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: the number of pcap writing threads cannot be changed without restarting the mediator.");
+    }
+
     currstate->pcapdirectory = newstate->pcapdirectory;
     currstate->pcaptemplate = newstate->pcaptemplate;
     currstate->pcapcompress = newstate->pcapcompress;
+    currstate->pcapmaxopen = newstate->pcapmaxopen;
 
     return changed;
 }
@@ -1616,6 +2253,27 @@ static int reload_mediator_config(mediator_state_t *currstate) {
         return -1;
     }
 
+    update_handover_sched_config(&(currstate->hosched), &(newstate.hosched));
+
+    if (currstate->backpressure != newstate.backpressure) {
+        if (newstate.backpressure == 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: collectors will no longer be asked to hold back records for congested agencies.");
+        } else {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: collectors will now be asked to hold back records for agencies with more than %lu MB waiting.",
+                    newstate.backpressure / (1024 * 1024));
+        }
+        currstate->backpressure = newstate.backpressure;
+    }
+
+    if (currstate->relay.enabled != newstate.relay.enabled) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: direct relaying to handovers is now %s.",
+                newstate.relay.enabled ? "enabled" : "disabled");
+        currstate->relay.enabled = newstate.relay.enabled;
+    }
+
     pcapchanged = reload_pcap_config(currstate, &newstate);
     if (pcapchanged == -1) {
         return -1;
@@ -1627,11 +2285,7 @@ static int reload_mediator_config(mediator_state_t *currstate) {
         currstate->etsitls = newstate.etsitls;
 
         if (!listenchanged) {
-            /* Disconnect all collectors */
-            drop_all_collectors(&(currstate->collectors));
-            currstate->collectors.collectors = libtrace_list_init(
-                    sizeof(active_collector_t *));
-
+            reset_collectors(currstate);
             listenchanged = 1;
         }
         if (!provchanged) {
@@ -1679,6 +2333,35 @@ static void run(mediator_state_t *state) {
     signalev = create_mediator_fdevent(state->epoll_fd, NULL,
             MED_EPOLL_SIGNAL, state->signalev->fd, EPOLLIN);
 
+    if (state->use_iouring) {
+        init_openli_uring(&(state->uring), DEFAULT_URING_DEPTH,
+                "mediator handovers");
+    }
+
+    if (state->relay.enabled && state->collthreadcount > 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: direct relaying to handovers is not used when collector receive threads are enabled.");
+    } else if (state->relay.enabled) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: relaying records directly to handovers where possible.");
+    }
+
+    if (state->hosched.enabled) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: scheduling handover transmissions with a quantum of %u bytes.",
+                state->hosched.quantum);
+        if (state->uring.active) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: io_uring is not used for handover transmissions while they are being scheduled.");
+        }
+    }
+
+    if (state->backpressure > 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: asking collectors to hold back records for agencies with more than %lu MB waiting.",
+                state->backpressure / (1024 * 1024));
+    }
+
     logger(LOG_INFO,
             "OpenLI Mediator: pcap output file rotation frequency is set to %d minutes.",
             state->pcaprotatefreq);
@@ -1761,7 +2444,17 @@ static void run(mediator_state_t *state) {
                 continue;
             }
 
+            /* The handover scheduler decides when each handover gets
+             * to send, so we can't batch every writable handover */
+            if (state->uring.active && !state->hosched.enabled) {
+                batch_handover_writes(state, evs, nfds);
+            }
+
             for (i = 0; i < nfds; i++) {
+                if (evs[i].events == 0) {
+                    /* already handled by batch_handover_writes() */
+                    continue;
+                }
                 timerexpired = check_epoll_fd(state, &(evs[i]));
                 /* timerexpired will be set to 1 if the one second loop
                  * breaking timer fires.
@@ -1774,12 +2467,29 @@ static void run(mediator_state_t *state) {
                     break;
                 }
             }
+
+            /* Give each of the handovers that are now writable their
+             * share of the link */
+            run_handover_sched(&(state->hosched));
         }
 
         /* Remove the old 1 second timer, but it will get replaced if we
          * go around again.
          */
         halt_mediator_timer(state->timerev);
+
+        /* Trigger any keep alive or cease timers that have expired since
+         * we last went around */
+        if (advance_mediator_timer_wheel(&(state->timers),
+                    trigger_wheel_timer, state) < 0) {
+            /* A handover has been disconnected, so go straight back to
+             * a fresh epoll_wait() as we would for any other timer */
+            continue;
+        }
+        update_agency_backpressure(&(state->handover_state),
+                state->backpressure);
+        report_handover_sched_stats(&(state->hosched));
+        report_net_buffer_usage("OpenLI Mediator");
     }
 
 runfailure:
@@ -1789,6 +2499,10 @@ runfailure:
      */
     mediator_halt = true;
 
+    /* Stop reading from collectors -- anything that the receive threads
+     * have already passed on will still be in the handover buffers */
+    halt_collector_threads(state);
+
     /* Tell our agency connection thread to stop when it can */
     pthread_mutex_lock(state->handover_state.agency_mutex);
     state->handover_state.halt_flag = 1;
@@ -1797,6 +2511,7 @@ runfailure:
     if (signalev) {
         remove_mediator_fdevent(signalev);
     }
+    destroy_openli_uring(&(state->uring));
 }
 
 /** Main function for the OpenLI mediator.
@@ -1815,7 +2530,6 @@ int main(int argc, char *argv[]) {
     char *pidfile = NULL;
 
     mediator_state_t medstate;
-    mediator_pcap_msg_t pcapmsg;
 
     while (1) {
         int optind;
@@ -1880,11 +2594,18 @@ int main(int argc, char *argv[]) {
 
     logger(LOG_INFO, "OpenLI Mediator: '%u' has started.", medstate.mediatorid);
 
+    /* Start the pcap output threads */
+    if (start_pcap_writers(&(medstate.pcapwriters),
+                medstate.pcapthreadcount) == -1) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: could not start pcap writing threads.");
+        return 1;
+    }
+
     update_pcap_msg_thread(&medstate);
 
-    /* Start the pcap output thread */
-    pthread_create(&(medstate.pcapthread), NULL, start_pcap_thread,
-            &(medstate.pcapqueue));
+    /* Start the threads that will read from connected collectors */
+    start_collector_threads(&medstate);
 
     /* Start the thread that listens for connections from collectors */
     if (start_collector_listener(&medstate) == -1) {
@@ -1898,14 +2619,7 @@ int main(int argc, char *argv[]) {
      */
     run(&medstate);
 
-    /* Tell the pcap thread to halt */
-    memset(&pcapmsg, 0, sizeof(pcapmsg));
-    pcapmsg.msgtype = PCAP_MESSAGE_HALT;
-    pcapmsg.msgbody = NULL;
-    pcapmsg.msglen = 0;
-    libtrace_message_queue_put(&(medstate.pcapqueue), &pcapmsg);
-
-    /* Clean up */
+    /* Clean up -- this will also halt the pcap output threads */
     destroy_med_state(&medstate);
     clear_med_config(&medstate);
 
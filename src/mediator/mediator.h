@@ -36,11 +36,15 @@
 #include "export_buffer.h"
 #include "util.h"
 #include "openli_tls.h"
+#include "openli_uring.h"
 #include "med_epoll.h"
 #include "pcapthread.h"
 #include "liidmapping.h"
 #include "mediator_prov.h"
 #include "mediator_coll.h"
+#include "collthread.h"
+#include "relay.h"
+#include "hosched.h"
 
 /** Global state variables for a mediator instance */
 typedef struct med_state {
@@ -97,6 +101,10 @@ typedef struct med_state {
     /** The epoll event for the epoll loop timer */
     med_epoll_ev_t *timerev;
 
+    /** The timer wheel for the handover keep alive and LIID cease timers,
+     *  which is advanced each time the epoll loop timer fires */
+    med_timer_wheel_t timers;
+
     /** The epoll event for the pcap file rotation timer */
     med_epoll_ev_t *pcaptimerev;
 
@@ -112,16 +120,54 @@ typedef struct med_state {
     /** The frequency to rotate the pcap files (in minutes) */
     uint32_t pcaprotatefreq;
 
-    /** The pthread ID for the pcap file writing thread */
-    pthread_t pcapthread;
+    /** The number of threads to use for writing pcap files */
+    int pcapthreadcount;
+
+    /** The maximum number of pcap files that may be open at once, across
+     *  all pcap writing threads (0 = no limit) */
+    uint32_t pcapmaxopen;
+
+    /** The largest size (in bytes) that any one net buffer may grow to */
+    uint64_t netbufferlimit;
 
-    /** The queue for pushing packets to the pcap file writing thread */
-    libtrace_message_queue_t pcapqueue;
+    /** The threads that write packets to pcap files */
+    pcap_writer_set_t pcapwriters;
 
     /** The SSL configuration for the mediator */
     openli_ssl_config_t sslconf;
     openli_RMQ_config_t RMQ_conf;
 
+    /** The configuration for spilling handover buffers to disk */
+    openli_spool_config_t spoolconf;
+
+    /** Set to 1 if handovers should be written using io_uring */
+    uint8_t use_iouring;
+
+    /** The io_uring used to batch handover transmissions */
+    openli_uring_t uring;
+
+    /** The number of threads to use for receiving from collectors -- if
+     *  zero, collectors are read by the main thread */
+    uint32_t collthreadcount;
+
+    /** The state for each of the collector receive threads */
+    coll_recv_worker_t *collthreads;
+
+    /** Prevents the LIID map and the agencies from being modified while
+     *  a collector receive thread is using them */
+    pthread_rwlock_t liidmap_lock;
+
+    /** State for sending records from collectors straight to the
+     *  handover sockets, without buffering them first */
+    handover_relay_t relay;
+
+    /** State for scheduling transmissions fairly across the handovers */
+    handover_sched_t hosched;
+
+    /** The handover backlog (in bytes) at which collectors are asked to
+     *  hold back the records for an agency (0 = never) */
+    uint64_t backpressure;
+
 } mediator_state_t;
 
 #endif
@@ -29,6 +29,7 @@
 #include "util.h"
 #include "logger.h"
 #include <unistd.h>
+#include <time.h>
 #include <assert.h>
 
 /** Initialises the state for the collectors managed by a mediator.
@@ -53,6 +54,11 @@ void init_med_collector_state(mediator_collector_t *medcol, uint8_t *usetls,
     medcol->epoll_fd = -1;
     medcol->rmqconf = rmqconf;
     medcol->parent_mediatorid = mediatorid;
+    medcol->worker_epoll_fds = NULL;
+    medcol->workercount = 0;
+    medcol->nextworker = 0;
+    pthread_mutex_init(&(medcol->disabled_mutex), NULL);
+    pthread_mutex_init(&(medcol->sslerror_mutex), NULL);
 }
 
 /** Destroys the state for the collectors managed by mediator, including
@@ -75,6 +81,170 @@ void destroy_med_collector_state(mediator_collector_t *medcol) {
     /* Dump all connected collectors */
     drop_all_collectors(medcol);
 
+    pthread_mutex_destroy(&(medcol->disabled_mutex));
+    pthread_mutex_destroy(&(medcol->sslerror_mutex));
+}
+
+/** Records the outcome of the most recent TLS handshake with a collector.
+ *
+ *  @param medcol       The global state for the collectors seen by the mediator
+ *  @param sslerror     The outcome of the handshake
+ *
+ *  @return the outcome of the previous handshake
+ */
+static int set_last_ssl_error(mediator_collector_t *medcol, int sslerror) {
+    int prev;
+
+    pthread_mutex_lock(&(medcol->sslerror_mutex));
+    prev = medcol->lastsslerror;
+    medcol->lastsslerror = sslerror;
+    pthread_mutex_unlock(&(medcol->sslerror_mutex));
+    return prev;
+}
+
+/** Tells a newly connected collector which optional protocol features
+ *  this mediator supports, e.g. batched record framing.
+ *
+ *  Older collectors never read from this socket, so they will simply
+ *  ignore this message.
+ *
+ *  @param fd           The file descriptor for the collector connection
+ *  @param ssl          The SSL socket for the collector connection, if
+ *                      using TLS
+ *  @param ipaddr       The IP address of the collector, for logging
+ */
+static void send_collector_capabilities(int fd, SSL *ssl, char *ipaddr) {
+
+    uint8_t msg[64];
+    int len, ret;
+    uint32_t caps = OPENLI_CAP_BATCHED_RECORDS;
+
+    if (compression_method_available(OPENLI_COMPRESS_LZ4)) {
+        caps |= OPENLI_CAP_COMPRESS_LZ4;
+    }
+    if (compression_method_available(OPENLI_COMPRESS_ZSTD)) {
+        caps |= OPENLI_CAP_COMPRESS_ZSTD;
+    }
+
+    len = construct_capabilities_message(msg, sizeof(msg), caps);
+    if (len < 0) {
+        return;
+    }
+
+    if (ssl) {
+        ret = SSL_write(ssl, msg, len);
+    } else {
+        ret = send(fd, msg, len, MSG_DONTWAIT);
+    }
+
+    /* The collector will just fall back to per-record framing if it
+     * doesn't get this message */
+    if (ret != len) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to send capabilities to collector %s",
+                ipaddr);
+    }
+}
+
+/** Sends a flow control message for an LIID to a collector.
+ *
+ *  @param cs           The collector to send the message to
+ *  @param fd           The file descriptor for the collector connection
+ *  @param liid         The LIID that the message is about
+ *  @param leasems      How long the collector should hold back the records
+ *                      for the LIID, or zero if it may resume sending them
+ *
+ *  @return -1 if the message could not be sent, 0 otherwise.
+ */
+static int send_collector_flow_control(single_coll_state_t *cs, int fd,
+        char *liid, uint32_t leasems) {
+
+    /* Collectors won't accept a control message that is any larger */
+    uint8_t msg[256];
+    int len, ret;
+
+    len = construct_flow_control_message(msg, sizeof(msg), liid, leasems);
+    if (len < 0) {
+        return -1;
+    }
+
+    if (cs->ssl) {
+        ret = SSL_write(cs->ssl, msg, len);
+    } else {
+        ret = send(fd, msg, len, MSG_DONTWAIT);
+    }
+
+    /* This socket is otherwise only ever used to send the capabilities,
+     * so a failure here means something has gone badly wrong. Collectors
+     * stop holding records once the lease runs out, so the safest thing
+     * to do is to stop sending flow control messages on this connection.
+     */
+    if (ret != len) {
+        if (cs->disabled_log == 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: unable to send flow control message to collector %s -- disabling flow control for this connection",
+                    cs->ipaddr);
+        }
+        cs->flowfailed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+void update_collector_flow(single_coll_state_t *cs, int fd,
+        liid_map_entry_t *mapping) {
+
+    coll_flow_hold_t *hold;
+    struct timespec ts;
+    uint64_t now;
+    uint8_t congested;
+
+    if (cs->flowfailed) {
+        return;
+    }
+
+    /* Records that are going to a pcap file are never held back */
+    if (mapping->agency == NULL) {
+        congested = 0;
+    } else {
+        congested = __atomic_load_n(&(mapping->agency->congested),
+                __ATOMIC_RELAXED);
+    }
+    if (!congested && cs->flowholds == NULL) {
+        return;
+    }
+
+    HASH_FIND(hh, cs->flowholds, mapping->liid, strlen(mapping->liid), hold);
+
+    if (!congested) {
+        if (hold == NULL) {
+            return;
+        }
+        HASH_DELETE(hh, cs->flowholds, hold);
+        send_collector_flow_control(cs, fd, hold->liid, 0);
+        free(hold->liid);
+        free(hold);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+    if (hold == NULL) {
+        hold = (coll_flow_hold_t *)calloc(1, sizeof(coll_flow_hold_t));
+        if (hold == NULL) {
+            return;
+        }
+        hold->liid = strdup(mapping->liid);
+        HASH_ADD_KEYPTR(hh, cs->flowholds, hold->liid, strlen(hold->liid),
+                hold);
+    } else if (now - hold->lastsent < COLL_FLOW_LEASE_MS / 2) {
+        /* Records that were already in flight when we asked */
+        return;
+    }
+
+    hold->lastsent = now;
+    send_collector_flow_control(cs, fd, hold->liid, COLL_FLOW_LEASE_MS);
 }
 
 /** Accepts a connection from a collector and prepares to receive encoded
@@ -99,7 +269,9 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
     disabled_collector_t *discol = NULL;
     int fdtype;
     int r = OPENLI_SSL_CONNECT_NOSSL;
+    int epoll_fd = medcol->epoll_fd;
     char stringspace[32];
+    char desc[INET6_ADDRSTRLEN + 16];
 
     /* TODO check for EPOLLHUP or EPOLLERR */
 
@@ -130,12 +302,11 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
             SSL_free(col->ssl);
             col->ssl = NULL;
 
-            if (r != medcol->lastsslerror) {
+            if (set_last_ssl_error(medcol, r) != r) {
                 logger(LOG_INFO,
                         "OpenLI: SSL Handshake failed for collector %s",
                         strbuf);
             }
-            medcol->lastsslerror = r;
             return -1;
         }
 
@@ -145,7 +316,7 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
         } else {
             /* Handshake completed, go straight to "Ready" mode */
             fdtype = MED_EPOLL_COLLECTOR;
-            medcol->lastsslerror = 0;
+            set_last_ssl_error(medcol, 0);
         }
     } else {
         /* Not using TLS, we're good to go right away */
@@ -181,25 +352,21 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
         }
     }
 
-    /* Add fd to epoll */
-    col->colev = create_mediator_fdevent(medcol->epoll_fd, mstate, fdtype,
-            newfd, EPOLLIN | EPOLLRDHUP);
-
-    if (col->colev == NULL) {
-        logger(LOG_INFO,
-                "OpenLI Mediator: unable to add collector fd to epoll: %s.",
-                strerror(errno));
-        goto acceptfail;
-    }
-    mstate->ssl = col->ssl;
-    mstate->owner = col;
-    if (!mstate->incoming) {
-        mstate->incoming = create_net_buffer(NETBUF_RECV, newfd, col->ssl);
+    /* If we have collector receive threads, the thread that we add the fd
+     * to will take care of everything from here on (including the rest
+     * of the TLS handshake) */
+    if (medcol->workercount > 0) {
+        epoll_fd = medcol->worker_epoll_fds[medcol->nextworker];
+        medcol->nextworker = (medcol->nextworker + 1) % medcol->workercount;
     }
 
-    /* Check if this is a reconnection case */
+    /* Check if this is a reconnection case -- this needs to happen before
+     * the fd is added to epoll, as a receive thread may start using
+     * mstate straight away */
+    pthread_mutex_lock(&(medcol->disabled_mutex));
     HASH_FIND(hh, medcol->disabledcols, mstate->ipaddr,
             strlen(mstate->ipaddr), discol);
+    pthread_mutex_unlock(&(medcol->disabled_mutex));
 
     if (discol) {
         mstate->disabled_log = 1;
@@ -210,9 +377,46 @@ int mediator_accept_collector(mediator_collector_t *medcol, int listenfd) {
         mstate->disabled_log = 0;
     }
 
+    mstate->ssl = col->ssl;
+    mstate->owner = col;
+    if (!mstate->incoming) {
+        mstate->incoming = create_net_buffer(NETBUF_RECV, newfd, col->ssl);
+    }
+
+    if (col->ssl && fdtype == MED_EPOLL_COLLECTOR) {
+        snprintf(desc, sizeof(desc), "collector %s", strbuf);
+        log_ssl_offload_mode(col->ssl, desc);
+    }
+
+    /* Collectors using RMQ don't send their records over this socket */
+    if (fdtype == MED_EPOLL_COLLECTOR && !medcol->rmqconf->enabled) {
+        send_collector_capabilities(newfd, col->ssl, strbuf);
+    }
+
+    col->colev = prepare_mediator_fdevent(epoll_fd, mstate, fdtype, newfd);
+    if (col->colev == NULL) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to create epoll event for collector %s.",
+                strbuf);
+        goto acceptfail;
+    }
+
     /* Add this collector to the set of active collectors */
     libtrace_list_push_back(medcol->collectors, &col);
 
+    /* Add fd to epoll -- this must be the last thing that we do, as a
+     * receive thread may start using (or even drop) the collector as soon
+     * as the fd is in its epoll set */
+    if (register_mediator_fdevent(col->colev, EPOLLIN | EPOLLRDHUP) < 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to add collector fd to epoll: %s.",
+                strerror(errno));
+        /* The collector is already on the active list, so just drop it
+         * in the usual way -- this also closes newfd and the RMQ fd */
+        drop_collector(medcol, col->colev, 0);
+        return -1;
+    }
+
     return newfd;
 
 acceptfail:
@@ -228,6 +432,9 @@ acceptfail:
         free(col);
     }
 
+    if (mstate->incoming) {
+        destroy_net_buffer(mstate->incoming);
+    }
     free(mstate->ipaddr);
     free(mstate);
     return -1;
@@ -245,6 +452,7 @@ int continue_collector_handshake(mediator_collector_t *medcol,
         med_epoll_ev_t *mev) {
 
     single_coll_state_t *cs = (single_coll_state_t *)(mev->state);
+    char desc[INET6_ADDRSTRLEN + 16];
 
     //either keep running handshake or return when error
     int ret = SSL_accept(cs->ssl);
@@ -263,7 +471,10 @@ int continue_collector_handshake(mediator_collector_t *medcol,
         }
     }
     logger(LOG_INFO, "OpenLI: Pending SSL Handshake for collector accepted");
-    medcol->lastsslerror = 0;
+    set_last_ssl_error(medcol, 0);
+
+    snprintf(desc, sizeof(desc), "collector %s", cs->ipaddr);
+    log_ssl_offload_mode(cs->ssl, desc);
 
     //handshake has finished
     if (medcol->rmqconf->enabled) {
@@ -283,6 +494,8 @@ int continue_collector_handshake(mediator_collector_t *medcol,
                     strerror(errno));
             return -1;
         }
+    } else {
+        send_collector_capabilities(mev->fd, cs->ssl, cs->ipaddr);
     }
     mev->fdtype = MED_EPOLL_COLLECTOR;
     return 1;
@@ -299,6 +512,8 @@ int continue_collector_handshake(mediator_collector_t *medcol,
 void drop_collector(mediator_collector_t *medcol,
         med_epoll_ev_t *colev, int disablelog) {
     single_coll_state_t *mstate;
+    coll_flow_hold_t *hold, *htmp;
+    int i;
 
     if (!colev) {
         return;
@@ -315,6 +530,7 @@ void drop_collector(mediator_collector_t *medcol,
         disabled_collector_t *discol;
 
         /* Add this collector to the disabled collectors list. */
+        pthread_mutex_lock(&(medcol->disabled_mutex));
         HASH_FIND(hh, medcol->disabledcols, mstate->ipaddr,
                 strlen(mstate->ipaddr), discol);
         if (discol == NULL) {
@@ -326,6 +542,7 @@ void drop_collector(mediator_collector_t *medcol,
             HASH_ADD_KEYPTR(hh, medcol->disabledcols, discol->ipaddr,
                     strlen(discol->ipaddr), discol);
         }
+        pthread_mutex_unlock(&(medcol->disabled_mutex));
     }
 
     if (mstate && mstate->incoming) {
@@ -338,11 +555,24 @@ void drop_collector(mediator_collector_t *medcol,
         mstate->incoming_rmq = NULL;
     }
 
+    for (i = 0; i < MAX_PCAP_THREADS; i++) {
+        if (mstate->pcapbatch[i]) {
+            release_pcap_batch(mstate->pcapbatch[i]);
+            mstate->pcapbatch[i] = NULL;
+        }
+    }
+
     if (mstate->ipaddr) {
         free(mstate->ipaddr);
         mstate->ipaddr = NULL;
     }
 
+    HASH_ITER(hh, mstate->flowholds, hold, htmp) {
+        HASH_DELETE(hh, mstate->flowholds, hold);
+        free(hold->liid);
+        free(hold);
+    }
+
     if (mstate->amqp_state) {
         amqp_destroy_connection(mstate->amqp_state);
         mstate->amqp_state = NULL;
@@ -401,9 +631,14 @@ void reenable_collector_logging(mediator_collector_t *medcol,
     disabled_collector_t *discol = NULL;
 
     cs->disabled_log = 0;
+    pthread_mutex_lock(&(medcol->disabled_mutex));
     HASH_FIND(hh, medcol->disabledcols, cs->ipaddr, strlen(cs->ipaddr), discol);
     if (discol) {
         HASH_DELETE(hh, medcol->disabledcols, discol);
+    }
+    pthread_mutex_unlock(&(medcol->disabled_mutex));
+
+    if (discol) {
         free(discol->ipaddr);
         free(discol);
         logger(LOG_INFO, "collector %s has successfully re-connected",
@@ -411,6 +646,76 @@ void reenable_collector_logging(mediator_collector_t *medcol,
     }
 }
 
+/** Empties a collector's LIID cache if it was populated using an older
+ *  version of the LIID map.
+ *
+ *  @param cs           The collector to check the cache for
+ *  @param generation   The current generation of the LIID map
+ */
+static inline void validate_collector_liid_cache(single_coll_state_t *cs,
+        uint32_t generation) {
+
+    if (cs->liidcache_gen == generation) {
+        return;
+    }
+    memset(cs->liidcache, 0, sizeof(cs->liidcache));
+    cs->liidcache_next = 0;
+    cs->liidcache_gen = generation;
+}
+
+int lookup_collector_liid_cache(single_coll_state_t *cs, uint32_t generation,
+        uint8_t *etsimsg, uint16_t msglen, uint16_t *liidlen,
+        liid_map_entry_t **mapping) {
+
+    coll_liid_cache_entry_t *ent;
+    uint16_t l;
+    int i;
+
+    validate_collector_liid_cache(cs, generation);
+
+    if (msglen < sizeof(l)) {
+        return 0;
+    }
+
+    /* LIID length is stored in network byte order, just like in
+     * extract_liid_from_exported_msg() */
+    memcpy(&l, etsimsg, sizeof(l));
+    l = ntohs(l);
+    if (l == 0 || l > msglen - sizeof(l)) {
+        return 0;
+    }
+
+    for (i = 0; i < COLL_LIID_CACHE_SIZE; i++) {
+        ent = &(cs->liidcache[i]);
+        if (ent->liidlen == l && memcmp(ent->liid, etsimsg + sizeof(l),
+                    l) == 0) {
+            *mapping = ent->mapping;
+            *liidlen = l + sizeof(l);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void add_collector_liid_cache(single_coll_state_t *cs, uint32_t generation,
+        char *liid, uint16_t len, liid_map_entry_t *mapping) {
+
+    coll_liid_cache_entry_t *ent;
+
+    if (len == 0 || len > COLL_LIID_CACHE_MAXLEN) {
+        return;
+    }
+
+    validate_collector_liid_cache(cs, generation);
+
+    ent = &(cs->liidcache[cs->liidcache_next]);
+    memcpy(ent->liid, liid, len);
+    ent->liidlen = len;
+    ent->mapping = mapping;
+
+    cs->liidcache_next = (cs->liidcache_next + 1) % COLL_LIID_CACHE_SIZE;
+}
+
 void service_RMQ_connections(mediator_collector_t *medcol) {
 
     libtrace_list_node_t *curr;
@@ -27,15 +27,56 @@
 #ifndef OPENLI_MEDIATOR_COLL_H_
 #define OPENLI_MEDIATOR_COLL_H_
 
+#include <pthread.h>
 #include <uthash.h>
 #include <libtrace/linked_list.h>
 #include <amqp.h>
 #include "med_epoll.h"
 #include "netcomms.h"
 #include "openli_tls.h"
+#include "liidmapping.h"
+#include "pcapthread.h"
 
 typedef struct active_collector active_collector_t;
 
+/** The number of recently seen LIIDs to remember for each collector */
+#define COLL_LIID_CACHE_SIZE 8
+
+/** The longest LIID that will be remembered by the LIID cache */
+#define COLL_LIID_CACHE_MAXLEN 64
+
+/** An LIID that was recently received from a collector, along with the
+ *  LIID->agency mapping that it matched.
+ */
+typedef struct coll_liid_cache_entry {
+    /** The length of the LIID, or 0 if this entry is unused */
+    uint16_t liidlen;
+
+    /** The LIID itself (not null-terminated) */
+    char liid[COLL_LIID_CACHE_MAXLEN];
+
+    /** The mapping for the LIID, or NULL if the LIID has no mapping */
+    liid_map_entry_t *mapping;
+} coll_liid_cache_entry_t;
+
+/** How long (in milliseconds) a collector should hold back the records
+ *  for an LIID after being asked to, unless we renew the request */
+#define COLL_FLOW_LEASE_MS 2000
+
+/** An LIID that a collector has been asked to hold back, because the
+ *  agency that it belongs to is congested.
+ */
+typedef struct coll_flow_hold {
+    /** The LIID being held back */
+    char *liid;
+
+    /** The time (in milliseconds) when we last asked the collector to
+     *  hold back this LIID */
+    uint64_t lastsent;
+
+    UT_hash_handle hh;
+} coll_flow_hold_t;
+
 /** Describes a collector which has been temporarily disabled, e.g. due to
  *  a connection breaking down.
  */
@@ -76,6 +117,26 @@ typedef struct single_coll_state {
     amqp_bytes_t rmq_queueid;
 
     active_collector_t *owner;
+
+    /** The LIIDs that have been recently received from this collector */
+    coll_liid_cache_entry_t liidcache[COLL_LIID_CACHE_SIZE];
+
+    /** The LIID map generation that the cached LIIDs were looked up in */
+    uint32_t liidcache_gen;
+
+    /** The index of the cache entry that will be replaced next */
+    uint8_t liidcache_next;
+
+    /** Records from this collector that are waiting to be sent to the
+     *  pcap writing threads, one batch per thread */
+    pcap_batch_t *pcapbatch[MAX_PCAP_THREADS];
+
+    /** The LIIDs that this collector has been asked to hold back */
+    coll_flow_hold_t *flowholds;
+
+    /** Set to 1 if we have failed to send a flow control message to this
+     *  collector, so no more should be attempted on this connection */
+    uint8_t flowfailed;
 } single_coll_state_t;
 
 /** An instance of an active collector */
@@ -99,6 +160,11 @@ typedef struct mediator_collector_glob_state {
      */
     int lastsslerror;
 
+    /** Protects lastsslerror, which may be updated by the collector
+     *  receive threads as well as the main thread.
+     */
+    pthread_mutex_t sslerror_mutex;
+
     /** Points to the flag that indicates whether collector connections are
      *  using TLS.
      */
@@ -107,6 +173,23 @@ typedef struct mediator_collector_glob_state {
     /** The global epoll fd for this mediator instance. */
     int epoll_fd;
 
+    /** The epoll fds for the collector receive threads, if any. New
+     *  collector connections are assigned to these in turn; otherwise
+     *  they are added to the global epoll fd.
+     */
+    int *worker_epoll_fds;
+
+    /** The number of collector receive threads */
+    int workercount;
+
+    /** The index of the receive thread to assign the next collector to */
+    int nextworker;
+
+    /** Protects the disabled collector map, which may be updated by
+     *  multiple collector receive threads.
+     */
+    pthread_mutex_t disabled_mutex;
+
     /** The list of currently active collector connections. */
     libtrace_list_t *collectors;
 
@@ -196,6 +279,51 @@ void drop_all_collectors(mediator_collector_t *medcol);
 void reenable_collector_logging(mediator_collector_t *medcol,
         single_coll_state_t *cs);
 
+/** Looks for the LIID of a record received from a collector in the
+ *  collector's cache of recently matched LIIDs.
+ *
+ *  @param cs           The collector that sent the record
+ *  @param generation   The current generation of the LIID map
+ *  @param etsimsg      The start of the record, i.e. the LIID length
+ *  @param msglen       The length of the record
+ *  @param liidlen[out] The number of bytes to strip from the front of the
+ *                      record to reach the ETSI record (only set on a hit)
+ *  @param mapping[out] The cached LIID->agency mapping, which may be NULL
+ *                      if the LIID is not known (only set on a hit)
+ *
+ *  @return 1 if the LIID was found in the cache, 0 otherwise.
+ */
+int lookup_collector_liid_cache(single_coll_state_t *cs, uint32_t generation,
+        uint8_t *etsimsg, uint16_t msglen, uint16_t *liidlen,
+        liid_map_entry_t **mapping);
+
+/** Adds the result of an LIID lookup to a collector's LIID cache.
+ *
+ *  @param cs           The collector that sent the LIID
+ *  @param generation   The current generation of the LIID map
+ *  @param liid         The LIID that was looked up (not null-terminated)
+ *  @param len          The length of the LIID
+ *  @param mapping      The result of the lookup (NULL if the LIID is not
+ *                      in the map)
+ */
+void add_collector_liid_cache(single_coll_state_t *cs, uint32_t generation,
+        char *liid, uint16_t len, liid_map_entry_t *mapping);
+
+/** Asks a collector to hold back the records for an LIID if the agency
+ *  that the LIID belongs to is congested, or to resume sending them if
+ *  the collector was holding them back and the agency has caught up.
+ *
+ *  Should be called whenever a record for an agency is received from a
+ *  collector. Only the thread that reads from the collector may call
+ *  this.
+ *
+ *  @param cs           The collector that sent the record
+ *  @param fd           The file descriptor for the collector connection
+ *  @param mapping      The LIID->agency mapping that the record matched
+ */
+void update_collector_flow(single_coll_state_t *cs, int fd,
+        liid_map_entry_t *mapping);
+
 int receive_rmq_invite(mediator_collector_t *medcol,
         single_coll_state_t *mstate);
 
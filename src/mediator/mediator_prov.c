@@ -46,6 +46,8 @@ void init_provisioner_instance(mediator_prov_t *prov, SSL_CTX **ctx) {
 	prov->lastsslerror = 0;
     prov->provport = NULL;
     prov->provaddr = NULL;
+    prov->confepoch = 0;
+    prov->confversion = 0;
 }
 
 /** Create an epoll timer event for the next attempt to reconnect to the
@@ -221,7 +223,8 @@ static int init_provisioner_connection(mediator_prov_t *prov, int sock) {
     prov->incoming = create_net_buffer(NETBUF_RECV, sock, prov->ssl);
 
     if (push_auth_onto_net_buffer(prov->outgoing,
-                OPENLI_PROTO_MEDIATOR_AUTH) == -1) {
+                OPENLI_PROTO_MEDIATOR_AUTH, prov->confepoch,
+                prov->confversion) == -1) {
         if (prov->disable_log == 0) {
             logger(LOG_INFO, "OpenLI Mediator: unable to push auth message for provisioner.");
         }
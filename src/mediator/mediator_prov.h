@@ -77,6 +77,14 @@ typedef struct mediator_provisioner {
 
     /** The port number of the provisioner, derived from the config file */
     char *provport;
+
+    /** The epoch of the provisioner configuration that we have most
+     *  recently been told about, or 0 if we have no usable configuration */
+    uint64_t confepoch;
+
+    /** The version of the provisioner configuration that we have, within
+     *  the epoch above */
+    uint64_t confversion;
 } mediator_prov_t;
 
 /** Initialises a provisioner instance with an OpenLI mediator
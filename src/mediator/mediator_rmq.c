@@ -30,6 +30,11 @@
 #include "mediator_coll.h"
 #include "logger.h"
 
+/** The number of unacknowledged messages that the broker may deliver to
+ *  us at once -- twice a consume batch, so that the next batch is already
+ *  on its way while we acknowledge the last one */
+#define MEDIATOR_RMQ_PREFETCH (RMQ_CONSUME_BATCH * 2)
+
 static amqp_connection_state_t join_RMQ(mediator_collector_t *medcol,
 		uint8_t *msgbody, uint16_t msglen, int logDisabled,
         single_coll_state_t *mstate) {
@@ -180,6 +185,15 @@ static amqp_connection_state_t join_RMQ(mediator_collector_t *medcol,
     }
 
 
+    amqp_basic_qos(amqp_state, 1, 0, MEDIATOR_RMQ_PREFETCH, 0);
+
+    if (amqp_get_rpc_reply(amqp_state).reply_type != AMQP_RESPONSE_NORMAL ) {
+        if (!logDisabled)
+            logger(LOG_INFO, "OpenLI Mediator: RMQ Failed to set prefetch count");
+        amqp_destroy_connection(amqp_state);
+        return NULL;
+    }
+
     amqp_basic_consume(amqp_state,
             1,
             mstate->rmq_queueid,
@@ -25,6 +25,7 @@
  */
 
 #include <unistd.h>
+#include <inttypes.h>
 
 #include "logger.h"
 #include "mediator.h"
@@ -32,6 +33,320 @@
 #include <libtrace.h>
 #include <assert.h>
 
+/** The amount of record data that a pcap batch can hold before it will be
+ *  sent to the pcap thread */
+#define PCAP_BATCH_SIZE (256 * 1024)
+
+/** The maximum number of unused batches to keep in a pcap batch pool */
+#define PCAP_BATCH_POOL_MAX 32
+
+/** The number of consecutive flushes (one per minute) with nothing written
+ *  before an idle pcap file is closed, if the number of open files is
+ *  limited */
+#define PCAP_IDLE_FLUSHES 5
+
+/** Chooses the pcap writing thread that will handle a given LIID.
+ *
+ *  @param set          The set of pcap writing threads
+ *  @param liid         The LIID (not null-terminated)
+ *  @param liidlen      The length of the LIID
+ *
+ *  @return the index of the writing thread for the LIID.
+ */
+static int pcap_writer_index(pcap_writer_set_t *set, const uint8_t *liid,
+        uint16_t liidlen) {
+
+    uint32_t hash = 2166136261u;
+    uint16_t i;
+
+    if (set->count <= 1) {
+        return 0;
+    }
+
+    /* FNV-1a */
+    for (i = 0; i < liidlen; i++) {
+        hash ^= liid[i];
+        hash *= 16777619u;
+    }
+    return hash % set->count;
+}
+
+void init_pcap_batch_pool(pcap_batch_pool_t *pool) {
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pool->freelist = NULL;
+    pool->freecount = 0;
+}
+
+void destroy_pcap_batch_pool(pcap_batch_pool_t *pool) {
+    pcap_batch_t *batch;
+
+    while (pool->freelist) {
+        batch = pool->freelist;
+        pool->freelist = batch->next;
+        free(batch->buf);
+        free(batch);
+    }
+    pool->freecount = 0;
+    pthread_mutex_destroy(&(pool->mutex));
+}
+
+/** Takes an empty pcap batch from a pool, creating a new batch if there
+ *  are none available.
+ *
+ *  @param pool             The pool to take the batch from
+ *
+ *  @return an empty pcap batch, or NULL if an error occurs.
+ */
+static pcap_batch_t *get_pcap_batch(pcap_batch_pool_t *pool) {
+    pcap_batch_t *batch;
+
+    pthread_mutex_lock(&(pool->mutex));
+    batch = pool->freelist;
+    if (batch) {
+        pool->freelist = batch->next;
+        pool->freecount --;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if (batch == NULL) {
+        batch = (pcap_batch_t *)calloc(1, sizeof(pcap_batch_t));
+        if (batch == NULL) {
+            return NULL;
+        }
+        batch->buf = (uint8_t *)malloc(PCAP_BATCH_SIZE);
+        if (batch->buf == NULL) {
+            free(batch);
+            return NULL;
+        }
+        batch->alloc = PCAP_BATCH_SIZE;
+        batch->pool = pool;
+    }
+
+    batch->used = 0;
+    batch->next = NULL;
+    return batch;
+}
+
+void release_pcap_batch(pcap_batch_t *batch) {
+    pcap_batch_pool_t *pool = batch->pool;
+
+    /* Don't hang on to batches that had to be grown to fit an unusually
+     * large record */
+    if (batch->alloc == PCAP_BATCH_SIZE) {
+        pthread_mutex_lock(&(pool->mutex));
+        if (pool->freecount < PCAP_BATCH_POOL_MAX) {
+            batch->next = pool->freelist;
+            pool->freelist = batch;
+            pool->freecount ++;
+            batch = NULL;
+        }
+        pthread_mutex_unlock(&(pool->mutex));
+    }
+
+    if (batch) {
+        free(batch->buf);
+        free(batch);
+    }
+}
+
+void send_pcap_message(pcap_writer_t *writer, uint8_t msgtype,
+        uint8_t *msgbody, uint16_t msglen) {
+    mediator_pcap_msg_t pcapmsg;
+
+    memset(&pcapmsg, 0, sizeof(pcapmsg));
+    pcapmsg.msgtype = msgtype;
+    pcapmsg.msgbody = msgbody;
+    pcapmsg.msglen = msglen;
+    libtrace_message_queue_put(&(writer->inqueue), &pcapmsg);
+}
+
+void broadcast_pcap_string(pcap_writer_set_t *set, uint8_t msgtype,
+        const char *str) {
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        if (str) {
+            send_pcap_message(&(set->writers[i]), msgtype,
+                    (uint8_t *)strdup(str), strlen(str));
+        } else {
+            send_pcap_message(&(set->writers[i]), msgtype, NULL, 0);
+        }
+    }
+}
+
+void disable_pcap_liid(pcap_writer_set_t *set, const char *liid) {
+    int ind;
+
+    if (set->count == 0) {
+        return;
+    }
+    ind = pcap_writer_index(set, (const uint8_t *)liid, strlen(liid));
+    send_pcap_message(&(set->writers[ind]), PCAP_MESSAGE_DISABLE_LIID,
+            (uint8_t *)strdup(liid), strlen(liid) + 1);
+}
+
+/** Sends a pcap batch to a pcap writing thread, if it contains any records.
+ *
+ *  @param batch        The batch to send -- will be set to NULL if the
+ *                      batch is sent
+ *  @param writer       The pcap writing thread to send the batch to
+ */
+static void send_pcap_batch(pcap_batch_t **batch, pcap_writer_t *writer) {
+
+    if (*batch == NULL || (*batch)->used == 0) {
+        return;
+    }
+
+    send_pcap_message(writer, PCAP_MESSAGE_BATCH, (uint8_t *)(*batch), 0);
+    *batch = NULL;
+}
+
+void send_pcap_batches(pcap_writer_set_t *set, pcap_batch_t **batches) {
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        send_pcap_batch(&(batches[i]), &(set->writers[i]));
+    }
+}
+
+int append_pcap_batch_record(pcap_writer_set_t *set, pcap_batch_t **batches,
+        uint8_t rectype, uint8_t *liid, uint16_t liidlen, uint8_t *rec,
+        uint32_t reclen) {
+
+    pcap_batch_record_t hdr;
+    pcap_batch_t *b, **batch;
+    uint32_t required = sizeof(hdr) + liidlen + reclen;
+    uint8_t *tmp;
+    int ind;
+
+    if (set->count == 0) {
+        return 0;
+    }
+
+    ind = pcap_writer_index(set, liid, liidlen);
+    batch = &(batches[ind]);
+
+    if (*batch && (*batch)->alloc - (*batch)->used < required) {
+        send_pcap_batch(batch, &(set->writers[ind]));
+    }
+
+    if (*batch == NULL) {
+        *batch = get_pcap_batch(&(set->pool));
+        if (*batch == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: OOM while creating a batch for the pcap thread");
+            return -1;
+        }
+    }
+    b = *batch;
+
+    if (b->alloc - b->used < required) {
+        /* A single record that is bigger than an entire batch */
+        tmp = realloc(b->buf, b->used + required);
+        if (tmp == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: OOM while adding a record to a pcap batch");
+            return -1;
+        }
+        b->buf = tmp;
+        b->alloc = b->used + required;
+    }
+
+    hdr.rectype = rectype;
+    hdr.liidlen = liidlen;
+    hdr.reclen = reclen;
+
+    memcpy(b->buf + b->used, &hdr, sizeof(hdr));
+    memcpy(b->buf + b->used + sizeof(hdr), liid, liidlen);
+    memcpy(b->buf + b->used + sizeof(hdr) + liidlen, rec, reclen);
+    b->used += required;
+    return 0;
+}
+
+/** Removes a pcap output from the list of outputs with an open file.
+ *
+ *  @param pstate           The state for the pcap output thread
+ *  @param pcapout          The pcap output to remove from the list
+ */
+static void lru_unlink_pcap_output(pcap_thread_state_t *pstate,
+        active_pcap_output_t *pcapout) {
+
+    if (pcapout->lruprev) {
+        pcapout->lruprev->lrunext = pcapout->lrunext;
+    } else {
+        pstate->lruhead = pcapout->lrunext;
+    }
+    if (pcapout->lrunext) {
+        pcapout->lrunext->lruprev = pcapout->lruprev;
+    } else {
+        pstate->lrutail = pcapout->lruprev;
+    }
+    pcapout->lruprev = NULL;
+    pcapout->lrunext = NULL;
+}
+
+/** Moves a pcap output with an open file to the front of the list of
+ *  open outputs, i.e. marks it as the most recently used output.
+ *
+ *  @param pstate           The state for the pcap output thread
+ *  @param pcapout          The pcap output that has been used
+ */
+static void lru_touch_pcap_output(pcap_thread_state_t *pstate,
+        active_pcap_output_t *pcapout) {
+
+    if (pstate->lruhead == pcapout) {
+        return;
+    }
+    if (pcapout->lruprev || pcapout->lrunext || pstate->lrutail == pcapout) {
+        lru_unlink_pcap_output(pstate, pcapout);
+    }
+
+    pcapout->lrunext = pstate->lruhead;
+    pcapout->lruprev = NULL;
+    if (pstate->lruhead) {
+        pstate->lruhead->lruprev = pcapout;
+    }
+    pstate->lruhead = pcapout;
+    if (pstate->lrutail == NULL) {
+        pstate->lrutail = pcapout;
+    }
+}
+
+/** Closes the file for a pcap output, but keeps the output itself so
+ *  that a new file can be opened if more packets arrive for the LIID.
+ *
+ *  @param pstate           The state for the pcap output thread
+ *  @param pcapout          The pcap output to close the file for
+ */
+static void close_pcap_output_file(pcap_thread_state_t *pstate,
+        active_pcap_output_t *pcapout) {
+
+    if (pcapout->out == NULL) {
+        return;
+    }
+    trace_destroy_output(pcapout->out);
+    pcapout->out = NULL;
+    lru_unlink_pcap_output(pstate, pcapout);
+    pstate->opencount --;
+}
+
+/** Closes a pcap output and removes it from the set of active outputs.
+ *
+ *  @param pstate           The state for the pcap output thread
+ *  @param pcapout          The pcap output to remove
+ */
+static void remove_pcap_output(pcap_thread_state_t *pstate,
+        active_pcap_output_t *pcapout) {
+
+    close_pcap_output_file(pstate, pcapout);
+    HASH_DELETE(hh, pstate->active, pcapout);
+    if (pstate->lastout == pcapout) {
+        pstate->lastout = NULL;
+    }
+    free(pcapout->liid);
+    free(pcapout);
+}
+
 /** Halt all ongoing pcap outputs and close their respective files.
  *
  *  @param pstate           The state for the pcap output thread
@@ -41,10 +356,7 @@ static void halt_pcap_outputs(pcap_thread_state_t *pstate) {
     active_pcap_output_t *out, *tmp;
 
     HASH_ITER(hh, pstate->active, out, tmp) {
-        HASH_DELETE(hh, pstate->active, out);
-        free(out->liid);
-        trace_destroy_output(out->out);
-        free(out);
+        remove_pcap_output(pstate, out);
     }
 }
 
@@ -109,7 +421,53 @@ static int populate_pcap_uri(pcap_thread_state_t *pstate, char *urispace,
     return 1;
 }
 
+/** Makes sure that a new pcap file will not overwrite an existing file,
+ *  e.g. if an idle file was closed and a new file is being opened for
+ *  the same LIID within the same second. If the file already exists, a
+ *  numeric suffix is added to the file name.
+ *
+ *  @param uri              The libtrace URI for the new file, which may be
+ *                          modified by this function
+ *  @param urilen           The size of the buffer holding the URI
+ *
+ *  @return -1 if no unused file name could be found, 0 otherwise.
+ */
+static int avoid_pcap_overwrite(char *uri, size_t urilen) {
+
+    char *path = uri + strlen("pcapfile:");
+    char *ext, *next;
+    char extspace[16];
+    int i;
+
+    if (access(path, F_OK) != 0) {
+        return 0;
+    }
+
+    /* Insert the suffix in front of the ".pcap" (or ".pcap.gz") */
+    ext = NULL;
+    next = path;
+    while ((next = strstr(next, ".pcap")) != NULL) {
+        ext = next;
+        next ++;
+    }
+    if (ext == NULL || strlen(ext) >= sizeof(extspace)) {
+        return -1;
+    }
+    strcpy(extspace, ext);
+
+    for (i = 1; i < 1000; i++) {
+        snprintf(ext, urilen - (ext - uri), "-%d%s", i, extspace);
+        if (access(path, F_OK) != 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
 /** Opens a pcap output file using libtrace, named after the current time.
+ *
+ *  If this thread already has as many open files as it is allowed, the
+ *  least recently used file is closed first.
  *
  *  @param pstate           The state for the pcap output thread
  *  @param act              The intercept that requires a new pcap file
@@ -164,6 +522,20 @@ static int open_pcap_output_file(pcap_thread_state_t *pstate,
         }
     }
 
+    if (avoid_pcap_overwrite(uri, 4096) < 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: unable to find an unused file name for pcap output %s",
+                uri);
+        return -1;
+    }
+
+    if (pstate->openlimit > 0) {
+        while (pstate->opencount >= pstate->openlimit && pstate->lrutail) {
+            close_pcap_output_file(pstate, pstate->lrutail);
+            pstate->filesclosed ++;
+        }
+    }
+
     /* Libtrace boiler-plate for creating an output file - we use zlib
      * compression level 1 here for a good balance between compression ratio
      * and inter-operability with other software.
@@ -216,6 +588,10 @@ static int open_pcap_output_file(pcap_thread_state_t *pstate,
     logger(LOG_INFO, "OpenLI Mediator: opened new trace file %s for LIID %s",
             uri, act->liid);
     act->pktwritten = 0;
+    act->idleflushes = 0;
+    lru_touch_pcap_output(pstate, act);
+    pstate->opencount ++;
+    pstate->filesopened ++;
 
     return 0;
 
@@ -239,8 +615,9 @@ static active_pcap_output_t *create_new_pcap_output(pcap_thread_state_t *pstate,
 
     active_pcap_output_t *act;
 
-    act = (active_pcap_output_t *)malloc(sizeof(active_pcap_output_t));
+    act = (active_pcap_output_t *)calloc(1, sizeof(active_pcap_output_t));
     act->liid = strdup(liid);
+    act->liidlen = strlen(liid);
 
     if (open_pcap_output_file(pstate, act) == -1) {
         free(act->liid);
@@ -251,164 +628,175 @@ static active_pcap_output_t *create_new_pcap_output(pcap_thread_state_t *pstate,
     return act;
 }
 
-/** Writes a raw captured IP packet to a pcap trace file.
- *
- *  The IP packet must be prepended with the LIID of the intercept that
- *  triggered this packet's capture.
+/** Finds the pcap output for an LIID, creating a new output if the LIID
+ *  has not been seen before.
  *
  *  @param pstate           The state for the pcap output thread
- *  @param pcapmsg          The message containing the captured packet, as
- *                          received from the collector.
+ *  @param liid             The LIID (not null-terminated)
+ *  @param liidlen          The length of the LIID
+ *
+ *  @return the pcap output for the LIID, or NULL if no output is available.
  */
-static void write_rawpcap_packet(pcap_thread_state_t *pstate,
-        mediator_pcap_msg_t *pcapmsg) {
+static active_pcap_output_t *find_pcap_output(pcap_thread_state_t *pstate,
+        uint8_t *liid, uint16_t liidlen) {
 
     active_pcap_output_t *pcapout;
-    uint16_t liidlen;
-    unsigned char liidspace[2048];
-    uint8_t *rawip;
+    char liidspace[2048];
 
-    if (pcapmsg->msgbody == NULL) {
-        return;
+    /* Consecutive records are usually for the same LIID */
+    if (pstate->lastout && pstate->lastout->liidlen == liidlen &&
+            memcmp(pstate->lastout->liid, liid, liidlen) == 0) {
+        pcapout = pstate->lastout;
+    } else {
+        if (liidlen >= sizeof(liidspace)) {
+            return NULL;
+        }
+        memcpy(liidspace, liid, liidlen);
+        liidspace[liidlen] = '\0';
+
+        /* Have we seen this LIID before? -- if not, create a new pcap
+         * output */
+        HASH_FIND(hh, pstate->active, liidspace, liidlen, pcapout);
+        if (!pcapout) {
+            pcapout = create_new_pcap_output(pstate, liidspace);
+            pstate->lastout = pcapout;
+            return pcapout;
+        }
+        pstate->lastout = pcapout;
     }
 
-    /* Strip off the LIID that is at the start of the message */
-    extract_liid_from_exported_msg(pcapmsg->msgbody, pcapmsg->msglen,
-            liidspace, 2048, &liidlen);
+    if (pcapout->out == NULL) {
+        /* The file was closed while idle, so start a new one */
+        if (open_pcap_output_file(pstate, pcapout) == -1) {
+            return NULL;
+        }
+    } else if (pstate->openlimit > 0) {
+        lru_touch_pcap_output(pstate, pcapout);
+    }
+    return pcapout;
+}
+
+/** Writes a captured IP packet to a pcap trace file.
+ *
+ *  @param pstate           The state for the pcap output thread
+ *  @param pcapout          The pcap output to write the packet to
+ *  @param rawip            The start of the IP header
+ *  @param iplen            The length of the IP packet
+ */
+static void write_pcap_ip_packet(pcap_thread_state_t *pstate,
+        active_pcap_output_t *pcapout, uint8_t *rawip, uint32_t iplen) {
 
-    if (liidlen == pcapmsg->msglen) {
+    if (iplen == 0) {
         return;
     }
 
-    /* The IP header starts immediately after the LIID */
-    rawip = pcapmsg->msgbody + liidlen;
-
-    /* Have we seen this LIID before? -- if not, create a new pcap output */
-    HASH_FIND(hh, pstate->active, liidspace, strlen((char *)liidspace),
-            pcapout);
-    if (!pcapout) {
-        pcapout = create_new_pcap_output(pstate, (char *)liidspace);
+    if (iplen > 65535) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: captured packet is too large to write as a pcap packet -- possibly corrupt.");
+        return;
     }
 
-    if (pcapout) {
-        if (!pstate->packet) {
-            pstate->packet = trace_create_packet();
-        }
+    if (!pstate->packet) {
+        pstate->packet = trace_create_packet();
+    }
 
-        /* To use the libtrace API to write this packet and construct an
-         * appropriate pcap header for it, we'll need to use
-         * trace_construct_packet() to turn our buffer containing the IP
-         * packet into a libtrace packet.
-         */
-        trace_construct_packet(pstate->packet, TRACE_TYPE_NONE,
-                (const void *)rawip, (uint16_t)pcapmsg->msglen - liidlen);
+    /* To use the libtrace API to write this packet and construct an
+     * appropriate pcap header for it, we'll need to use
+     * trace_construct_packet() to turn our buffer containing the IP
+     * packet into a libtrace packet.
+     */
+    trace_construct_packet(pstate->packet, TRACE_TYPE_NONE,
+            (const void *)rawip, (uint16_t)iplen);
 
-        /* write resulting packet to libtrace output */
-        if (trace_write_packet(pcapout->out, pstate->packet) < 0) {
-            libtrace_err_t err = trace_get_err_output(pcapout->out);
-            logger(LOG_INFO,
-                    "OpenLI mediator: error while writing packet to pcap trace file: %s",
-                    err.problem);
-            trace_destroy_output(pcapout->out);
-            HASH_DELETE(hh, pstate->active, pcapout);
-            free(pcapout->liid);
-            free(pcapout);
-        }
-        pcapout->pktwritten = 1;
+    /* write resulting packet to libtrace output */
+    if (trace_write_packet(pcapout->out, pstate->packet) < 0) {
+        libtrace_err_t err = trace_get_err_output(pcapout->out);
+        logger(LOG_INFO,
+                "OpenLI Mediator: error while writing packet to pcap trace file: %s",
+                err.problem);
+        remove_pcap_output(pstate, pcapout);
+        pstate->dropcount ++;
+        return;
     }
-
-    free(pcapmsg->msgbody);
+    pcapout->pktwritten = 1;
+    pstate->pktcount ++;
+    pstate->bytecount += iplen;
 }
 
-/** Writes the IP packet contents of an encoded ETSI record to a pcap trace
+/** Writes the IP packet contents of an encoded ETSI CC to a pcap trace
  *  file.
  *
- *  The IP packet must be prepended with the LIID of the intercept that
- *  triggered this packet's capture.
+ *  The mediator has already worked out the LIID for the record, so the
+ *  only decoding required here is to find the CC contents.
  *
  *  @param pstate           The state for the pcap output thread
- *  @param pcapmsg          The message containing the captured packet, as
- *                          received from the collector.
+ *  @param pcapout          The pcap output to write the packet to
+ *  @param rec              The encoded ETSI CC
+ *  @param reclen           The length of the encoded ETSI CC
  */
-static void write_pcap_packet(pcap_thread_state_t *pstate,
-        mediator_pcap_msg_t *pcapmsg) {
+static void write_pcap_cc_packet(pcap_thread_state_t *pstate,
+        active_pcap_output_t *pcapout, uint8_t *rec, uint32_t reclen) {
 
-    uint32_t pdulen;
-    char liidspace[1024];
+    uint8_t *rawip;
+    uint32_t cclen = 0;
     char ccname[128];
-    active_pcap_output_t *pcapout;
-
-    if (pcapmsg->msgbody == NULL) {
-        return;
-    }
 
-    /* First, we're going to need to decode the ETSI encoding */
     if (pstate->decoder == NULL) {
         pstate->decoder = wandder_create_etsili_decoder();
     }
 
-    wandder_attach_etsili_buffer(pstate->decoder, pcapmsg->msgbody,
-            pcapmsg->msglen, false);
-    pdulen = wandder_etsili_get_pdu_length(pstate->decoder);
-    if (pdulen == 0 || pcapmsg->msglen < pdulen) {
+    wandder_attach_etsili_buffer(pstate->decoder, rec, reclen, false);
+
+    rawip = wandder_etsili_get_cc_contents(pstate->decoder, &cclen,
+            ccname, 128);
+    if (rawip == NULL || rawip < rec || rawip + cclen > rec + reclen) {
         logger(LOG_INFO,
                 "OpenLI Mediator: pcap thread received incomplete ETSI CC?");
+        pstate->dropcount ++;
         return;
     }
 
-    /* Use the decoder to figure out the LIID for this record */
-    if (wandder_etsili_get_liid(pstate->decoder, liidspace, 1024) == NULL) {
-        logger(LOG_INFO,
-                "OpenLI Mediator: unable to find LIID for ETSI CC in pcap thread");
-        return;
-    }
+    write_pcap_ip_packet(pstate, pcapout, rawip, cclen);
+}
 
-    /* Have we seen this LIID before? -- if not, create a new pcap output */
-    HASH_FIND(hh, pstate->active, liidspace, strlen(liidspace), pcapout);
-    if (!pcapout) {
-        pcapout = create_new_pcap_output(pstate, liidspace);
-    }
+/** Writes each of the records in a batch to the pcap trace file for the
+ *  LIID that the record belongs to, then releases the batch.
+ *
+ *  @param pstate           The state for the pcap output thread
+ *  @param batch            The batch of records received from the mediator
+ */
+static void write_pcap_batch(pcap_thread_state_t *pstate,
+        pcap_batch_t *batch) {
 
-    if (pcapout && pcapout->out) {
-        uint8_t *rawip;
-        uint32_t cclen;
+    pcap_batch_record_t hdr;
+    active_pcap_output_t *pcapout;
+    uint8_t *ptr = batch->buf;
+    uint8_t *end = batch->buf + batch->used;
+    uint8_t *liid, *rec;
+
+    while (ptr + sizeof(hdr) <= end) {
+        memcpy(&hdr, ptr, sizeof(hdr));
+        liid = ptr + sizeof(hdr);
+        rec = liid + hdr.liidlen;
+        ptr = rec + hdr.reclen;
+        if (ptr > end) {
+            break;
+        }
 
-        if (!pstate->packet) {
-            pstate->packet = trace_create_packet();
+        pcapout = find_pcap_output(pstate, liid, hdr.liidlen);
+        if (pcapout == NULL || pcapout->out == NULL) {
+            pstate->dropcount ++;
+            continue;
         }
 
-        /* Turn the ETSI CC into a libtrace pcap packet */
-        rawip = wandder_etsili_get_cc_contents(pstate->decoder, &cclen,
-                ccname, 128);
-        if (cclen > 65535) {
-logger(LOG_INFO,
-                    "OpenLI Mediator: ETSI CC record is too large to write as a pcap packet -- possibly corrupt.");
+        if (hdr.rectype == PCAP_MESSAGE_RAWIP) {
+            write_pcap_ip_packet(pstate, pcapout, rec, hdr.reclen);
         } else {
-            /* To use the libtrace API to write this packet and construct an
-             * appropriate pcap header for it, we'll need to use
-             * trace_construct_packet() to turn our buffer containing the IP
-             * packet into a libtrace packet.
-             */
-            trace_construct_packet(pstate->packet, TRACE_TYPE_NONE,
-                    (const void *)rawip, (uint16_t)cclen);
-
-            /* write resulting packet to libtrace output */
-            if (trace_write_packet(pcapout->out, pstate->packet) < 0) {
-                libtrace_err_t err = trace_get_err_output(pcapout->out);
-                logger(LOG_INFO,
-                        "OpenLI Mediator: error while writing packet to pcap trace file: %s",
-                        err.problem);
-                trace_destroy_output(pcapout->out);
-                pcapout->out = NULL;
-                HASH_DELETE(hh, pstate->active, pcapout);
-                free(pcapout->liid);
-                free(pcapout);
-            }
-            pcapout->pktwritten = 1;
+            write_pcap_cc_packet(pstate, pcapout, rec, hdr.reclen);
         }
     }
 
-    free(pcapmsg->msgbody);
+    release_pcap_batch(batch);
 }
 
 /** Flush any outstanding packets for each active pcap output.
@@ -419,26 +807,41 @@ logger(LOG_INFO,
  *  flushing of the pcap outputs to ensure that the file on disk is more
  *  representative of what has been intercepted thus far.
  *
+ *  If the number of open files is limited, files that have been idle for
+ *  a while are also closed here.
+ *
  *  @param pstate           The state for the pcap output thread
  */
 static void pcap_flush_traces(pcap_thread_state_t *pstate) {
     active_pcap_output_t *pcapout, *tmp;
 
     HASH_ITER(hh, pstate->active, pcapout, tmp) {
+        if (pcapout->out == NULL) {
+            continue;
+        }
+
+        if (pcapout->pktwritten == 0) {
+            pcapout->idleflushes ++;
+            if (pstate->openlimit > 0 &&
+                    pcapout->idleflushes >= PCAP_IDLE_FLUSHES) {
+                close_pcap_output_file(pstate, pcapout);
+                pstate->filesclosed ++;
+            }
+            continue;
+        }
+        pcapout->idleflushes = 0;
+
         /* if pktwritten is zero, then no packets have been added since the
          * last flush so no need to bother with an explicit flush call.
          */
-        if (pcapout->out && pcapout->pktwritten &&
+        if (pcapout->pktwritten &&
                 trace_flush_output(pcapout->out) < 0) {
             libtrace_err_t err = trace_get_err_output(pcapout->out);
             logger(LOG_INFO,
                     "OpenLI Mediator: error while flushing pcap trace file: %s",
                     err.problem);
-            trace_destroy_output(pcapout->out);
-            pcapout->out = NULL;
-            HASH_DELETE(hh, pstate->active, pcapout);
-            free(pcapout->liid);
-            free(pcapout);
+            remove_pcap_output(pstate, pcapout);
+            continue;
         }
         pcapout->pktwritten = 0;
     }
@@ -455,25 +858,37 @@ static void pcap_flush_traces(pcap_thread_state_t *pstate) {
 static void pcap_rotate_traces(pcap_thread_state_t *pstate) {
     active_pcap_output_t *pcapout, *tmp;
 
+    if (pstate->pktcount > 0 || pstate->dropcount > 0 ||
+            pstate->opencount > 0) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: pcap writer %d wrote %" PRIu64 " packets (%" PRIu64 " bytes) and dropped %" PRIu64 " records since the last rotation; %u files opened, %u closed early, %u open now",
+                pstate->writerid, pstate->pktcount, pstate->bytecount,
+                pstate->dropcount, pstate->filesopened, pstate->filesclosed,
+                pstate->opencount);
+    }
+    pstate->pktcount = 0;
+    pstate->bytecount = 0;
+    pstate->dropcount = 0;
+    pstate->filesopened = 0;
+    pstate->filesclosed = 0;
+
     HASH_ITER(hh, pstate->active, pcapout, tmp) {
+        /* Files that were closed while idle will be reopened when
+         * there is something to write to them */
+        if (pcapout->out == NULL) {
+            continue;
+        }
+
         /* Close the existing output file -- this will also flush any
          * remaining output and append any appropriate footer to the file.
          */
-        trace_destroy_output(pcapout->out);
-        pcapout->out = NULL;
+        close_pcap_output_file(pstate, pcapout);
 
         /* Open a new file, which will be named using the current time */
         if (open_pcap_output_file(pstate, pcapout) == -1) {
             logger(LOG_INFO,
                     "OpenLI Mediator: error while rotating pcap trace file");
-
-            if (pcapout->out) {
-                trace_destroy_output(pcapout->out);
-                pcapout->out = NULL;
-            }
-            HASH_DELETE(hh, pstate->active, pcapout);
-            free(pcapout->liid);
-            free(pcapout);
+            remove_pcap_output(pstate, pcapout);
         }
     }
 }
@@ -490,39 +905,31 @@ static void pcap_disable_liid(pcap_thread_state_t *pstate, char *liid,
         return;
     }
 
-    if (pcapout->out) {
-        trace_destroy_output(pcapout->out);
-        pcapout->out = NULL;
-    }
-    HASH_DELETE(hh, pstate->active, pcapout);
-    free(pcapout->liid);
-    free(pcapout);
+    remove_pcap_output(pstate, pcapout);
     free(liid);
 }
 
-/** Main loop for the pcap output thread.
+/** Main loop for a pcap output thread.
  *
  *  This thread handles any intercepted packets that the user has requested
  *  to be written to pcap files on disk, instead of mediated over the
  *  network using the ETSI LI handovers.
  *
- *  @param params           The message queue on which the main thread will
- *                          be sending packets and instructions to this
- *                          thread.
+ *  @param params           The pcap writer that this thread is running
+ *                          for, which holds the message queue on which the
+ *                          main thread will be sending packets and
+ *                          instructions to this thread.
  */
-void *start_pcap_thread(void *params) {
+static void *start_pcap_thread(void *params) {
 
+    pcap_writer_t *writer = (pcap_writer_t *)params;
     pcap_thread_state_t pstate;
     mediator_pcap_msg_t pcapmsg;
 
-    pstate.active = NULL;
-    pstate.dir = NULL;
+    memset(&pstate, 0, sizeof(pstate));
     pstate.compresslevel = 10;
-    pstate.outtemplate = NULL;
-    pstate.dirwarned = 0;
-    pstate.inqueue = (libtrace_message_queue_t *)params;
-    pstate.decoder = NULL;
-    pstate.packet = NULL;
+    pstate.inqueue = &(writer->inqueue);
+    pstate.writerid = writer->writerid;
 
     while (1) {
         if (libtrace_message_queue_try_get(pstate.inqueue,
@@ -560,10 +967,11 @@ void *start_pcap_thread(void *params) {
                  * close all of our existing files and switch over to the
                  * new directory.
                  */
-                free(pstate.dir);
-                if (strcmp(pstate.dir, (char *)pcapmsg.msgbody) != 0) {
+                if (pcapmsg.msgbody == NULL ||
+                        strcmp(pstate.dir, (char *)pcapmsg.msgbody) != 0) {
                     halt_pcap_outputs(&pstate);
                 }
+                free(pstate.dir);
             }
             pstate.dir = (char *)pcapmsg.msgbody;
             if (pstate.dir) {
@@ -585,10 +993,11 @@ void *start_pcap_thread(void *params) {
                  * close all of our existing files and switch over to the
                  * new template.
                  */
-                free(pstate.outtemplate);
-                if (strcmp(pstate.outtemplate, (char *)pcapmsg.msgbody) != 0) {
+                if (pcapmsg.msgbody == NULL || strcmp(pstate.outtemplate,
+                            (char *)pcapmsg.msgbody) != 0) {
                     halt_pcap_outputs(&pstate);
                 }
+                free(pstate.outtemplate);
             }
             pstate.outtemplate = (char *)pcapmsg.msgbody;
             if (pstate.outtemplate) {
@@ -613,16 +1022,28 @@ void *start_pcap_thread(void *params) {
             continue;
         }
 
-        if (pcapmsg.msgtype == PCAP_MESSAGE_RAWIP) {
-            /* We've received a "raw" IP packet to be written to disk */
-            write_rawpcap_packet(&pstate, &pcapmsg);
+        if (pcapmsg.msgtype == PCAP_MESSAGE_CHANGE_MAXOPEN) {
+            /* Each thread gets an even share of the open file limit */
+            pstate.openlimit = *((uint32_t *)pcapmsg.msgbody);
+            while (pstate.openlimit > 0 &&
+                    pstate.opencount > pstate.openlimit && pstate.lrutail) {
+                close_pcap_output_file(&pstate, pstate.lrutail);
+                pstate.filesclosed ++;
+            }
+            free(pcapmsg.msgbody);
             continue;
         }
 
-        /* If we get here, we've received an ETSI record that needs to be
-         * reverted back to an IP packet and written to disk.
-         */
-        write_pcap_packet(&pstate, &pcapmsg);
+        if (pcapmsg.msgtype == PCAP_MESSAGE_BATCH) {
+            /* We've received a batch of ETSI CCs and/or raw IP packets
+             * that need to be written to disk */
+            write_pcap_batch(&pstate, (pcap_batch_t *)pcapmsg.msgbody);
+            continue;
+        }
+
+        logger(LOG_INFO,
+                "OpenLI Mediator: unexpected message type %u received by pcap thread",
+                pcapmsg.msgtype);
     }
 
     /* Clean up any remaining thread state before exiting */
@@ -636,8 +1057,90 @@ void *start_pcap_thread(void *params) {
     if (pstate.packet) {
         trace_destroy_packet(pstate.packet);
     }
-    logger(LOG_INFO, "OpenLI Mediator: exiting pcap thread.");
+    logger(LOG_INFO, "OpenLI Mediator: exiting pcap thread %d.",
+            pstate.writerid);
     pthread_exit(NULL);
 }
 
+int start_pcap_writers(pcap_writer_set_t *set, int count) {
+
+    int i;
+
+    if (count < 1) {
+        count = 1;
+    }
+
+    set->writers = (pcap_writer_t *)calloc(count, sizeof(pcap_writer_t));
+    if (set->writers == NULL) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: OOM while creating pcap writing threads");
+        return -1;
+    }
+    set->count = count;
+
+    for (i = 0; i < count; i++) {
+        set->writers[i].writerid = i;
+        libtrace_message_queue_init(&(set->writers[i].inqueue),
+                sizeof(mediator_pcap_msg_t));
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&(set->writers[i].threadid), NULL,
+                start_pcap_thread, &(set->writers[i])) != 0) {
+            logger(LOG_INFO,
+                    "OpenLI Mediator: unable to start pcap writing thread %d",
+                    i);
+            /* Stop any writers that we have already started */
+            halt_pcap_writers(set);
+            return -1;
+        }
+        set->writers[i].running = 1;
+    }
+
+    if (count > 1) {
+        logger(LOG_INFO, "OpenLI Mediator: started %d pcap writing threads",
+                count);
+    }
+    return 0;
+}
+
+void halt_pcap_writers(pcap_writer_set_t *set) {
+
+    mediator_pcap_msg_t pcapmsg;
+    int i;
+
+    if (set->writers == NULL) {
+        return;
+    }
+
+    for (i = 0; i < set->count; i++) {
+        if (set->writers[i].running) {
+            send_pcap_message(&(set->writers[i]), PCAP_MESSAGE_HALT, NULL, 0);
+        }
+    }
+
+    for (i = 0; i < set->count; i++) {
+        if (set->writers[i].running) {
+            pthread_join(set->writers[i].threadid, NULL);
+            set->writers[i].running = 0;
+        }
+
+        /* Release anything that the thread didn't get to */
+        while (libtrace_message_queue_try_get(&(set->writers[i].inqueue),
+                (void *)&pcapmsg) != LIBTRACE_MQ_FAILED) {
+            if (pcapmsg.msgtype == PCAP_MESSAGE_BATCH) {
+                release_pcap_batch((pcap_batch_t *)pcapmsg.msgbody);
+            } else if (pcapmsg.msgtype != PCAP_MESSAGE_CHANGE_COMPRESS &&
+                    pcapmsg.msgbody) {
+                free(pcapmsg.msgbody);
+            }
+        }
+        libtrace_message_queue_destroy(&(set->writers[i].inqueue));
+    }
+
+    free(set->writers);
+    set->writers = NULL;
+    set->count = 0;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -27,37 +27,93 @@
 #ifndef OPENLI_MEDIATOR_PCAPTHREAD_H_
 #define OPENLI_MEDIATOR_PCAPTHREAD_H_
 
+#include <pthread.h>
 #include <libtrace.h>
 #include <libtrace/message_queue.h>
 #include <libwandder_etsili.h>
 #include <uthash.h>
 
+/** The maximum number of pcap writing threads that may be configured */
+#define MAX_PCAP_THREADS 16
+
+typedef struct active_pcap_output active_pcap_output_t;
+
 /** State for a particular pcap output file */
-typedef struct active_pcap_output {
+struct active_pcap_output {
     /** The LIID for the intercept that is being written to this file */
     char *liid;
 
-    /** The libtrace output file handle for the output file */
+    /** The length of the LIID string */
+    uint16_t liidlen;
+
+    /** The libtrace output file handle for the output file -- NULL if
+     *  the file has been closed because it was idle */
     libtrace_out_t *out;
 
     /** The number of packets written to this file so far */
     int pktwritten;
 
+    /** The number of consecutive flushes where nothing had been written
+     *  to this file */
+    int idleflushes;
+
+    /** The previous (more recently used) output in the open file list */
+    active_pcap_output_t *lruprev;
+
+    /** The next (less recently used) output in the open file list */
+    active_pcap_output_t *lrunext;
+
     UT_hash_handle hh;
-} active_pcap_output_t;
+};
 
-/** State for the pcap thread */
+/** State for a pcap writing thread */
 typedef struct pcap_thread_state {
 
     /** The queue which this thread will receive messages from the mediator */
     libtrace_message_queue_t *inqueue;
 
+    /** A number identifying this thread, for logging */
+    int writerid;
+
     /** A libtrace packet used to convert raw IP blobs into a usable packet */
     libtrace_packet_t *packet;
 
     /** A map of open pcap outputs, one per LIID */
     active_pcap_output_t *active;
 
+    /** The pcap output that was most recently written to */
+    active_pcap_output_t *lastout;
+
+    /** The open pcap outputs, most recently used first */
+    active_pcap_output_t *lruhead;
+
+    /** The least recently used open pcap output */
+    active_pcap_output_t *lrutail;
+
+    /** The number of pcap outputs that currently have an open file */
+    uint32_t opencount;
+
+    /** The maximum number of files that this thread may have open at
+     *  once -- 0 means no limit */
+    uint32_t openlimit;
+
+    /** The number of packets written since the last rotation */
+    uint64_t pktcount;
+
+    /** The number of bytes of packet data written since the last rotation */
+    uint64_t bytecount;
+
+    /** The number of records that could not be written since the last
+     *  rotation */
+    uint64_t dropcount;
+
+    /** The number of files opened since the last rotation */
+    uint32_t filesopened;
+
+    /** The number of files closed early (because they were idle or to
+     *  stay under the open file limit) since the last rotation */
+    uint32_t filesclosed;
+
     /** The directory where pcap file are to be written into */
     char *dir;
 
@@ -79,6 +135,87 @@ typedef struct pcap_thread_state {
 
 } pcap_thread_state_t;
 
+typedef struct pcap_batch pcap_batch_t;
+
+/** A pool of pcap batches that can be re-used, rather than allocating
+ *  a new batch for each set of records received from a collector.
+ */
+typedef struct pcap_batch_pool {
+    /** Protects the free list -- batches are taken by the threads that
+     *  receive from collectors and returned by the pcap thread */
+    pthread_mutex_t mutex;
+
+    /** Batches that are available for re-use */
+    pcap_batch_t *freelist;
+
+    /** The number of batches in the free list */
+    uint32_t freecount;
+} pcap_batch_pool_t;
+
+/** A set of records that are to be written to pcap files, which are passed
+ *  to the pcap thread using a single message.
+ *
+ *  Each record in the batch consists of a pcap_batch_record_t header,
+ *  followed by the LIID, followed by the record itself.
+ */
+struct pcap_batch {
+    /** The buffer containing the records */
+    uint8_t *buf;
+
+    /** The number of bytes used in the buffer */
+    uint32_t used;
+
+    /** The allocated size of the buffer */
+    uint32_t alloc;
+
+    /** The pool that this batch should be returned to */
+    pcap_batch_pool_t *pool;
+
+    /** The next batch in the pool free list */
+    pcap_batch_t *next;
+};
+
+/** Header for a record within a pcap batch */
+typedef struct pcap_batch_record {
+    /** The record type, either PCAP_MESSAGE_PACKET or PCAP_MESSAGE_RAWIP */
+    uint8_t rectype;
+
+    /** The length of the LIID that follows this header */
+    uint16_t liidlen;
+
+    /** The length of the record that follows the LIID */
+    uint32_t reclen;
+} pcap_batch_record_t;
+
+/** A single pcap writing thread, as seen by the main mediator thread */
+typedef struct pcap_writer {
+    /** A number identifying this thread, for logging */
+    int writerid;
+
+    /** The pthread ID for the thread */
+    pthread_t threadid;
+
+    /** Set to 1 once the thread has been started */
+    uint8_t running;
+
+    /** The queue for sending messages to this thread */
+    libtrace_message_queue_t inqueue;
+} pcap_writer_t;
+
+/** The set of pcap writing threads for a mediator. Each LIID is always
+ *  written by the same thread, chosen by hashing the LIID.
+ */
+typedef struct pcap_writer_set {
+    /** The pcap writing threads */
+    pcap_writer_t *writers;
+
+    /** The number of pcap writing threads */
+    int count;
+
+    /** The pool of batches used to send records to the writing threads */
+    pcap_batch_pool_t pool;
+} pcap_writer_set_t;
+
 /** Simple wrapper structure for a message sent to the pcap thread */
 typedef struct mediator_pcap_message {
 
@@ -100,7 +237,7 @@ enum {
     /** Tells the pcap thread to exit */
     PCAP_MESSAGE_HALT,
 
-    /** Message contains an encoded ETSI record to be written as pcap */
+    /** Batched record is an encoded ETSI CC to be written as pcap */
     PCAP_MESSAGE_PACKET,
 
     /** Tells the pcap thread to flush any buffered output to disk */
@@ -109,7 +246,7 @@ enum {
     /** Triggers a rotation of all active pcap files */
     PCAP_MESSAGE_ROTATE,
 
-    /** Message contains a raw IP packet to be written as pcap */
+    /** Batched record is a raw IP packet to be written as pcap */
     PCAP_MESSAGE_RAWIP,
 
     /** Changes the template used to name pcap files */
@@ -120,18 +257,109 @@ enum {
 
     /** Removes an LIID from the set of active pcap outputs */
     PCAP_MESSAGE_DISABLE_LIID,
+
+    /** Message contains a pcap batch of records to be written as pcap */
+    PCAP_MESSAGE_BATCH,
+
+    /** Changes the maximum number of pcap files that may be open at once */
+    PCAP_MESSAGE_CHANGE_MAXOPEN,
 };
 
+/** Initialises a pool of pcap batches.
+ *
+ *  @param pool         The pool to initialise
+ */
+void init_pcap_batch_pool(pcap_batch_pool_t *pool);
+
+/** Frees a pool of pcap batches, including any batches in the free list.
+ *
+ *  @param pool         The pool to destroy
+ */
+void destroy_pcap_batch_pool(pcap_batch_pool_t *pool);
+
+/** Adds a record to the pcap batch for the writing thread that handles
+ *  the record's LIID, sending the batch to that thread first if it is
+ *  already full.
+ *
+ *  @param set          The set of pcap writing threads
+ *  @param batches      The batches to add the record to, one per writing
+ *                      thread -- if the batch for the thread is NULL, a new
+ *                      batch will be taken from the pool
+ *  @param rectype      The type of record, e.g. PCAP_MESSAGE_RAWIP
+ *  @param liid         The LIID that the record belongs to (does not
+ *                      need to be null-terminated)
+ *  @param liidlen      The length of the LIID
+ *  @param rec          The record itself
+ *  @param reclen       The length of the record
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int append_pcap_batch_record(pcap_writer_set_t *set, pcap_batch_t **batches,
+        uint8_t rectype, uint8_t *liid, uint16_t liidlen, uint8_t *rec,
+        uint32_t reclen);
+
+/** Sends each non-empty pcap batch to its pcap writing thread.
+ *
+ *  @param set          The set of pcap writing threads
+ *  @param batches      The batches to send, one per writing thread -- each
+ *                      batch that is sent will be set to NULL
+ */
+void send_pcap_batches(pcap_writer_set_t *set, pcap_batch_t **batches);
+
+/** Returns a pcap batch to the pool that it came from.
+ *
+ *  @param batch        The batch to release
+ */
+void release_pcap_batch(pcap_batch_t *batch);
+
+
+/** Starts the pcap file writing threads, each of which will listen on a
+ *  queue for messages containing packets that will be written to pcap
+ *  output files (as opposed to being emitted via an ETSI handover).
+ *
+ *  The batch pool for the set must have already been initialised.
+ *
+ *  @param set          The set of pcap writing threads to start
+ *  @param count        The number of threads to start
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int start_pcap_writers(pcap_writer_set_t *set, int count);
+
+/** Tells each pcap writing thread to exit, then waits for them to do so.
+ *
+ *  @param set          The set of pcap writing threads to halt
+ */
+void halt_pcap_writers(pcap_writer_set_t *set);
+
+/** Sends a message to a single pcap writing thread.
+ *
+ *  @param writer       The thread to send the message to
+ *  @param msgtype      The type of message, e.g. PCAP_MESSAGE_FLUSH
+ *  @param msgbody      The message body, which will be owned by the
+ *                      thread (may be NULL)
+ *  @param msglen       The length of the message body
+ */
+void send_pcap_message(pcap_writer_t *writer, uint8_t msgtype,
+        uint8_t *msgbody, uint16_t msglen);
+
+/** Sends a configuration string to every pcap writing thread. Each thread
+ *  receives its own copy of the string.
+ *
+ *  @param set          The set of pcap writing threads
+ *  @param msgtype      The type of message, e.g. PCAP_MESSAGE_CHANGE_DIR
+ *  @param str          The string to send (may be NULL)
+ */
+void broadcast_pcap_string(pcap_writer_set_t *set, uint8_t msgtype,
+        const char *str);
 
-/** Starts the pcap file writing thread, which will listen on a queue for
- *  messages containing packets that will be written to pcap output files
- *  (as opposed to being emitted via an ETSI handover).
+/** Tells the pcap writing thread for an LIID to close the pcap output for
+ *  that LIID.
  *
- *  @param params       A pointer to the libtrace message queue that the
- *                      packets for pcap export will be sent to by the main
- *                      thread.
+ *  @param set          The set of pcap writing threads
+ *  @param liid         The LIID to stop writing pcap files for
  */
-void *start_pcap_thread(void *params);
+void disable_pcap_liid(pcap_writer_set_t *set, const char *liid);
 
 #endif
 
@@ -0,0 +1,147 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <string.h>
+
+#include "logger.h"
+#include "relay.h"
+
+/** How often to log the amount of data that has been relayed, in bytes */
+#define RELAY_REPORT_INTERVAL (1024ULL * 1024 * 1024)
+
+/** Sends the pending records for a single handover.
+ *
+ *  @param relay        The relay state
+ *  @param pend         The pending records to send
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+static int flush_relay_pending(handover_relay_t *relay,
+        relay_pending_t *pend) {
+
+    int64_t sent;
+
+    if (pend->iovcnt == 0) {
+        return 0;
+    }
+
+    sent = send_handover_records_directly(pend->ho, pend->iov, pend->iovcnt,
+            pend->bytes);
+    if (sent >= 0) {
+        relay->relayed += sent;
+        relay->buffered += (pend->bytes - sent);
+    }
+
+    pend->iovcnt = 0;
+    pend->bytes = 0;
+    return (sent < 0) ? -1 : 0;
+}
+
+int flush_handover_relay(handover_relay_t *relay) {
+
+    int i, ret = 0;
+
+    for (i = 0; i < relay->count; i++) {
+        if (flush_relay_pending(relay, &(relay->pending[i])) < 0) {
+            ret = -1;
+        }
+        relay->pending[i].ho = NULL;
+    }
+    relay->count = 0;
+
+    if (relay->nextreport == 0) {
+        relay->nextreport = RELAY_REPORT_INTERVAL;
+    } else if (relay->relayed >= relay->nextreport) {
+        logger(LOG_INFO,
+                "OpenLI Mediator: relayed %lu MB directly to handovers, %lu MB had to be buffered",
+                relay->relayed / (1024 * 1024),
+                relay->buffered / (1024 * 1024));
+        relay->nextreport = relay->relayed + RELAY_REPORT_INTERVAL;
+    }
+    return ret;
+}
+
+int relay_handover_record(handover_relay_t *relay, handover_t *ho,
+        uint8_t *rec, uint32_t reclen) {
+
+    relay_pending_t *pend = NULL;
+    int i;
+
+    if (!relay->enabled) {
+        return 0;
+    }
+
+    for (i = 0; i < relay->count; i++) {
+        if (relay->pending[i].ho == ho) {
+            pend = &(relay->pending[i]);
+            break;
+        }
+    }
+
+    if (pend == NULL) {
+        /* Nothing pending for this handover yet, so we can only relay if
+         * the handover has nothing buffered. Once we have started
+         * relaying, all further records for the handover must be relayed
+         * too, so that they stay in order.
+         */
+        if (!handover_can_send_directly(ho)) {
+            return 0;
+        }
+        if (relay->count == RELAY_MAX_HANDOVERS) {
+            if (flush_handover_relay(relay) < 0) {
+                return -1;
+            }
+            /* The handover may have buffered something during the flush */
+            if (!handover_can_send_directly(ho)) {
+                return 0;
+            }
+        }
+        pend = &(relay->pending[relay->count]);
+        relay->count ++;
+        pend->ho = ho;
+        pend->iovcnt = 0;
+        pend->bytes = 0;
+    } else {
+        if (pend->iovcnt == RELAY_MAX_RECORDS) {
+            if (flush_relay_pending(relay, pend) < 0) {
+                return -1;
+            }
+        }
+        /* If an earlier send for this handover didn't complete, the rest
+         * of its records must go into its buffer behind the unsent ones */
+        if (pend->iovcnt == 0 && !handover_can_send_directly(ho)) {
+            return 0;
+        }
+    }
+
+    pend->iov[pend->iovcnt].iov_base = rec;
+    pend->iov[pend->iovcnt].iov_len = reclen;
+    pend->iovcnt ++;
+    pend->bytes += reclen;
+    return 1;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,127 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_MEDIATOR_RELAY_H_
+#define OPENLI_MEDIATOR_RELAY_H_
+
+#include <inttypes.h>
+#include <sys/uio.h>
+#include "handover.h"
+
+/** The maximum number of handovers that can have relayed records pending
+ *  at any one time */
+#define RELAY_MAX_HANDOVERS 16
+
+/** The maximum number of records that can be pending for a single
+ *  handover before they must be sent */
+#define RELAY_MAX_RECORDS 64
+
+/** Records that are waiting to be sent directly to a single handover */
+typedef struct relay_pending {
+    /** The handover that the records are destined for */
+    handover_t *ho;
+
+    /** The records themselves, which still live in the buffer that they
+     *  were received into */
+    struct iovec iov[RELAY_MAX_RECORDS];
+
+    /** The number of pending records */
+    int iovcnt;
+
+    /** The total length of the pending records, in bytes */
+    uint64_t bytes;
+} relay_pending_t;
+
+/** State for relaying records from a collector's receive buffer straight to
+ *  the handover sockets, without copying them into the handover buffers
+ *  first.
+ *
+ *  Records are gathered while messages are read from a collector, then
+ *  sent to each handover using a single system call. The pending records
+ *  point into the collector's receive buffer, so they must be sent before
+ *  anything else is read into that buffer.
+ */
+typedef struct handover_relay {
+    /** Set to 1 if direct relaying is enabled */
+    uint8_t enabled;
+
+    /** Set to 1 while reading from a collector whose records can be
+     *  relayed */
+    uint8_t active;
+
+    /** The handovers with pending records */
+    relay_pending_t pending[RELAY_MAX_HANDOVERS];
+
+    /** The number of handovers with pending records */
+    int count;
+
+    /** The number of bytes that have been sent directly */
+    uint64_t relayed;
+
+    /** The number of bytes that could not be sent directly and had to be
+     *  buffered */
+    uint64_t buffered;
+
+    /** The value of 'relayed' when we last logged our statistics */
+    uint64_t nextreport;
+} handover_relay_t;
+
+/** Attempts to add a record to the set of records that will be sent
+ *  directly to a handover.
+ *
+ *  @param relay        The relay state
+ *  @param ho           The handover that the record is destined for
+ *  @param rec          The start of the record -- must remain valid until
+ *                      flush_handover_relay() is called
+ *  @param reclen       The length of the record, in bytes
+ *
+ *  @return -1 if an error occurs, 1 if the record will be sent directly,
+ *          0 if the record cannot be sent directly and should be added to
+ *          the handover's buffer instead.
+ */
+int relay_handover_record(handover_relay_t *relay, handover_t *ho,
+        uint8_t *rec, uint32_t reclen);
+
+/** Sends all pending records to their handovers.
+ *
+ *  @param relay        The relay state
+ *
+ *  @return -1 if an error occurs while sending to any handover, 0 otherwise.
+ */
+int flush_handover_relay(handover_relay_t *relay);
+
+/** Checks whether there are any records waiting to be relayed.
+ *
+ *  @param relay        The relay state
+ *
+ *  @return 1 if there are pending records, 0 otherwise.
+ */
+static inline int handover_relay_pending(handover_relay_t *relay) {
+    return (relay->count > 0);
+}
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
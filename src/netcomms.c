@@ -30,6 +30,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
 #include <amqp.h>
 #include <amqp_tcp_socket.h>
 
@@ -56,23 +59,124 @@ static inline void dump_buffer_contents(uint8_t *buf, uint16_t len) {
 
 }
 
+/* Largest size that any one net buffer may grow to */
+static uint64_t netbuf_limit = NETBUF_DEFAULT_LIMIT;
+
+/* Total memory held by all net buffers in this process, and the most that
+ * they have ever held at once */
+static uint64_t netbuf_committed = 0;
+static uint64_t netbuf_peak = 0;
+
+/* Time (in seconds) at which the net buffer usage should next be logged */
+static uint64_t netbuf_nextreport = 0;
+
+static inline uint32_t netbuf_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+static void account_net_buffer(int64_t change) {
+
+    uint64_t total, peak;
+
+    total = __atomic_add_fetch(&netbuf_committed, (uint64_t)change,
+            __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&netbuf_peak, __ATOMIC_RELAXED);
+    while (total > peak) {
+        if (__atomic_compare_exchange_n(&netbuf_peak, &peak, total, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+void set_net_buffer_limit(uint64_t limit) {
+
+    if (limit < NETBUF_MIN_LIMIT) {
+        limit = NETBUF_MIN_LIMIT;
+    }
+    /* alloced is an int, so don't let it get anywhere near overflowing */
+    if (limit > (1ULL << 30)) {
+        limit = (1ULL << 30);
+    }
+    __atomic_store_n(&netbuf_limit, limit, __ATOMIC_RELAXED);
+}
+
+uint64_t get_net_buffer_committed(void) {
+    return __atomic_load_n(&netbuf_committed, __ATOMIC_RELAXED);
+}
+
+uint64_t get_net_buffer_peak(void) {
+    return __atomic_load_n(&netbuf_peak, __ATOMIC_RELAXED);
+}
+
+void report_net_buffer_usage(const char *component) {
+
+    uint64_t now = netbuf_now();
+    uint64_t next = __atomic_load_n(&netbuf_nextreport, __ATOMIC_RELAXED);
+
+    if (next != 0 && now < next) {
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&netbuf_nextreport, &next,
+                now + NETBUF_REPORT_INTERVAL, 0, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED)) {
+        /* Someone else is reporting */
+        return;
+    }
+    if (next == 0) {
+        return;
+    }
+
+    logger(LOG_INFO,
+            "%s: net buffers are holding %lu KB of memory (peak %lu KB)",
+            component, get_net_buffer_committed() / 1024,
+            get_net_buffer_peak() / 1024);
+}
+
 net_buffer_t *create_net_buffer(net_buffer_type_t buftype, int fd, SSL *ssl) {
 
     net_buffer_t *nb = (net_buffer_t *)malloc(sizeof(net_buffer_t));
-    nb->buf = (char *)malloc(NETBUF_ALLOC_SIZE);
+    nb->buf = (char *)malloc(NETBUF_INIT_SIZE);
     nb->appendptr = nb->buf;
     nb->actptr = nb->buf;
-    nb->alloced = NETBUF_ALLOC_SIZE;
+    nb->alloced = NETBUF_INIT_SIZE;
     nb->fd = fd;
     nb->buftype = buftype;
     nb->ssl = ssl;
+    nb->readwant = NETBUF_READ_MIN;
+    nb->lastbusy = netbuf_now();
+    nb->decomp = NULL;
+    nb->zin = NULL;
+    nb->zinlen = 0;
+    nb->zinalloc = 0;
+    nb->zintotal = 0;
+    nb->zouttotal = 0;
+    nb->sharedhead = NULL;
+    nb->sharedtail = NULL;
+    nb->consumed = 0;
+    nb->sharedpending = 0;
+    account_net_buffer(nb->alloced);
     return nb;
 }
 
 void destroy_net_buffer(net_buffer_t *nb) {
+    net_shared_ref_t *ref;
+
     if (nb == NULL) {
         return;
     }
+    while (nb->sharedhead) {
+        ref = nb->sharedhead;
+        nb->sharedhead = ref->next;
+        release_shared_net_message(ref->msg);
+        free(ref);
+    }
+    account_net_buffer(-((int64_t)nb->alloced + (int64_t)nb->zinalloc));
+    destroy_decompressor(nb->decomp);
+    free(nb->zin);
     free(nb->buf);
     free(nb);
 }
@@ -89,38 +193,117 @@ inline int fd_set_block(int fd){
     return fcntl(fd, F_SETFL, flags);
 }
 
+static inline void compact_net_buffer(net_buffer_t *nb) {
+
+    int contsize = NETBUF_CONTENT_SIZE(nb);
+
+    if (contsize > 0) {
+        memmove(nb->buf, nb->actptr, contsize);
+    }
+    nb->actptr = nb->buf;
+    nb->appendptr = nb->actptr + contsize;
+}
+
 static inline int extend_net_buffer(net_buffer_t *nb, int musthave) {
 
     int frontfree = NETBUF_FRONT_FREE(nb);
     int contsize = NETBUF_CONTENT_SIZE(nb);
+    uint64_t newsize, required, limit;
     char *tmp = NULL;
 
-    if (frontfree >= 0.75 * nb->alloced) {
-        memmove(nb->buf, nb->buf + frontfree, contsize);
-        nb->actptr = nb->buf;
-        nb->appendptr = nb->actptr + contsize;
-
+    /* Moving the content back to the front is cheap if there isn't
+     * much of it */
+    if (frontfree > 0 && (frontfree >= contsize ||
+                frontfree >= 0.75 * nb->alloced)) {
+        compact_net_buffer(nb);
         if (NETBUF_SPACE_REM(nb) >= musthave) {
             return 0;
         }
         frontfree = 0;
     }
 
-    tmp = (char *)realloc(nb->buf, nb->alloced + NETBUF_ALLOC_SIZE);
+    required = (uint64_t)frontfree + contsize + musthave;
+    newsize = (uint64_t)nb->alloced * 2;
+    while (newsize < required) {
+        newsize *= 2;
+    }
+
+    limit = __atomic_load_n(&netbuf_limit, __ATOMIC_RELAXED);
+    if (newsize > limit) {
+        if (frontfree > 0) {
+            compact_net_buffer(nb);
+            frontfree = 0;
+            required = contsize + musthave;
+        }
+        if (required > limit) {
+            return -1;
+        }
+        newsize = limit;
+    }
+
+    tmp = (char *)realloc(nb->buf, newsize);
     if (tmp == NULL) {
         /* OOM */
         return -1;
     }
 
+    account_net_buffer((int64_t)newsize - nb->alloced);
     nb->buf = tmp;
-    nb->alloced += NETBUF_ALLOC_SIZE;
+    nb->alloced = (int)newsize;
     nb->actptr = nb->buf + frontfree;
     nb->appendptr = nb->actptr + contsize;
+    nb->lastbusy = netbuf_now();
 
     return 0;
 
 }
 
+/* Gives memory back if a buffer has been mostly empty for a while, e.g.
+ * after a burst of traffic has been dealt with.
+ */
+static void shrink_idle_net_buffer(net_buffer_t *nb) {
+
+    int contsize = NETBUF_CONTENT_SIZE(nb);
+    uint32_t now;
+    int newsize;
+    char *tmp;
+
+    if (nb->alloced <= NETBUF_INIT_SIZE) {
+        return;
+    }
+
+    now = netbuf_now();
+    if (contsize > nb->alloced / 4) {
+        nb->lastbusy = now;
+        return;
+    }
+    if (now - nb->lastbusy < NETBUF_IDLE_SHRINK) {
+        return;
+    }
+
+    newsize = NETBUF_INIT_SIZE;
+    while (newsize < contsize * 2) {
+        newsize *= 2;
+    }
+    if (newsize >= nb->alloced) {
+        return;
+    }
+
+    compact_net_buffer(nb);
+    tmp = (char *)realloc(nb->buf, newsize);
+    if (tmp == NULL) {
+        return;
+    }
+
+    account_net_buffer((int64_t)newsize - nb->alloced);
+    nb->buf = tmp;
+    nb->alloced = newsize;
+    nb->actptr = nb->buf;
+    nb->appendptr = nb->actptr + contsize;
+    nb->readwant = NETBUF_READ_MIN;
+    nb->lastbusy = now;
+}
+
 static int push_generic_onto_net_buffer(net_buffer_t *nb,
         uint8_t *data, uint16_t len) {
 
@@ -172,6 +355,95 @@ int construct_netcomm_protocol_header(ii_header_t *newhdr,
 
 }
 
+/* Writes a message containing a single 32 bit field into caller-supplied
+ * space. Used for session control messages between collectors and
+ * mediators, which are sent directly on the socket rather than via a
+ * net buffer.
+ *
+ * Returns the length of the message, or -1 if there was not enough space.
+ */
+static int construct_single_field_message(uint8_t *space, uint32_t spacelen,
+        openli_proto_msgtype_t msgtype, openli_proto_fieldtype_t field,
+        uint32_t value) {
+
+    uint16_t shorttype, swaplen;
+    uint32_t total = sizeof(ii_header_t) + 4 + sizeof(value);
+
+    if (spacelen < total) {
+        return -1;
+    }
+
+    populate_header((ii_header_t *)space, msgtype, 4 + sizeof(value), 0);
+    space += sizeof(ii_header_t);
+
+    shorttype = htons((uint16_t)field);
+    swaplen = htons(sizeof(value));
+    memcpy(space, &shorttype, sizeof(uint16_t));
+    memcpy(space + 2, &swaplen, sizeof(uint16_t));
+    memcpy(space + 4, &value, sizeof(value));
+
+    return (int)total;
+}
+
+/* Builds a message advertising the optional protocol features that a
+ * mediator supports.
+ */
+int construct_capabilities_message(uint8_t *space, uint32_t spacelen,
+        uint32_t caps) {
+
+    return construct_single_field_message(space, spacelen,
+            OPENLI_PROTO_CAPABILITIES, OPENLI_PROTO_FIELD_CAPABILITIES, caps);
+}
+
+/* Builds a message telling a mediator that everything that follows this
+ * message on the connection will be compressed using the given method.
+ */
+int construct_start_compression_message(uint8_t *space, uint32_t spacelen,
+        uint8_t method) {
+
+    return construct_single_field_message(space, spacelen,
+            OPENLI_PROTO_START_COMPRESSION,
+            OPENLI_PROTO_FIELD_COMPRESSION_METHOD, (uint32_t)method);
+}
+
+/* Builds a message telling a collector to hold back (leasems > 0) or to
+ * resume sending (leasems == 0) the records for an LIID. A hold only lasts
+ * for the lease, so a collector that never hears from the mediator again
+ * will not sit on the records forever.
+ *
+ * Returns the length of the message, or -1 if there was not enough space.
+ */
+int construct_flow_control_message(uint8_t *space, uint32_t spacelen,
+        char *liid, uint32_t leasems) {
+
+    uint16_t shorttype, swaplen;
+    uint16_t liidlen = strlen(liid);
+    uint32_t bodylen = 4 + liidlen + 4 + sizeof(leasems);
+
+    if (spacelen < sizeof(ii_header_t) + bodylen) {
+        return -1;
+    }
+
+    populate_header((ii_header_t *)space, OPENLI_PROTO_FLOW_CONTROL,
+            (uint16_t)bodylen, 0);
+    space += sizeof(ii_header_t);
+
+    shorttype = htons((uint16_t)OPENLI_PROTO_FIELD_LIID);
+    swaplen = htons(liidlen);
+    memcpy(space, &shorttype, sizeof(uint16_t));
+    memcpy(space + 2, &swaplen, sizeof(uint16_t));
+    memcpy(space + 4, liid, liidlen);
+    space += (4 + liidlen);
+
+    shorttype = htons((uint16_t)OPENLI_PROTO_FIELD_FLOW_LEASE);
+    swaplen = htons(sizeof(leasems));
+    memcpy(space, &shorttype, sizeof(uint16_t));
+    memcpy(space + 2, &swaplen, sizeof(uint16_t));
+    memcpy(space + 4, &leasems, sizeof(leasems));
+
+    return (int)(sizeof(ii_header_t) + bodylen);
+}
+
 static inline int push_tlv(net_buffer_t *nb, openli_proto_fieldtype_t type,
         uint8_t *value, uint16_t vallen) {
 
@@ -199,20 +471,77 @@ static inline int push_tlv(net_buffer_t *nb, openli_proto_fieldtype_t type,
     return push_generic_onto_net_buffer(nb, tmp, vallen + 4);
 }
 
-int push_auth_onto_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t msgtype)
+#define CONFIG_VERSION_BODY_LEN (2 * (4 + sizeof(uint64_t)))
+
+static int push_config_version_fields(net_buffer_t *nb, uint64_t confepoch,
+        uint64_t confversion) {
+
+    if (push_tlv(nb, OPENLI_PROTO_FIELD_CONFIG_EPOCH,
+            (uint8_t *)&confepoch, sizeof(confepoch)) == -1) {
+        return -1;
+    }
+    if (push_tlv(nb, OPENLI_PROTO_FIELD_CONFIG_VERSION,
+            (uint8_t *)&confversion, sizeof(confversion)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* The auth message carries the version of the provisioner configuration
+ * that the client last applied (or zeroes if it has none), so that the
+ * provisioner can send it just the changes that it has missed. Older
+ * provisioners ignore the body of the auth message altogether.
+ */
+int push_auth_onto_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t msgtype,
+        uint64_t confepoch, uint64_t confversion)
 {
 
     ii_header_t hdr;
 
     if (msgtype == OPENLI_PROTO_COLLECTOR_AUTH) {
-        populate_header(&hdr, msgtype, 0, OPENLI_COLLECTOR_MAGIC);
+        populate_header(&hdr, msgtype, CONFIG_VERSION_BODY_LEN,
+                OPENLI_COLLECTOR_MAGIC);
     } else if (msgtype == OPENLI_PROTO_MEDIATOR_AUTH) {
-        populate_header(&hdr, msgtype, 0, OPENLI_MEDIATOR_MAGIC);
+        populate_header(&hdr, msgtype, CONFIG_VERSION_BODY_LEN,
+                OPENLI_MEDIATOR_MAGIC);
     } else {
         logger(LOG_INFO, "OpenLI: invalid auth message type: %d.", msgtype);
         return -1;
     }
 
+    if (push_generic_onto_net_buffer(nb, (uint8_t *)(&hdr),
+            sizeof(ii_header_t)) == -1) {
+        return -1;
+    }
+
+    if (push_config_version_fields(nb, confepoch, confversion) == -1) {
+        return -1;
+    }
+    return sizeof(ii_header_t) + CONFIG_VERSION_BODY_LEN;
+}
+
+int push_config_version_onto_net_buffer(net_buffer_t *nb, uint64_t confepoch,
+        uint64_t confversion) {
+
+    ii_header_t hdr;
+
+    populate_header(&hdr, OPENLI_PROTO_CONFIG_VERSION,
+            CONFIG_VERSION_BODY_LEN, 0);
+    if (push_generic_onto_net_buffer(nb, (uint8_t *)(&hdr),
+            sizeof(ii_header_t)) == -1) {
+        return -1;
+    }
+
+    if (push_config_version_fields(nb, confepoch, confversion) == -1) {
+        return -1;
+    }
+    return sizeof(ii_header_t) + CONFIG_VERSION_BODY_LEN;
+}
+
+int push_config_delta_onto_net_buffer(net_buffer_t *nb) {
+    ii_header_t hdr;
+    populate_header(&hdr, OPENLI_PROTO_CONFIG_DELTA, 0, 0);
+
     return push_generic_onto_net_buffer(nb, (uint8_t *)(&hdr),
             sizeof(ii_header_t));
 }
@@ -1257,8 +1586,118 @@ int push_ssl_required(net_buffer_t *nb) {
 
 
 
+net_shared_msg_t *create_shared_net_message(net_buffer_t *encoded) {
+
+    net_shared_msg_t *msg;
+    int len = NETBUF_CONTENT_SIZE(encoded);
+
+    if (len <= 0) {
+        return NULL;
+    }
+
+    msg = (net_shared_msg_t *)malloc(sizeof(net_shared_msg_t));
+    if (msg == NULL) {
+        return NULL;
+    }
+    msg->data = (uint8_t *)malloc(len);
+    if (msg->data == NULL) {
+        free(msg);
+        return NULL;
+    }
+    memcpy(msg->data, encoded->actptr, len);
+    msg->len = len;
+    msg->refs = 1;
+    account_net_buffer(len);
+    return msg;
+}
+
+void release_shared_net_message(net_shared_msg_t *msg) {
+
+    if (msg == NULL) {
+        return;
+    }
+    /* Buffers may be sent (and their references released) by a different
+     * thread to the one that is queueing the message */
+    if (__atomic_sub_fetch(&(msg->refs), 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    account_net_buffer(-((int64_t)msg->len));
+    free(msg->data);
+    free(msg);
+}
+
+int push_shared_onto_net_buffer(net_buffer_t *nb, net_shared_msg_t *msg) {
+
+    net_shared_ref_t *ref;
+    uint64_t limit;
+
+    if (msg == NULL || nb->buftype != NETBUF_SEND) {
+        return -1;
+    }
+
+    limit = __atomic_load_n(&netbuf_limit, __ATOMIC_RELAXED);
+    if (NETBUF_CONTENT_SIZE(nb) + nb->sharedpending + msg->len > limit) {
+        return -1;
+    }
+
+    ref = (net_shared_ref_t *)malloc(sizeof(net_shared_ref_t));
+    if (ref == NULL) {
+        return -1;
+    }
+
+    __atomic_add_fetch(&(msg->refs), 1, __ATOMIC_RELAXED);
+    ref->msg = msg;
+    ref->pos = nb->consumed + NETBUF_CONTENT_SIZE(nb);
+    ref->sent = 0;
+    ref->next = NULL;
+
+    if (nb->sharedtail) {
+        nb->sharedtail->next = ref;
+    } else {
+        nb->sharedhead = ref;
+    }
+    nb->sharedtail = ref;
+    nb->sharedpending += msg->len;
+    return msg->len;
+}
+
+/* Copies the contents of a shared message into a buffer, e.g. to build a
+ * new message that includes it, rather than queueing a reference to it.
+ */
+int copy_shared_onto_net_buffer(net_buffer_t *nb, net_shared_msg_t *msg) {
+
+    uint32_t done = 0;
+    uint16_t chunk;
+
+    if (msg == NULL) {
+        return -1;
+    }
+
+    /* A shared message may hold more than one message, so it can be
+     * longer than a single push will allow */
+    while (done < msg->len) {
+        chunk = (msg->len - done > 65535) ? 65535 : msg->len - done;
+        if (push_generic_onto_net_buffer(nb, msg->data + done, chunk) < 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+    return (int)msg->len;
+}
+
+static inline int send_net_buffer_bytes(net_buffer_t *nb, const void *ptr,
+        int len) {
+
+    if (nb->ssl != NULL) {
+        return SSL_write(nb->ssl, ptr, len);
+    }
+    return send(nb->fd, ptr, len, MSG_DONTWAIT);
+}
+
 int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err) {
-    int ret;
+    int ret, tosend;
+    net_shared_ref_t *ref;
+    uint64_t pending;
 
     if (nb == NULL) {
         *err = OPENLI_PROTO_NULL_BUFFER;
@@ -1270,17 +1709,56 @@ int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err) {
         return -1;
     }
 
-    if (NETBUF_CONTENT_SIZE(nb) == 0) {
+    if (NETBUF_CONTENT_SIZE(nb) == 0 && nb->sharedhead == NULL) {
         return 0;
     }
 
     //dump_buffer_contents(nb->actptr, NETBUF_CONTENT_SIZE(nb));
 
-    if (nb->ssl != NULL){
-        ret = SSL_write(nb->ssl, nb->actptr, NETBUF_CONTENT_SIZE(nb));
-    }
-    else {
-        ret = send(nb->fd, nb->actptr, NETBUF_CONTENT_SIZE(nb), MSG_DONTWAIT);
+    /* Send the buffer contents and any shared messages in the order that
+     * they were pushed, until we run out or the socket is full */
+    while (1) {
+        ref = nb->sharedhead;
+        if (ref && ref->pos == nb->consumed) {
+            tosend = ref->msg->len - ref->sent;
+            ret = send_net_buffer_bytes(nb, ref->msg->data + ref->sent,
+                    tosend);
+            if (ret == -1) {
+                break;
+            }
+            ref->sent += ret;
+            nb->sharedpending -= ret;
+            if (ret < tosend) {
+                break;
+            }
+
+            nb->sharedhead = ref->next;
+            if (nb->sharedhead == NULL) {
+                nb->sharedtail = NULL;
+            }
+            release_shared_net_message(ref->msg);
+            free(ref);
+            continue;
+        }
+
+        tosend = NETBUF_CONTENT_SIZE(nb);
+        if (ref && ref->pos - nb->consumed < (uint64_t)tosend) {
+            tosend = ref->pos - nb->consumed;
+        }
+        if (tosend == 0) {
+            ret = 0;
+            break;
+        }
+
+        ret = send_net_buffer_bytes(nb, nb->actptr, tosend);
+        if (ret == -1) {
+            break;
+        }
+        nb->actptr += ret;
+        nb->consumed += ret;
+        if (ret < tosend) {
+            break;
+        }
     }
 
     if (ret == -1) {
@@ -1292,34 +1770,29 @@ int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err) {
         return -1;
     }
 
-
-    nb->actptr += ret;
-
     /* If we've got a lot of unused space at the front of the buffer,
      * reclaim it by moving our content back to the front.
      */
-    if (NETBUF_FRONT_FREE(nb) > NETBUF_ALLOC_SIZE) {
-        int consize = NETBUF_CONTENT_SIZE(nb);
-
-        if (consize > 0) {
-            memmove(nb->buf, nb->actptr, consize);
-        }
-        nb->actptr = nb->buf;
-        nb->appendptr = nb->actptr + consize;
-
-        /* TODO consider shrinking the buffer if alloced > 10 allocations
-         * and consize < 0.3 * alloced.
-         */
+    if (NETBUF_CONTENT_SIZE(nb) == 0 ||
+            NETBUF_FRONT_FREE(nb) > nb->alloced / 2) {
+        compact_net_buffer(nb);
     }
+    shrink_idle_net_buffer(nb);
 
-    return NETBUF_CONTENT_SIZE(nb);
+    pending = NETBUF_CONTENT_SIZE(nb) + nb->sharedpending;
+    if (pending > INT_MAX) {
+        return INT_MAX;
+    }
+    return (int)pending;
 }
 
 static openli_proto_msgtype_t parse_received_message(net_buffer_t *nb,
-        uint8_t **msgbody, uint16_t *msglen, uint64_t *intid) {
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid) {
 
     ii_header_t *hdr;
     openli_proto_msgtype_t rettype;
+    uint32_t hdrlen = sizeof(ii_header_t);
+    uint32_t bodylen;
 
     if (NETBUF_CONTENT_SIZE(nb) < sizeof(ii_header_t)) {
         return OPENLI_PROTO_NO_MESSAGE;
@@ -1332,18 +1805,94 @@ static openli_proto_msgtype_t parse_received_message(net_buffer_t *nb,
         return OPENLI_PROTO_INVALID_MESSAGE;
     }
 
-    if (NETBUF_CONTENT_SIZE(nb) < sizeof(ii_header_t) + ntohs(hdr->bodylen)) {
+    rettype = ntohs(hdr->intercepttype);
+    if (rettype == OPENLI_PROTO_ETSI_BATCH) {
+        /* Batches use a 32 bit length that follows the regular header */
+        uint32_t batchlen;
+
+        hdrlen += sizeof(batchlen);
+        if (NETBUF_CONTENT_SIZE(nb) < hdrlen) {
+            return OPENLI_PROTO_NO_MESSAGE;
+        }
+        memcpy(&batchlen, nb->actptr + sizeof(ii_header_t), sizeof(batchlen));
+        bodylen = ntohl(batchlen);
+
+        if (bodylen > OPENLI_PROTO_MAX_BATCH_SIZE) {
+            logger(LOG_INFO,
+                    "OpenLI: received oversized record batch (%u bytes)",
+                    bodylen);
+            return OPENLI_PROTO_INVALID_MESSAGE;
+        }
+    } else {
+        bodylen = ntohs(hdr->bodylen);
+    }
+
+    if (NETBUF_CONTENT_SIZE(nb) < hdrlen + bodylen) {
         return OPENLI_PROTO_NO_MESSAGE;
     }
 
     /* Got a complete message */
-    *msgbody = ((uint8_t *)(nb->actptr)) + sizeof(ii_header_t);
-    *msglen = ntohs(hdr->bodylen);
+    *msgbody = ((uint8_t *)(nb->actptr)) + hdrlen;
+    *msglen = bodylen;
     *intid = bswap_be_to_host64(hdr->internalid);
-    rettype = ntohs(hdr->intercepttype);
 
-    nb->actptr += ((*msglen) + sizeof(ii_header_t));
+    nb->actptr += (bodylen + hdrlen);
+
+    return rettype;
+}
+
+/* Checks whether the next message in a receive buffer has been received in
+ * full, i.e. whether receive_net_buffer_ext() can return it without having
+ * to read anything more into the buffer (which may move the contents of
+ * the buffer). Invalid messages count as ready, as they will be reported
+ * without reading anything more.
+ */
+int net_buffer_message_ready(net_buffer_t *nb) {
+
+    ii_header_t *hdr;
+    uint32_t hdrlen = sizeof(ii_header_t);
+    uint32_t bodylen, batchlen;
+
+    if (NETBUF_CONTENT_SIZE(nb) < hdrlen) {
+        return 0;
+    }
+
+    hdr = (ii_header_t *)(nb->actptr);
+    if (ntohl(hdr->magic) != OPENLI_PROTO_MAGIC) {
+        return 1;
+    }
+
+    if (ntohs(hdr->intercepttype) == OPENLI_PROTO_ETSI_BATCH) {
+        hdrlen += sizeof(batchlen);
+        if (NETBUF_CONTENT_SIZE(nb) < hdrlen) {
+            return 0;
+        }
+        memcpy(&batchlen, nb->actptr + sizeof(ii_header_t), sizeof(batchlen));
+        bodylen = ntohl(batchlen);
+        if (bodylen > OPENLI_PROTO_MAX_BATCH_SIZE) {
+            return 1;
+        }
+    } else {
+        bodylen = ntohs(hdr->bodylen);
+    }
+
+    return (NETBUF_CONTENT_SIZE(nb) >= hdrlen + bodylen);
+}
 
+/* Wrapper for parse_received_message() for callers that only deal with
+ * messages using the original 16 bit length field.
+ */
+static openli_proto_msgtype_t parse_received_short_message(net_buffer_t *nb,
+        uint8_t **msgbody, uint16_t *msglen, uint64_t *intid) {
+
+    openli_proto_msgtype_t rettype;
+    uint32_t len = 0;
+
+    rettype = parse_received_message(nb, msgbody, &len, intid);
+    if (len > 65535) {
+        return OPENLI_PROTO_INVALID_MESSAGE;
+    }
+    *msglen = (uint16_t)len;
     return rettype;
 }
 
@@ -1790,7 +2339,59 @@ int decode_staticip_modify(uint8_t *msgbody, uint16_t len,
     return decode_staticip_announcement(msgbody, len, ipr);
 }
 
-int decode_hi1_notification(uint8_t *msgbody, uint16_t len,
+/* Decodes the configuration version from either an auth message or a
+ * config version message.
+ *
+ * Returns 1 if a version was present, 0 if the message had no body (e.g.
+ * an auth message from an older client) and -1 if the message is invalid.
+ */
+int decode_config_version(uint8_t *msgbody, uint16_t len,
+        uint64_t *confepoch, uint64_t *confversion) {
+
+    uint8_t *msgend = msgbody + len;
+    int found = 0;
+
+    *confepoch = 0;
+    *confversion = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    while (msgbody < msgend) {
+        openli_proto_fieldtype_t f;
+        uint8_t *valptr;
+        uint16_t vallen;
+
+        if (decode_tlv(msgbody, msgend, &f, &vallen, &valptr) == -1) {
+            return -1;
+        }
+
+        if (f == OPENLI_PROTO_FIELD_CONFIG_EPOCH &&
+                vallen == sizeof(uint64_t)) {
+            memcpy(confepoch, valptr, sizeof(uint64_t));
+            found |= 1;
+        } else if (f == OPENLI_PROTO_FIELD_CONFIG_VERSION &&
+                vallen == sizeof(uint64_t)) {
+            memcpy(confversion, valptr, sizeof(uint64_t));
+            found |= 2;
+        } else {
+            dump_buffer_contents(msgbody, len);
+            logger(LOG_INFO,
+                "OpenLI: invalid field in received config version: %d.",
+                f);
+            return -1;
+        }
+        msgbody += (vallen + 4);
+    }
+
+    if (found != 3) {
+        return -1;
+    }
+    return 1;
+}
+
+int decode_hi1_notification(uint8_t *msgbody, uint16_t len,
         hi1_notify_data_t *ndata) {
 
     uint8_t *msgend = msgbody + len;
@@ -1946,12 +2547,354 @@ int decode_cease_mediation(uint8_t *msgbody, uint16_t len, char **liid) {
 }
 
 
+int decode_capabilities(uint8_t *msgbody, uint16_t len, uint32_t *caps) {
+
+    uint8_t *msgend = msgbody + len;
+
+    *caps = 0;
+
+    while (msgbody < msgend) {
+        openli_proto_fieldtype_t f;
+        uint8_t *valptr;
+        uint16_t vallen;
+
+        if (decode_tlv(msgbody, msgend, &f, &vallen, &valptr) == -1) {
+            return -1;
+        }
+
+        /* Unlike other messages, unknown fields are ignored here so that
+         * newer peers can add capability information without breaking
+         * older ones. */
+        if (f == OPENLI_PROTO_FIELD_CAPABILITIES &&
+                vallen == sizeof(uint32_t)) {
+            memcpy(caps, valptr, sizeof(uint32_t));
+        }
+        msgbody += (vallen + 4);
+    }
+
+    return 0;
+}
+
+int decode_start_compression(uint8_t *msgbody, uint16_t len,
+        uint8_t *method) {
+
+    uint8_t *msgend = msgbody + len;
+    uint32_t val;
+    int found = 0;
+
+    while (msgbody < msgend) {
+        openli_proto_fieldtype_t f;
+        uint8_t *valptr;
+        uint16_t vallen;
+
+        if (decode_tlv(msgbody, msgend, &f, &vallen, &valptr) == -1) {
+            return -1;
+        }
+
+        if (f == OPENLI_PROTO_FIELD_COMPRESSION_METHOD &&
+                vallen == sizeof(uint32_t)) {
+            memcpy(&val, valptr, sizeof(uint32_t));
+            *method = (uint8_t)val;
+            found = 1;
+        } else {
+            dump_buffer_contents(msgbody, len);
+            logger(LOG_INFO,
+                "OpenLI: invalid field in received start compression message: %d.",
+                f);
+            return -1;
+        }
+        msgbody += (vallen + 4);
+    }
+
+    if (!found) {
+        return -1;
+    }
+    return 0;
+}
+
+int decode_flow_control(uint8_t *msgbody, uint16_t len, char *liid,
+        uint16_t liidspace, uint32_t *leasems) {
+
+    uint8_t *msgend = msgbody + len;
+    int found = 0;
+
+    liid[0] = '\0';
+    while (msgbody < msgend) {
+        openli_proto_fieldtype_t f;
+        uint8_t *valptr;
+        uint16_t vallen;
+
+        if (decode_tlv(msgbody, msgend, &f, &vallen, &valptr) == -1) {
+            return -1;
+        }
+
+        if (f == OPENLI_PROTO_FIELD_LIID && vallen > 0 &&
+                vallen < liidspace) {
+            memcpy(liid, valptr, vallen);
+            liid[vallen] = '\0';
+            found |= 1;
+        } else if (f == OPENLI_PROTO_FIELD_FLOW_LEASE &&
+                vallen == sizeof(uint32_t)) {
+            memcpy(leasems, valptr, sizeof(uint32_t));
+            found |= 2;
+        } else {
+            dump_buffer_contents(msgbody, len);
+            logger(LOG_INFO,
+                "OpenLI: invalid field in received flow control message: %d.",
+                f);
+            return -1;
+        }
+        msgbody += (vallen + 4);
+    }
+
+    if (found != 3) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Checks the header of a received record batch.
+ *
+ * liidprefix is set to point at the LIID length and LIID, which use the
+ * same format as the prefix on a single ETSI record. records is set to
+ * point at the first record in the batch -- use next_etsi_batch_record()
+ * to walk through them.
+ */
+int decode_etsi_batch(uint8_t *msgbody, uint32_t len, uint16_t *reccount,
+        uint8_t **liidprefix, uint16_t *prefixlen, uint8_t **records) {
+
+    uint16_t v;
+
+    if (len < 2 * sizeof(uint16_t)) {
+        logger(LOG_INFO, "OpenLI: truncated record batch header.");
+        return -1;
+    }
+
+    memcpy(&v, msgbody, sizeof(uint16_t));
+    *reccount = ntohs(v);
+    memcpy(&v, msgbody + sizeof(uint16_t), sizeof(uint16_t));
+
+    if (ntohs(v) > len - (2 * sizeof(uint16_t))) {
+        logger(LOG_INFO, "OpenLI: invalid LIID length in record batch: %u",
+                ntohs(v));
+        return -1;
+    }
+
+    *liidprefix = msgbody + sizeof(uint16_t);
+    *prefixlen = ntohs(v) + sizeof(uint16_t);
+    *records = *liidprefix + *prefixlen;
+    return 0;
+}
+
+/* Extracts the next record from a record batch and advances ptr past it.
+ *
+ * Returns 1 if a record was extracted, 0 if there are no more records
+ * and -1 if the batch is malformed.
+ */
+int next_etsi_batch_record(uint8_t **ptr, uint8_t *end,
+        openli_proto_msgtype_t *rectype, uint8_t **rec, uint32_t *reclen) {
+
+    ii_batch_record_t rhdr;
+
+    if (*ptr >= end) {
+        return 0;
+    }
+
+    if (end - *ptr < sizeof(rhdr)) {
+        logger(LOG_INFO, "OpenLI: truncated record header in record batch.");
+        return -1;
+    }
+
+    memcpy(&rhdr, *ptr, sizeof(rhdr));
+    *rectype = ntohs(rhdr.rectype);
+    *reclen = ntohl(rhdr.reclen);
+
+    if (*reclen > (end - *ptr) - sizeof(rhdr)) {
+        logger(LOG_INFO,
+                "OpenLI: truncated record in record batch -- %u bytes remain, record length is %u",
+                (uint32_t)((end - *ptr) - sizeof(rhdr)), *reclen);
+        return -1;
+    }
+
+    *rec = *ptr + sizeof(rhdr);
+    *ptr = *rec + *reclen;
+    return 1;
+}
+
 openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
         uint16_t *msglen, uint64_t *intid) {
 
+    openli_proto_msgtype_t rettype;
+    uint32_t len = 0;
+
+    rettype = receive_net_buffer_ext(nb, msgbody, &len, intid);
+    if (len > 65535) {
+        /* Caller can't cope with anything that doesn't fit in the
+         * original 16 bit length field, e.g. a record batch */
+        return OPENLI_PROTO_INVALID_MESSAGE;
+    }
+    *msglen = (uint16_t)len;
+    return rettype;
+}
+
+/* Switches a receive buffer over to decompressing everything that is
+ * received from now on. Any data that we have already read from the
+ * socket but not yet parsed must have been sent after the compression
+ * started, so it is moved back into the compressed input buffer.
+ *
+ * Returns -1 if the compression method is not supported, 0 otherwise.
+ */
+int enable_net_buffer_decompression(net_buffer_t *nb, uint8_t method) {
+
+    uint64_t leftover;
+
+    if (nb->decomp) {
+        return -1;
+    }
+
+    nb->decomp = create_decompressor(method);
+    if (nb->decomp == NULL) {
+        return -1;
+    }
+
+    leftover = NETBUF_CONTENT_SIZE(nb);
+    nb->zinalloc = NETBUF_ZIN_SIZE;
+    if (leftover > nb->zinalloc) {
+        nb->zinalloc = leftover;
+    }
+    nb->zin = (uint8_t *)malloc(nb->zinalloc);
+    if (nb->zin == NULL) {
+        destroy_decompressor(nb->decomp);
+        nb->decomp = NULL;
+        nb->zinalloc = 0;
+        return -1;
+    }
+
+    account_net_buffer(nb->zinalloc);
+
+    memcpy(nb->zin, nb->actptr, leftover);
+    nb->zinlen = leftover;
+    nb->zintotal += leftover;
+    nb->appendptr = nb->actptr;
+    return 0;
+}
+
+/* Decompresses as much of the pending compressed input as we can into the
+ * receive buffer. We stop once a buffer's worth has been produced so that
+ * a highly compressible stream can't make the buffer grow without limit
+ * before any of it has been parsed.
+ */
+static int64_t decompress_net_buffer(net_buffer_t *nb) {
+
+    uint64_t used = 0, consumed, produced, total = 0;
+
+    while (used < nb->zinlen && total < NETBUF_ALLOC_SIZE) {
+        if (NETBUF_SPACE_REM(nb) < NETBUF_ZOUT_MIN) {
+            if (extend_net_buffer(nb, NETBUF_ZOUT_MIN) == -1) {
+                return -1;
+            }
+        }
+
+        if (decompress_available(nb->decomp, nb->zin + used,
+                    nb->zinlen - used, &consumed, (uint8_t *)nb->appendptr,
+                    NETBUF_SPACE_REM(nb), &produced) < 0) {
+            return -1;
+        }
+
+        used += consumed;
+        nb->appendptr += produced;
+        total += produced;
+
+        if (consumed == 0 && produced == 0) {
+            break;
+        }
+    }
+
+    if (used > 0) {
+        memmove(nb->zin, nb->zin + used, nb->zinlen - used);
+        nb->zinlen -= used;
+    }
+    nb->zouttotal += total;
+    return (int64_t)total;
+}
+
+/* Keeps decompressing pending input until we have a complete message to
+ * return or we run out of compressed input.
+ */
+static openli_proto_msgtype_t parse_decompressed_message(net_buffer_t *nb,
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid) {
+
+    openli_proto_msgtype_t rettype = OPENLI_PROTO_NO_MESSAGE;
+    int64_t produced;
+
+    while (nb->zinlen > 0) {
+        produced = decompress_net_buffer(nb);
+        if (produced < 0) {
+            return OPENLI_PROTO_RECV_ERROR;
+        }
+        rettype = parse_received_message(nb, msgbody, msglen, intid);
+        if (rettype != OPENLI_PROTO_NO_MESSAGE || produced == 0) {
+            break;
+        }
+    }
+    return rettype;
+}
+
+/* Receive path for a buffer where the sender is compressing their
+ * stream -- raw data from the socket goes into the compressed input
+ * buffer and is decompressed into the main buffer for parsing.
+ */
+static openli_proto_msgtype_t receive_compressed_net_buffer(net_buffer_t *nb,
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid) {
+
     openli_proto_msgtype_t rettype;
     int ret;
 
+    rettype = parse_decompressed_message(nb, msgbody, msglen, intid);
+    if (rettype != OPENLI_PROTO_NO_MESSAGE) {
+        return rettype;
+    }
+
+    if (nb->zinlen == nb->zinalloc) {
+        /* Decompressor isn't making progress on what we already have */
+        return OPENLI_PROTO_BUFFER_TOO_FULL;
+    }
+
+    if (nb->ssl != NULL){
+        ret = SSL_read(nb->ssl, nb->zin + nb->zinlen,
+                nb->zinalloc - nb->zinlen);
+    }
+    else {
+        ret = recv(nb->fd, nb->zin + nb->zinlen, nb->zinalloc - nb->zinlen,
+                MSG_DONTWAIT);
+    }
+
+    if (ret <= 0) {
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return OPENLI_PROTO_NO_MESSAGE;
+        }
+        if (ret == 0) {
+            return OPENLI_PROTO_PEER_DISCONNECTED;
+        }
+        return OPENLI_PROTO_RECV_ERROR;
+    }
+
+    nb->zinlen += ret;
+    nb->zintotal += ret;
+
+    return parse_decompressed_message(nb, msgbody, msglen, intid);
+}
+
+/* As per receive_net_buffer(), but the message length is 32 bits so that
+ * record batches can be received.
+ */
+openli_proto_msgtype_t receive_net_buffer_ext(net_buffer_t *nb,
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid) {
+
+    openli_proto_msgtype_t rettype;
+    int ret;
+    int space;
+
     if (nb == NULL) {
         return OPENLI_PROTO_NULL_BUFFER;
     }
@@ -1965,18 +2908,23 @@ openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
         return rettype;
     }
 
+    if (nb->decomp) {
+        return receive_compressed_net_buffer(nb, msgbody, msglen, intid);
+    }
+
     /* Not enough data in the buffer for a complete message, read some more. */
-    if (NETBUF_SPACE_REM(nb) < NETBUF_ALLOC_SIZE) {
-        if (extend_net_buffer(nb, NETBUF_ALLOC_SIZE) == -1) {
+    if (NETBUF_SPACE_REM(nb) < nb->readwant) {
+        if (extend_net_buffer(nb, nb->readwant) == -1) {
             return OPENLI_PROTO_BUFFER_TOO_FULL;
         }
     }
 
+    space = NETBUF_SPACE_REM(nb);
     if (nb->ssl != NULL){
-        ret = SSL_read(nb->ssl, nb->appendptr, NETBUF_SPACE_REM(nb));
+        ret = SSL_read(nb->ssl, nb->appendptr, space);
     }
     else {
-        ret = recv(nb->fd, nb->appendptr, NETBUF_SPACE_REM(nb), MSG_DONTWAIT);
+        ret = recv(nb->fd, nb->appendptr, space, MSG_DONTWAIT);
     }
     
     if (ret <= 0) {
@@ -1992,10 +2940,83 @@ openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
 
     nb->appendptr += ret;
 
+    /* If we filled all of the space we had, there's probably plenty more
+     * waiting so ask for more room next time */
+    if (ret == space && nb->readwant < NETBUF_ALLOC_SIZE) {
+        nb->readwant *= 2;
+    }
+    shrink_idle_net_buffer(nb);
+
     rettype = parse_received_message(nb, msgbody, msglen, intid);
     return rettype;
 }
 
+/* Writes the current contents of a send buffer to a file descriptor, e.g.
+ * to save a set of encoded messages to disk. Any shared messages that are
+ * queued on the buffer are not written.
+ *
+ * Returns -1 if an error occurs, otherwise the number of bytes written.
+ */
+int64_t write_net_buffer_to_fd(net_buffer_t *nb, int fd) {
+
+    char *ptr = nb->actptr;
+    int64_t total = 0;
+    ssize_t ret;
+
+    while (ptr < nb->appendptr) {
+        ret = write(fd, ptr, nb->appendptr - ptr);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += ret;
+        total += ret;
+    }
+    return total;
+}
+
+/* Appends everything that can be read from a file descriptor to a receive
+ * buffer, e.g. to load messages that were saved using
+ * write_net_buffer_to_fd(). The messages can then be read using
+ * receive_net_buffer() for as long as net_buffer_message_ready() says
+ * that a complete message is available.
+ *
+ * Returns -1 if an error occurs, otherwise the number of bytes read.
+ */
+int64_t read_net_buffer_from_fd(net_buffer_t *nb, int fd) {
+
+    int64_t total = 0;
+    ssize_t ret;
+
+    if (nb->buftype != NETBUF_RECV) {
+        return -1;
+    }
+
+    while (1) {
+        if (NETBUF_SPACE_REM(nb) < NETBUF_READ_MIN) {
+            if (extend_net_buffer(nb, NETBUF_READ_MIN) == -1) {
+                return -1;
+            }
+        }
+
+        ret = read(fd, nb->appendptr, NETBUF_SPACE_REM(nb));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        nb->appendptr += ret;
+        total += ret;
+    }
+    return total;
+}
+
 
 //Check the RMQ connection for new frames/messages, new messages will be placed
 //inside the netbuffer 
@@ -2006,6 +3027,9 @@ openli_proto_msgtype_t receive_RMQ_buffer(net_buffer_t *nb,
     amqp_frame_t frame;
     amqp_rpc_reply_t ret;
     amqp_envelope_t envelope;
+    uint64_t lasttag = 0;
+    amqp_channel_t lastchannel = 0;
+    int consumed = 0;
 
     openli_proto_msgtype_t rettype;
     struct timeval tv;
@@ -2020,13 +3044,49 @@ openli_proto_msgtype_t receive_RMQ_buffer(net_buffer_t *nb,
         return OPENLI_PROTO_WRONG_BUFFER_TYPE;
     }
 
-    rettype = parse_received_message(nb, msgbody, msglen, intid);
+    rettype = parse_received_short_message(nb, msgbody, msglen, intid);
     if (rettype != OPENLI_PROTO_NO_MESSAGE) {
         return rettype;
     }
 
-    amqp_maybe_release_buffers(amqp_state);
-    ret = amqp_consume_message(amqp_state, &envelope, &tv, 0);
+    /* Take as many messages as are already waiting (up to a limit) before
+     * parsing anything, so that they can all be acknowledged at once */
+    while (consumed < RMQ_CONSUME_BATCH) {
+        amqp_maybe_release_buffers(amqp_state);
+        ret = amqp_consume_message(amqp_state, &envelope, &tv, 0);
+
+        if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+            break;
+        }
+
+        lasttag = envelope.delivery_tag;
+        lastchannel = envelope.channel;
+        consumed ++;
+
+        /* Ensure the buffer is big enough to hold the new message. */
+        if (NETBUF_SPACE_REM(nb) < envelope.message.body.len) {
+            if (extend_net_buffer(nb, envelope.message.body.len) == -1) {
+                amqp_destroy_envelope(&envelope);
+                return OPENLI_PROTO_BUFFER_TOO_FULL;
+            }
+        }
+
+        memcpy(nb->appendptr,
+                envelope.message.body.bytes,
+                envelope.message.body.len);
+        nb->appendptr += envelope.message.body.len;
+        amqp_destroy_envelope(&envelope);
+
+        /* Don't wait around for any more after the first one */
+        tv.tv_usec = 0;
+    }
+
+    if (consumed > 0) {
+        if (amqp_basic_ack(amqp_state, lastchannel, lasttag, 1) != 0) {
+            logger(LOG_INFO, "OpenLI: RMQ error in basic acknowledgement");
+        }
+        return parse_received_short_message(nb, msgbody, msglen, intid);
+    }
 
     if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
         if (AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type &&
@@ -2090,30 +3150,7 @@ openli_proto_msgtype_t receive_RMQ_buffer(net_buffer_t *nb,
             }
         }
     }
-    else {
-        if (amqp_basic_ack (amqp_state,
-                envelope.channel,
-                envelope.delivery_tag,
-                0) != 0 ) {
-            logger(LOG_INFO, "OpenLI: RMQ error in basic acknowledgement");
-        }
-    }
-
-    /* Ensure the buffer is big enough to hold the new message. */
-    if (NETBUF_SPACE_REM(nb) < envelope.message.body.len) {
-        if (extend_net_buffer(nb, envelope.message.body.len) == -1) {
-            return OPENLI_PROTO_BUFFER_TOO_FULL;
-        }
-    }
-
-    memcpy(nb->appendptr, 
-            envelope.message.body.bytes,
-            envelope.message.body.len);
-    nb->appendptr += envelope.message.body.len;
-    amqp_destroy_envelope(&envelope);
-
-    rettype = parse_received_message(nb, msgbody, msglen, intid);
-    return rettype;
+    return OPENLI_PROTO_NO_MESSAGE;
 }
 
 void nb_log_transmit_error(openli_proto_msgtype_t err) {
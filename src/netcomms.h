@@ -34,8 +34,31 @@
 #include <fcntl.h>
 #include <amqp.h>
 
+/* Net buffers start small and double in size whenever they run out of
+ * room, up to the configured limit (see set_net_buffer_limit()) */
+#define NETBUF_INIT_SIZE (64 * 1024)
+#define NETBUF_DEFAULT_LIMIT (256ULL * 1024 * 1024)
+/* Smallest limit that still leaves room for a full record batch frame */
+#define NETBUF_MIN_LIMIT (128ULL * 1024 * 1024)
+
+/* Receive buffers ask for at least NETBUF_READ_MIN bytes of space per
+ * read, doubling that (up to NETBUF_ALLOC_SIZE) while reads keep filling
+ * the space that they are given */
+#define NETBUF_READ_MIN (16 * 1024)
 #define NETBUF_ALLOC_SIZE (10 * 1024 * 1024)
 
+/* Buffers that have been mostly empty for this many seconds are shrunk */
+#define NETBUF_IDLE_SHRINK 30
+
+/* How often to log the total memory held by net buffers, in seconds */
+#define NETBUF_REPORT_INTERVAL 300
+
+#define NETBUF_ZIN_SIZE (1024 * 1024)
+#define NETBUF_ZOUT_MIN (64 * 1024)
+
+/* Maximum number of RabbitMQ messages to read (and acknowledge) at once */
+#define RMQ_CONSUME_BATCH 32
+
 #define OPENLI_PROTO_MAGIC 0x5c4c6c5c
 #define OPENLI_COLLECTOR_MAGIC 0x00180014202042a8
 #define OPENLI_MEDIATOR_MAGIC 0x01153200d6f12905
@@ -47,6 +70,7 @@
 #include "intercept.h"
 #include "agency.h"
 #include "coreserver.h"
+#include "openli_compress.h"
 
 typedef struct ii_header {
     uint32_t magic;
@@ -55,6 +79,37 @@ typedef struct ii_header {
     uint64_t internalid;
 } PACKED ii_header_t;
 
+/* Capability flags that a mediator may advertise to its collectors */
+#define OPENLI_CAP_BATCHED_RECORDS (1 << 0)
+#define OPENLI_CAP_COMPRESS_LZ4 (1 << 1)
+#define OPENLI_CAP_COMPRESS_ZSTD (1 << 2)
+
+/* Largest batch frame that we are willing to accept from a peer */
+#define OPENLI_PROTO_MAX_BATCH_SIZE (64 * 1024 * 1024)
+
+/* Header for a frame containing multiple records for the same LIID.
+ *
+ * The bodylen in the regular header is unused (zero) -- instead, batchlen
+ * gives the number of bytes that follow the batchlen field. The LIID
+ * (liidlen bytes) comes immediately after this header, followed by
+ * reccount records that each begin with an ii_batch_record_t.
+ *
+ * Because the liidlen field is followed directly by the LIID, the
+ * liidlen and LIID together have the same format as the LIID prefix
+ * on a regular ETSI CC or IRI message.
+ */
+typedef struct ii_batch_header {
+    ii_header_t hdr;
+    uint32_t batchlen;
+    uint16_t reccount;
+    uint16_t liidlen;
+} PACKED ii_batch_header_t;
+
+typedef struct ii_batch_record {
+    uint16_t rectype;
+    uint32_t reclen;
+} PACKED ii_batch_record_t;
+
 
 typedef struct openli_mediator {
     uint32_t mediatorid;
@@ -109,8 +164,53 @@ typedef enum {
     OPENLI_PROTO_HEARTBEAT,
     OPENLI_PROTO_SSL_REQUIRED,
     OPENLI_PROTO_HI1_NOTIFICATION,
+    OPENLI_PROTO_CAPABILITIES,
+    OPENLI_PROTO_ETSI_BATCH,
+    OPENLI_PROTO_START_COMPRESSION,
+    OPENLI_PROTO_FLOW_CONTROL,
+    OPENLI_PROTO_CONFIG_VERSION,
+    OPENLI_PROTO_CONFIG_DELTA,
 } openli_proto_msgtype_t;
 
+/* An encoded message that can be queued on the send buffers of many
+ * clients at once, so that it only needs to be encoded once no matter how
+ * many clients it is sent to */
+typedef struct net_shared_msg {
+    /* Number of send buffers (plus the creator) still referring to this */
+    uint32_t refs;
+    uint32_t len;
+    uint8_t *data;
+} net_shared_msg_t;
+
+/* A shared message that is waiting in a send buffer */
+typedef struct net_shared_ref {
+    net_shared_msg_t *msg;
+    /* The message is sent once this many bytes have been sent from the
+     * buffer itself, i.e. it goes after everything that had been pushed
+     * onto the buffer when it was queued */
+    uint64_t pos;
+    /* Number of bytes of the message that have already been sent */
+    uint32_t sent;
+    struct net_shared_ref *next;
+} net_shared_ref_t;
+
+/* Encodes a message once, so that the same encoded copy can be queued for
+ * every client that needs it rather than being encoded again for each one.
+ * 'encodecall' should push the message onto 'enc'. If encoding fails, msg
+ * is left as NULL and pushing it onto a client's buffer will also fail.
+ */
+#define ENCODE_SHARED_MESSAGE(msg, encodecall) \
+    do { \
+        net_buffer_t *enc = create_net_buffer(NETBUF_SEND, -1, NULL); \
+        msg = NULL; \
+        if (enc != NULL) { \
+            if ((encodecall) >= 0) { \
+                msg = create_shared_net_message(enc); \
+            } \
+            destroy_net_buffer(enc); \
+        } \
+    } while (0)
+
 typedef struct net_buffer {
     int fd;
     char *buf;
@@ -119,6 +219,29 @@ typedef struct net_buffer {
     int alloced;
     net_buffer_type_t buftype;
     SSL *ssl;
+
+    /* Amount of space to make available for the next read */
+    int readwant;
+    /* Last time (in seconds) that more than a quarter of the buffer was
+     * in use */
+    uint32_t lastbusy;
+
+    /* Only used if the sender has started compressing the stream */
+    openli_decompressor_t *decomp;
+    uint8_t *zin;
+    uint64_t zinlen;
+    uint64_t zinalloc;
+    uint64_t zintotal;
+    uint64_t zouttotal;
+
+    /* Only used by send buffers that have shared messages queued */
+    net_shared_ref_t *sharedhead;
+    net_shared_ref_t *sharedtail;
+    /* Total bytes sent from the buffer itself (i.e. not counting shared
+     * messages) */
+    uint64_t consumed;
+    /* Bytes of shared messages that are yet to be sent */
+    uint64_t sharedpending;
 } net_buffer_t;
 
 typedef enum {
@@ -154,15 +277,31 @@ typedef enum {
     OPENLI_PROTO_FIELD_TS_USEC,
     OPENLI_PROTO_FIELD_INTERCEPT_START_TIME,
     OPENLI_PROTO_FIELD_INTERCEPT_END_TIME,
+    OPENLI_PROTO_FIELD_CAPABILITIES,
+    OPENLI_PROTO_FIELD_COMPRESSION_METHOD,
+    OPENLI_PROTO_FIELD_FLOW_LEASE,
+    OPENLI_PROTO_FIELD_CONFIG_EPOCH,
+    OPENLI_PROTO_FIELD_CONFIG_VERSION,
 } openli_proto_fieldtype_t;
 
 net_buffer_t *create_net_buffer(net_buffer_type_t buftype, int fd, SSL *ssl);
 int fd_set_nonblock(int fd);
 int fd_set_block(int fd);
 void destroy_net_buffer(net_buffer_t *nb);
+void set_net_buffer_limit(uint64_t limit);
+uint64_t get_net_buffer_committed(void);
+uint64_t get_net_buffer_peak(void);
+void report_net_buffer_usage(const char *component);
 
 int construct_netcomm_protocol_header(ii_header_t *hdr, uint32_t contentlen,
         uint16_t msgtype, uint64_t internalid, uint32_t *hdrlen);
+int construct_capabilities_message(uint8_t *space, uint32_t spacelen,
+        uint32_t caps);
+int construct_start_compression_message(uint8_t *space, uint32_t spacelen,
+        uint8_t method);
+int construct_flow_control_message(uint8_t *space, uint32_t spacelen,
+        char *liid, uint32_t leasems);
+int enable_net_buffer_decompression(net_buffer_t *nb, uint8_t method);
 
 int push_default_radius_onto_net_buffer(net_buffer_t *nb,
         default_radius_user_t *defuser);
@@ -183,7 +322,7 @@ int push_lea_withdrawal_onto_net_buffer(net_buffer_t *nb, liagency_t *lea);
 int push_intercept_dest_onto_net_buffer(net_buffer_t *nb, char *liid,
         char *agencyid);
 int push_auth_onto_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t
-        authtype);
+        authtype, uint64_t confepoch, uint64_t confversion);
 int push_liid_mapping_onto_net_buffer(net_buffer_t *nb, char *agency,
         char *liid);
 int push_cease_mediation_onto_net_buffer(net_buffer_t *nb, char *liid,
@@ -198,8 +337,15 @@ int push_sip_target_onto_net_buffer(net_buffer_t *nb,
 int push_sip_target_withdrawal_onto_net_buffer(net_buffer_t *nb,
         openli_sip_identity_t *sipid, voipintercept_t *vint);
 int push_nomore_intercepts(net_buffer_t *nb);
+int push_config_version_onto_net_buffer(net_buffer_t *nb, uint64_t confepoch,
+        uint64_t confversion);
+int push_config_delta_onto_net_buffer(net_buffer_t *nb);
 int push_ssl_required(net_buffer_t *nb);
 int transmit_net_buffer(net_buffer_t *nb, openli_proto_msgtype_t *err);
+net_shared_msg_t *create_shared_net_message(net_buffer_t *encoded);
+void release_shared_net_message(net_shared_msg_t *msg);
+int push_shared_onto_net_buffer(net_buffer_t *nb, net_shared_msg_t *msg);
+int copy_shared_onto_net_buffer(net_buffer_t *nb, net_shared_msg_t *msg);
 int push_static_ipranges_removal_onto_net_buffer(net_buffer_t *nb,
         ipintercept_t *ipint, static_ipranges_t *ipr);
 int push_static_ipranges_modify_onto_net_buffer(net_buffer_t *nb,
@@ -214,6 +360,20 @@ openli_proto_msgtype_t receive_RMQ_buffer(net_buffer_t *nb,
         uint16_t *msglen, uint64_t *intid);
 openli_proto_msgtype_t receive_net_buffer(net_buffer_t *nb, uint8_t **msgbody,
         uint16_t *msglen, uint64_t *intid);
+openli_proto_msgtype_t receive_net_buffer_ext(net_buffer_t *nb,
+        uint8_t **msgbody, uint32_t *msglen, uint64_t *intid);
+int net_buffer_message_ready(net_buffer_t *nb);
+int64_t write_net_buffer_to_fd(net_buffer_t *nb, int fd);
+int64_t read_net_buffer_from_fd(net_buffer_t *nb, int fd);
+int decode_capabilities(uint8_t *msgbody, uint16_t len, uint32_t *caps);
+int decode_start_compression(uint8_t *msgbody, uint16_t len,
+        uint8_t *method);
+int decode_flow_control(uint8_t *msgbody, uint16_t len, char *liid,
+        uint16_t liidspace, uint32_t *leasems);
+int decode_etsi_batch(uint8_t *msgbody, uint32_t len, uint16_t *reccount,
+        uint8_t **liidprefix, uint16_t *prefixlen, uint8_t **records);
+int next_etsi_batch_record(uint8_t **ptr, uint8_t *end,
+        openli_proto_msgtype_t *rectype, uint8_t **rec, uint32_t *reclen);
 int decode_default_radius_announcement(uint8_t *msgbody, uint16_t len,
         default_radius_user_t *defuser);
 int decode_default_radius_withdraw(uint8_t *msgbody, uint16_t len,
@@ -253,6 +413,8 @@ int decode_staticip_removal(uint8_t *msgbody, uint16_t len,
         static_ipranges_t *ipr);
 int decode_staticip_modify(uint8_t *msgbody, uint16_t len,
         static_ipranges_t *ipr);
+int decode_config_version(uint8_t *msgbody, uint16_t len,
+        uint64_t *confepoch, uint64_t *confversion);
 int decode_hi1_notification(uint8_t *msgbody, uint16_t len,
         hi1_notify_data_t *ndata);
 void nb_log_receive_error(openli_proto_msgtype_t err);
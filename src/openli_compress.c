@@ -0,0 +1,393 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "logger.h"
+#include "openli_compress.h"
+
+/* Largest amount of input that we will hand to the compressor at once,
+ * which limits how much output space we need to reserve for each step */
+#define COMPRESS_SLICE (1024 * 1024)
+
+int parse_compression_method(const char *str) {
+
+    if (strcasecmp(str, "none") == 0 || strcasecmp(str, "no") == 0 ||
+            strcasecmp(str, "off") == 0) {
+        return OPENLI_COMPRESS_NONE;
+    }
+    if (strcasecmp(str, "lz4") == 0) {
+        return OPENLI_COMPRESS_LZ4;
+    }
+    if (strcasecmp(str, "zstd") == 0) {
+        return OPENLI_COMPRESS_ZSTD;
+    }
+    return -1;
+}
+
+const char *compression_method_string(uint8_t method) {
+
+    switch(method) {
+        case OPENLI_COMPRESS_NONE:
+            return "none";
+        case OPENLI_COMPRESS_LZ4:
+            return "lz4";
+        case OPENLI_COMPRESS_ZSTD:
+            return "zstd";
+    }
+    return "unknown";
+}
+
+int compression_method_available(uint8_t method) {
+
+    switch(method) {
+        case OPENLI_COMPRESS_NONE:
+            return 1;
+#ifdef HAVE_LZ4
+        case OPENLI_COMPRESS_LZ4:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case OPENLI_COMPRESS_ZSTD:
+            return 1;
+#endif
+    }
+    return 0;
+}
+
+static int reserve_output(uint8_t **out, uint64_t *outlen,
+        uint64_t *outalloc, uint64_t required) {
+
+    uint8_t *tmp;
+    uint64_t newsize;
+
+    if (*outalloc - *outlen >= required) {
+        return 0;
+    }
+
+    newsize = (*outalloc) * 2;
+    if (newsize < *outlen + required) {
+        newsize = *outlen + required;
+    }
+
+    tmp = realloc(*out, newsize);
+    if (tmp == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: unable to allocate %lu bytes for compressed output",
+                newsize);
+        return -1;
+    }
+    *out = tmp;
+    *outalloc = newsize;
+    return 0;
+}
+
+openli_compressor_t *create_compressor(uint8_t method) {
+
+    openli_compressor_t *comp;
+
+    if (method == OPENLI_COMPRESS_NONE ||
+            !compression_method_available(method)) {
+        return NULL;
+    }
+
+    comp = (openli_compressor_t *)calloc(1, sizeof(openli_compressor_t));
+    comp->method = method;
+
+#ifdef HAVE_ZSTD
+    if (method == OPENLI_COMPRESS_ZSTD) {
+        comp->ctx = ZSTD_createCCtx();
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (method == OPENLI_COMPRESS_LZ4) {
+        LZ4F_cctx *cctx = NULL;
+        if (!LZ4F_isError(LZ4F_createCompressionContext(&cctx,
+                        LZ4F_VERSION))) {
+            comp->ctx = cctx;
+        }
+    }
+#endif
+
+    if (comp->ctx == NULL) {
+        logger(LOG_INFO, "OpenLI: unable to create %s compression context",
+                compression_method_string(method));
+        free(comp);
+        return NULL;
+    }
+    return comp;
+}
+
+void destroy_compressor(openli_compressor_t *comp) {
+
+    if (comp == NULL) {
+        return;
+    }
+#ifdef HAVE_ZSTD
+    if (comp->method == OPENLI_COMPRESS_ZSTD) {
+        ZSTD_freeCCtx((ZSTD_CCtx *)comp->ctx);
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (comp->method == OPENLI_COMPRESS_LZ4) {
+        LZ4F_freeCompressionContext((LZ4F_cctx *)comp->ctx);
+    }
+#endif
+    free(comp);
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_compress_and_flush(openli_compressor_t *comp, uint8_t *in,
+        uint64_t inlen, uint8_t **out, uint64_t *outlen, uint64_t *outalloc) {
+
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t rem;
+
+    input.src = in;
+    input.size = inlen;
+    input.pos = 0;
+
+    do {
+        if (reserve_output(out, outlen, outalloc, ZSTD_CStreamOutSize()) < 0) {
+            return -1;
+        }
+        output.dst = *out;
+        output.size = *outalloc;
+        output.pos = *outlen;
+
+        rem = ZSTD_compressStream2((ZSTD_CCtx *)comp->ctx, &output, &input,
+                ZSTD_e_flush);
+        if (ZSTD_isError(rem)) {
+            logger(LOG_INFO, "OpenLI: zstd compression failed: %s",
+                    ZSTD_getErrorName(rem));
+            return -1;
+        }
+        *outlen = output.pos;
+    } while (rem != 0 || input.pos < input.size);
+
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int lz4_compress_and_flush(openli_compressor_t *comp, uint8_t *in,
+        uint64_t inlen, uint8_t **out, uint64_t *outlen, uint64_t *outalloc) {
+
+    LZ4F_cctx *cctx = (LZ4F_cctx *)comp->ctx;
+    LZ4F_preferences_t prefs;
+    uint64_t slice;
+    size_t ret;
+
+    /* Must match the preferences used when the frame was started */
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.autoFlush = 1;
+
+    if (!comp->started) {
+        if (reserve_output(out, outlen, outalloc, LZ4F_HEADER_SIZE_MAX) < 0) {
+            return -1;
+        }
+        ret = LZ4F_compressBegin(cctx, *out + *outlen, *outalloc - *outlen,
+                &prefs);
+        if (LZ4F_isError(ret)) {
+            logger(LOG_INFO, "OpenLI: unable to start lz4 frame: %s",
+                    LZ4F_getErrorName(ret));
+            return -1;
+        }
+        *outlen += ret;
+        comp->started = 1;
+    }
+
+    while (inlen > 0) {
+        slice = (inlen > COMPRESS_SLICE) ? COMPRESS_SLICE : inlen;
+
+        if (reserve_output(out, outlen, outalloc,
+                    LZ4F_compressBound(slice, &prefs)) < 0) {
+            return -1;
+        }
+        ret = LZ4F_compressUpdate(cctx, *out + *outlen, *outalloc - *outlen,
+                in, slice, NULL);
+        if (LZ4F_isError(ret)) {
+            logger(LOG_INFO, "OpenLI: lz4 compression failed: %s",
+                    LZ4F_getErrorName(ret));
+            return -1;
+        }
+        *outlen += ret;
+        in += slice;
+        inlen -= slice;
+    }
+
+    if (reserve_output(out, outlen, outalloc,
+                LZ4F_compressBound(0, &prefs)) < 0) {
+        return -1;
+    }
+    ret = LZ4F_flush(cctx, *out + *outlen, *outalloc - *outlen, NULL);
+    if (LZ4F_isError(ret)) {
+        logger(LOG_INFO, "OpenLI: lz4 flush failed: %s",
+                LZ4F_getErrorName(ret));
+        return -1;
+    }
+    *outlen += ret;
+    return 0;
+}
+#endif
+
+int compress_and_flush(openli_compressor_t *comp, uint8_t *in,
+        uint64_t inlen, uint8_t **out, uint64_t *outlen, uint64_t *outalloc) {
+
+#ifdef HAVE_ZSTD
+    if (comp->method == OPENLI_COMPRESS_ZSTD) {
+        return zstd_compress_and_flush(comp, in, inlen, out, outlen,
+                outalloc);
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (comp->method == OPENLI_COMPRESS_LZ4) {
+        return lz4_compress_and_flush(comp, in, inlen, out, outlen,
+                outalloc);
+    }
+#endif
+    return -1;
+}
+
+openli_decompressor_t *create_decompressor(uint8_t method) {
+
+    openli_decompressor_t *decomp;
+
+    if (method == OPENLI_COMPRESS_NONE ||
+            !compression_method_available(method)) {
+        return NULL;
+    }
+
+    decomp = (openli_decompressor_t *)calloc(1,
+            sizeof(openli_decompressor_t));
+    decomp->method = method;
+
+#ifdef HAVE_ZSTD
+    if (method == OPENLI_COMPRESS_ZSTD) {
+        decomp->ctx = ZSTD_createDCtx();
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (method == OPENLI_COMPRESS_LZ4) {
+        LZ4F_dctx *dctx = NULL;
+        if (!LZ4F_isError(LZ4F_createDecompressionContext(&dctx,
+                        LZ4F_VERSION))) {
+            decomp->ctx = dctx;
+        }
+    }
+#endif
+
+    if (decomp->ctx == NULL) {
+        logger(LOG_INFO, "OpenLI: unable to create %s decompression context",
+                compression_method_string(method));
+        free(decomp);
+        return NULL;
+    }
+    return decomp;
+}
+
+void destroy_decompressor(openli_decompressor_t *decomp) {
+
+    if (decomp == NULL) {
+        return;
+    }
+#ifdef HAVE_ZSTD
+    if (decomp->method == OPENLI_COMPRESS_ZSTD) {
+        ZSTD_freeDCtx((ZSTD_DCtx *)decomp->ctx);
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (decomp->method == OPENLI_COMPRESS_LZ4) {
+        LZ4F_freeDecompressionContext((LZ4F_dctx *)decomp->ctx);
+    }
+#endif
+    free(decomp);
+}
+
+int decompress_available(openli_decompressor_t *decomp, uint8_t *in,
+        uint64_t inlen, uint64_t *consumed, uint8_t *out, uint64_t outspace,
+        uint64_t *produced) {
+
+    *consumed = 0;
+    *produced = 0;
+
+#ifdef HAVE_ZSTD
+    if (decomp->method == OPENLI_COMPRESS_ZSTD) {
+        ZSTD_inBuffer input;
+        ZSTD_outBuffer output;
+        size_t ret;
+
+        input.src = in;
+        input.size = inlen;
+        input.pos = 0;
+        output.dst = out;
+        output.size = outspace;
+        output.pos = 0;
+
+        ret = ZSTD_decompressStream((ZSTD_DCtx *)decomp->ctx, &output,
+                &input);
+        if (ZSTD_isError(ret)) {
+            logger(LOG_INFO, "OpenLI: zstd decompression failed: %s",
+                    ZSTD_getErrorName(ret));
+            return -1;
+        }
+        *consumed = input.pos;
+        *produced = output.pos;
+        return 0;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (decomp->method == OPENLI_COMPRESS_LZ4) {
+        size_t srcsize = inlen;
+        size_t dstsize = outspace;
+        size_t ret;
+
+        ret = LZ4F_decompress((LZ4F_dctx *)decomp->ctx, out, &dstsize, in,
+                &srcsize, NULL);
+        if (LZ4F_isError(ret)) {
+            logger(LOG_INFO, "OpenLI: lz4 decompression failed: %s",
+                    LZ4F_getErrorName(ret));
+            return -1;
+        }
+        *consumed = srcsize;
+        *produced = dstsize;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
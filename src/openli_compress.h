@@ -0,0 +1,134 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_COMPRESS_H_
+#define OPENLI_COMPRESS_H_
+
+#include "config.h"
+#include <stdint.h>
+
+/* Stream compression methods that may be used for collector->mediator
+ * exports. The values are used on the wire, so don't reorder them.
+ */
+typedef enum {
+    OPENLI_COMPRESS_NONE = 0,
+    OPENLI_COMPRESS_LZ4 = 1,
+    OPENLI_COMPRESS_ZSTD = 2,
+} openli_compress_method_t;
+
+/* The compression state for a single outgoing stream. The whole
+ * connection is compressed as one continuous stream, which is flushed
+ * after each chunk so that the receiver can decode everything we have
+ * sent so far.
+ */
+typedef struct openli_compressor {
+    uint8_t method;
+    void *ctx;
+    uint8_t started;
+} openli_compressor_t;
+
+/* The decompression state for a single incoming stream */
+typedef struct openli_decompressor {
+    uint8_t method;
+    void *ctx;
+} openli_decompressor_t;
+
+/** Converts a compression method name from a config file into the
+ *  corresponding method.
+ *
+ *  @param str          The method name, e.g. "zstd"
+ *
+ *  @return the compression method, or -1 if the name is not recognised.
+ */
+int parse_compression_method(const char *str);
+
+/** Returns a printable name for a compression method */
+const char *compression_method_string(uint8_t method);
+
+/** Checks whether this build of OpenLI supports a compression method.
+ *
+ *  @return 1 if the method is supported, 0 otherwise.
+ */
+int compression_method_available(uint8_t method);
+
+/** Creates the state required to compress an outgoing stream.
+ *
+ *  @param method       The compression method to use
+ *
+ *  @return the new compressor, or NULL if the method is not supported.
+ */
+openli_compressor_t *create_compressor(uint8_t method);
+
+void destroy_compressor(openli_compressor_t *comp);
+
+/** Compresses a chunk of data and flushes the stream, so that all of the
+ *  data in the chunk can be decompressed by the receiver.
+ *
+ *  The compressed data is appended to the end of an output buffer that is
+ *  owned by the caller and is grown (using realloc) as required.
+ *
+ *  @param comp         The compressor for the stream
+ *  @param in           The data to compress
+ *  @param inlen        The amount of data to compress
+ *  @param out          The output buffer
+ *  @param outlen       The amount of data already in the output buffer --
+ *                      updated to include the newly compressed data
+ *  @param outalloc     The allocated size of the output buffer
+ *
+ *  @return -1 if an error occurs, 0 otherwise.
+ */
+int compress_and_flush(openli_compressor_t *comp, uint8_t *in,
+        uint64_t inlen, uint8_t **out, uint64_t *outlen, uint64_t *outalloc);
+
+/** Creates the state required to decompress an incoming stream.
+ *
+ *  @param method       The compression method used by the sender
+ *
+ *  @return the new decompressor, or NULL if the method is not supported.
+ */
+openli_decompressor_t *create_decompressor(uint8_t method);
+
+void destroy_decompressor(openli_decompressor_t *decomp);
+
+/** Decompresses as much of the given input as will fit in the output
+ *  space.
+ *
+ *  @param decomp       The decompressor for the stream
+ *  @param in           The compressed input
+ *  @param inlen        The amount of compressed input available
+ *  @param consumed     Set to the number of input bytes that were used
+ *  @param out          The space to write decompressed data into
+ *  @param outspace     The amount of space available at 'out'
+ *  @param produced     Set to the number of bytes written to 'out'
+ *
+ *  @return -1 if the input is corrupt, 0 otherwise.
+ */
+int decompress_available(openli_decompressor_t *decomp, uint8_t *in,
+        uint64_t inlen, uint64_t *consumed, uint8_t *out, uint64_t outspace,
+        uint64_t *produced);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -83,6 +83,13 @@ SSL_CTX * ssl_init(const char *cacertfile, const char *certfile, const char *key
     /* Enforce use of TLSv1_2 */
     SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
 
+#ifdef SSL_OP_ENABLE_KTLS
+    /* Let the kernel do the record encryption if it is able to. OpenSSL
+     * will quietly fall back to userspace crypto for any session where
+     * the kernel or the negotiated cipher does not support kTLS. */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
     if (SSL_CTX_load_verify_locations(ctx, cacertfile, "./") != 1){ //TODO this might want to be changed
         logger(LOG_INFO, "OpenLI: SSL CA cert loading {%s} failed", cacertfile);
         SSL_CTX_free(ctx);
@@ -157,6 +164,52 @@ void free_ssl_config(openli_ssl_config_t *sslconf) {
     }
 }
 
+int ssl_has_ktls_send(SSL *ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+    if (ssl == NULL) {
+        return 0;
+    }
+    return (BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0);
+#else
+    return 0;
+#endif
+}
+
+int ssl_has_ktls_recv(SSL *ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_recv)
+    if (ssl == NULL) {
+        return 0;
+    }
+    return (BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? 1 : 0);
+#else
+    return 0;
+#endif
+}
+
+void log_ssl_offload_mode(SSL *ssl, const char *peerdesc) {
+
+    int ktx = ssl_has_ktls_send(ssl);
+    int krx = ssl_has_ktls_recv(ssl);
+
+    if (ktx && krx) {
+        logger(LOG_INFO,
+                "OpenLI: TLS session with %s is using kernel TLS for sending and receiving (%s)",
+                peerdesc, SSL_get_cipher(ssl));
+    } else if (ktx) {
+        logger(LOG_INFO,
+                "OpenLI: TLS session with %s is using kernel TLS for sending only (%s)",
+                peerdesc, SSL_get_cipher(ssl));
+    } else if (krx) {
+        logger(LOG_INFO,
+                "OpenLI: TLS session with %s is using kernel TLS for receiving only (%s)",
+                peerdesc, SSL_get_cipher(ssl));
+    } else {
+        logger(LOG_INFO,
+                "OpenLI: TLS session with %s is using userspace encryption (%s)",
+                peerdesc, SSL_get_cipher(ssl));
+    }
+}
+
 int listen_ssl_socket(openli_ssl_config_t *sslconf, SSL **ssl, int newfd) {
 
     int err;
@@ -61,6 +61,9 @@ void free_ssl_config(openli_ssl_config_t *sslconf);
 int reload_ssl_config(openli_ssl_config_t *current,
         openli_ssl_config_t *newconf);
 int listen_ssl_socket(openli_ssl_config_t *sslconf, SSL **ssl, int newfd);
+int ssl_has_ktls_send(SSL *ssl);
+int ssl_has_ktls_recv(SSL *ssl);
+void log_ssl_offload_mode(SSL *ssl, const char *peerdesc);
 
 int load_pem_into_memory(char *pemfile, char **memspace);
 #endif
@@ -0,0 +1,235 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "openli_uring.h"
+
+int init_openli_uring(openli_uring_t *ur, uint32_t depth, const char *name) {
+
+    memset(ur, 0, sizeof(openli_uring_t));
+
+    if (depth == 0) {
+        depth = DEFAULT_URING_DEPTH;
+    }
+
+#ifdef HAVE_LIBURING
+    int ret;
+
+    ret = io_uring_queue_init(depth, &(ur->ring), 0);
+    if (ret < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to create io_uring for %s, falling back to regular sends: %s",
+                name, strerror(-ret));
+        return -1;
+    }
+
+    ur->depth = depth;
+    ur->active = 1;
+    logger(LOG_INFO, "OpenLI: %s is using io_uring to transmit records",
+            name);
+    return 0;
+#else
+    logger(LOG_INFO,
+            "OpenLI: io_uring was requested for %s, but this build does not support it -- falling back to regular sends", name);
+    return -1;
+#endif
+}
+
+void destroy_openli_uring(openli_uring_t *ur) {
+
+#ifdef HAVE_LIBURING
+    if (ur->active) {
+        io_uring_queue_exit(&(ur->ring));
+    }
+#endif
+    if (ur->batch) {
+        free(ur->batch);
+    }
+    memset(ur, 0, sizeof(openli_uring_t));
+}
+
+static openli_uring_send_t *next_batch_slot(openli_uring_t *ur) {
+
+    if (ur->batchcount == ur->batchsize) {
+        openli_uring_send_t *tmp;
+        uint32_t newsize = ur->batchsize == 0 ? ur->depth : ur->batchsize * 2;
+
+        tmp = realloc(ur->batch, newsize * sizeof(openli_uring_send_t));
+        if (tmp == NULL) {
+            return NULL;
+        }
+        ur->batch = tmp;
+        ur->batchsize = newsize;
+    }
+
+    ur->batchcount ++;
+    return &(ur->batch[ur->batchcount - 1]);
+}
+
+int queue_uring_send(openli_uring_t *ur, int fd, uint8_t *data, uint64_t len,
+        void *owner) {
+
+    openli_uring_send_t *s = next_batch_slot(ur);
+
+    if (s == NULL) {
+        return -1;
+    }
+
+    s->fd = fd;
+    s->data = data;
+    s->len = len;
+    s->msg = NULL;
+    s->owner = owner;
+    s->result = -EAGAIN;
+    return 0;
+}
+
+int queue_uring_sendmsg(openli_uring_t *ur, int fd, struct msghdr *msg,
+        void *owner) {
+
+    openli_uring_send_t *s = next_batch_slot(ur);
+
+    if (s == NULL) {
+        return -1;
+    }
+
+    s->fd = fd;
+    s->data = NULL;
+    s->len = 0;
+    s->msg = msg;
+    s->owner = owner;
+    s->result = -EAGAIN;
+    return 0;
+}
+
+void clear_uring_batch(openli_uring_t *ur) {
+    ur->batchcount = 0;
+}
+
+#ifdef HAVE_LIBURING
+static int submit_uring_chunk(openli_uring_t *ur, uint32_t first,
+        uint32_t count) {
+
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    openli_uring_send_t *s;
+    uint32_t i, queued = 0, reaped = 0;
+    int ret;
+
+    for (i = first; i < first + count; i++) {
+        sqe = io_uring_get_sqe(&(ur->ring));
+        if (sqe == NULL) {
+            break;
+        }
+        s = &(ur->batch[i]);
+
+        /* MSG_DONTWAIT means the kernel completes the request with
+         * -EAGAIN instead of parking it until the socket is writable,
+         * so the caller's memory is never referenced after we return.
+         */
+        if (s->msg) {
+            io_uring_prep_sendmsg(sqe, s->fd, s->msg, MSG_DONTWAIT);
+        } else {
+            io_uring_prep_send(sqe, s->fd, s->data, s->len, MSG_DONTWAIT);
+        }
+        io_uring_sqe_set_data(sqe, s);
+        queued ++;
+    }
+
+    if (queued == 0) {
+        return 0;
+    }
+
+    do {
+        ret = io_uring_submit_and_wait(&(ur->ring), queued);
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        logger(LOG_INFO, "OpenLI: io_uring submission failed: %s",
+                strerror(-ret));
+        return -1;
+    }
+
+    while (reaped < queued) {
+        ret = io_uring_wait_cqe(&(ur->ring), &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            logger(LOG_INFO, "OpenLI: io_uring completion failed: %s",
+                    strerror(-ret));
+            return -1;
+        }
+        s = (openli_uring_send_t *)io_uring_cqe_get_data(cqe);
+        s->result = cqe->res;
+        io_uring_cqe_seen(&(ur->ring), cqe);
+        reaped ++;
+    }
+
+    return queued;
+}
+#endif
+
+int submit_uring_batch(openli_uring_t *ur) {
+
+#ifdef HAVE_LIBURING
+    uint32_t done = 0, chunk;
+    int ret;
+
+    if (!ur->active) {
+        return -1;
+    }
+
+    while (done < ur->batchcount) {
+        chunk = ur->batchcount - done;
+        if (chunk > ur->depth) {
+            chunk = ur->depth;
+        }
+
+        ret = submit_uring_chunk(ur, done, chunk);
+        if (ret <= 0) {
+            /* Ring is unusable -- everything that is left stays at -EAGAIN
+             * so that the caller can retry without io_uring.
+             */
+            io_uring_queue_exit(&(ur->ring));
+            ur->active = 0;
+            logger(LOG_INFO,
+                    "OpenLI: disabling io_uring, falling back to regular sends");
+            return -1;
+        }
+        done += ret;
+    }
+    return (int)ur->batchcount;
+#else
+    return -1;
+#endif
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,144 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef OPENLI_URING_H_
+#define OPENLI_URING_H_
+
+#include "config.h"
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/* Default number of submission queue entries for a transmit ring */
+#define DEFAULT_URING_DEPTH (64)
+
+/** A single send that has been queued for submission via io_uring.
+ *
+ *  Either 'data' and 'len' describe a contiguous chunk of memory to send,
+ *  or 'msg' points to a message header describing a scatter-gather send.
+ *  The memory must remain valid until the batch has been submitted.
+ */
+typedef struct openli_uring_send {
+    int fd;
+    uint8_t *data;
+    uint64_t len;
+    struct msghdr *msg;
+
+    /** The caller's context for this send, e.g. a destination or handover */
+    void *owner;
+
+    /** Bytes sent, or a negative errno if the send failed */
+    int result;
+} openli_uring_send_t;
+
+typedef struct openli_uring {
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    uint8_t active;
+    uint32_t depth;
+
+    openli_uring_send_t *batch;
+    uint32_t batchsize;
+    uint32_t batchcount;
+} openli_uring_t;
+
+/** Prepares an io_uring instance for batched transmission.
+ *
+ *  If io_uring is not available (either at build time or because the
+ *  running kernel does not support it), the ring is left inactive and
+ *  the caller should continue to use regular send() calls.
+ *
+ *  @param ur           The ring to initialise
+ *  @param depth        The number of submission queue entries to request
+ *  @param name         A description of the owner, for logging purposes
+ *
+ *  @return -1 if the ring could not be created, 0 otherwise.
+ */
+int init_openli_uring(openli_uring_t *ur, uint32_t depth, const char *name);
+
+/** Tears down an io_uring instance and frees any batch memory.
+ *
+ *  @param ur           The ring to destroy
+ */
+void destroy_openli_uring(openli_uring_t *ur);
+
+/** Adds a send of a contiguous block of memory to the current batch.
+ *
+ *  @param ur           The ring to add the send to
+ *  @param fd           The socket to send on
+ *  @param data         The start of the data to send
+ *  @param len          The amount of data to send
+ *  @param owner        Caller context to associate with this send
+ *
+ *  @return -1 if the send could not be queued, 0 otherwise.
+ */
+int queue_uring_send(openli_uring_t *ur, int fd, uint8_t *data, uint64_t len,
+        void *owner);
+
+/** Adds a scatter-gather send to the current batch.
+ *
+ *  @param ur           The ring to add the send to
+ *  @param fd           The socket to send on
+ *  @param msg          The message header describing the data to send
+ *  @param owner        Caller context to associate with this send
+ *
+ *  @return -1 if the send could not be queued, 0 otherwise.
+ */
+int queue_uring_sendmsg(openli_uring_t *ur, int fd, struct msghdr *msg,
+        void *owner);
+
+/** Submits all queued sends using as few system calls as possible and
+ *  waits for them to complete.
+ *
+ *  All sends are non-blocking, so completion is immediate -- a socket
+ *  that cannot accept data will report -EAGAIN rather than stalling the
+ *  batch. After this returns, the 'result' field of each entry in
+ *  ur->batch is set and the caller should walk ur->batch[0 ..
+ *  ur->batchcount - 1] to act on the results, then call
+ *  clear_uring_batch().
+ *
+ *  If the ring fails, it is deactivated and every unsubmitted send is
+ *  reported as -EAGAIN so that the caller can retry using regular
+ *  send() calls.
+ *
+ *  @param ur           The ring to submit the batch on
+ *
+ *  @return the number of sends in the batch, or -1 if the ring failed.
+ */
+int submit_uring_batch(openli_uring_t *ur);
+
+/** Empties the current batch, ready for a new set of sends.
+ *
+ *  @param ur           The ring whose batch is to be cleared
+ */
+void clear_uring_batch(openli_uring_t *ur);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
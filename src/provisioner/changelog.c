@@ -0,0 +1,278 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "provisioner.h"
+
+/* Picks an epoch for a new sequence of configuration versions. This only
+ * needs to differ from any epoch that a client might have been given
+ * previously, including by an earlier run of the provisioner.
+ */
+static uint64_t new_change_log_epoch(uint64_t previous) {
+    struct timespec ts;
+    uint64_t epoch;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    epoch = (((uint64_t)ts.tv_sec) << 32) ^ (((uint64_t)ts.tv_nsec) << 2) ^
+            ((uint64_t)getpid());
+
+    /* Zero means "no version" to a client */
+    if (epoch == 0 || epoch == previous) {
+        epoch = previous + 1;
+    }
+    return epoch;
+}
+
+/* Releases every change in the log. The caller must hold the log mutex. */
+static void clear_change_log(prov_change_log_t *log) {
+    uint32_t i, ind;
+
+    for (i = 0; i < log->count; i++) {
+        ind = (log->first + i) % log->size;
+        release_shared_net_message(log->changes[ind].msg);
+        log->changes[ind].msg = NULL;
+    }
+    log->count = 0;
+    log->first = 0;
+}
+
+/* Resizes the ring buffer for a log, which must be empty. The caller must
+ * hold the log mutex.
+ */
+static void resize_change_log(prov_change_log_t *log, uint32_t size) {
+
+    if (size == log->size) {
+        return;
+    }
+
+    free(log->changes);
+    log->changes = NULL;
+    log->size = 0;
+
+    if (size == 0) {
+        return;
+    }
+
+    log->changes = (prov_config_change_t *)calloc(size,
+            sizeof(prov_config_change_t));
+    if (log->changes == NULL) {
+        logger(LOG_INFO,
+                "OpenLI provisioner: unable to allocate a log for %u configuration changes -- reconnecting clients will be sent the entire configuration.",
+                size);
+        return;
+    }
+    log->size = size;
+}
+
+void init_change_log(prov_change_log_t *log, uint32_t size) {
+
+    memset(log, 0, sizeof(prov_change_log_t));
+    pthread_mutex_init(&(log->mutex), NULL);
+    log->epoch = new_change_log_epoch(0);
+    resize_change_log(log, size);
+}
+
+void destroy_change_log(prov_change_log_t *log) {
+
+    pthread_mutex_lock(&(log->mutex));
+    clear_change_log(log);
+    free(log->changes);
+    log->changes = NULL;
+    log->size = 0;
+    pthread_mutex_unlock(&(log->mutex));
+    pthread_mutex_destroy(&(log->mutex));
+}
+
+/* Forgets every change in the log and starts a new sequence of versions,
+ * so that any client that reconnects will be sent the entire configuration.
+ *
+ * This must be called whenever the configuration changes without the
+ * change being recorded, e.g. because the clients were all disconnected
+ * instead of being told about the change.
+ */
+void reset_change_log(prov_change_log_t *log, uint32_t size) {
+
+    pthread_mutex_lock(&(log->mutex));
+    clear_change_log(log);
+    resize_change_log(log, size);
+    log->epoch = new_change_log_epoch(log->epoch);
+    log->version = 0;
+    pthread_mutex_unlock(&(log->mutex));
+}
+
+/* Adds a change that is about to be announced to every client of a given
+ * type to the log for that type of client.
+ *
+ * The log keeps its own reference to the change, followed by a message
+ * telling the client which version it is now up to. The caller is given
+ * a reference to this version-tagged copy, which is what should be sent
+ * to any client that is keeping track of its configuration version.
+ *
+ * Returns NULL if no changes are being logged, or if the change could not
+ * be logged. In the latter case, the log is reset so that reconnecting
+ * clients will not be sent an incomplete set of changes.
+ */
+net_shared_msg_t *record_config_change(prov_change_log_t *log,
+        net_shared_msg_t *msg) {
+
+    net_buffer_t *enc;
+    net_shared_msg_t *tagged = NULL;
+    prov_config_change_t *slot;
+
+    pthread_mutex_lock(&(log->mutex));
+    if (log->size == 0) {
+        log->version ++;
+        pthread_mutex_unlock(&(log->mutex));
+        return NULL;
+    }
+
+    if (msg == NULL) {
+        /* The change could not even be encoded, so nobody will have
+         * received it */
+        goto resetlog;
+    }
+
+    enc = create_net_buffer(NETBUF_SEND, -1, NULL);
+    if (enc == NULL) {
+        goto resetlog;
+    }
+    if (copy_shared_onto_net_buffer(enc, msg) >= 0 &&
+            push_config_version_onto_net_buffer(enc, log->epoch,
+                    log->version + 1) >= 0) {
+        tagged = create_shared_net_message(enc);
+    }
+    destroy_net_buffer(enc);
+    if (tagged == NULL) {
+        goto resetlog;
+    }
+
+    if (log->count == log->size) {
+        /* Make room by forgetting the oldest change */
+        release_shared_net_message(log->changes[log->first].msg);
+        log->changes[log->first].msg = NULL;
+        log->first = (log->first + 1) % log->size;
+        log->count --;
+    }
+
+    log->version ++;
+    slot = &(log->changes[(log->first + log->count) % log->size]);
+    slot->version = log->version;
+    slot->msg = tagged;
+    log->count ++;
+
+    /* One reference for the log, one for the caller */
+    __atomic_add_fetch(&(tagged->refs), 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(log->mutex));
+    return tagged;
+
+resetlog:
+    logger(LOG_INFO,
+            "OpenLI provisioner: unable to record configuration change -- reconnecting clients will be sent the entire configuration.");
+    clear_change_log(log);
+    log->epoch = new_change_log_epoch(log->epoch);
+    log->version = 0;
+    pthread_mutex_unlock(&(log->mutex));
+    return NULL;
+}
+
+/* Queues the changes that a reconnecting client has missed, if the log
+ * still contains all of them.
+ *
+ * The changes are preceded by a message telling the client that it is
+ * only being sent changes (so it should keep its existing configuration),
+ * and followed by the current configuration version.
+ *
+ * Returns 1 if the changes were queued, 0 if the client must be sent the
+ * entire configuration instead, or -1 if an error occurs.
+ */
+int push_config_changes_since(prov_change_log_t *log, net_buffer_t *nb,
+        uint64_t confepoch, uint64_t confversion) {
+
+    uint32_t i, skip;
+    prov_config_change_t *ch;
+    int ret = 1;
+
+    pthread_mutex_lock(&(log->mutex));
+    if (log->size == 0 || confepoch != log->epoch ||
+            confversion > log->version ||
+            log->version - confversion > log->count) {
+        pthread_mutex_unlock(&(log->mutex));
+        return 0;
+    }
+
+    if (push_config_delta_onto_net_buffer(nb) < 0) {
+        pthread_mutex_unlock(&(log->mutex));
+        return -1;
+    }
+
+    skip = log->count - (uint32_t)(log->version - confversion);
+    for (i = skip; i < log->count; i++) {
+        ch = &(log->changes[(log->first + i) % log->size]);
+        if (push_shared_onto_net_buffer(nb, ch->msg) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    /* Always finish with the version, even if no changes were missed */
+    if (ret == 1 && push_config_version_onto_net_buffer(nb, log->epoch,
+                log->version) < 0) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&(log->mutex));
+    return ret;
+}
+
+/* Queues the current configuration version, i.e. after a client has been
+ * sent the entire configuration.
+ *
+ * Returns 0 if no changes are being logged (so there is no version to
+ * send), 1 if the version was queued and -1 if an error occurs.
+ */
+int push_current_config_version(prov_change_log_t *log, net_buffer_t *nb) {
+
+    int ret = 0;
+
+    pthread_mutex_lock(&(log->mutex));
+    if (log->size > 0) {
+        if (push_config_version_onto_net_buffer(nb, log->epoch,
+                    log->version) < 0) {
+            ret = -1;
+        } else {
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&(log->mutex));
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -125,6 +125,20 @@ int compare_sip_targets(provision_state_t *currstate,
 
 
 
+/* Encodes a change that is being announced to every collector (or every
+ * mediator) and records it in the given change log. 'msg' is the change
+ * itself, 'vmsg' is the version-tagged copy that goes to clients that keep
+ * track of their configuration version.
+ */
+#define ENCODE_CONFIG_CHANGE(changelog, encodecall) \
+    do { \
+        ENCODE_SHARED_MESSAGE(msg, encodecall); \
+        vmsg = record_config_change(changelog, msg); \
+    } while (0)
+
+#define CHANGE_FOR_CLIENT(sock) \
+    (((sock)->configsync && vmsg != NULL) ? vmsg : msg)
+
 #define SEND_ALL_COLLECTORS_BEGIN \
     prov_collector_t *col, *coltmp; \
     prov_sock_state_t *sock; \
@@ -138,7 +152,9 @@ int compare_sip_targets(provision_state_t *currstate,
         }
 
 #define SEND_ALL_COLLECTORS_END \
-        if (enable_epoll_write(state, col->client->commev) == -1) { \
+        if (state->batchannouncements) { \
+            sock->writepending = 1; \
+        } else if (enable_epoll_write(state, col->client->commev) == -1) { \
             if (sock->log_allowed) { \
                 logger(LOG_INFO, \
                         "OpenLI: unable to enable epoll write event for collector %s -- %s", \
@@ -162,7 +178,9 @@ int compare_sip_targets(provision_state_t *currstate,
         }
 
 #define SEND_ALL_MEDIATORS_END \
-        if (enable_epoll_write(state, med->client->commev) == -1) { \
+        if (state->batchannouncements) { \
+            sock->writepending = 1; \
+        } else if (enable_epoll_write(state, med->client->commev) == -1) { \
             if (sock->log_allowed) { \
                 logger(LOG_INFO, \
                         "OpenLI: unable to enable epoll write event for mediator %u -- %s", \
@@ -176,9 +194,14 @@ int compare_sip_targets(provision_state_t *currstate,
 
 int announce_lea_to_mediators(provision_state_t *state,
         prov_agency_t *lea) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->mediatorchanges),
+            push_lea_onto_net_buffer(enc, lea->ag));
 
     SEND_ALL_MEDIATORS_BEGIN
-        if (push_lea_onto_net_buffer(sock->outgoing, lea->ag) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             logger(LOG_INFO,
                     "OpenLI provisioner: unable to send LEA %s to mediator %u.",
                     lea->ag->agencyid, med->mediatorid);
@@ -187,17 +210,23 @@ int announce_lea_to_mediators(provision_state_t *state,
             continue;
         }
     SEND_ALL_MEDIATORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 }
 
 int withdraw_agency_from_mediators(provision_state_t *state,
         prov_agency_t *lea) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->mediatorchanges),
+            push_lea_withdrawal_onto_net_buffer(enc, lea->ag));
 
     SEND_ALL_MEDIATORS_BEGIN
 
-        if (push_lea_withdrawal_onto_net_buffer(sock->outgoing,
-                    lea->ag) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             logger(LOG_INFO,
                     "OpenLI provisioner: unable to send withdrawal of LEA %s to mediator %u.",
                     lea->ag->agencyid, med->mediatorid);
@@ -206,101 +235,138 @@ int withdraw_agency_from_mediators(provision_state_t *state,
             continue;
         }
     SEND_ALL_MEDIATORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 }
 
 int announce_default_radius_username(provision_state_t *state,
         default_radius_user_t *raduser) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_default_radius_onto_net_buffer(enc, raduser));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_default_radius_onto_net_buffer(sock->outgoing, raduser) < 0) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) < 0) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
     return 0;
 }
 
 int withdraw_default_radius_username(provision_state_t *state,
         default_radius_user_t *raduser) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_default_radius_withdraw_onto_net_buffer(enc, raduser));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_default_radius_withdraw_onto_net_buffer(sock->outgoing,
-                raduser) < 0) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) < 0) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
     return 0;
 }
 
 void add_new_staticip_range(provision_state_t *state,
         ipintercept_t *ipint, static_ipranges_t *ipr) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_static_ipranges_onto_net_buffer(enc, ipint, ipr));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_static_ipranges_onto_net_buffer(sock->outgoing,
-                ipint, ipr) < 0) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) < 0) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 }
 
 void modify_existing_staticip_range(provision_state_t *state,
         ipintercept_t *ipint, static_ipranges_t *ipr) {
+    net_shared_msg_t *msg, *vmsg;
 
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_static_ipranges_modify_onto_net_buffer(enc, ipint, ipr));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_static_ipranges_modify_onto_net_buffer(sock->outgoing,
-                ipint, ipr) < 0) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) < 0) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 }
 
 void remove_existing_staticip_range(provision_state_t *state,
         ipintercept_t *ipint, static_ipranges_t *ipr) {
+    net_shared_msg_t *msg, *vmsg;
 
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_static_ipranges_removal_onto_net_buffer(enc, ipint, ipr));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_static_ipranges_removal_onto_net_buffer(sock->outgoing,
-                ipint, ipr) < 0) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) < 0) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 }
 
 int halt_existing_intercept(provision_state_t *state,
         void *cept, openli_proto_msgtype_t wdtype) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_intercept_withdrawal_onto_net_buffer(enc, cept, wdtype));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_intercept_withdrawal_onto_net_buffer(sock->outgoing,
-                cept, wdtype) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 
@@ -308,16 +374,22 @@ int halt_existing_intercept(provision_state_t *state,
 
 int modify_existing_intercept_options(provision_state_t *state,
         void *cept, openli_proto_msgtype_t modtype) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_intercept_modify_onto_net_buffer(enc, cept, modtype));
 
     SEND_ALL_COLLECTORS_BEGIN
-        if (push_intercept_modify_onto_net_buffer(sock->outgoing,
-                cept, modtype) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 
@@ -328,16 +400,23 @@ int modify_existing_intercept_options(provision_state_t *state,
  */
 
 int disconnect_mediators_from_collectors(provision_state_t *state) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            push_disconnect_mediators_onto_net_buffer(enc));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (push_disconnect_mediators_onto_net_buffer(sock->outgoing) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             disconnect_provisioner_client(state->epoll_fd,
                     col->client, col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 
@@ -354,6 +433,7 @@ int announce_hi1_notification_to_mediators(provision_state_t *state,
 
     hi1_notify_data_t ndata;
     struct timeval tv;
+    net_shared_msg_t *msg;
 
     if (intcomm == NULL) {
         return -1;
@@ -370,8 +450,11 @@ int announce_hi1_notification_to_mediators(provision_state_t *state,
     ndata.ts_sec = tv.tv_sec;
     ndata.ts_usec = tv.tv_usec;
 
+    ENCODE_SHARED_MESSAGE(msg,
+            push_hi1_notification_onto_net_buffer(enc, &ndata));
+
     SEND_ALL_MEDIATORS_BEGIN
-        if (push_hi1_notification_onto_net_buffer(sock->outgoing, &ndata) == -1)
+        if (push_shared_onto_net_buffer(sock->outgoing, msg) == -1)
         {
             if (sock->log_allowed) {
                 logger(LOG_INFO,
@@ -382,12 +465,14 @@ int announce_hi1_notification_to_mediators(provision_state_t *state,
             continue;
         }
     SEND_ALL_MEDIATORS_END
+    release_shared_net_message(msg);
     intcomm->hi1_seqno ++;
     return 0;
 }
 
 int remove_liid_mapping(provision_state_t *state,
         char *liid, int liid_len, int droppedmeds) {
+    net_shared_msg_t *msg, *vmsg;
 
     liid_hash_t *found;
     /* Don't need to find and remove the mapping from our LIID map, as
@@ -403,14 +488,17 @@ int remove_liid_mapping(provision_state_t *state,
         free(found);
     }
 
+    ENCODE_CONFIG_CHANGE(&(state->mediatorchanges),
+            push_cease_mediation_onto_net_buffer(enc, liid, liid_len));
+
     SEND_ALL_MEDIATORS_BEGIN
 
     /* Still got mediators connected, so tell them about the now disabled
      * LIID.
      */
 
-        if (push_cease_mediation_onto_net_buffer(sock->outgoing,
-                    liid, liid_len) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             if (sock->log_allowed) {
                 logger(LOG_INFO,
                         "OpenLI provisioner: unable to halt mediation of intercept %s on mediator %u.",
@@ -421,20 +509,27 @@ int remove_liid_mapping(provision_state_t *state,
             continue;
         }
     SEND_ALL_MEDIATORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 }
 
 int announce_liidmapping_to_mediators(provision_state_t *state,
         liid_hash_t *liidmap) {
+    net_shared_msg_t *msg, *vmsg;
 
     if (liidmap == NULL) {
         return 0;
     }
 
+    ENCODE_CONFIG_CHANGE(&(state->mediatorchanges),
+            push_liid_mapping_onto_net_buffer(enc, liidmap->agency,
+                    liidmap->liid));
+
     SEND_ALL_MEDIATORS_BEGIN
-        if (push_liid_mapping_onto_net_buffer(sock->outgoing, liidmap->agency,
-                liidmap->liid) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             logger(LOG_INFO,
                     "OpenLI provisioner: unable to send mapping for LIID %s to mediator %u.",
                     liidmap->liid, med->mediatorid);
@@ -443,17 +538,26 @@ int announce_liidmapping_to_mediators(provision_state_t *state,
             continue;
         }
     SEND_ALL_MEDIATORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 }
 
 int announce_coreserver_change(provision_state_t *state,
         coreserver_t *cs, uint8_t isnew) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            isnew ?
+            push_coreserver_onto_net_buffer(enc, cs, cs->servertype) :
+            push_coreserver_withdraw_onto_net_buffer(enc, cs, cs->servertype));
+
     SEND_ALL_COLLECTORS_BEGIN
 
         if (isnew) {
-            if (push_coreserver_onto_net_buffer(sock->outgoing, cs,
-                        cs->servertype) == -1) {
+            if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
                 logger(LOG_INFO,
                         "OpenLI: Unable to push new %s server to collector %s",
                         coreserver_type_to_string(cs->servertype),
@@ -463,8 +567,8 @@ int announce_coreserver_change(provision_state_t *state,
                 continue;
             }
         } else {
-            if (push_coreserver_withdraw_onto_net_buffer(sock->outgoing,
-                        cs, cs->servertype) == -1) {
+            if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
                 logger(LOG_INFO,
                         "OpenLI: Unable to push removal of %s server to collector %s",
                         coreserver_type_to_string(cs->servertype),
@@ -476,16 +580,24 @@ int announce_coreserver_change(provision_state_t *state,
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
     return 0;
 }
 
 int announce_sip_target_change(provision_state_t *state,
         openli_sip_identity_t *sipid, voipintercept_t *vint, uint8_t isnew) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            isnew ?
+            push_sip_target_onto_net_buffer(enc, sipid, vint) :
+            push_sip_target_withdrawal_onto_net_buffer(enc, sipid, vint));
 
     SEND_ALL_COLLECTORS_BEGIN
         if (isnew) {
-            if (push_sip_target_onto_net_buffer(sock->outgoing, sipid,
-                        vint) == -1) {
+            if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
                 logger(LOG_INFO,
                         "OpenLI: Unable to push SIP target to collector %s",
                         col->identifier);
@@ -494,8 +606,8 @@ int announce_sip_target_change(provision_state_t *state,
                 continue;
             }
         } else {
-            if (push_sip_target_withdrawal_onto_net_buffer(sock->outgoing,
-                        sipid, vint) == -1) {
+            if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
                 logger(LOG_INFO,
                         "OpenLI: Unable to push removal of SIP target to collector %s",
                         col->identifier);
@@ -505,6 +617,8 @@ int announce_sip_target_change(provision_state_t *state,
             }
         }
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 }
@@ -544,20 +658,57 @@ int remove_all_sip_targets(provision_state_t *state, voipintercept_t *vint) {
 
 int announce_single_intercept(provision_state_t *state,
         void *cept, int (*sendfunc)(net_buffer_t *, void *)) {
+    net_shared_msg_t *msg, *vmsg;
+
+    ENCODE_CONFIG_CHANGE(&(state->collectorchanges),
+            sendfunc(enc, cept));
 
     SEND_ALL_COLLECTORS_BEGIN
 
-        if (sendfunc(sock->outgoing, cept) == -1) {
+        if (push_shared_onto_net_buffer(sock->outgoing,
+                CHANGE_FOR_CLIENT(sock)) == -1) {
             disconnect_provisioner_client(state->epoll_fd, col->client,
                     col->identifier);
             continue;
         }
 
     SEND_ALL_COLLECTORS_END
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
 
     return 0;
 }
 
+void start_batched_announcements(provision_state_t *state) {
+    state->batchannouncements = 1;
+}
+
+/* Polls each client that had messages queued while announcements were
+ * being batched, so each one only needs to be woken once no matter how
+ * many announcements it was sent */
+void flush_batched_announcements(provision_state_t *state) {
+
+    state->batchannouncements = 0;
+
+    {
+        SEND_ALL_COLLECTORS_BEGIN
+            if (!sock->writepending) {
+                continue;
+            }
+            sock->writepending = 0;
+        SEND_ALL_COLLECTORS_END
+    }
+
+    {
+        SEND_ALL_MEDIATORS_BEGIN
+            if (!sock->writepending) {
+                continue;
+            }
+            sock->writepending = 0;
+        SEND_ALL_MEDIATORS_END
+    }
+}
+
 liid_hash_t *add_liid_mapping(prov_intercept_conf_t *conf,
         char *liid, char *agency) {
 
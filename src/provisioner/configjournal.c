@@ -0,0 +1,561 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "provisioner.h"
+
+/* Marks the start of every record in the journal ("OLIJ") */
+#define JOURNAL_MAGIC 0x4f4c494a
+
+/* Any record claiming to be larger than this must be corrupt */
+#define JOURNAL_MAX_RECORD (256 * 1024 * 1024)
+
+/* How long to wait before trying again after a compaction fails */
+#define JOURNAL_RETRY_INTERVAL 5
+
+/* Every journal record starts with this header, followed by 'len' bytes
+ * of data: the JSON body for a POST or PUT, or the ID of the removed
+ * object for a DELETE. The journal is only ever read by the host that
+ * wrote it, so host byte order is fine.
+ */
+typedef struct journal_rec_hdr {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t target;
+    uint16_t reserved;
+    uint32_t len;
+    uint32_t checksum;
+} journal_rec_hdr_t;
+
+/* FNV-1a, over the header (with a zero checksum) and then the data */
+static uint32_t journal_checksum(journal_rec_hdr_t *hdr, const char *data,
+        uint32_t len) {
+
+    journal_rec_hdr_t copy = *hdr;
+    const uint8_t *ptr = (const uint8_t *)&copy;
+    uint32_t hash = 2166136261U;
+    uint32_t i;
+
+    copy.checksum = 0;
+    for (i = 0; i < sizeof(copy); i++) {
+        hash = (hash ^ ptr[i]) * 16777619U;
+    }
+
+    ptr = (const uint8_t *)data;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ ptr[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static inline time_t journal_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int read_fully(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    ssize_t ret;
+
+    while (got < len) {
+        ret = read(fd, ((char *)buf) + got, len - got);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return 0;
+        }
+        got += ret;
+    }
+    return 1;
+}
+
+static int write_fully(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = write(fd, ((const char *)buf) + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static void remember_config_mtime(provision_state_t *state) {
+    struct stat sb;
+
+    if (stat(state->interceptconffile, &sb) == 0) {
+        state->journal.confmtime = sb.st_mtim;
+    } else {
+        memset(&(state->journal.confmtime), 0, sizeof(struct timespec));
+    }
+}
+
+/* Returns 1 if the intercept config file has been changed by someone
+ * other than us since we last wrote it */
+static int config_edited_elsewhere(provision_state_t *state) {
+    struct stat sb;
+
+    if (stat(state->interceptconffile, &sb) < 0) {
+        return 1;
+    }
+    if (sb.st_mtim.tv_sec != state->journal.confmtime.tv_sec ||
+            sb.st_mtim.tv_nsec != state->journal.confmtime.tv_nsec) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Writes the entire running intercept config to the intercept config
+ * file, then empties the journal. The caller must hold both the intercept
+ * config safelock and the journal mutex.
+ *
+ * If we crash after the config is written but before the journal is
+ * emptied, the journalled changes will be replayed on top of a config
+ * that already includes them -- replaying a change is harmless, as
+ * re-adding an existing object fails and re-removing a missing object
+ * does nothing.
+ */
+static int write_journal_snapshot(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+
+    if (emit_intercept_config(state->interceptconffile,
+                &(state->interceptconf)) < 0) {
+        j->retryafter = journal_now() + JOURNAL_RETRY_INTERVAL;
+        return -1;
+    }
+    remember_config_mtime(state);
+
+    if (j->fd == -1) {
+        return 0;
+    }
+
+    if (ftruncate(j->fd, 0) < 0 || fdatasync(j->fd) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to empty intercept config journal %s: %s",
+                j->path, strerror(errno));
+        j->retryafter = journal_now() + JOURNAL_RETRY_INTERVAL;
+        return -1;
+    }
+
+    j->records = 0;
+    j->size = 0;
+    j->retryafter = 0;
+    return 0;
+}
+
+/* Re-applies every change in the journal to the running intercept
+ * config. Stops at the first record that is incomplete or corrupt (i.e.
+ * we crashed while writing it) and cuts it off the end of the journal.
+ * The caller must hold both the intercept config safelock and the journal
+ * mutex.
+ */
+static int replay_journal(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+    journal_rec_hdr_t hdr;
+    off_t offset = 0;
+    char *data = NULL;
+    uint32_t replayed = 0, failed = 0;
+    int ret;
+
+    if (lseek(j->fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    while (read_fully(j->fd, &hdr, sizeof(hdr))) {
+        if (hdr.magic != JOURNAL_MAGIC || hdr.len > JOURNAL_MAX_RECORD) {
+            break;
+        }
+
+        data = malloc(hdr.len + 1);
+        if (data == NULL) {
+            logger(LOG_INFO,
+                    "OpenLI: OOM while replaying intercept config journal %s",
+                    j->path);
+            return -1;
+        }
+        if (!read_fully(j->fd, data, hdr.len) ||
+                journal_checksum(&hdr, data, hdr.len) != hdr.checksum) {
+            free(data);
+            break;
+        }
+        data[hdr.len] = '\0';
+
+        ret = replay_intercept_config_change(state, hdr.op, hdr.target,
+                data, hdr.len);
+        if ((hdr.op == JOURNAL_OP_DELETE && ret <= 0) ||
+                (hdr.op != JOURNAL_OP_DELETE && ret < 0)) {
+            failed ++;
+        }
+        replayed ++;
+        free(data);
+        offset += sizeof(hdr) + hdr.len;
+    }
+
+    if (offset != lseek(j->fd, 0, SEEK_END)) {
+        logger(LOG_INFO,
+                "OpenLI: discarding incomplete change at offset %ld of intercept config journal %s",
+                (long)offset, j->path);
+        if (ftruncate(j->fd, offset) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: unable to truncate intercept config journal %s: %s",
+                    j->path, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (replayed > 0) {
+        logger(LOG_INFO,
+                "OpenLI: replayed %u changes from intercept config journal %s (%u had no effect)",
+                replayed, j->path, failed);
+    }
+
+    j->records = replayed;
+    j->size = offset;
+    j->firstpending = journal_now();
+    return replayed;
+}
+
+/* Opens the journal for the current intercept config file and replays any
+ * changes that it contains. The caller must hold both the intercept config
+ * safelock and the journal mutex. */
+static int open_journal_file(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+    int ret;
+
+    j->path = malloc(strlen(state->interceptconffile) + 9);
+    sprintf(j->path, "%s.journal", state->interceptconffile);
+
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (j->fd == -1) {
+        logger(LOG_INFO,
+                "OpenLI: unable to open intercept config journal %s: %s",
+                j->path, strerror(errno));
+        logger(LOG_INFO,
+                "OpenLI: intercept config changes will be written straight to %s instead.",
+                state->interceptconffile);
+        return -1;
+    }
+
+    ret = replay_journal(state);
+    if (ret > 0) {
+        write_journal_snapshot(state);
+    } else {
+        remember_config_mtime(state);
+    }
+    return ret;
+}
+
+static void close_journal_file(intercept_journal_t *j) {
+    if (j->fd != -1) {
+        close(j->fd);
+        j->fd = -1;
+    }
+    if (j->path) {
+        free(j->path);
+        j->path = NULL;
+    }
+    j->records = 0;
+    j->size = 0;
+}
+
+static void *run_journal_compactor(void *arg) {
+
+    provision_state_t *state = (provision_state_t *)arg;
+    intercept_journal_t *j = &(state->journal);
+    struct timespec ts;
+    time_t now;
+    int due;
+
+    pthread_mutex_lock(&(j->mutex));
+    while (!j->halt) {
+        now = journal_now();
+        due = 0;
+        if (j->records > 0 && !j->suspended && now >= j->retryafter) {
+            if (j->records >= j->compactrecords ||
+                    now >= j->firstpending + j->compactinterval) {
+                due = 1;
+            }
+        }
+
+        if (!due) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&(j->cond), &(j->mutex), &ts);
+            continue;
+        }
+
+        /* the safelock has to be taken before the journal mutex */
+        pthread_mutex_unlock(&(j->mutex));
+        compact_intercept_journal(state);
+        pthread_mutex_lock(&(j->mutex));
+    }
+    pthread_mutex_unlock(&(j->mutex));
+    pthread_exit(NULL);
+}
+
+void init_intercept_journal(intercept_journal_t *journal) {
+
+    memset(journal, 0, sizeof(intercept_journal_t));
+    journal->fd = -1;
+    journal->compactrecords = DEFAULT_JOURNAL_COMPACT_RECORDS;
+    journal->compactinterval = DEFAULT_JOURNAL_COMPACT_INTERVAL;
+    pthread_mutex_init(&(journal->mutex), NULL);
+    pthread_cond_init(&(journal->cond), NULL);
+}
+
+int open_intercept_journal(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+    int ret;
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    pthread_mutex_lock(&(j->mutex));
+    ret = open_journal_file(state);
+    pthread_mutex_unlock(&(j->mutex));
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+
+    /* start the thread even if the journal couldn't be opened, in case
+     * it can be opened after a config reload */
+    j->halt = 0;
+    if (pthread_create(&(j->threadid), NULL, run_journal_compactor,
+                state) != 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to start intercept config journal compaction thread");
+        return -1;
+    }
+    j->running = 1;
+
+    if (j->fd == -1) {
+        return -1;
+    }
+    return ret;
+}
+
+void close_intercept_journal(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+
+    if (j->running) {
+        pthread_mutex_lock(&(j->mutex));
+        j->halt = 1;
+        pthread_cond_signal(&(j->cond));
+        pthread_mutex_unlock(&(j->mutex));
+        pthread_join(j->threadid, NULL);
+        j->running = 0;
+    }
+
+    if (j->fd != -1 && j->records > 0) {
+        j->suspended = 0;
+        j->retryafter = 0;
+        compact_intercept_journal(state);
+    }
+    close_journal_file(j);
+
+    pthread_mutex_destroy(&(j->mutex));
+    pthread_cond_destroy(&(j->cond));
+}
+
+int record_intercept_config_change(provision_state_t *state, uint8_t op,
+        int target, const char *data, uint32_t len) {
+
+    intercept_journal_t *j = &(state->journal);
+    journal_rec_hdr_t hdr;
+    char *rec;
+    int ret = 0;
+
+    pthread_mutex_lock(&(j->mutex));
+
+    if (j->fd == -1 || len > JOURNAL_MAX_RECORD) {
+        /* no journal (or the change is too big to be journalled), so
+         * write the whole config out like we used to */
+        ret = write_journal_snapshot(state);
+        pthread_mutex_unlock(&(j->mutex));
+        return ret;
+    }
+
+    hdr.magic = JOURNAL_MAGIC;
+    hdr.op = op;
+    hdr.target = (uint8_t)target;
+    hdr.reserved = 0;
+    hdr.len = len;
+    hdr.checksum = journal_checksum(&hdr, data, len);
+
+    /* a single write, so a crash can only ever tear the last record */
+    rec = malloc(sizeof(hdr) + len);
+    if (rec == NULL) {
+        ret = -1;
+    } else {
+        memcpy(rec, &hdr, sizeof(hdr));
+        memcpy(rec + sizeof(hdr), data, len);
+        ret = write_fully(j->fd, rec, sizeof(hdr) + len);
+        free(rec);
+        if (ret == 0) {
+            ret = fdatasync(j->fd);
+        }
+    }
+
+    if (ret < 0) {
+        logger(LOG_INFO,
+                "OpenLI: unable to append to intercept config journal %s: %s",
+                j->path, strerror(errno));
+        /* fall back to writing the full config, which also removes any
+         * partial record that we might have left in the journal */
+        ret = write_journal_snapshot(state);
+        pthread_mutex_unlock(&(j->mutex));
+        return ret;
+    }
+
+    if (j->records == 0) {
+        j->firstpending = journal_now();
+    }
+    j->records ++;
+    j->size += sizeof(hdr) + len;
+
+    if (j->records >= j->compactrecords) {
+        pthread_cond_signal(&(j->cond));
+    }
+    pthread_mutex_unlock(&(j->mutex));
+    return 0;
+}
+
+int compact_intercept_journal(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+    uint32_t records;
+    uint64_t size;
+    int ret = 0;
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    pthread_mutex_lock(&(j->mutex));
+    if (j->records > 0 && !j->suspended) {
+        records = j->records;
+        size = j->size;
+        ret = write_journal_snapshot(state);
+        if (ret == 0) {
+            logger(LOG_DEBUG,
+                    "OpenLI: compacted %u changes (%lu bytes) from intercept config journal into %s",
+                    records, size, state->interceptconffile);
+        }
+    }
+    pthread_mutex_unlock(&(j->mutex));
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    return ret;
+}
+
+int suspend_intercept_journal(provision_state_t *state) {
+
+    intercept_journal_t *j = &(state->journal);
+    int pending = 0;
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    pthread_mutex_lock(&(j->mutex));
+
+    if (j->fd != -1 && j->records > 0) {
+        if (!config_edited_elsewhere(state)) {
+            /* get the file up to date before it is re-read */
+            if (write_journal_snapshot(state) < 0) {
+                pending = 1;
+            }
+        } else {
+            logger(LOG_INFO,
+                    "OpenLI: %s has been edited since it was last written by the provisioner -- %u REST API changes will be re-applied after it is reloaded.",
+                    state->interceptconffile, j->records);
+            pending = 1;
+        }
+    }
+    j->suspended = 1;
+
+    pthread_mutex_unlock(&(j->mutex));
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    return pending;
+}
+
+int resume_intercept_journal(provision_state_t *state, int pending) {
+
+    intercept_journal_t *j = &(state->journal);
+    char *newpath;
+    int ret = 0;
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    pthread_mutex_lock(&(j->mutex));
+
+    newpath = malloc(strlen(state->interceptconffile) + 9);
+    sprintf(newpath, "%s.journal", state->interceptconffile);
+
+    if (j->path == NULL || strcmp(newpath, j->path) != 0) {
+        /* the intercept config file has changed, so switch to its journal
+         * (which may have changes of its own from an earlier run) */
+        if (j->records > 0) {
+            logger(LOG_INFO,
+                    "OpenLI: leaving %u unapplied changes in intercept config journal %s",
+                    j->records, j->path);
+        }
+        close_journal_file(j);
+        ret = open_journal_file(state);
+    } else if (j->fd != -1) {
+        /* even if the file wasn't edited, changes may have been made via
+         * the REST API while the config was being reloaded */
+        if (pending || j->records > 0) {
+            ret = replay_journal(state);
+        }
+        if (ret > 0) {
+            ret = write_journal_snapshot(state);
+        } else {
+            remember_config_mtime(state);
+        }
+    }
+    free(newpath);
+
+    j->suspended = 0;
+    pthread_mutex_unlock(&(j->mutex));
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "logger.h"
 #include "agency.h"
@@ -626,16 +629,53 @@ int emit_intercept_config(char *configfile, prov_intercept_conf_t *conf) {
     yaml_emitter_t emitter;
     yaml_event_t event;
     FILE *f, *fout;
-    char tmpfile[] = "/tmp/openli-intconf-XXXXXX";
-    int tmpfd;
+    char *tmpfile = NULL;
+    char *realconf = NULL;
+    int tmpfd = -1;
+    int renamable = 0;
     char buffer[1024 * 32];
     size_t n;
+    struct stat sb;
+
+    /* Write the new config next to the old one if we can, so that it can
+     * be renamed over the old config once it is complete -- that way a
+     * crash part way through can never leave a half-written config
+     * behind. Otherwise, write it to /tmp and copy it over the old
+     * config as we always used to.
+     */
+    realconf = realpath(configfile, NULL);
+    if (realconf && stat(realconf, &sb) == 0) {
+        tmpfile = malloc(strlen(realconf) + 8);
+        sprintf(tmpfile, "%s.XXXXXX", realconf);
+        tmpfd = mkstemp(tmpfile);
+        if (tmpfd != -1) {
+            /* keep the permissions of the existing file */
+            if (fchmod(tmpfd, sb.st_mode & 07777) < 0 ||
+                    (fchown(tmpfd, sb.st_uid, sb.st_gid) < 0 &&
+                     errno != EPERM)) {
+                close(tmpfd);
+                unlink(tmpfile);
+                tmpfd = -1;
+            } else {
+                renamable = 1;
+            }
+        }
+    }
 
-    tmpfd = mkstemp(tmpfile);
+    if (tmpfd == -1) {
+        free(tmpfile);
+        tmpfile = strdup("/tmp/openli-intconf-XXXXXX");
+        tmpfd = mkstemp(tmpfile);
+    }
 
-    f = fdopen(tmpfd, "w");
-    if (ferror(f)) {
+    if (tmpfd == -1 || (f = fdopen(tmpfd, "w")) == NULL) {
         logger(LOG_INFO, "OpenLI: unable to open config file '%s' to write updated intercept config: %s", tmpfile, strerror(errno));
+        if (tmpfd != -1) {
+            close(tmpfd);
+            unlink(tmpfile);
+        }
+        free(tmpfile);
+        free(realconf);
         return -1;
     }
 
@@ -697,32 +737,80 @@ int emit_intercept_config(char *configfile, prov_intercept_conf_t *conf) {
     if (!yaml_emitter_emit(&emitter, &event)) goto error;
 
     yaml_emitter_delete(&emitter);
-    if (f) {
+
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: error writing new intercept config file: %s",
+                strerror(errno));
         fclose(f);
+        unlink(tmpfile);
+        goto fail;
+    }
+    fclose(f);
+
+    if (renamable) {
+        if (rename(tmpfile, realconf) == 0) {
+            free(tmpfile);
+            free(realconf);
+            return 0;
+        }
+        logger(LOG_INFO,
+                "OpenLI: unable to rename new intercept config into place, copying it instead: %s",
+                strerror(errno));
     }
 
     /* copy temp file contents back into the original */
     f = fopen(tmpfile, "r");
+    if (f == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: error reading temporary intercept config file: %s",
+                strerror(errno));
+        unlink(tmpfile);
+        goto fail;
+    }
     fout = fopen(configfile, "w");
+    if (fout == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: error writing new intercept config file: %s",
+                strerror(errno));
+        fclose(f);
+        unlink(tmpfile);
+        goto fail;
+    }
 
     while ((n = fread(buffer, sizeof(char), sizeof(buffer), f)) > 0) {
         if (fwrite(buffer, sizeof(char), n, fout) != n) {
             logger(LOG_INFO,
                     "OpenLI: error writing new intercept config file: %s",
                     strerror(errno));
-            return -1;
+            fclose(fout);
+            fclose(f);
+            goto fail;
         }
     }
     if (!feof(f)) {
         logger(LOG_INFO,
                 "OpenLI: error reading temporary intercept config file: %s",
                 strerror(errno));
-        return -1;
+        fclose(fout);
+        fclose(f);
+        goto fail;
+    }
+
+    if (fflush(fout) != 0 || fsync(fileno(fout)) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: error writing new intercept config file: %s",
+                strerror(errno));
+        fclose(fout);
+        fclose(f);
+        goto fail;
     }
 
     fclose(fout);
     fclose(f);
     unlink(tmpfile);
+    free(tmpfile);
+    free(realconf);
 
     return 0;
 
@@ -733,6 +821,10 @@ error:
     if (f) {
         fclose(f);
     }
+    unlink(tmpfile);
+fail:
+    free(tmpfile);
+    free(realconf);
     return -1;
 
 }
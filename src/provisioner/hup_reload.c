@@ -527,6 +527,18 @@ static int reload_intercept_config(provision_state_t *currstate,
 		return -1;
     }
 
+    /* Any client that was disconnected rather than being told about the
+     * changes will need to be sent the entire configuration when it
+     * reconnects */
+    if (clientchanged) {
+        reset_change_log(&(currstate->collectorchanges),
+                currstate->resynclogsize);
+    }
+    if (mediatorchanged) {
+        reset_change_log(&(currstate->mediatorchanges),
+                currstate->resynclogsize);
+    }
+
     clear_intercept_state(&(currstate->interceptconf));
     currstate->interceptconf = newconf;
     return 0;
@@ -548,6 +560,43 @@ static inline int reload_voipoptions_config(provision_state_t *currstate,
     return 0;
 }
 
+static inline void reload_journal_config(provision_state_t *currstate,
+        provision_state_t *newstate) {
+
+    intercept_journal_t *curr = &(currstate->journal);
+    intercept_journal_t *upd = &(newstate->journal);
+
+    pthread_mutex_lock(&(curr->mutex));
+    if (curr->compactrecords != upd->compactrecords ||
+            curr->compactinterval != upd->compactinterval) {
+        curr->compactrecords = upd->compactrecords;
+        curr->compactinterval = upd->compactinterval;
+        logger(LOG_INFO,
+                "OpenLI provisioner: intercept config journal will now be compacted every %u changes or %u seconds",
+                curr->compactrecords, curr->compactinterval);
+        pthread_cond_signal(&(curr->cond));
+    }
+    pthread_mutex_unlock(&(curr->mutex));
+}
+
+static inline void reload_resync_config(provision_state_t *currstate,
+        provision_state_t *newstate) {
+
+    if (currstate->resynclogsize == newstate->resynclogsize) {
+        return;
+    }
+
+    currstate->resynclogsize = newstate->resynclogsize;
+    logger(LOG_INFO,
+            "OpenLI provisioner: now remembering up to %u configuration changes for reconnecting clients",
+            currstate->resynclogsize);
+
+    pthread_mutex_lock(&(currstate->interceptconf.safelock));
+    reset_change_log(&(currstate->collectorchanges), currstate->resynclogsize);
+    reset_change_log(&(currstate->mediatorchanges), currstate->resynclogsize);
+    pthread_mutex_unlock(&(currstate->interceptconf.safelock));
+}
+
 static inline int reload_collector_socket_config(provision_state_t *currstate,
         provision_state_t *newstate) {
 
@@ -643,6 +692,14 @@ static inline void replace_restauth_config(provision_state_t *currstate,
 static int reload_restauth_config(provision_state_t *currstate,
         provision_state_t *newstate) {
 
+    /* Always start afresh, so that any credentials that have been revoked
+     * in the database (even if it is the same file) are no longer accepted */
+    flush_restauth_cache(&(currstate->restauthcache));
+
+    set_restauth_cache_ttl(&(currstate->restauthcache),
+            newstate->restauthcachettl);
+    currstate->restauthcachettl = newstate->restauthcachettl;
+
     if (currstate->restauthenabled == 0 &&
             (newstate->restauthdbfile == NULL || newstate->restauthkey == NULL)
             ) {
@@ -761,6 +818,8 @@ int reload_provisioner_config(provision_state_t *currstate) {
     int tlschanged = 0;
     int voipoptschanged = 0;
     int restauthchanged = 0;
+    int journalpending = 0;
+    int ret = 0;
 
     if (init_prov_state(&newstate, currstate->conffile) == -1) {
         logger(LOG_INFO,
@@ -801,11 +860,18 @@ int reload_provisioner_config(provision_state_t *currstate) {
         return -1;
     }
 
+    /* Bring the intercept config file up to date with any journalled
+     * changes before it is re-read */
+    journalpending = suspend_intercept_journal(currstate);
+
     if (reload_intercept_config_filename(currstate, &newstate) < 0) {
-        clear_prov_state(&newstate);
-        return -1;
+        ret = -1;
+        goto reloaddone;
     }
 
+    reload_journal_config(currstate, &newstate);
+    reload_resync_config(currstate, &newstate);
+
     voipoptschanged = reload_voipoptions_config(currstate, &newstate);
     if (voipoptschanged && !clientchanged) {
         voipintercept_t *vint, *tmp;
@@ -846,13 +912,18 @@ int reload_provisioner_config(provision_state_t *currstate) {
 
     if (reload_intercept_config(currstate, mediatorchanged, clientchanged) < 0)
     {
-        clear_prov_state(&newstate);
-        return -1;
+        ret = -1;
+        goto reloaddone;
     }
 
+reloaddone:
+    /* Always resume the journal, even if the reload failed -- otherwise
+     * it would never be compacted again */
+    resume_intercept_journal(currstate, journalpending);
+
     clear_prov_state(&newstate);
 
-    return 0;
+    return ret;
 
 
 }
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <getopt.h>
 #include <signal.h>
 #include <sys/signalfd.h>
@@ -39,6 +40,7 @@
 #include <libtrace/linked_list.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
 
 #include "configparser.h"
 #include "logger.h"
@@ -165,6 +167,7 @@ void init_intercept_config(prov_intercept_conf_t *state) {
     state->leas = NULL;
     state->defradusers = NULL;
     state->destroy_pending = 0;
+    state->loadedat = time(NULL);
     pthread_mutex_init(&(state->safelock), NULL);
 }
 
@@ -277,13 +280,23 @@ int init_prov_state(provision_state_t *state, char *configfile) {
     state->restauthdbfile = NULL;
     state->restauthkey = NULL;
     state->authdb = NULL;
+    state->restauthcachettl = DEFAULT_RESTAUTH_CACHE_TTL;
+    state->netbufferlimit = NETBUF_DEFAULT_LIMIT;
+    state->batchannouncements = 0;
+    state->resynclogsize = DEFAULT_RESYNC_LOG_SIZE;
 
     init_intercept_config(&(state->interceptconf));
+    init_intercept_journal(&(state->journal));
 
     if (parse_provisioning_config(configfile, state) == -1) {
         logger(LOG_INFO, "OpenLI provisioner: error while parsing provisioner config in %s", configfile);
         return -1;
     }
+    set_net_buffer_limit(state->netbufferlimit);
+
+    init_change_log(&(state->collectorchanges), state->resynclogsize);
+    init_change_log(&(state->mediatorchanges), state->resynclogsize);
+    init_restauth_cache(&(state->restauthcache), state->restauthcachettl);
 
     if (state->pushport == NULL) {
         state->pushport = strdup("8992");
@@ -324,6 +337,17 @@ static int announce_mediator(provision_state_t *state,
         prov_mediator_t *med) {
 
     prov_collector_t *col, *coltmp;
+    net_shared_msg_t *msg, *vmsg;
+    int ret = 0;
+
+    ENCODE_SHARED_MESSAGE(msg,
+            push_mediator_onto_net_buffer(enc, med->details));
+
+    /* Hold the intercept config lock while we record and queue the change,
+     * as the update socket thread does, so that the version numbers of
+     * the changes are in the same order in every collector's buffer */
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    vmsg = record_config_change(&(state->collectorchanges), msg);
 
     HASH_ITER(hh, state->collectors, col, coltmp) {
         prov_sock_state_t *cs = (prov_sock_state_t *)(col->client->state);
@@ -345,14 +369,16 @@ static int announce_mediator(provision_state_t *state,
             continue;
         }
 
-        if (push_mediator_onto_net_buffer(cs->outgoing, med->details) < 0) {
+        if (push_shared_onto_net_buffer(cs->outgoing,
+                (cs->configsync && vmsg) ? vmsg : msg) < 0) {
             if (cs->log_allowed) {
                 logger(LOG_INFO,
                     "OpenLI provisioner: error pushing mediator %s:%s onto buffer for writing to collector %s.",
                     med->details->ipstr, med->details->portstr,
                     col->identifier);
             }
-            return -1;
+            ret = -1;
+            break;
         }
         if (enable_epoll_write(state, col->client->commev) == -1) {
             if (cs->log_allowed) {
@@ -360,16 +386,29 @@ static int announce_mediator(provision_state_t *state,
                     "OpenLI provisioner: cannot enable epoll write event to transmit mediator update to collector %s -- %s.",
                     col->identifier, strerror(errno));
             }
-            return -1;
+            ret = -1;
+            break;
         }
     }
-    return 0;
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
+    return ret;
 }
 
 static int announce_mediator_withdraw(provision_state_t *state,
         prov_mediator_t *med) {
 
     prov_collector_t *col, *coltmp;
+    net_shared_msg_t *msg, *vmsg;
+    int ret = 0;
+
+    ENCODE_SHARED_MESSAGE(msg,
+            push_mediator_withdraw_onto_net_buffer(enc, med->details));
+
+    /* See announce_mediator() */
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    vmsg = record_config_change(&(state->collectorchanges), msg);
 
     HASH_ITER(hh, state->collectors, col, coltmp) {
         prov_sock_state_t *cs = (prov_sock_state_t *)(col->client->state);
@@ -391,15 +430,16 @@ static int announce_mediator_withdraw(provision_state_t *state,
             continue;
         }
 
-        if (push_mediator_withdraw_onto_net_buffer(cs->outgoing,
-                med->details) < 0) {
+        if (push_shared_onto_net_buffer(cs->outgoing,
+                (cs->configsync && vmsg) ? vmsg : msg) < 0) {
             if (cs->log_allowed) {
                 logger(LOG_INFO,
                         "OpenLI provisioner: error pushing mediator withdrawal %s:%s onto buffer for writing to collector %s.",
                         med->details->ipstr, med->details->portstr,
                         col->identifier);
             }
-            return -1;
+            ret = -1;
+            break;
         }
         if (enable_epoll_write(state, col->client->commev) == -1) {
             if (cs->log_allowed) {
@@ -407,10 +447,14 @@ static int announce_mediator_withdraw(provision_state_t *state,
                     "OpenLI provisioner: cannot enable epoll write event to transmit mediator update to collector %s -- %s.",
                     col->identifier, strerror(errno));
             }
-            return -1;
+            ret = -1;
+            break;
         }
     }
-    return 0;
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    release_shared_net_message(msg);
+    release_shared_net_message(vmsg);
+    return ret;
 }
 
 static int add_collector_to_hashmap(provision_state_t *state,
@@ -649,15 +693,22 @@ void clear_intercept_state(prov_intercept_conf_t *conf) {
 
 void clear_prov_state(provision_state_t *state) {
 
+    /* Any changes still in the journal are written out to the intercept
+     * config file here, so this must happen before the intercept config
+     * is cleared */
+    close_intercept_journal(state);
     clear_intercept_state(&(state->interceptconf));
 
     free_all_pending(state->epoll_fd, &(state->pendingclients));
     stop_all_collectors(state->epoll_fd, &(state->collectors));
     free_all_mediators(state->epoll_fd, &(state->mediators),
             &(state->knownmeds));
+    destroy_change_log(&(state->collectorchanges));
+    destroy_change_log(&(state->mediatorchanges));
 
     close(state->epoll_fd);
     close_restauth_db(state);
+    destroy_restauth_cache(&(state->restauthcache));
 
     if (state->clientfd) {
         close(state->clientfd->fd);
@@ -861,16 +912,77 @@ static int push_all_ipintercepts(ipintercept_t *ipintercepts,
     return 0;
 }
 
+/* Sends a client that has just authed the configuration changes that it
+ * missed while it was disconnected, if the client told us which version
+ * it had and we still have every change made since then.
+ *
+ * Must be called with the intercept config safelock held, so that no
+ * further changes can be announced until the client is up to date.
+ *
+ * Returns 1 if the changes were queued, 0 if the client needs to be sent
+ * the entire configuration instead, or -1 if an error occurs.
+ */
+static int respond_with_config_changes(provision_state_t *state,
+        prov_epoll_ev_t *pev, prov_sock_state_t *cs,
+        prov_change_log_t *changes, uint64_t confepoch,
+        uint64_t confversion) {
+
+    int ret;
+
+    if (!cs->configsync || confepoch == 0) {
+        return 0;
+    }
+
+    ret = push_config_changes_since(changes, cs->outgoing, confepoch,
+            confversion);
+    if (ret == 0) {
+        return 0;
+    }
+    if (ret < 0) {
+        logger(LOG_INFO,
+                "OpenLI provisioner: unable to queue configuration changes to be sent to client %s",
+                cs->ipaddr);
+        return -1;
+    }
+
+    if (enable_epoll_write(state, pev) == -1) {
+        logger(LOG_INFO,
+                "OpenLI: unable to enable epoll write event for newly authed client %s: %s",
+                cs->ipaddr, strerror(errno));
+        return -1;
+    }
+
+    logger(LOG_INFO,
+            "OpenLI provisioner: sending only the configuration changes since version %" PRIu64 " to client %s",
+            confversion, cs->ipaddr);
+    return 1;
+}
+
 static int respond_collector_auth(provision_state_t *state,
-        prov_epoll_ev_t *pev, net_buffer_t *outgoing) {
+        prov_epoll_ev_t *pev, prov_sock_state_t *cs, uint64_t confepoch,
+        uint64_t confversion) {
+
+    net_buffer_t *outgoing = cs->outgoing;
+    int ret;
 
     /* Collector just authed successfully, so we can safely shovel all
-     * of known mediators and active intercepts to it.
+     * of known mediators and active intercepts to it -- unless it only
+     * needs to hear about what has changed since it was last connected.
      */
 
     pthread_mutex_lock(&(state->interceptconf.safelock));
 
-    if (HASH_CNT(hh, state->mediators) +
+    ret = respond_with_config_changes(state, pev, cs,
+            &(state->collectorchanges), confepoch, confversion);
+    if (ret != 0) {
+        pthread_mutex_unlock(&(state->interceptconf.safelock));
+        return ret < 0 ? -1 : 0;
+    }
+
+    /* Collectors that track their configuration version still need to be
+     * told which version they have, even if there is nothing to send */
+    if (!cs->configsync &&
+            HASH_CNT(hh, state->mediators) +
             HASH_CNT(hh, state->interceptconf.radiusservers) +
             HASH_CNT(hh, state->interceptconf.gtpservers) +
             HASH_CNT(hh, state->interceptconf.sipservers) +
@@ -951,6 +1063,14 @@ static int respond_collector_auth(provision_state_t *state,
         return -1;
     }
 
+    if (cs->configsync && push_current_config_version(
+                &(state->collectorchanges), outgoing) < 0) {
+        logger(LOG_INFO,
+                "OpenLI provisioner: error pushing configuration version onto buffer for writing to collector.");
+        pthread_mutex_unlock(&(state->interceptconf.safelock));
+        return -1;
+    }
+
     if (enable_epoll_write(state, pev) == -1) {
         logger(LOG_INFO,
                 "OpenLI: unable to enable epoll write event for newly authed collector on fd %d: %s",
@@ -965,12 +1085,22 @@ static int respond_collector_auth(provision_state_t *state,
 }
 
 static int respond_mediator_auth(provision_state_t *state,
-        prov_epoll_ev_t *pev, net_buffer_t *outgoing) {
+        prov_epoll_ev_t *pev, prov_sock_state_t *cs, uint64_t confepoch,
+        uint64_t confversion) {
 
+    net_buffer_t *outgoing = cs->outgoing;
     liid_hash_t *h;
     prov_agency_t *ag, *tmp;
+    int ret;
 
     pthread_mutex_lock(&(state->interceptconf.safelock));
+
+    ret = respond_with_config_changes(state, pev, cs,
+            &(state->mediatorchanges), confepoch, confversion);
+    if (ret != 0) {
+        pthread_mutex_unlock(&(state->interceptconf.safelock));
+        return ret < 0 ? -1 : 0;
+    }
     /* Mediator just authed successfully, so we can safely send it details
      * on any LEAs that we know about */
     /* No need to wrap our log messages with checks for log_allowed, as
@@ -997,6 +1127,14 @@ static int respond_mediator_auth(provision_state_t *state,
         }
         h = h->hh.next;
     }
+
+    if (cs->configsync && push_current_config_version(
+                &(state->mediatorchanges), outgoing) < 0) {
+        logger(LOG_INFO,
+                "OpenLI: error while buffering configuration version to send to mediator.");
+        pthread_mutex_unlock(&(state->interceptconf.safelock));
+        return -1;
+    }
     pthread_mutex_unlock(&(state->interceptconf.safelock));
 
     /* Update our epoll event for this mediator to allow transmit. */
@@ -1018,6 +1156,8 @@ static int receive_collector(provision_state_t *state, prov_epoll_ev_t *pev) {
     uint64_t internalid;
     openli_proto_msgtype_t msgtype;
     uint8_t justauthed = 0;
+    uint64_t confepoch = 0, confversion = 0;
+    int ret;
 
     do {
         msgtype = receive_net_buffer(cs->incoming, &msgbody, &msglen,
@@ -1051,6 +1191,16 @@ static int receive_collector(provision_state_t *state, prov_epoll_ev_t *pev) {
                     }
                     return -1;
                 }
+                ret = decode_config_version(msgbody, msglen, &confepoch,
+                        &confversion);
+                if (ret < 0) {
+                    if (cs->log_allowed) {
+                        logger(LOG_INFO,
+                                "OpenLI: invalid auth message from collector.");
+                    }
+                    return -1;
+                }
+                cs->configsync = ret;
                 cs->trusted = 1;
                 justauthed = 1;
                 add_collector_to_hashmap(state, pev->client, cs);
@@ -1073,7 +1223,8 @@ static int receive_collector(provision_state_t *state, prov_epoll_ev_t *pev) {
                 cs->ipaddr, pev->fd);
         halt_provisioner_client_authtimer(state->epoll_fd, pev->client,
                 cs->ipaddr);
-        return respond_collector_auth(state, pev, cs->outgoing);
+        return respond_collector_auth(state, pev, cs, confepoch,
+                confversion);
    }
 
    return 0;
@@ -1086,6 +1237,8 @@ static int receive_mediator(provision_state_t *state, prov_epoll_ev_t *pev) {
     uint64_t internalid;
     openli_proto_msgtype_t msgtype;
     uint8_t justauthed = 0;
+    uint64_t confepoch = 0, confversion = 0;
+    int ret;
 
     if (pev->client->lastsslerror == 1) {
         return 0;
@@ -1122,6 +1275,16 @@ static int receive_mediator(provision_state_t *state, prov_epoll_ev_t *pev) {
                     }
                     return -1;
                 }
+                ret = decode_config_version(msgbody, msglen, &confepoch,
+                        &confversion);
+                if (ret < 0) {
+                    if (cs->log_allowed) {
+                        logger(LOG_INFO,
+                                "OpenLI: invalid auth message from mediator.");
+                    }
+                    return -1;
+                }
+                cs->configsync = ret;
                 cs->trusted = 1;
                 justauthed = 1;
                 break;
@@ -1157,7 +1320,8 @@ static int receive_mediator(provision_state_t *state, prov_epoll_ev_t *pev) {
                 cs->ipaddr, pev->fd);
         halt_provisioner_client_authtimer(state->epoll_fd, pev->client,
                 cs->ipaddr);
-        return respond_mediator_auth(state, pev, cs->outgoing);
+        return respond_mediator_auth(state, pev, cs, confepoch,
+                confversion);
     }
 
     return 0;
@@ -1666,6 +1830,8 @@ static void run(provision_state_t *state) {
 
         close(timerfd);
         state->timerfd->fd = -1;
+        report_net_buffer_usage("OpenLI provisioner");
+        report_restauth_stats(&(state->restauthcache));
     }
 
     if (state->updatedaemon) {
@@ -1794,6 +1960,10 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    /* Apply any changes that were made via the REST API but had not been
+     * written to the intercept config file when we last stopped */
+    open_intercept_journal(&provstate);
+
     if (start_main_listener(&provstate) == -1) {
         logger(LOG_INFO, "OpenLI: Error, could not start listening socket.");
         return 1;
@@ -32,6 +32,8 @@
 #include <libtrace/linked_list.h>
 #include <uthash.h>
 #include <microhttpd.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifdef HAVE_SQLCIPHER
 #include <sqlcipher/sqlite3.h>
@@ -205,10 +207,216 @@ typedef struct prov_intercept_conf {
     default_radius_user_t *defradusers;
 
     int destroy_pending;
+
+    /** The time when the intercept config was loaded -- this is used as
+     *  the modification time for any intercepts that have not been changed
+     *  since */
+    uint64_t loadedat;
+
     /** A mutex to protect the intercept config from race conditions */
     pthread_mutex_t safelock;
 } prov_intercept_conf_t;
 
+/** The types of change that can be recorded in the intercept config
+ *  journal, i.e. the REST API methods that modify the intercept config */
+enum {
+    JOURNAL_OP_POST = 1,
+    JOURNAL_OP_PUT = 2,
+    JOURNAL_OP_DELETE = 3,
+    JOURNAL_OP_BULK = 4,
+};
+
+/** The default number of journalled changes that will trigger a compaction
+ *  of the journal into the intercept config file */
+#define DEFAULT_JOURNAL_COMPACT_RECORDS 1000
+
+/** The default number of seconds that a journalled change may wait before
+ *  the journal is compacted into the intercept config file */
+#define DEFAULT_JOURNAL_COMPACT_INTERVAL 30
+
+/** A journal of the changes made to the running intercept config via the
+ *  REST API that have not yet been written to the intercept config file.
+ *
+ *  Each change is appended to the journal (and synced to disk) as it is
+ *  made. A background thread periodically compacts the journal by writing
+ *  out the full intercept config and then emptying the journal. On
+ *  start-up, any changes left in the journal are replayed on top of the
+ *  intercept config file.
+ */
+typedef struct intercept_journal {
+    /** The path to the journal file */
+    char *path;
+
+    /** The file descriptor for the journal file, or -1 if not open */
+    int fd;
+
+    /** The number of changes in the journal */
+    uint32_t records;
+
+    /** The size of the journal file, in bytes */
+    uint64_t size;
+
+    /** The time when the oldest change in the journal was recorded */
+    time_t firstpending;
+
+    /** The time before which we should not try to compact the journal
+     *  again, following a failed compaction */
+    time_t retryafter;
+
+    /** The modification time of the intercept config file after we last
+     *  wrote it, so we can tell if it has been edited by hand since */
+    struct timespec confmtime;
+
+    /** Compact the journal once it contains this many changes */
+    uint32_t compactrecords;
+
+    /** Compact the journal once its oldest change is this many seconds old */
+    uint32_t compactinterval;
+
+    /** Set to 1 while the intercept config is being reloaded, to prevent
+     *  compaction */
+    uint8_t suspended;
+
+    /** Set to 1 to tell the compaction thread to halt */
+    uint8_t halt;
+
+    /** Set to 1 if the compaction thread is running */
+    uint8_t running;
+
+    /** The compaction thread */
+    pthread_t threadid;
+
+    /** Protects the journal -- if the intercept config safelock is also
+     *  required, it must be locked first */
+    pthread_mutex_t mutex;
+
+    /** Used to wake the compaction thread */
+    pthread_cond_t cond;
+} intercept_journal_t;
+
+/** The default number of recent changes that are remembered for each type
+ *  of client, so that a client that reconnects can be sent just the changes
+ *  that it missed */
+#define DEFAULT_RESYNC_LOG_SIZE 10000
+
+/** A change to the configuration that was announced to every client of
+ *  one type */
+typedef struct prov_config_change {
+    /** The configuration version that this change produced */
+    uint64_t version;
+
+    /** The encoded announcement, followed by a message giving the new
+     *  configuration version */
+    net_shared_msg_t *msg;
+} prov_config_change_t;
+
+/** The most recent changes that have been announced to one type of client
+ *  (i.e. either collectors or mediators).
+ *
+ *  Every change bumps the configuration version. A client that reconnects
+ *  tells us the epoch and version that it last saw -- if we still have
+ *  every change made since then, the client is sent just those changes
+ *  instead of the entire configuration.
+ */
+typedef struct prov_change_log {
+    /** Identifies this sequence of versions. Changes whenever the log is
+     *  reset, so that a client is never sent changes relative to a version
+     *  from another sequence (e.g. from before the provisioner restarted) */
+    uint64_t epoch;
+
+    /** The version produced by the most recent change */
+    uint64_t version;
+
+    /** Ring buffer containing the most recent changes */
+    prov_config_change_t *changes;
+
+    /** The number of changes that the ring buffer can hold -- if zero, no
+     *  changes are kept and clients are always sent everything */
+    uint32_t size;
+
+    /** The number of changes currently in the ring buffer */
+    uint32_t count;
+
+    /** The index of the oldest change in the ring buffer */
+    uint32_t first;
+
+    /** Protects the log -- if the intercept config safelock is also
+     *  required, it must be locked first */
+    pthread_mutex_t mutex;
+} prov_change_log_t;
+
+/** The default number of seconds that a REST API credential is remembered
+ *  for after it has been looked up in the authentication database */
+#define DEFAULT_RESTAUTH_CACHE_TTL 60
+
+/** The most REST API credentials that will be remembered at once */
+#define RESTAUTH_CACHE_MAX_ENTRIES 1024
+
+/** How often to log the REST API authentication statistics, in seconds */
+#define RESTAUTH_REPORT_INTERVAL 300
+
+/** The types of credential that can be cached */
+enum {
+    RESTAUTH_CRED_APIKEY = 'K',
+    RESTAUTH_CRED_DIGEST = 'D',
+};
+
+/** A REST API credential that was recently found in the authentication
+ *  database */
+typedef struct restauth_cached_cred {
+    /** The type of credential, followed by the API key or username */
+    char *key;
+
+    /** The user that the credential belongs to */
+    char *username;
+
+    /** The digest hash for the user (digest credentials only) */
+    unsigned char digest[16];
+
+    /** The time (in seconds) after which the credential must be looked up
+     *  in the database again */
+    uint64_t expires;
+
+    UT_hash_handle hh;
+} restauth_cached_cred_t;
+
+/** Remembers recently used REST API credentials, so that the authentication
+ *  database does not need to be queried for every request.
+ *
+ *  Only credentials that were found in the database are cached. The cache
+ *  is emptied whenever the authentication database or key is changed.
+ */
+typedef struct restauth_cache {
+    /** The cached credentials, oldest first */
+    restauth_cached_cred_t *creds;
+
+    /** The number of seconds to remember each credential for -- if zero,
+     *  the database is queried for every request */
+    uint32_t ttl;
+
+    /** The number of requests that were authenticated using the cache
+     *  since the statistics were last logged */
+    uint64_t hits;
+
+    /** The number of requests that required a database lookup since the
+     *  statistics were last logged */
+    uint64_t misses;
+
+    /** The number of requests authenticated and the total and longest time
+     *  taken to authenticate them (in microseconds) since the statistics
+     *  were last logged */
+    uint64_t authcount;
+    uint64_t authtotal;
+    uint64_t authmax;
+
+    /** The time at which the statistics should next be logged */
+    uint64_t nextreport;
+
+    /** Protects the cache, which is used by the update socket thread but
+     *  reconfigured by the main thread */
+    pthread_mutex_t mutex;
+} restauth_cache_t;
+
 typedef struct mediator_address {
     char *ipportstr;
     uint32_t medid;
@@ -262,6 +470,24 @@ typedef struct prov_state {
 
     prov_intercept_conf_t interceptconf;
 
+    /** The journal of changes to the intercept config that have not yet
+     *  been written to the intercept config file */
+    intercept_journal_t journal;
+
+    /** The recent changes that have been announced to the collectors */
+    prov_change_log_t collectorchanges;
+
+    /** The recent changes that have been announced to the mediators */
+    prov_change_log_t mediatorchanges;
+
+    /** The number of recent changes to remember for each type of client */
+    uint32_t resynclogsize;
+
+    /** Set to 1 while a bulk update is being applied, so that clients are
+     *  only polled for writing once all of the resulting announcements
+     *  have been queued. Protected by the intercept config safelock. */
+    uint8_t batchannouncements;
+
     char *key_pem;
     char *cert_pem;
     struct MHD_Daemon *updatedaemon;
@@ -272,6 +498,15 @@ typedef struct prov_state {
     char *restauthkey;
     void *authdb;
 
+    /** Recently used REST API credentials */
+    restauth_cache_t restauthcache;
+
+    /** The number of seconds to cache REST API credentials for */
+    uint32_t restauthcachettl;
+
+    /** The largest size (in bytes) that any one net buffer may grow to */
+    uint64_t netbufferlimit;
+
     /** A flag indicating whether collectors should ignore RTP comfort noise
      *  packets when intercepting voice traffic.
      */
@@ -305,6 +540,16 @@ struct prov_sock_state {
     /** Set to 1 if the client has been disconnected, 0 otherwise */
     uint8_t halted;
 
+    /** Set to 1 if messages have been queued for the client while
+     *  announcements were being batched, but the client has not yet been
+     *  polled for writing */
+    uint8_t writepending;
+
+    /** Set to 1 if the client keeps track of which configuration version
+     *  it has applied, i.e. it should be sent the version along with each
+     *  change */
+    uint8_t configsync;
+
     /** The type of client, e.g. either collector or mediator */
     int clientrole;
 };
@@ -327,6 +572,42 @@ int map_intercepts_to_leas(prov_intercept_conf_t *conf);
 /* Implemented in configwriter.c */
 int emit_intercept_config(char *configfile, prov_intercept_conf_t *conf);
 
+/* Implemented in configjournal.c */
+void init_intercept_journal(intercept_journal_t *journal);
+int open_intercept_journal(provision_state_t *state);
+void close_intercept_journal(provision_state_t *state);
+int record_intercept_config_change(provision_state_t *state, uint8_t op,
+        int target, const char *data, uint32_t len);
+int compact_intercept_journal(provision_state_t *state);
+int suspend_intercept_journal(provision_state_t *state);
+int resume_intercept_journal(provision_state_t *state, int pending);
+
+/* Implemented in changelog.c */
+void init_change_log(prov_change_log_t *log, uint32_t size);
+void destroy_change_log(prov_change_log_t *log);
+void reset_change_log(prov_change_log_t *log, uint32_t size);
+net_shared_msg_t *record_config_change(prov_change_log_t *log,
+        net_shared_msg_t *msg);
+int push_config_changes_since(prov_change_log_t *log, net_buffer_t *nb,
+        uint64_t confepoch, uint64_t confversion);
+int push_current_config_version(prov_change_log_t *log, net_buffer_t *nb);
+
+/* Implemented in restauthcache.c */
+void init_restauth_cache(restauth_cache_t *cache, uint32_t ttl);
+void destroy_restauth_cache(restauth_cache_t *cache);
+void flush_restauth_cache(restauth_cache_t *cache);
+void set_restauth_cache_ttl(restauth_cache_t *cache, uint32_t ttl);
+int lookup_restauth_cache(restauth_cache_t *cache, char credtype,
+        const char *cred, char **username, unsigned char *digest);
+void add_restauth_cache(restauth_cache_t *cache, char credtype,
+        const char *cred, const char *username, unsigned char *digest);
+void record_restauth_latency(restauth_cache_t *cache, uint64_t usecs);
+void report_restauth_stats(restauth_cache_t *cache);
+
+/* Implemented in updateserver.c */
+int replay_intercept_config_change(provision_state_t *state, uint8_t op,
+        int target, char *data, uint32_t len);
+
 /* Implemented in clientupdates.c */
 int compare_sip_targets(provision_state_t *currstate,
         voipintercept_t *existing, voipintercept_t *reload);
@@ -365,6 +646,8 @@ liid_hash_t *add_liid_mapping(prov_intercept_conf_t *conf,
         char *liid, char *agency);
 int announce_hi1_notification_to_mediators(provision_state_t *state,
         intercept_common_t *intcomm, hi1_notify_t not_type);
+void start_batched_announcements(provision_state_t *state);
+void flush_batched_announcements(provision_state_t *state);
 
 /* Implemented in hup_reload.c */
 int reload_provisioner_config(provision_state_t *state);
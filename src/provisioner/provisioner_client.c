@@ -199,6 +199,7 @@ static void create_prov_socket_state(prov_client_t *client, int authtimerfd,
     cs->outgoing = create_net_buffer(NETBUF_SEND, fd, client->ssl);
     cs->trusted = 0;
     cs->halted = 0;
+    cs->writepending = 0;
     cs->clientrole = fdtype;
     cs->parent = NULL;
 
@@ -0,0 +1,256 @@
+/*
+ *
+ * Copyright (c) 2018-2020 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of OpenLI.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * OpenLI is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * OpenLI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "provisioner.h"
+
+static inline uint64_t restauth_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/* Builds the key for a credential in the cache, i.e. the credential type
+ * followed by the credential itself, so that an API key can never be
+ * mistaken for a username.
+ */
+static char *make_restauth_key(char credtype, const char *cred) {
+    size_t len = strlen(cred);
+    char *key;
+
+    key = malloc(len + 2);
+    if (key == NULL) {
+        return NULL;
+    }
+    key[0] = credtype;
+    memcpy(key + 1, cred, len + 1);
+    return key;
+}
+
+static void free_cached_cred(restauth_cached_cred_t *cc) {
+    free(cc->key);
+    free(cc->username);
+    free(cc);
+}
+
+/* The caller must hold the cache mutex */
+static void clear_cached_creds(restauth_cache_t *cache) {
+    restauth_cached_cred_t *cc, *tmp;
+
+    HASH_ITER(hh, cache->creds, cc, tmp) {
+        HASH_DELETE(hh, cache->creds, cc);
+        free_cached_cred(cc);
+    }
+}
+
+void init_restauth_cache(restauth_cache_t *cache, uint32_t ttl) {
+    memset(cache, 0, sizeof(restauth_cache_t));
+    cache->ttl = ttl;
+    pthread_mutex_init(&(cache->mutex), NULL);
+}
+
+void destroy_restauth_cache(restauth_cache_t *cache) {
+    pthread_mutex_lock(&(cache->mutex));
+    clear_cached_creds(cache);
+    pthread_mutex_unlock(&(cache->mutex));
+    pthread_mutex_destroy(&(cache->mutex));
+}
+
+/* Forgets every cached credential, e.g. because the authentication
+ * database has changed.
+ */
+void flush_restauth_cache(restauth_cache_t *cache) {
+    pthread_mutex_lock(&(cache->mutex));
+    clear_cached_creds(cache);
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+void set_restauth_cache_ttl(restauth_cache_t *cache, uint32_t ttl) {
+    pthread_mutex_lock(&(cache->mutex));
+    if (cache->ttl != ttl) {
+        logger(LOG_INFO,
+                "OpenLI provisioner: REST API credentials will now be cached for %u seconds",
+                ttl);
+        cache->ttl = ttl;
+        clear_cached_creds(cache);
+    }
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+/* Looks for a credential in the cache.
+ *
+ * If found, the username that the credential belongs to is returned via
+ * 'username' (the caller must free it) and, for digest credentials, the
+ * digest hash is copied into 'digest'.
+ *
+ * Returns 1 if the credential was found, 0 if the database must be
+ * checked instead.
+ */
+int lookup_restauth_cache(restauth_cache_t *cache, char credtype,
+        const char *cred, char **username, unsigned char *digest) {
+
+    restauth_cached_cred_t *cc;
+    char *key;
+    int ret = 0;
+
+    key = make_restauth_key(credtype, cred);
+    if (key == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(cache->mutex));
+    if (cache->ttl == 0) {
+        cache->misses ++;
+        goto endlookup;
+    }
+
+    HASH_FIND(hh, cache->creds, key, strlen(key), cc);
+    if (cc && cc->expires <= restauth_now()) {
+        HASH_DELETE(hh, cache->creds, cc);
+        free_cached_cred(cc);
+        cc = NULL;
+    }
+
+    if (cc == NULL) {
+        cache->misses ++;
+        goto endlookup;
+    }
+
+    if (username) {
+        *username = strdup(cc->username);
+    }
+    if (digest) {
+        memcpy(digest, cc->digest, 16);
+    }
+    cache->hits ++;
+    ret = 1;
+
+endlookup:
+    pthread_mutex_unlock(&(cache->mutex));
+    free(key);
+    return ret;
+}
+
+/* Remembers a credential that has just been found in the database. */
+void add_restauth_cache(restauth_cache_t *cache, char credtype,
+        const char *cred, const char *username, unsigned char *digest) {
+
+    restauth_cached_cred_t *cc, *old;
+
+    pthread_mutex_lock(&(cache->mutex));
+    if (cache->ttl == 0) {
+        pthread_mutex_unlock(&(cache->mutex));
+        return;
+    }
+
+    cc = calloc(1, sizeof(restauth_cached_cred_t));
+    if (cc == NULL) {
+        pthread_mutex_unlock(&(cache->mutex));
+        return;
+    }
+    cc->key = make_restauth_key(credtype, cred);
+    cc->username = strdup(username ? username : "");
+    if (cc->key == NULL || cc->username == NULL) {
+        free_cached_cred(cc);
+        pthread_mutex_unlock(&(cache->mutex));
+        return;
+    }
+    if (digest) {
+        memcpy(cc->digest, digest, 16);
+    }
+    cc->expires = restauth_now() + cache->ttl;
+
+    HASH_FIND(hh, cache->creds, cc->key, strlen(cc->key), old);
+    if (old) {
+        HASH_DELETE(hh, cache->creds, old);
+        free_cached_cred(old);
+    }
+
+    /* Credentials are added in order, so the oldest is always first */
+    if (HASH_COUNT(cache->creds) >= RESTAUTH_CACHE_MAX_ENTRIES) {
+        old = cache->creds;
+        HASH_DELETE(hh, cache->creds, old);
+        free_cached_cred(old);
+    }
+
+    HASH_ADD_KEYPTR(hh, cache->creds, cc->key, strlen(cc->key), cc);
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+void record_restauth_latency(restauth_cache_t *cache, uint64_t usecs) {
+    pthread_mutex_lock(&(cache->mutex));
+    cache->authcount ++;
+    cache->authtotal += usecs;
+    if (usecs > cache->authmax) {
+        cache->authmax = usecs;
+    }
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+/* Logs how many REST API requests were authenticated using the cache and
+ * how long authentication took, if enough time has passed since the
+ * statistics were last logged.
+ */
+void report_restauth_stats(restauth_cache_t *cache) {
+
+    uint64_t now = restauth_now();
+
+    pthread_mutex_lock(&(cache->mutex));
+    if (cache->nextreport == 0) {
+        cache->nextreport = now + RESTAUTH_REPORT_INTERVAL;
+        pthread_mutex_unlock(&(cache->mutex));
+        return;
+    }
+    if (now < cache->nextreport) {
+        pthread_mutex_unlock(&(cache->mutex));
+        return;
+    }
+
+    if (cache->authcount > 0) {
+        logger(LOG_INFO,
+                "OpenLI provisioner: authenticated %" PRIu64 " REST API requests (%" PRIu64 " cache hits, %" PRIu64 " database lookups), avg %" PRIu64 " us max %" PRIu64 " us",
+                cache->authcount, cache->hits, cache->misses,
+                cache->authtotal / cache->authcount, cache->authmax);
+    }
+
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->authcount = 0;
+    cache->authtotal = 0;
+    cache->authmax = 0;
+    cache->nextreport = now + RESTAUTH_REPORT_INTERVAL;
+    pthread_mutex_unlock(&(cache->mutex));
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
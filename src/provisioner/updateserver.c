@@ -27,6 +27,10 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -34,6 +38,7 @@
 #include <json-c/json.h>
 #include <pthread.h>
 #include <assert.h>
+#include <time.h>
 
 #ifdef HAVE_SQLCIPHER
 #include <sqlcipher/sqlite3.h>
@@ -60,6 +65,9 @@ int init_restauth_db(provision_state_t *state) {
         sqlite3_close(state->authdb);
     }
 
+    /* Anything we remember from the old database may no longer be valid */
+    flush_restauth_cache(&(state->restauthcache));
+
     rc = sqlite3_open(state->restauthdbfile, (sqlite3 **)(&(state->authdb)));
     if (rc != SQLITE_OK) {
         logger(LOG_INFO, "OpenLI provisioner: Failed to open REST authentication database: %s: %s",
@@ -214,27 +222,11 @@ static inline int extract_target_from_url(update_con_info_t *cinfo,
     return 1;
 }
 
-static int update_configuration_delete(update_con_info_t *cinfo,
-        provision_state_t *state, const char *url) {
+static int apply_configuration_delete(update_con_info_t *cinfo,
+        provision_state_t *state, const char *target) {
 
     int ret = 0;
-    char *urlcopy = strdup(url);
-    char target[4096];
-
-    if ((ret = extract_target_from_url(cinfo, urlcopy, target, 4096, "DELETE"))
-             < 0) {
-        free(urlcopy);
-        return -1;
-    }
-
-    if (ret == 0) {
-        /* no target specified, just return quietly? */
-        free(urlcopy);
-        return ret;
-    }
-    ret = 0;
 
-    pthread_mutex_lock(&(state->interceptconf.safelock));
     switch(cinfo->target) {
         case TARGET_AGENCY:
             ret = remove_agency(cinfo, state, target);
@@ -261,11 +253,39 @@ static int update_configuration_delete(update_con_info_t *cinfo,
             ret = remove_defaultradius(cinfo, state, target);
             break;
     }
+    return ret;
+}
 
-    /* Safe to unlock before emitting, since all accesses should be reads
-     * anyway... */
+static int update_configuration_delete(update_con_info_t *cinfo,
+        provision_state_t *state, const char *url) {
+
+    int ret = 0;
+    char *urlcopy = strdup(url);
+    char target[4096];
+
+    if ((ret = extract_target_from_url(cinfo, urlcopy, target, 4096, "DELETE"))
+             < 0) {
+        free(urlcopy);
+        return -1;
+    }
+
+    if (ret == 0) {
+        /* no target specified, just return quietly? */
+        free(urlcopy);
+        return ret;
+    }
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    ret = apply_configuration_delete(cinfo, state, target);
+
+    /* Record the change in the journal rather than rewriting the whole
+     * intercept config file -- the journal will be compacted into the
+     * file in the background */
+    if (ret > 0) {
+        record_intercept_config_change(state, JOURNAL_OP_DELETE,
+                cinfo->target, target, strlen(target));
+    }
     pthread_mutex_unlock(&(state->interceptconf.safelock));
-    emit_intercept_config(state->interceptconffile, &(state->interceptconf));
     free(urlcopy);
     return ret;
 }
@@ -323,25 +343,190 @@ static json_object *create_get_response(update_con_info_t *cinfo,
     return jobj;
 }
 
+static int parse_filter_number(update_con_info_t *cinfo,
+        struct MHD_Connection *conn, const char *key, uint64_t max,
+        uint64_t *result) {
 
-static int update_configuration_post(update_con_info_t *cinfo,
-        provision_state_t *state, const char *method) {
+    const char *valstr;
+    char *endptr = NULL;
+    unsigned long long val;
 
-    int ret = 0;
+    valstr = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, key);
+    if (valstr == NULL || *valstr == '\0') {
+        return 0;
+    }
 
-    if (cinfo->content_type == NULL || strcasecmp(cinfo->content_type,
-                "application/json") != 0) {
+    errno = 0;
+    val = strtoull(valstr, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || *valstr == '-' || val > max) {
+        logger(LOG_INFO,
+                "OpenLI: invalid value for '%s' in GET request from update socket: %s",
+                key, valstr);
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Invalid value for '%s' -- must be a number no larger than %" PRIu64 ". %s",
+                update_failure_page_start, key, max,
+                update_failure_page_end);
         return -1;
     }
+    *result = val;
+    return 1;
+}
 
-    if (!cinfo->jsonbuffer) {
+static inline const char *lookup_filter_string(struct MHD_Connection *conn,
+        const char *key) {
+
+    const char *valstr;
+
+    valstr = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, key);
+    if (valstr == NULL || *valstr == '\0') {
+        return NULL;
+    }
+    return valstr;
+}
+
+static int parse_intercept_filter(update_con_info_t *cinfo,
+        struct MHD_Connection *conn, intercept_filter_t *filter) {
+
+    uint64_t val;
+    int ret;
+
+    memset(filter, 0, sizeof(intercept_filter_t));
+
+    ret = parse_filter_number(cinfo, conn, "limit", MAX_INTERCEPT_PAGE_SIZE,
+            &val);
+    if (ret < 0) {
         return -1;
     }
+    if (ret > 0) {
+        if (val == 0) {
+            snprintf(cinfo->answerstring, 4096,
+                    "%s <p>Invalid value for 'limit' -- must be at least 1. %s",
+                    update_failure_page_start, update_failure_page_end);
+            return -1;
+        }
+        filter->limit = (uint32_t)val;
+    }
+
+    ret = parse_filter_number(cinfo, conn, "modifiedsince", UINT64_MAX, &val);
+    if (ret < 0) {
+        return -1;
+    }
+    if (ret > 0) {
+        filter->modifiedsince = val;
+    }
+
+    filter->cursor = lookup_filter_string(conn, "cursor");
+    filter->agencyid = lookup_filter_string(conn, "agency");
+    filter->liidprefix = lookup_filter_string(conn, "liidprefix");
+    return 0;
+}
+
+static ssize_t read_intercept_listing(void *cls, uint64_t pos, char *buf,
+        size_t max) {
+
+    intercept_listing_t *listing = (intercept_listing_t *)cls;
+    size_t tocopy;
+    int ret;
+
+    /* Each chunk of intercepts may turn out to be empty, if they were all
+     * removed after the listing began */
+    while (listing->bufread >= listing->bufused) {
+        ret = fill_intercept_listing(listing);
+        if (ret < 0) {
+            logger(LOG_INFO,
+                    "OpenLI provisioner: error while streaming intercept listing to update socket");
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+        if (ret == 0) {
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+    }
+
+    tocopy = listing->bufused - listing->bufread;
+    if (tocopy > max) {
+        tocopy = max;
+    }
+    memcpy(buf, listing->buf + listing->bufread, tocopy);
+    listing->bufread += tocopy;
+    return (ssize_t)tocopy;
+}
+
+static void release_intercept_listing(void *cls) {
+    free_intercept_listing((intercept_listing_t *)cls);
+}
+
+/* Sends a listing of every IP or VOIP intercept, as a stream of JSON rather
+ * than a single JSON object, so that we don't have to hold the config lock
+ * (or the entire response) while a large listing is serialised.
+ *
+ * The listing can be paged through by setting 'limit' and then passing
+ * the value of the X-OpenLI-Next-Cursor header as the 'cursor' for the
+ * next request.
+ */
+static int send_intercept_listing(struct MHD_Connection *conn,
+        update_con_info_t *cinfo, provision_state_t *state) {
+
+    intercept_filter_t filter;
+    intercept_listing_t *listing;
+    struct MHD_Response *resp;
+    int ret;
+
+    if (parse_intercept_filter(cinfo, conn, &filter) < 0) {
+        return send_http_page(conn, cinfo->answerstring,
+                MHD_HTTP_BAD_REQUEST);
+    }
+
+    listing = create_intercept_listing(cinfo, state, &filter);
+    if (listing == NULL) {
+        return MHD_NO;
+    }
+
+    resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
+            read_intercept_listing, listing, release_intercept_listing);
+    if (!resp) {
+        free_intercept_listing(listing);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+            "application/json");
+    if (listing->nextcursor) {
+        MHD_add_response_header(resp, "X-OpenLI-Next-Cursor",
+                listing->nextcursor);
+    }
+    ret = MHD_queue_response(conn, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
+static int is_intercept_listing_request(update_con_info_t *cinfo,
+        const char *url) {
+
+    char *urlcopy;
+    char target[4096];
+    int ret;
+
+    if (cinfo->target != TARGET_IPINTERCEPT &&
+            cinfo->target != TARGET_VOIPINTERCEPT) {
+        return 0;
+    }
+
+    urlcopy = strdup(url);
+    ret = extract_target_from_url(cinfo, urlcopy, target, 4096, "GET");
+    free(urlcopy);
+
+    /* Let create_get_response() deal with any errors */
+    return (ret == 0);
+}
+
+static int apply_configuration_post(update_con_info_t *cinfo,
+        provision_state_t *state, uint8_t op) {
+
+    int ret = 0;
 
-    pthread_mutex_lock(&(state->interceptconf.safelock));
     switch(cinfo->target) {
         case TARGET_AGENCY:
-            if (strcmp(method, "POST") == 0) {
+            if (op == JOURNAL_OP_POST) {
                 ret = add_new_agency(cinfo, state);
             }
             else {
@@ -361,30 +546,385 @@ static int update_configuration_post(update_con_info_t *cinfo,
             ret = add_new_coreserver(cinfo, state, OPENLI_CORE_SERVER_GTP);
             break;
         case TARGET_IPINTERCEPT:
-            if (strcmp(method, "POST") == 0) {
+            if (op == JOURNAL_OP_POST) {
                 ret = add_new_ipintercept(cinfo, state);
             } else {
                 ret = modify_ipintercept(cinfo, state);
             }
             break;
         case TARGET_VOIPINTERCEPT:
-            if (strcmp(method, "POST") == 0) {
+            if (op == JOURNAL_OP_POST) {
                 ret = add_new_voipintercept(cinfo, state);
             } else {
                 ret = modify_voipintercept(cinfo, state);
             }
             break;
     }
+    return ret;
+}
 
+static int update_configuration_post(update_con_info_t *cinfo,
+        provision_state_t *state, const char *method) {
 
-    /* Safe to unlock before emitting, since all accesses should be reads
-     * anyway... */
-    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    int ret = 0;
+    uint8_t op;
+
+    if (cinfo->content_type == NULL || strcasecmp(cinfo->content_type,
+                "application/json") != 0) {
+        return -1;
+    }
+
+    if (!cinfo->jsonbuffer) {
+        return -1;
+    }
 
-    emit_intercept_config(state->interceptconffile, &(state->interceptconf));
+    if (strcmp(method, "POST") == 0) {
+        op = JOURNAL_OP_POST;
+    } else {
+        op = JOURNAL_OP_PUT;
+    }
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    ret = apply_configuration_post(cinfo, state, op);
+
+    /* Record the change in the journal rather than rewriting the whole
+     * intercept config file -- the journal will be compacted into the
+     * file in the background */
+    if (ret == 0) {
+        record_intercept_config_change(state, op, cinfo->target,
+                cinfo->jsonbuffer, cinfo->jsonlen);
+    }
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
     return ret;
 }
 
+/* The names used for each type of object in a bulk update */
+static const struct bulk_target_name {
+    const char *name;
+    int target;
+} bulk_targets[] = {
+    { "agency", TARGET_AGENCY },
+    { "sipserver", TARGET_SIPSERVER },
+    { "radiusserver", TARGET_RADIUSSERVER },
+    { "gtpserver", TARGET_GTPSERVER },
+    { "ipintercept", TARGET_IPINTERCEPT },
+    { "voipintercept", TARGET_VOIPINTERCEPT },
+    { "defaultradius", TARGET_DEFAULTRADIUS },
+    { NULL, -1 },
+};
+
+/* A single operation from a bulk update */
+typedef struct bulk_op {
+    uint8_t op;
+    int target;
+    const char *method;
+    const char *targetname;
+    json_object *body;
+    const char *id;
+} bulk_op_t;
+
+/* Pulls the reason for a failure out of the HTML page that the update
+ * functions write into the answer string */
+static const char *bulk_failure_reason(update_con_info_t *cinfo) {
+
+    char *reason = cinfo->answerstring;
+    char *end;
+    size_t startlen = strlen(update_failure_page_start);
+
+    if (strncmp(reason, update_failure_page_start, startlen) == 0) {
+        reason += startlen;
+    }
+    while (*reason == ' ') {
+        reason ++;
+    }
+    if (strncmp(reason, "<p>", 3) == 0) {
+        reason += 3;
+    }
+
+    end = strstr(reason, update_failure_page_end);
+    if (end) {
+        while (end > reason && *(end - 1) == ' ') {
+            end --;
+        }
+        *end = '\0';
+    }
+
+    if (*reason == '\0') {
+        return "operation failed";
+    }
+    return reason;
+}
+
+static int parse_bulk_operation(json_object *jop, bulk_op_t *op,
+        char *errspace, int errlen) {
+
+    json_object *jmethod, *jtarget, *jid;
+    const struct bulk_target_name *t;
+
+    memset(op, 0, sizeof(bulk_op_t));
+
+    if (json_object_get_type(jop) != json_type_object) {
+        snprintf(errspace, errlen, "operation is not a JSON object");
+        return -1;
+    }
+
+    if (!json_object_object_get_ex(jop, "method", &jmethod) ||
+            json_object_get_type(jmethod) != json_type_string) {
+        snprintf(errspace, errlen, "operation must include a 'method'");
+        return -1;
+    }
+    op->method = json_object_get_string(jmethod);
+
+    if (strcmp(op->method, "POST") == 0) {
+        op->op = JOURNAL_OP_POST;
+    } else if (strcmp(op->method, "PUT") == 0) {
+        op->op = JOURNAL_OP_PUT;
+    } else if (strcmp(op->method, "DELETE") == 0) {
+        op->op = JOURNAL_OP_DELETE;
+    } else {
+        snprintf(errspace, errlen, "unsupported method '%s'", op->method);
+        return -1;
+    }
+
+    if (!json_object_object_get_ex(jop, "target", &jtarget) ||
+            json_object_get_type(jtarget) != json_type_string) {
+        snprintf(errspace, errlen, "operation must include a 'target'");
+        return -1;
+    }
+    op->targetname = json_object_get_string(jtarget);
+
+    op->target = -1;
+    for (t = bulk_targets; t->name != NULL; t++) {
+        if (strcmp(t->name, op->targetname) == 0) {
+            op->target = t->target;
+            break;
+        }
+    }
+    if (op->target == -1) {
+        snprintf(errspace, errlen, "unknown target '%s'", op->targetname);
+        return -1;
+    }
+
+    if (op->op == JOURNAL_OP_DELETE) {
+        if (!json_object_object_get_ex(jop, "id", &jid) ||
+                json_object_get_type(jid) != json_type_string ||
+                strlen(json_object_get_string(jid)) == 0) {
+            snprintf(errspace, errlen,
+                    "DELETE operations must include an 'id'");
+            return -1;
+        }
+        op->id = json_object_get_string(jid);
+    } else {
+        if (!json_object_object_get_ex(jop, "body", &(op->body)) ||
+                json_object_get_type(op->body) != json_type_object) {
+            snprintf(errspace, errlen,
+                    "%s operations must include a 'body' object",
+                    op->method);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parses and validates every operation in a bulk update. If any operation
+ * is malformed, none of them are applied. */
+static bulk_op_t *parse_bulk_request(update_con_info_t *cinfo,
+        const char *data, int len, json_object **parsed, size_t *count) {
+
+    struct json_tokener *tknr;
+    bulk_op_t *ops;
+    char err[512];
+    size_t i;
+
+    tknr = json_tokener_new();
+    *parsed = json_tokener_parse_ex(tknr, data, len);
+    if (*parsed == NULL) {
+        logger(LOG_INFO,
+                "OpenLI: unable to parse JSON received over update socket: %s",
+                json_tokener_error_desc(json_tokener_get_error(tknr)));
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>OpenLI provisioner was unable to parse JSON received over update socket: %s. %s",
+                update_failure_page_start,
+                json_tokener_error_desc(json_tokener_get_error(tknr)),
+                update_failure_page_end);
+        json_tokener_free(tknr);
+        return NULL;
+    }
+    json_tokener_free(tknr);
+
+    if (json_object_get_type(*parsed) != json_type_array) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Bulk update socket messages must be a JSON array of operations. %s",
+                update_failure_page_start, update_failure_page_end);
+        json_object_put(*parsed);
+        *parsed = NULL;
+        return NULL;
+    }
+
+    *count = json_object_array_length(*parsed);
+    ops = calloc(*count ? *count : 1, sizeof(bulk_op_t));
+
+    for (i = 0; i < *count; i++) {
+        if (parse_bulk_operation(json_object_array_get_idx(*parsed, i),
+                    &(ops[i]), err, sizeof(err)) < 0) {
+            logger(LOG_INFO,
+                    "OpenLI: invalid operation %zu in bulk update: %s",
+                    i, err);
+            snprintf(cinfo->answerstring, 4096,
+                    "%s <p>Operation %zu of bulk update is invalid: %s. No changes have been made. %s",
+                    update_failure_page_start, i, err,
+                    update_failure_page_end);
+            free(ops);
+            json_object_put(*parsed);
+            *parsed = NULL;
+            return NULL;
+        }
+    }
+    return ops;
+}
+
+/* Applies each operation from a bulk update in turn. The caller must hold
+ * the intercept config safelock. If results is not NULL, the outcome of
+ * each operation is added to it. */
+static uint32_t apply_bulk_request(provision_state_t *state, bulk_op_t *ops,
+        size_t count, json_object *results) {
+
+    update_con_info_t item;
+    json_object *res;
+    const char *status;
+    uint32_t applied = 0;
+    size_t i;
+    int ret;
+
+    start_batched_announcements(state);
+    for (i = 0; i < count; i++) {
+        memset(&item, 0, sizeof(item));
+        item.target = ops[i].target;
+
+        if (ops[i].op == JOURNAL_OP_DELETE) {
+            item.connectiontype = MICRO_DELETE;
+            ret = apply_configuration_delete(&item, state, ops[i].id);
+            status = (ret > 0) ? "ok" : "notfound";
+        } else {
+            item.connectiontype = MICRO_POST;
+            item.content_type = "application/json";
+            item.jsonbuffer = (char *)json_object_to_json_string(ops[i].body);
+            item.jsonlen = strlen(item.jsonbuffer);
+            ret = apply_configuration_post(&item, state, ops[i].op);
+            status = (ret == 0) ? "ok" : "failed";
+        }
+
+        if (strcmp(status, "ok") == 0) {
+            applied ++;
+        }
+
+        if (results == NULL) {
+            continue;
+        }
+        res = json_object_new_object();
+        json_object_object_add(res, "index", json_object_new_int(i));
+        json_object_object_add(res, "method",
+                json_object_new_string(ops[i].method));
+        json_object_object_add(res, "target",
+                json_object_new_string(ops[i].targetname));
+        json_object_object_add(res, "status", json_object_new_string(status));
+        if (strcmp(status, "failed") == 0) {
+            json_object_object_add(res, "error",
+                    json_object_new_string(bulk_failure_reason(&item)));
+        }
+        json_object_array_add(results, res);
+    }
+    flush_batched_announcements(state);
+    return applied;
+}
+
+static json_object *update_configuration_bulk(update_con_info_t *cinfo,
+        provision_state_t *state) {
+
+    json_object *parsed = NULL, *results, *resp;
+    bulk_op_t *ops;
+    size_t count = 0;
+    uint32_t applied;
+
+    if (cinfo->content_type == NULL || strcasecmp(cinfo->content_type,
+                "application/json") != 0 || cinfo->jsonbuffer == NULL) {
+        snprintf(cinfo->answerstring, 4096,
+                "%s <p>Bulk update socket messages must contain JSON. %s",
+                update_failure_page_start, update_failure_page_end);
+        return NULL;
+    }
+
+    ops = parse_bulk_request(cinfo, cinfo->jsonbuffer, cinfo->jsonlen,
+            &parsed, &count);
+    if (ops == NULL) {
+        return NULL;
+    }
+
+    results = json_object_new_array();
+
+    /* Hold the lock for the entire update, so nobody else sees (or
+     * changes) the config part way through */
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    applied = apply_bulk_request(state, ops, count, results);
+
+    /* The whole update goes into the journal as a single change */
+    if (applied > 0) {
+        record_intercept_config_change(state, JOURNAL_OP_BULK, TARGET_BULK,
+                cinfo->jsonbuffer, cinfo->jsonlen);
+    }
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+
+    logger(LOG_INFO,
+            "OpenLI: applied %u of %zu operations from bulk update via update socket.",
+            applied, count);
+
+    resp = json_object_new_object();
+    json_object_object_add(resp, "applied", json_object_new_int(applied));
+    json_object_object_add(resp, "failed",
+            json_object_new_int(count - applied));
+    json_object_object_add(resp, "results", results);
+
+    free(ops);
+    json_object_put(parsed);
+    return resp;
+}
+
+int replay_intercept_config_change(provision_state_t *state, uint8_t op,
+        int target, char *data, uint32_t len) {
+
+    update_con_info_t cinfo;
+
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.target = target;
+
+    if (op == JOURNAL_OP_DELETE) {
+        cinfo.connectiontype = MICRO_DELETE;
+        return apply_configuration_delete(&cinfo, state, data);
+    }
+
+    if (op == JOURNAL_OP_BULK) {
+        json_object *parsed = NULL;
+        bulk_op_t *ops;
+        size_t count = 0;
+        uint32_t applied;
+
+        ops = parse_bulk_request(&cinfo, data, len, &parsed, &count);
+        if (ops == NULL) {
+            return -1;
+        }
+        applied = apply_bulk_request(state, ops, count, NULL);
+        free(ops);
+        json_object_put(parsed);
+        return (applied > 0) ? 0 : -1;
+    }
+
+    cinfo.connectiontype = MICRO_POST;
+    cinfo.content_type = "application/json";
+    cinfo.jsonbuffer = data;
+    cinfo.jsonlen = len;
+    return apply_configuration_post(&cinfo, state, op);
+}
+
 static int consume_upload_data(update_con_info_t *cinfo, const char *data,
         size_t size) {
 
@@ -474,6 +1014,22 @@ static unsigned char *lookup_user_digest(provision_state_t *provstate,
     sqlite3_finalize(res);
     return returning;
 }
+
+static unsigned char *lookup_cached_user_digest(provision_state_t *provstate,
+        char *username, unsigned char *digestres) {
+
+    if (lookup_restauth_cache(&(provstate->restauthcache),
+                RESTAUTH_CRED_DIGEST, username, NULL, digestres) == 1) {
+        return digestres;
+    }
+
+    if (lookup_user_digest(provstate, username, digestres) == NULL) {
+        return NULL;
+    }
+    add_restauth_cache(&(provstate->restauthcache), RESTAUTH_CRED_DIGEST,
+            username, username, digestres);
+    return digestres;
+}
 #endif
 
 static int validate_user_apikey(provision_state_t *provstate,
@@ -483,6 +1039,14 @@ static int validate_user_apikey(provision_state_t *provstate,
     int rc, step;
     sqlite3_stmt *res;
     char *sql = "SELECT username, apikey FROM authcreds where apikey = ?";
+    char *username = NULL;
+
+    if (lookup_restauth_cache(&(provstate->restauthcache),
+                RESTAUTH_CRED_APIKEY, apikey, &username, NULL) == 1) {
+        logger(LOG_INFO, "OpenLI: User %s has used their API key to send a request via the REST API", username);
+        free(username);
+        return MHD_YES;
+    }
 
     rc = sqlite3_prepare_v2(provstate->authdb, sql, -1, &res, 0);
     if (rc != SQLITE_OK) {
@@ -496,6 +1060,8 @@ static int validate_user_apikey(provision_state_t *provstate,
     step = sqlite3_step(res);
     if (step == SQLITE_ROW) {
         logger(LOG_INFO, "OpenLI: User %s has used their API key to send a request via the REST API", sqlite3_column_text(res, 0));
+        add_restauth_cache(&(provstate->restauthcache), RESTAUTH_CRED_APIKEY,
+                apikey, (const char *)sqlite3_column_text(res, 0), NULL);
         sqlite3_finalize(res);
         return MHD_YES;
     }
@@ -505,7 +1071,7 @@ static int validate_user_apikey(provision_state_t *provstate,
     return MHD_NO;
 }
 
-static int authenticate_request(provision_state_t *provstate,
+static int check_request_credentials(provision_state_t *provstate,
         struct MHD_Connection *conn, const char *realm) {
 
     unsigned char digest[16];
@@ -532,7 +1098,7 @@ static int authenticate_request(provision_state_t *provstate,
 
     ret = MHD_NO;
 #ifdef HAVE_SQLCIPHER
-    if (lookup_user_digest(provstate, username, digest) == NULL) {
+    if (lookup_cached_user_digest(provstate, username, digest) == NULL) {
         logger(LOG_INFO,
                 "OpenLI: user '%s' attempted to authenticate against provisioner update service, but they don't exist in the database", username);
         return send_auth_failure(conn, realm, MHD_NO);
@@ -552,6 +1118,22 @@ static int authenticate_request(provision_state_t *provstate,
     return MHD_YES;
 }
 
+static int authenticate_request(provision_state_t *provstate,
+        struct MHD_Connection *conn, const char *realm) {
+
+    struct timespec start, end;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = check_request_credentials(provstate, conn, realm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    record_restauth_latency(&(provstate->restauthcache),
+            ((end.tv_sec - start.tv_sec) * 1000000) +
+            ((end.tv_nsec - start.tv_nsec) / 1000));
+    return ret;
+}
+
 int handle_update_request(void *cls, struct MHD_Connection *conn,
         const char *url, const char *method, const char *version,
         const char *upload_data, size_t *upload_data_size,
@@ -592,6 +1174,8 @@ int handle_update_request(void *cls, struct MHD_Connection *conn,
             cinfo->target = TARGET_VOIPINTERCEPT;
         } else if (strncmp(url, "/defaultradius", 14) == 0) {
             cinfo->target = TARGET_DEFAULTRADIUS;
+        } else if (strncmp(url, "/bulk", 5) == 0) {
+            cinfo->target = TARGET_BULK;
         } else {
             free(cinfo);
             return MHD_NO;
@@ -618,10 +1202,26 @@ int handle_update_request(void *cls, struct MHD_Connection *conn,
     }
 
 
+    cinfo = (update_con_info_t *)(*con_cls);
+    if (cinfo->target == TARGET_BULK && strcmp(method, "POST") != 0) {
+        /* bulk updates can only be POSTed -- but we still have to accept
+         * any upload data before we can respond */
+        if (*upload_data_size != 0) {
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
+        return send_http_page(conn, unsupported_operation,
+                MHD_HTTP_BAD_REQUEST);
+    }
+
     if (strcmp(method, "GET") == 0) {
         json_object *respjson = NULL;
         cinfo = (update_con_info_t *)(*con_cls);
 
+        if (is_intercept_listing_request(cinfo, url)) {
+            return send_intercept_listing(conn, cinfo, provstate);
+        }
+
         respjson = create_get_response(cinfo, provstate, url);
         ret = send_json_object(conn, respjson);
 
@@ -638,6 +1238,19 @@ int handle_update_request(void *cls, struct MHD_Connection *conn,
             return ret;
         } else {
             /* POST / PUT is complete */
+            if (cinfo->target == TARGET_BULK) {
+                json_object *respjson;
+
+                respjson = update_configuration_bulk(cinfo, provstate);
+                if (respjson == NULL) {
+                    return send_http_page(conn, cinfo->answerstring,
+                            MHD_HTTP_BAD_REQUEST);
+                }
+                ret = send_json_object(conn, respjson);
+                json_object_put(respjson);
+                return ret;
+            }
+
             if (update_configuration_post(cinfo, provstate, method) < 0) {
                 return send_http_page(conn, cinfo->answerstring,
                         MHD_HTTP_BAD_REQUEST);
@@ -51,8 +51,65 @@ enum {
     TARGET_VOIPINTERCEPT,
     TARGET_GTPSERVER,
     TARGET_DEFAULTRADIUS,
+    TARGET_BULK,
 };
 
+/* The most intercepts that may be requested in a single page */
+#define MAX_INTERCEPT_PAGE_SIZE 10000
+
+/* The number of intercepts to serialise each time the config lock is
+ * taken while streaming an intercept listing */
+#define INTERCEPT_LISTING_CHUNK 64
+
+/* Restricts which intercepts are included in an intercept listing */
+typedef struct intercept_filter {
+    /* The most intercepts to include, or 0 for no limit */
+    uint32_t limit;
+
+    /* Only include intercepts with an LIID that sorts after this one */
+    const char *cursor;
+
+    /* Only include intercepts for this agency */
+    const char *agencyid;
+
+    /* Only include intercepts with an LIID that begins with this string */
+    const char *liidprefix;
+
+    /* Only include intercepts that have changed since this time */
+    uint64_t modifiedsince;
+} intercept_filter_t;
+
+/* A listing of IP or VOIP intercepts that is being streamed to a client.
+ *
+ * The LIIDs to be sent are chosen (and sorted) when the listing is
+ * created. The intercepts themselves are then serialised a few at a time,
+ * so that the config lock is only held briefly. Any intercept that is
+ * removed before it is serialised is left out of the listing.
+ */
+typedef struct intercept_listing {
+    provision_state_t *state;
+    int target;
+
+    char **liids;
+    size_t liidcount;
+    size_t nextliid;
+
+    /* The LIID to pass as the cursor for the next page, if the listing
+     * was truncated */
+    char *nextcursor;
+
+    char *buf;
+    size_t bufsize;
+    size_t bufused;
+    size_t bufread;
+
+    /* The number of intercepts that have been serialised so far */
+    size_t sentcount;
+
+    uint8_t started;
+    uint8_t finished;
+} intercept_listing_t;
+
 static const char *update_success_page =
         "<html><body>OpenLI provisioner configuration was successfully updated.</body></html>\n";
 
@@ -116,5 +173,10 @@ struct json_object *get_voip_intercept(update_con_info_t *cinfo,
         provision_state_t *state, char *target);
 struct json_object *get_ip_intercept(update_con_info_t *cinfo,
         provision_state_t *state, char *target);
+
+intercept_listing_t *create_intercept_listing(update_con_info_t *cinfo,
+        provision_state_t *state, intercept_filter_t *filter);
+int fill_intercept_listing(intercept_listing_t *listing);
+void free_intercept_listing(intercept_listing_t *listing);
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -281,55 +281,285 @@ json_object *get_agency(update_con_info_t *cinfo, provision_state_t *state,
 json_object *get_voip_intercept(update_con_info_t *cinfo,
         provision_state_t *state, char *target) {
 
-    voipintercept_t *vint, *tmp;
-    json_object *jarray, *jobj;
-
-    if (target) {
-        HASH_FIND(hh_liid, state->interceptconf.voipintercepts, target,
-                strlen(target), vint);
-        if (!vint) {
-            return NULL;
-        }
+    voipintercept_t *vint;
 
-        jobj = convert_voipintercept_to_json(vint);
-        return jobj;
+    /* Requests for all VOIP intercepts are handled by
+     * send_intercept_listing() */
+    if (!target) {
+        return NULL;
     }
 
-    jarray = json_object_new_array();
-    HASH_ITER(hh_liid, state->interceptconf.voipintercepts, vint, tmp) {
-        jobj = convert_voipintercept_to_json(vint);
-        json_object_array_add(jarray, jobj);
+    HASH_FIND(hh_liid, state->interceptconf.voipintercepts, target,
+            strlen(target), vint);
+    if (!vint) {
+        return NULL;
     }
 
-    return jarray;
+    return convert_voipintercept_to_json(vint);
 }
 
 json_object *get_ip_intercept(update_con_info_t *cinfo,
         provision_state_t *state, char *target) {
 
+    ipintercept_t *ipint;
+
+    /* Requests for all IP intercepts are handled by
+     * send_intercept_listing() */
+    if (!target) {
+        return NULL;
+    }
+
+    HASH_FIND(hh_liid, state->interceptconf.ipintercepts, target,
+            strlen(target), ipint);
+    if (!ipint) {
+        return NULL;
+    }
+
+    return convert_ipintercept_to_json(ipint);
+}
+
+static int compare_liids(const void *a, const void *b) {
+    return strcmp(*((const char **)a), *((const char **)b));
+}
+
+static inline int intercept_matches_filter(provision_state_t *state,
+        intercept_common_t *common, intercept_filter_t *filter) {
+
+    uint64_t modified;
+
+    if (filter->cursor && strcmp(common->liid, filter->cursor) <= 0) {
+        return 0;
+    }
+    if (filter->agencyid && (common->targetagency == NULL ||
+            strcmp(common->targetagency, filter->agencyid) != 0)) {
+        return 0;
+    }
+    if (filter->liidprefix && strncmp(common->liid, filter->liidprefix,
+            strlen(filter->liidprefix)) != 0) {
+        return 0;
+    }
+    if (filter->modifiedsince) {
+        modified = common->lastmodified;
+        if (modified == 0) {
+            modified = state->interceptconf.loadedat;
+        }
+        if (modified < filter->modifiedsince) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+intercept_listing_t *create_intercept_listing(update_con_info_t *cinfo,
+        provision_state_t *state, intercept_filter_t *filter) {
+
+    intercept_listing_t *listing;
     ipintercept_t *ipint, *tmp;
-    json_object *jarray, *jobj;
+    voipintercept_t *vint, *tmp2;
+    char **matches = NULL;
+    size_t total, count = 0, i;
 
-    if (target) {
-        HASH_FIND(hh_liid, state->interceptconf.ipintercepts, target,
-                strlen(target), ipint);
-        if (!ipint) {
-            return NULL;
+    listing = calloc(1, sizeof(intercept_listing_t));
+    if (listing == NULL) {
+        return NULL;
+    }
+    listing->state = state;
+    listing->target = cinfo->target;
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+
+    if (cinfo->target == TARGET_IPINTERCEPT) {
+        total = HASH_CNT(hh_liid, state->interceptconf.ipintercepts);
+    } else {
+        total = HASH_CNT(hh_liid, state->interceptconf.voipintercepts);
+    }
+
+    if (total > 0) {
+        /* These point into the intercepts themselves, so we need to copy
+         * the ones we keep before releasing the lock */
+        matches = calloc(total, sizeof(char *));
+        if (matches == NULL) {
+            goto listingerr;
         }
+    }
 
-        jobj = convert_ipintercept_to_json(ipint);
-        return jobj;
+    if (cinfo->target == TARGET_IPINTERCEPT) {
+        HASH_ITER(hh_liid, state->interceptconf.ipintercepts, ipint, tmp) {
+            if (intercept_matches_filter(state, &(ipint->common), filter)) {
+                matches[count] = ipint->common.liid;
+                count ++;
+            }
+        }
+    } else {
+        HASH_ITER(hh_liid, state->interceptconf.voipintercepts, vint, tmp2) {
+            if (intercept_matches_filter(state, &(vint->common), filter)) {
+                matches[count] = vint->common.liid;
+                count ++;
+            }
+        }
     }
 
-    jarray = json_object_new_array();
-    HASH_ITER(hh_liid, state->interceptconf.ipintercepts, ipint, tmp) {
-        jobj = convert_ipintercept_to_json(ipint);
-        json_object_array_add(jarray, jobj);
+    if (count > 0) {
+        qsort(matches, count, sizeof(char *), compare_liids);
     }
 
-    return jarray;
+    if (filter->limit > 0 && count > filter->limit) {
+        count = filter->limit;
+        listing->nextcursor = strdup(matches[count - 1]);
+        if (listing->nextcursor == NULL) {
+            goto listingerr;
+        }
+    }
+
+    if (count > 0) {
+        listing->liids = calloc(count, sizeof(char *));
+        if (listing->liids == NULL) {
+            goto listingerr;
+        }
+        for (i = 0; i < count; i++) {
+            listing->liids[i] = strdup(matches[i]);
+            if (listing->liids[i] == NULL) {
+                goto listingerr;
+            }
+            listing->liidcount ++;
+        }
+    }
+
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    free(matches);
+    return listing;
+
+listingerr:
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+    logger(LOG_INFO,
+            "OpenLI provisioner: unable to allocate memory for intercept listing");
+    free(matches);
+    free_intercept_listing(listing);
+    return NULL;
+}
+
+static int append_to_listing(intercept_listing_t *listing, const char *str) {
+
+    size_t len = strlen(str);
+    size_t newsize;
+    char *newbuf;
+
+    if (listing->bufused + len > listing->bufsize) {
+        newsize = listing->bufsize ? listing->bufsize : 4096;
+        while (listing->bufused + len > newsize) {
+            newsize *= 2;
+        }
+        newbuf = realloc(listing->buf, newsize);
+        if (newbuf == NULL) {
+            return -1;
+        }
+        listing->buf = newbuf;
+        listing->bufsize = newsize;
+    }
+
+    memcpy(listing->buf + listing->bufused, str, len);
+    listing->bufused += len;
+    return 0;
 }
 
+/* Replaces the contents of the listing buffer with the next few intercepts
+ * in the listing.
+ *
+ * Returns 1 if the buffer now contains more of the listing, 0 if the
+ * listing is complete, or -1 if an error occurs.
+ */
+int fill_intercept_listing(intercept_listing_t *listing) {
+
+    provision_state_t *state = listing->state;
+    ipintercept_t *ipint;
+    voipintercept_t *vint;
+    json_object *jobj;
+    const char *jsonstr;
+    char *liid;
+    int added = 0, ret = 1;
+
+    listing->bufused = 0;
+    listing->bufread = 0;
+
+    if (listing->finished) {
+        return 0;
+    }
 
+    /* Match the formatting that json-c uses for the other GET responses */
+    if (!listing->started) {
+        if (append_to_listing(listing, "[") < 0) {
+            return -1;
+        }
+        listing->started = 1;
+    }
+
+    pthread_mutex_lock(&(state->interceptconf.safelock));
+    while (listing->nextliid < listing->liidcount &&
+            added < INTERCEPT_LISTING_CHUNK) {
+
+        liid = listing->liids[listing->nextliid];
+        listing->nextliid ++;
+
+        /* The intercept may have been removed since the listing began */
+        jobj = NULL;
+        if (listing->target == TARGET_IPINTERCEPT) {
+            HASH_FIND(hh_liid, state->interceptconf.ipintercepts, liid,
+                    strlen(liid), ipint);
+            if (ipint) {
+                jobj = convert_ipintercept_to_json(ipint);
+            }
+        } else {
+            HASH_FIND(hh_liid, state->interceptconf.voipintercepts, liid,
+                    strlen(liid), vint);
+            if (vint) {
+                jobj = convert_voipintercept_to_json(vint);
+            }
+        }
+
+        if (jobj == NULL) {
+            continue;
+        }
+
+        jsonstr = json_object_to_json_string(jobj);
+        if (jsonstr == NULL || append_to_listing(listing,
+                    listing->sentcount > 0 ? ", " : " ") < 0 ||
+                append_to_listing(listing, jsonstr) < 0) {
+            json_object_put(jobj);
+            ret = -1;
+            break;
+        }
+        json_object_put(jobj);
+        listing->sentcount ++;
+        added ++;
+    }
+    pthread_mutex_unlock(&(state->interceptconf.safelock));
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (listing->nextliid >= listing->liidcount) {
+        if (append_to_listing(listing, " ]") < 0) {
+            return -1;
+        }
+        listing->finished = 1;
+    }
+    return 1;
+}
+
+void free_intercept_listing(intercept_listing_t *listing) {
+    size_t i;
+
+    if (listing == NULL) {
+        return;
+    }
+    for (i = 0; i < listing->liidcount; i++) {
+        free(listing->liids[i]);
+    }
+    free(listing->liids);
+    free(listing->nextcursor);
+    free(listing->buf);
+    free(listing);
+}
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
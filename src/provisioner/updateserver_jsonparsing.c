@@ -27,6 +27,7 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <time.h>
 #include <json-c/json.h>
 
 #include "provisioner.h"
@@ -775,6 +776,7 @@ int add_new_voipintercept(update_con_info_t *cinfo, provision_state_t *state) {
         goto cepterr;
     }
 
+    vint->common.lastmodified = time(NULL);
     HASH_ADD_KEYPTR(hh_liid, state->interceptconf.voipintercepts,
             vint->common.liid, vint->common.liid_len, vint);
 
@@ -911,6 +913,7 @@ int add_new_ipintercept(update_con_info_t *cinfo, provision_state_t *state) {
         goto cepterr;
     }
 
+    ipint->common.lastmodified = time(NULL);
     HASH_ADD_KEYPTR(hh_liid, state->interceptconf.ipintercepts,
             ipint->common.liid, ipint->common.liid_len, ipint);
 
@@ -1068,6 +1071,7 @@ int modify_voipintercept(update_con_info_t *cinfo, provision_state_t *state) {
     }
 
     vint->common.hi1_seqno = found->common.hi1_seqno;
+    found->common.lastmodified = time(NULL);
     logger(LOG_INFO,
             "OpenLI provisioner: updated VOIP intercept %s via update socket.",
             found->common.liid);
@@ -1279,6 +1283,7 @@ int modify_ipintercept(update_con_info_t *cinfo, provision_state_t *state) {
     }
 
     ipint->common.hi1_seqno = found->common.hi1_seqno;
+    found->common.lastmodified = time(NULL);
     logger(LOG_INFO,
             "OpenLI provisioner: updated IP intercept %s via update socket.",
             found->common.liid);